@@ -0,0 +1,131 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "adaptive_bitrate.h"
+#include "bitrate_controller.h"
+#include "video_encoder.h"
+#include "link_feedback.h"
+#include "telemetry_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+static const double MIN_CHANGE = 0.03;          // Smaller changes aren't worth disturbing the encoder's rate control
+static const guint WATCHDOG_INTERVAL = 250;     // Milliseconds between report timeout checks
+
+struct _FPVAdaptiveBitrate {
+    GstElement *encoder;
+    const char *property;
+    int scale;                  // Bits per second per unit of the property
+    FPVBitrateController *controller;
+    int min_bitrate;
+    int max_bitrate;
+    int applied;
+    FPVFeedbackServer *server;  // NULL until started
+    guint watchdog;
+};
+
+#pragma mark - Forward declarations
+
+static void fpv_adaptive_bitrate_apply(FPVAdaptiveBitrate * adaptive, int bitrate);
+static void on_report(const FPVLinkFeedback * feedback, int sender, uint64_t received, void * userinfo);
+static gboolean on_watchdog(gpointer user_data);
+
+#pragma mark -
+
+FPVAdaptiveBitrate * fpv_adaptive_bitrate_new(GstPipeline * pipeline, int bitrate, int min_bitrate, int max_bitrate) {
+    int scale = 1;
+    GstElement *encoder = fpv_video_encoder_find(pipeline);
+    const char *property = encoder ? fpv_video_encoder_bitrate_property(encoder, &scale) : NULL;
+    if ( !property ) {
+        fprintf(stderr, "No encoder with a bitrate property in the video pipeline\n");
+        if ( encoder ) gst_object_unref(encoder);
+        return NULL;
+    }
+
+    FPVAdaptiveBitrate *adaptive = (FPVAdaptiveBitrate*)calloc(1, sizeof(FPVAdaptiveBitrate));
+    adaptive->encoder = encoder;
+    adaptive->property = property;
+    adaptive->scale = scale;
+    adaptive->controller = fpv_bitrate_controller_new(bitrate, min_bitrate, max_bitrate);
+    adaptive->min_bitrate = min_bitrate;
+    adaptive->max_bitrate = max_bitrate;
+
+    // The pipeline description gives the encoder bits per second whatever its units; set it properly
+    fpv_adaptive_bitrate_apply(adaptive, fpv_bitrate_controller_get_bitrate(adaptive->controller));
+    return adaptive;
+}
+
+void fpv_adaptive_bitrate_dispose(FPVAdaptiveBitrate * adaptive) {
+    if ( adaptive->server ) fpv_adaptive_bitrate_stop(adaptive);
+    fpv_bitrate_controller_dispose(adaptive->controller);
+    gst_object_unref(adaptive->encoder);
+    free(adaptive);
+}
+
+int fpv_adaptive_bitrate_start(FPVAdaptiveBitrate * adaptive, FPVFeedbackServer * server) {
+    adaptive->server = server;
+    fpv_feedback_server_set_handler(server, LINK_FEEDBACK_TYPE_REPORT, on_report, adaptive);
+    adaptive->watchdog = g_timeout_add(WATCHDOG_INTERVAL, on_watchdog, adaptive);
+
+    printf("Adapting %s between %d and %d bps to link feedback\n", adaptive->property, adaptive->min_bitrate, adaptive->max_bitrate);
+    return 1;
+}
+
+void fpv_adaptive_bitrate_stop(FPVAdaptiveBitrate * adaptive) {
+    if ( !adaptive->server ) return;
+
+    fpv_feedback_server_set_handler(adaptive->server, LINK_FEEDBACK_TYPE_REPORT, NULL, NULL);
+    g_source_remove(adaptive->watchdog);
+    adaptive->server = NULL;
+
+    FPVBitrateControllerStats stats;
+    fpv_bitrate_controller_get_stats(adaptive->controller, &stats);
+    printf("Adaptive bitrate: %llu reports, %llu increases, %llu decreases, %llu timeouts, ended at %d bps\n",
+        (unsigned long long)stats.reports, (unsigned long long)stats.increases,
+        (unsigned long long)stats.decreases, (unsigned long long)stats.timeouts, adaptive->applied);
+}
+
+void fpv_adaptive_bitrate_set_max_bitrate(FPVAdaptiveBitrate * adaptive, int max_bitrate) {
+    if ( adaptive->min_bitrate > max_bitrate ) adaptive->min_bitrate = max_bitrate;
+    adaptive->max_bitrate = max_bitrate;
+    fpv_adaptive_bitrate_apply(adaptive, fpv_bitrate_controller_set_limits(adaptive->controller, adaptive->min_bitrate, max_bitrate));
+}
+
+static void fpv_adaptive_bitrate_apply(FPVAdaptiveBitrate * adaptive, int bitrate) {
+    if ( bitrate == adaptive->applied ) return;
+
+    // Always reach the limits exactly, so a collapsed link gets the floor promptly
+    int at_limit = bitrate == adaptive->min_bitrate || bitrate == adaptive->max_bitrate;
+    if ( !at_limit && abs(bitrate - adaptive->applied) < adaptive->applied * MIN_CHANGE ) return;
+
+    if ( !fpv_video_encoder_set_integer(adaptive->encoder, adaptive->property, bitrate / adaptive->scale) ) return;
+    adaptive->applied = bitrate;
+}
+
+static void on_report(const FPVLinkFeedback * feedback, int sender, uint64_t received, void * userinfo) {
+    FPVAdaptiveBitrate *adaptive = (FPVAdaptiveBitrate*)userinfo;
+    int bitrate = fpv_bitrate_controller_report(adaptive->controller, sender, &feedback->content.report, received);
+    fpv_adaptive_bitrate_apply(adaptive, bitrate);
+}
+
+static gboolean on_watchdog(gpointer user_data) {
+    FPVAdaptiveBitrate *adaptive = (FPVAdaptiveBitrate*)user_data;
+    fpv_adaptive_bitrate_apply(adaptive, fpv_bitrate_controller_check_timeout(adaptive->controller, fpv_telemetry_now()));
+    return G_SOURCE_CONTINUE;
+}
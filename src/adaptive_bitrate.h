@@ -0,0 +1,46 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ADAPTIVE_BITRATE_H
+#define __ADAPTIVE_BITRATE_H
+
+#include <gst/gst.h>
+#include "feedback_server.h"
+
+/*
+ * Closes the loop between the ground station's link feedback and the video encoder:
+ * takes reports from the feedback server, runs them through an FPVBitrateController,
+ * and sets the encoder's bitrate property while the pipeline plays. Works with any
+ * encoder in the pipeline with a "target-bitrate" (bits per second, as omxh264enc) or
+ * "bitrate" (kilobits per second, as x264enc) property. Runs on the default main context.
+ */
+
+typedef struct _FPVAdaptiveBitrate FPVAdaptiveBitrate;
+
+// Bitrates in bits per second; returns NULL if the pipeline has no encoder it can drive
+FPVAdaptiveBitrate * fpv_adaptive_bitrate_new(GstPipeline * pipeline, int bitrate, int min_bitrate, int max_bitrate);
+void fpv_adaptive_bitrate_dispose(FPVAdaptiveBitrate * adaptive);
+
+int fpv_adaptive_bitrate_start(FPVAdaptiveBitrate * adaptive, FPVFeedbackServer * server);
+void fpv_adaptive_bitrate_stop(FPVAdaptiveBitrate * adaptive);
+
+// Moves the ceiling while running, lowering the floor with it if need be; the rate
+// drops to it at once, and climbs toward it as the link allows
+void fpv_adaptive_bitrate_set_max_bitrate(FPVAdaptiveBitrate * adaptive, int max_bitrate);
+
+#endif
@@ -0,0 +1,215 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures the erasure code: each GF(256) region kernel this CPU can run, the cost of
+// encoding and of rebuilding a packet, and the loss left after decoding against the
+// repair overhead, under random loss and under loss in bursts:
+// bench-fec [packets per point [k]]
+
+#include "gf256.h"
+#include "fec.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PACKET_LENGTH 1400
+
+static volatile double sink;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+typedef struct {
+    uint16_t first;
+    int count;
+    uint8_t *lost;
+    uint64_t recovered;
+} residual_t;
+
+static void residual_recovered(const uint8_t * packet, int length, void * userinfo) {
+    residual_t *residual = (residual_t*)userinfo;
+    uint16_t index = ((packet[2] << 8) | packet[3]) - residual->first;
+    if ( index < residual->count && residual->lost[index] ) {
+        residual->lost[index] = 0;
+        residual->recovered++;
+    }
+}
+
+static void make_packet(uint8_t * packet, uint16_t sequence, int marker) {
+    packet[0] = 0x80;
+    packet[1] = 96 | (marker ? 0x80 : 0);
+    packet[2] = sequence >> 8;
+    packet[3] = sequence;
+}
+
+// Gilbert-Elliott: everything is lost in the bad state, entered and left so that the
+// long-run loss rate and mean burst length come out as asked; independent losses for a
+// burst length of 1
+static int channel_drop(uint32_t *seed, int *bad, double loss, double burst) {
+    double u = test_random(seed) / 4294967296.0;
+    if ( burst <= 1 ) return u < loss;
+    double leave = 1 / burst;
+    *bad = *bad ? u >= leave : u < loss * leave / (1 - loss);
+    return *bad;
+}
+
+// Fraction of media packets still missing after decoding, and optionally the fraction the
+// channel lost; frames of frame_length packets, or groups only closed by k if 0
+static double residual_loss(int k, int m, double loss, double burst, int frame_length, int packets, double * channel_loss) {
+    static uint8_t packet[PACKET_LENGTH];
+    residual_t residual = { 0 };
+    residual.count = packets;
+    residual.lost = (uint8_t*)calloc(packets, 1);
+    FPVFecEncoder *encoder = fpv_fec_encoder_new(k, m);
+    FPVFecDecoder *decoder = fpv_fec_decoder_new(residual_recovered, &residual);
+    uint32_t seed = 1;
+    int bad = 0, i, j;
+
+    for ( i=0; i<packets; i++ ) {
+        make_packet(packet, residual.first + i, frame_length && (i + 1) % frame_length == 0);
+        uint8_t **repair;
+        int *repair_lengths;
+        int n = fpv_fec_encoder_add(encoder, packet, sizeof(packet), &repair, &repair_lengths);
+        residual.lost[i] = channel_drop(&seed, &bad, loss, burst);
+        if ( !residual.lost[i] ) fpv_fec_decoder_add_media(decoder, packet, sizeof(packet));
+        for ( j=0; j<n; j++ ) {
+            if ( !channel_drop(&seed, &bad, loss, burst) ) fpv_fec_decoder_add_repair(decoder, repair[j], repair_lengths[j]);
+        }
+    }
+
+    uint64_t missing = 0;
+    for ( i=0; i<packets; i++ ) missing += residual.lost[i];
+    if ( channel_loss ) *channel_loss = (double)(missing + residual.recovered) / packets;
+    fpv_fec_encoder_dispose(encoder);
+    fpv_fec_decoder_dispose(decoder);
+    free(residual.lost);
+    return (double)missing / packets;
+}
+
+static void print_residual_table(const char * title, int k, double burst, int packets) {
+    static const double losses[] = { 0.01, 0.02, 0.05, 0.10, 0.20 };
+    static const int repairs[] = { 1, 2, 4, 8, 16 };
+    int l, r;
+
+    printf("\n%s, k = %d: residual loss by repair packets per group (overhead)\n  loss     none", title, k);
+    for ( r=0; r<(int)(sizeof(repairs)/sizeof(repairs[0])); r++ ) {
+        char heading[32];
+        snprintf(heading, sizeof(heading), "m=%d (%.0f%%)", repairs[r], 100.0 * repairs[r] / k);
+        printf(" %12s", heading);
+    }
+    printf("\n");
+    for ( l=0; l<(int)(sizeof(losses)/sizeof(losses[0])); l++ ) {
+        double results[sizeof(repairs)/sizeof(repairs[0])], channel_loss = 0;
+        for ( r=0; r<(int)(sizeof(repairs)/sizeof(repairs[0])); r++ ) {
+            results[r] = residual_loss(k, repairs[r], losses[l], burst, 0, packets, r == 0 ? &channel_loss : NULL);
+        }
+        printf("  %4.0f%%  %6.2f%%", losses[l] * 100, 100 * channel_loss);
+        for ( r=0; r<(int)(sizeof(repairs)/sizeof(repairs[0])); r++ ) printf(" %11.3f%%", 100 * results[r]);
+        printf("\n");
+    }
+}
+
+static double kernel_throughput(void) {
+    static uint8_t src[PACKET_LENGTH], dst[PACKET_LENGTH];
+    const int iterations = 200000;
+    int i;
+    for ( i=0; i<PACKET_LENGTH; i++ ) src[i] = i * 7;
+    uint64_t start = now_ns();
+    for ( i=0; i<iterations; i++ ) gf256_mul_add_region(dst, src, 2 + i % 254, PACKET_LENGTH);
+    uint64_t elapsed = now_ns() - start;
+    sink = dst[i % PACKET_LENGTH];
+    return (double)iterations * PACKET_LENGTH / elapsed;
+}
+
+int main(int argc, char **argv) {
+    int packets = argc > 1 ? atoi(argv[1]) : 65536;
+    int k = argc > 2 ? atoi(argv[2]) : 16;
+    if ( packets < 1 || k < 1 || k > FEC_MAX_MEDIA_PACKETS ) {
+        fprintf(stderr, "Usage: %s [packets per point [k]]\n", argv[0]);
+        return 1;
+    }
+    gf256_init();
+
+    static const char *kernels[] = { "scalar", "ssse3", "avx2", "neon" };
+    int i;
+    printf("GF(256) multiply-add over %d bytes, selected kernel %s:\n", PACKET_LENGTH, gf256_kernel_name());
+    for ( i=0; i<(int)(sizeof(kernels)/sizeof(kernels[0])); i++ ) {
+        if ( gf256_use_kernel(kernels[i]) ) printf("  %-6s %.1f GB/s\n", kernels[i], kernel_throughput());
+    }
+    gf256_use_kernel(NULL);
+
+    // Encoding a stream, then rebuilding the most each group can lose
+    int m = k / 4 > 0 ? k / 4 : 1;
+    int groups = packets / k > 0 ? packets / k : 1;
+    static uint8_t media[FEC_MAX_MEDIA_PACKETS][PACKET_LENGTH];
+    static uint8_t repair[FEC_MAX_REPAIR_PACKETS][FEC_MAX_REPAIR_LENGTH];
+    int repair_lengths[FEC_MAX_REPAIR_PACKETS];
+    int g, j;
+    for ( i=0; i<k; i++ ) {
+        for ( j=12; j<PACKET_LENGTH; j++ ) media[i][j] = i * 31 + j;
+    }
+
+    FPVFecEncoder *encoder = fpv_fec_encoder_new(k, m);
+    uint64_t start = now_ns();
+    for ( g=0; g<groups; g++ ) {
+        for ( i=0; i<k; i++ ) {
+            uint8_t **r;
+            int *rl;
+            make_packet(media[i], g * k + i, 0);
+            sink += fpv_fec_encoder_add(encoder, media[i], PACKET_LENGTH, &r, &rl);
+        }
+    }
+    uint64_t encode_time = now_ns() - start;
+
+    uint64_t decode_time = 0, recovered = 0;
+    for ( g=0; g<groups; g++ ) {
+        FPVFecDecoder *decoder = fpv_fec_decoder_new(NULL, NULL);
+        for ( i=0; i<k; i++ ) {
+            uint8_t **r;
+            int *rl;
+            make_packet(media[i], g * k + i, 0);
+            int n = fpv_fec_encoder_add(encoder, media[i], PACKET_LENGTH, &r, &rl);
+            for ( j=0; j<n; j++ ) {
+                memcpy(repair[j], r[j], rl[j]);
+                repair_lengths[j] = rl[j];
+            }
+            if ( i >= m ) fpv_fec_decoder_add_media(decoder, media[i], PACKET_LENGTH);
+        }
+        start = now_ns();
+        for ( j=0; j<m; j++ ) fpv_fec_decoder_add_repair(decoder, repair[j], repair_lengths[j]);
+        decode_time += now_ns() - start;
+
+        FPVFecStats stats;
+        fpv_fec_decoder_get_stats(decoder, &stats);
+        recovered += stats.recovered;
+        fpv_fec_decoder_dispose(decoder);
+    }
+    fpv_fec_encoder_dispose(encoder);
+    printf("\n%d/%d over %d-byte packets: encode %.0f ns a packet; rebuilding %d lost takes %.1f us a group (%llu rebuilt)\n",
+        k, m, PACKET_LENGTH, (double)encode_time / (groups * k), m, decode_time / 1000.0 / groups, (unsigned long long)recovered);
+
+    print_residual_table("Random loss", k, 1, packets);
+    print_residual_table("Burst loss (mean burst 4)", k, 4, packets);
+
+    // Groups closed early by frames of 25 packets carry proportionally less repair
+    printf("\n%d/%d, frames of 25 packets, 5%% random loss: residual loss %.3f%%\n", k, m, 100 * residual_loss(k, m, 0.05, 1, 25, packets, NULL));
+    return recovered == (uint64_t)groups * m ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures the flight log recorder: sustained appends with flushes on the usual cadence and
+// the latency of each append, then reading the log back and seeking through its index:
+// bench-flight-log [records [sync interval ms]]
+//
+// Appends and flushes by hand, as the recorder thread does, without the receiver in the way.
+
+#include "flight_log.h"
+#include "test_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 2000000;
+    int sync_interval = argc > 2 ? atoi(argv[2]) : FLIGHT_LOG_DEFAULT_SYNC_INTERVAL;
+    if ( count < 1 || sync_interval < 1 ) {
+        fprintf(stderr, "Usage: %s [records [sync interval ms]]\n", argv[0]);
+        return 1;
+    }
+
+    char path[256];
+    const char *directory = getenv("TMPDIR");
+    snprintf(path, sizeof(path), "%s/bench-flight-log-%d.log", directory ? directory : "/tmp", getpid());
+    uint64_t size = (uint64_t)count * (FLIGHT_LOG_RECORD_HEADER_LENGTH + TELEMETRY_WIRE_MAX_RECORD_LENGTH) + (1 << 20);
+    FPVFlightLog *log = fpv_flight_log_new(NULL, path, size);
+    if ( !log ) return 1;
+    fpv_flight_log_set_sync_interval(log, sync_interval);
+    if ( !fpv_flight_log_prepare(log) ) return 1;
+
+    // A receiver's mix: position, power, signal and attitude in turn
+    FPVTelemetryUpdate updates[TELEMETRY_TYPE_COUNT];
+    memset(updates, 0, sizeof(updates));
+    int type;
+    for ( type=0; type<TELEMETRY_TYPE_COUNT; type++ ) updates[type].type = type;
+    updates[TELEMETRY_TYPE_POSITION].content.position.latitude = 48.1173;
+    updates[TELEMETRY_TYPE_POSITION].content.position.longitude = 11.5167;
+    updates[TELEMETRY_TYPE_POWER].content.power.voltage = 15.2;
+
+    uint32_t *latencies = (uint32_t*)malloc(count * sizeof(uint32_t));
+    uint64_t interval = (uint64_t)sync_interval * 1000000;
+    uint64_t start = now_ns(), next_sync = start + interval;
+    int i;
+    for ( i=0; i<count; i++ ) {
+        FPVTelemetryUpdate *update = &updates[i % TELEMETRY_TYPE_COUNT];
+        update->received = start / 1000 + i;
+        update->content.position.altitude = i % 1000;
+        uint64_t before = now_ns();
+        fpv_flight_log_append(log, update);
+        uint64_t after = now_ns();
+        latencies[i] = after - before;
+        if ( after >= next_sync ) {
+            fpv_flight_log_sync(log);
+            next_sync = now_ns() + interval;
+        }
+    }
+    fpv_flight_log_sync(log);
+    uint64_t elapsed = now_ns() - start;
+
+    FPVFlightLogStats stats;
+    fpv_flight_log_get_stats(log, &stats);
+    qsort(latencies, count, sizeof(uint32_t), compare_latency);
+    printf("%d appends: %.2fM records/s including %llu flushes (longest %.1f ms), %.1f MB; "
+           "append p50 %u ns, p99 %u ns, p99.9 %u ns, max %u ns\n",
+        count, count / (elapsed / 1e9) / 1e6, (unsigned long long)stats.syncs, stats.max_sync_time / 1000.0,
+        stats.bytes / 1048576.0, latencies[count / 2], latencies[(int)(count * 0.99)],
+        latencies[(int)(count * 0.999)], latencies[count - 1]);
+    free(latencies);
+    fpv_flight_log_dispose(log);
+
+    FPVFlightLogReader *reader = fpv_flight_log_reader_new(path);
+    if ( !reader ) return 1;
+    FPVTelemetryUpdate update;
+    int read = 0;
+    start = now_ns();
+    while ( fpv_flight_log_reader_next(reader, &update) ) read++;
+    uint64_t read_time = now_ns() - start;
+
+    // Records were stamped a microsecond apart, so random targets spread across the whole log
+    uint64_t first;
+    fpv_flight_log_reader_get_info(reader, NULL, &first, NULL);
+    uint32_t seed = 1;
+    int seeks = 100000;
+    start = now_ns();
+    for ( i=0; i<seeks; i++ ) {
+        fpv_flight_log_reader_seek(reader, first + test_random(&seed) % count);
+    }
+    uint64_t seek_time = now_ns() - start;
+    fpv_flight_log_reader_dispose(reader);
+    unlink(path);
+
+    printf("Read back %d records in %.1f ms; seek %.0f ns with an index entry every %d records\n",
+        read, read_time / 1e6, (double)seek_time / seeks, FLIGHT_LOG_DEFAULT_INDEX_INTERVAL);
+    return read == count ? 0 : 1;
+}
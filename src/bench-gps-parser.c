@@ -0,0 +1,100 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures GPS parser throughput on a recorded-style stream of NMEA and UBX, fed in chunks the
+// size a serial read returns: bench-gps-parser [megabytes [chunk bytes]]
+
+#include "gps_parser.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t fixes;
+
+static void fix_callback(FPVGPSParser * parser, const FPVGPSFix * fix, void * context) {
+    fixes++;
+}
+
+static int nmea(char *buffer, const char *body) {
+    uint8_t checksum = 0;
+    const char *p;
+    for ( p = body; *p; p++ ) checksum ^= *p;
+    return sprintf(buffer, "$%s*%02X\r\n", body, checksum);
+}
+
+static int ubx_nav_pvt(uint8_t *buffer) {
+    static const int payload_length = 92;
+    memset(buffer, 0, 6 + payload_length + 2);
+    buffer[0] = 0xB5;
+    buffer[1] = 0x62;
+    buffer[2] = 0x01;
+    buffer[3] = 0x07;
+    buffer[4] = payload_length;
+    buffer[6 + 20] = 3;
+    buffer[6 + 21] = 0x01;
+    uint8_t ck_a = 0, ck_b = 0;
+    int i;
+    for ( i=2; i<6 + payload_length; i++ ) {
+        ck_a += buffer[i];
+        ck_b += ck_a;
+    }
+    buffer[6 + payload_length] = ck_a;
+    buffer[6 + payload_length + 1] = ck_b;
+    return 6 + payload_length + 2;
+}
+
+int main(int argc, char **argv) {
+    int megabytes = argc > 1 ? atoi(argv[1]) : 64;
+    int chunk = argc > 2 ? atoi(argv[2]) : 64;
+    if ( megabytes < 1 || chunk < 1 ) {
+        fprintf(stderr, "Usage: %s [megabytes [chunk bytes]]\n", argv[0]);
+        return 1;
+    }
+
+    // One second of a typical receiver: GGA, RMC, GSA and NAV-PVT
+    uint8_t second[1024];
+    int length = nmea((char*)second, "GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,");
+    length += nmea((char*)second + length, "GPRMC,123519,A,4807.038,N,01131.000,E,022.4,084.4,230394,003.1,W");
+    length += nmea((char*)second + length, "GPGSA,A,3,04,05,,09,12,,,24,,,,,2.5,1.3,2.1");
+    length += ubx_nav_pvt(second + length);
+
+    int repeats = (megabytes << 20) / length;
+    uint8_t *stream = malloc((size_t)repeats * length);
+    int i;
+    for ( i=0; i<repeats; i++ ) memcpy(stream + (size_t)i * length, second, length);
+    size_t total = (size_t)repeats * length;
+
+    FPVGPSParser *parser = fpv_gps_parser_new(fix_callback, NULL);
+    uint64_t start = test_now();
+    size_t offset;
+    for ( offset=0; offset<total; offset+=chunk ) {
+        fpv_gps_parser_feed(parser, stream + offset, total - offset < chunk ? total - offset : chunk);
+    }
+    uint64_t elapsed = test_now() - start;
+
+    FPVGPSParserStats stats;
+    fpv_gps_parser_get_stats(parser, &stats);
+    fpv_gps_parser_dispose(parser);
+    free(stream);
+
+    printf("%.1f MB in %d-byte chunks: %.1f MB/s, %.0f messages/s (%llu messages, %llu fixes, %llu errors)\n",
+        total / 1048576.0, chunk, total / 1048576.0 / (elapsed / 1e6), stats.messages / (elapsed / 1e6),
+        (unsigned long long)stats.messages, (unsigned long long)fixes,
+        (unsigned long long)(stats.checksum_errors + stats.resyncs));
+    return stats.checksum_errors + stats.resyncs ? 1 : 0;
+}
@@ -0,0 +1,103 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures MAVLink parser throughput on a flight controller's usual stream of heartbeat,
+// status, attitude and position messages: bench-mavlink-parser [megabytes [chunk bytes]]
+
+#include "mavlink_parser.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t updates;
+
+static void update_callback(FPVMAVLinkParser * parser, const FPVTelemetryUpdate * update, void * context) {
+    updates++;
+}
+
+static uint16_t crc_accumulate(uint8_t byte, uint16_t crc) {
+    uint8_t tmp = byte ^ (uint8_t)(crc & 0xff);
+    tmp ^= (tmp << 4);
+    return (crc >> 8) ^ ((uint16_t)tmp << 8) ^ ((uint16_t)tmp << 3) ^ (tmp >> 4);
+}
+
+// A v2 frame with a payload of arbitrary non-zero bytes, so nothing is truncated
+static int frame(uint8_t *buffer, uint32_t id, int length, uint8_t crc_extra, uint8_t fill) {
+    buffer[0] = 0xFD;
+    buffer[1] = length;
+    buffer[2] = 0;
+    buffer[3] = 0;
+    buffer[4] = 0;
+    buffer[5] = 1;
+    buffer[6] = 1;
+    buffer[7] = id;
+    buffer[8] = id >> 8;
+    buffer[9] = id >> 16;
+    memset(buffer + 10, fill, length);
+    uint16_t crc = 0xFFFF;
+    int i;
+    for ( i=1; i<10 + length; i++ ) crc = crc_accumulate(buffer[i], crc);
+    crc = crc_accumulate(crc_extra, crc);
+    buffer[10 + length] = crc;
+    buffer[10 + length + 1] = crc >> 8;
+    return 10 + length + 2;
+}
+
+int main(int argc, char **argv) {
+    int megabytes = argc > 1 ? atoi(argv[1]) : 64;
+    int chunk = argc > 2 ? atoi(argv[2]) : 64;
+    if ( megabytes < 1 || chunk < 1 ) {
+        fprintf(stderr, "Usage: %s [megabytes [chunk bytes]]\n", argv[0]);
+        return 1;
+    }
+
+    // Heartbeat, SYS_STATUS, ATTITUDE, GLOBAL_POSITION_INT and an unmapped VFR_HUD
+    uint8_t cycle[512];
+    int length = 0;
+    length += frame(cycle + length, 0, 9, 50, 0x01);
+    length += frame(cycle + length, 1, 31, 124, 0x10);
+    length += frame(cycle + length, 30, 28, 39, 0x3c);
+    length += frame(cycle + length, 33, 28, 104, 0x20);
+    length += frame(cycle + length, 74, 20, 20, 0x42);
+
+    int repeats = (megabytes << 20) / length;
+    size_t total = (size_t)repeats * length;
+    uint8_t *stream = malloc(total);
+    int i;
+    for ( i=0; i<repeats; i++ ) memcpy(stream + (size_t)i * length, cycle, length);
+
+    FPVMAVLinkParser *parser = fpv_mavlink_parser_new(update_callback, NULL);
+    uint64_t start = test_now();
+    size_t offset;
+    for ( offset=0; offset<total; offset+=chunk ) {
+        fpv_mavlink_parser_feed(parser, stream + offset, total - offset < chunk ? total - offset : chunk);
+    }
+    uint64_t elapsed = test_now() - start;
+
+    FPVMAVLinkParserStats stats;
+    fpv_mavlink_parser_get_stats(parser, &stats);
+    fpv_mavlink_parser_dispose(parser);
+    free(stream);
+
+    printf("%.1f MB in %d-byte chunks: %.1f MB/s, %.0f messages/s (%llu messages, %llu unmapped, %llu updates, %llu errors)\n",
+        total / 1048576.0, chunk, total / 1048576.0 / (elapsed / 1e6),
+        (stats.messages + stats.unhandled) / (elapsed / 1e6), (unsigned long long)stats.messages,
+        (unsigned long long)stats.unhandled, (unsigned long long)updates,
+        (unsigned long long)(stats.crc_errors + stats.resyncs));
+    return stats.crc_errors + stats.resyncs ? 1 : 0;
+}
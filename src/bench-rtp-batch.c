@@ -0,0 +1,255 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares ways of sending the video stream over loopback: a sendmsg per packet, as
+// udpsink does, against the sender's batches with sendmmsg alone, with UDP GSO, and with
+// FEC repair added. Reports send calls per frame and the sending thread's CPU time per
+// megabit of video, then how pacing spreads a keyframe on arrival:
+// bench-rtp-batch [frames [keyframe packets [P-frame packets]]]
+//
+// Frames are shaped like rtph264pay's, a 12-byte header and payload apart, at 30 fps with a
+// keyframe each second, and sent as fast as they'll go. A thread drains the receiving
+// sockets and counts what arrives. On loopback the receiving side's kernel work happens in
+// the sending call, so part of each figure is delivery rather than sending.
+
+#define _GNU_SOURCE
+#include "rtp_batch.h"
+#include "telemetry_common.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_FRAME_PACKETS 256
+#define PACKET_LENGTH 1400
+#define RTP_HEADER_LENGTH 12
+
+typedef enum {
+    MODE_SENDMSG,
+    MODE_SENDMMSG,
+    MODE_GSO,
+    MODE_GSO_FEC,
+    MODE_COUNT
+} send_mode_t;
+
+static const char * MODE_NAMES[MODE_COUNT] = {
+    "per-packet sendmsg (udpsink)", "sendmmsg", "sendmmsg + GSO", "sendmmsg + GSO + FEC 16/4"
+};
+
+static int port;
+static uint8_t headers[MAX_FRAME_PACKETS][RTP_HEADER_LENGTH];
+static uint8_t payload[PACKET_LENGTH];
+static uint16_t sequence;
+
+// What the receiving thread saw
+static volatile int receiving = 1;
+static uint64_t received;
+static uint64_t first_arrival;
+static uint64_t last_arrival;
+
+static int receive_socket(int port) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int size = 8 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if ( bind(sock, (struct sockaddr*)&address, sizeof(address)) != 0 ) {
+        perror("bind");
+        exit(1);
+    }
+    return sock;
+}
+
+static void * receive_thread(void * arg) {
+    struct pollfd pollfds[2] = { { receive_socket(port), POLLIN, 0 }, { receive_socket(port + 1), POLLIN, 0 } };
+    static uint8_t buffer[2048];
+    while ( receiving ) {
+        if ( poll(pollfds, 2, 10) <= 0 ) continue;
+        int i;
+        for ( i=0; i<2; i++ ) {
+            if ( !(pollfds[i].revents & POLLIN) ) continue;
+            while ( recv(pollfds[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0 ) {
+                uint64_t now = fpv_telemetry_now();
+                if ( !__atomic_load_n(&first_arrival, __ATOMIC_RELAXED) ) __atomic_store_n(&first_arrival, now, __ATOMIC_RELAXED);
+                __atomic_store_n(&last_arrival, now, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&received, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    close(pollfds[0].fd);
+    close(pollfds[1].fd);
+    return NULL;
+}
+
+static uint64_t thread_cpu_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void wait_for(uint64_t count) {
+    uint64_t deadline = fpv_telemetry_now() + 1000000;
+    while ( __atomic_load_n(&received, __ATOMIC_RELAXED) < count && fpv_telemetry_now() < deadline ) usleep(1000);
+}
+
+// Stamps the next frame's headers; all but the last packet are full-sized
+static int frame_lengths(int count, int * lengths) {
+    int i, bytes = 0;
+    for ( i=0; i<count; i++ ) {
+        uint8_t *h = headers[i];
+        h[0] = 0x80;
+        h[1] = 96 | (i == count - 1 ? 0x80 : 0);
+        h[2] = sequence >> 8;
+        h[3] = sequence;
+        sequence++;
+        lengths[i] = i < count - 1 ? PACKET_LENGTH : PACKET_LENGTH / 3;
+        bytes += lengths[i];
+    }
+    return bytes;
+}
+
+typedef struct {
+    double calls_per_frame;
+    double cpu_per_mbit;        // Microseconds
+    double delivered;           // Fraction of packets, media and repair
+} run_result_t;
+
+static void run(send_mode_t mode, int frames, int keyframe_packets, int frame_packets, run_result_t * result) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    FPVRTPBatch *batch = fpv_rtp_batch_new("127.0.0.1", port, NULL, NULL);
+    fpv_rtp_batch_set_gso(batch, mode >= MODE_GSO);
+    if ( mode == MODE_GSO_FEC ) fpv_rtp_batch_enable_fec(batch, port + 1, 16, 4);
+
+    __atomic_store_n(&received, 0, __ATOMIC_RELAXED);
+    uint64_t bytes = 0, packets = 0, syscalls = 0;
+    int lengths[MAX_FRAME_PACKETS];
+    uint64_t start = thread_cpu_time();
+    int f, i;
+    for ( f=0; f<frames; f++ ) {
+        int count = f % 30 == 0 ? keyframe_packets : frame_packets;
+        bytes += frame_lengths(count, lengths);
+        packets += count;
+
+        if ( mode == MODE_SENDMSG ) {
+            for ( i=0; i<count; i++ ) {
+                struct iovec iov[2] = { { headers[i], RTP_HEADER_LENGTH }, { payload, lengths[i] - RTP_HEADER_LENGTH } };
+                struct msghdr message;
+                memset(&message, 0, sizeof(message));
+                message.msg_name = &address;
+                message.msg_namelen = sizeof(address);
+                message.msg_iov = iov;
+                message.msg_iovlen = 2;
+                sendmsg(sock, &message, 0);
+                syscalls++;
+            }
+        } else {
+            fpv_rtp_batch_begin_frame(batch, count, f * 3000);
+            for ( i=0; i<count; i++ ) {
+                struct iovec iov[2] = { { headers[i], RTP_HEADER_LENGTH }, { payload, lengths[i] - RTP_HEADER_LENGTH } };
+                fpv_rtp_batch_queue(batch, iov, 2);
+            }
+            fpv_rtp_batch_end_frame(batch);
+        }
+    }
+    uint64_t cpu = thread_cpu_time() - start;
+
+    FPVRTPBatchStats stats;
+    fpv_rtp_batch_get_stats(batch, &stats);
+    if ( mode != MODE_SENDMSG ) {
+        syscalls = stats.syscalls;
+        packets = stats.packets;
+    }
+    wait_for(packets);
+
+    result->calls_per_frame = (double)syscalls / frames;
+    result->cpu_per_mbit = cpu / (bytes * 8 / 1e6);
+    result->delivered = (double)__atomic_load_n(&received, __ATOMIC_RELAXED) / packets;
+    fpv_rtp_batch_dispose(batch);
+    close(sock);
+}
+
+// How long a keyframe takes to arrive, first packet to last
+static double keyframe_spread(double pacing, int keyframe_packets) {
+    FPVRTPBatch *batch = fpv_rtp_batch_new("127.0.0.1", port, NULL, NULL);
+    fpv_rtp_batch_set_pacing(batch, pacing, 30);
+    int lengths[MAX_FRAME_PACKETS], i;
+    frame_lengths(keyframe_packets, lengths);
+
+    __atomic_store_n(&received, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&first_arrival, 0, __ATOMIC_RELAXED);
+    fpv_rtp_batch_begin_frame(batch, keyframe_packets, 0);
+    for ( i=0; i<keyframe_packets; i++ ) {
+        struct iovec iov[2] = { { headers[i], RTP_HEADER_LENGTH }, { payload, lengths[i] - RTP_HEADER_LENGTH } };
+        fpv_rtp_batch_queue(batch, iov, 2);
+    }
+    fpv_rtp_batch_end_frame(batch);
+    wait_for(keyframe_packets);
+    fpv_rtp_batch_dispose(batch);
+    return (__atomic_load_n(&last_arrival, __ATOMIC_RELAXED) - __atomic_load_n(&first_arrival, __ATOMIC_RELAXED)) / 1000.0;
+}
+
+int main(int argc, char **argv) {
+    int frames = argc > 1 ? atoi(argv[1]) : 3000;
+    int keyframe_packets = argc > 2 ? atoi(argv[2]) : 60;
+    int frame_packets = argc > 3 ? atoi(argv[3]) : 8;
+    if ( frames < 1 || keyframe_packets < 1 || keyframe_packets > MAX_FRAME_PACKETS || frame_packets < 1 || frame_packets > MAX_FRAME_PACKETS ) {
+        fprintf(stderr, "Usage: %s [frames [keyframe packets [P-frame packets]]]\n", argv[0]);
+        return 1;
+    }
+    port = 20000 + getpid() % 20000;
+    memset(payload, 0x5A, sizeof(payload));
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, receive_thread, NULL);
+    usleep(100000);
+
+    // The sender reports on itself as it goes, so the table waits for the end
+    run_result_t results[MODE_COUNT];
+    send_mode_t mode;
+    for ( mode=0; mode<MODE_COUNT; mode++ ) {
+        run(mode, frames, keyframe_packets, frame_packets, &results[mode]);
+    }
+    double unpaced = keyframe_spread(0, keyframe_packets);
+    double paced = keyframe_spread(0.5, keyframe_packets);
+
+    receiving = 0;
+    pthread_join(thread, NULL);
+
+    printf("\n%d frames at 30 fps, %d-packet keyframes each second, %d-packet P-frames:\n", frames, keyframe_packets, frame_packets);
+    printf("  %-28s %12s %13s %10s\n", "send path", "calls/frame", "CPU per Mbit", "delivered");
+    for ( mode=0; mode<MODE_COUNT; mode++ ) {
+        printf("  %-28s %12.2f %10.0f us %9.1f%%\n", MODE_NAMES[mode], results[mode].calls_per_frame,
+            results[mode].cpu_per_mbit, 100 * results[mode].delivered);
+    }
+    printf("\nA %d-packet keyframe arrives over %.2f ms unpaced, %.1f ms with pacing 0.5 at 30 fps\n", keyframe_packets, unpaced, paced);
+    return 0;
+}
@@ -0,0 +1,98 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Times reading MCP3008 channels one ioctl per channel against one batched ioctl, on real
+// hardware: bench-spi [bus [device [channels [rounds]]]]
+
+#include "spi.h"
+#include "test_common.h"
+#include <stdlib.h>
+
+#define ADC_CHANNELS 8
+
+static uint64_t bench_single(SPIInterface *spi, int channels, int rounds) {
+    uint8_t commands[ADC_CHANNELS][3], responses[ADC_CHANNELS][3];
+    int round, channel;
+    for ( channel=0; channel<channels; channel++ ) {
+        commands[channel][0] = 1;
+        commands[channel][1] = (8+channel) << 4;
+        commands[channel][2] = 0;
+    }
+
+    uint64_t start = test_now();
+    for ( round=0; round<rounds; round++ ) {
+        for ( channel=0; channel<channels; channel++ ) {
+            if ( spi_transaction(spi, commands[channel], responses[channel], 3) < 0 ) return 0;
+        }
+    }
+    return test_now() - start;
+}
+
+static uint64_t bench_batch(SPIInterface *spi, int channels, int rounds) {
+    uint8_t commands[ADC_CHANNELS][3], responses[ADC_CHANNELS][3];
+    SPITransfer transfers[ADC_CHANNELS];
+    int round, channel;
+    for ( channel=0; channel<channels; channel++ ) {
+        commands[channel][0] = 1;
+        commands[channel][1] = (8+channel) << 4;
+        commands[channel][2] = 0;
+        transfers[channel].txbuffer = commands[channel];
+        transfers[channel].rxbuffer = responses[channel];
+        transfers[channel].length = 3;
+    }
+
+    uint64_t start = test_now();
+    for ( round=0; round<rounds; round++ ) {
+        if ( spi_transaction_batch(spi, transfers, channels) < 0 ) return 0;
+    }
+    return test_now() - start;
+}
+
+int main(int argc, char **argv) {
+    int bus = argc > 1 ? atoi(argv[1]) : 0;
+    int device = argc > 2 ? atoi(argv[2]) : 0;
+    int channels = argc > 3 ? atoi(argv[3]) : 3;
+    int rounds = argc > 4 ? atoi(argv[4]) : 10000;
+    if ( channels < 1 || channels > ADC_CHANNELS || rounds < 1 ) {
+        fprintf(stderr, "Usage: %s [bus [device [channels (1-%d) [rounds]]]]\n", argv[0], ADC_CHANNELS);
+        return 1;
+    }
+
+    SPIInterface *spi = spi_new(bus, device);
+    if ( !spi ) return 1;
+
+    // Alternate, so clock scaling and other load affect both alike
+    uint64_t single = 0, batch = 0;
+    int pass;
+    for ( pass=0; pass<4; pass++ ) {
+        uint64_t single_time = bench_single(spi, channels, rounds / 4 + 1);
+        uint64_t batch_time = bench_batch(spi, channels, rounds / 4 + 1);
+        if ( !single_time || !batch_time ) {
+            spi_dispose(spi);
+            return 1;
+        }
+        single += single_time;
+        batch += batch_time;
+    }
+    spi_dispose(spi);
+
+    int total = 4 * (rounds / 4 + 1);
+    printf("%d channels, %d rounds: one ioctl per channel %.1f us/round, batched %.1f us/round (%.2fx)\n",
+        channels, total, (double)single / total, (double)batch / total, (double)single / batch);
+    return 0;
+}
@@ -0,0 +1,120 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures the telemetry history ring at 1 kHz for a whole flight: insert cost, then lookups,
+// min/max/mean over the last 10 s and the last hour, the mAh integral and a downsampled
+// iteration, all on a full ring: bench-telemetry-history [seconds [rate hz]]
+
+#include "telemetry_history.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define QUERIES 100000
+
+// Results are summed here so the queries can't be optimised away
+static volatile double sink;
+
+static void iterate_callback(uint64_t timestamp, double value, void *context) {
+    sink += value;
+}
+
+static double per_call(uint64_t start, int calls) {
+    return (test_now() - start) * 1000.0 / calls;
+}
+
+int main(int argc, char **argv) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 3600;
+    int rate = argc > 2 ? atoi(argv[2]) : 1000;
+    if ( seconds < 10 || rate < 1 ) {
+        fprintf(stderr, "Usage: %s [seconds [rate hz]]\n", argv[0]);
+        return 1;
+    }
+    int samples = seconds * rate;
+    uint64_t interval = 1000000 / rate;
+
+    // Sized so the whole flight stays queryable, as the receiver would size it
+    FPVTelemetryHistory *history = fpv_telemetry_history_new(samples + 128);
+    if ( !history ) return 1;
+
+    FPVTelemetryUpdate update;
+    memset(&update, 0, sizeof(update));
+    update.type = TELEMETRY_TYPE_POWER;
+    uint32_t seed = 1;
+    double expected_mas = 0.0, previous = 0.0;
+    uint64_t base = 1000000;
+    int i;
+    uint64_t start = test_now();
+    for ( i=0; i<samples; i++ ) {
+        update.content.power.voltage = 16.8 - 4.0 * i / samples;
+        update.content.power.current = 10.0 + (test_random(&seed) % 1000) * 0.01;
+        fpv_telemetry_history_add(history, &update, base + i * interval);
+        if ( i > 0 ) expected_mas += (previous + update.content.power.current) * 0.5 * interval * 1e-6;
+        previous = update.content.power.current;
+    }
+    double insert_ns = per_call(start, samples);
+    uint64_t end = base + (uint64_t)(samples - 1) * interval;
+
+    double value;
+    start = test_now();
+    for ( i=0; i<QUERIES; i++ ) {
+        if ( fpv_telemetry_history_value_at(history, FPV_TELEMETRY_FIELD_CURRENT, base + test_random(&seed) % (end - base), &value) ) sink += value;
+    }
+    double value_at_ns = per_call(start, QUERIES);
+
+    FPVTelemetryHistoryStats stats;
+    start = test_now();
+    for ( i=0; i<QUERIES; i++ ) {
+        fpv_telemetry_history_get_stats(history, FPV_TELEMETRY_FIELD_VOLTAGE, end - 10000000 - (i & 1023), end, &stats);
+        sink += stats.mean;
+    }
+    double recent_ns = per_call(start, QUERIES);
+
+    start = test_now();
+    for ( i=0; i<QUERIES; i++ ) {
+        fpv_telemetry_history_get_stats(history, FPV_TELEMETRY_FIELD_VOLTAGE, base + (i & 1023), end, &stats);
+        sink += stats.mean;
+    }
+    double whole_ns = per_call(start, QUERIES);
+    int whole_count = stats.count;
+
+    double mas = 0.0;
+    start = test_now();
+    for ( i=0; i<QUERIES; i++ ) {
+        mas = fpv_telemetry_history_integrate(history, FPV_TELEMETRY_FIELD_CURRENT, 0, end + (i & 1));
+    }
+    double integrate_ns = per_call(start, QUERIES);
+
+    // One point per pixel of a 720-pixel-wide graph of the whole flight
+    int points = 0, rounds = 100;
+    uint64_t step = (end - base) / 720;
+    start = test_now();
+    for ( i=0; i<rounds; i++ ) {
+        points = fpv_telemetry_history_iterate(history, FPV_TELEMETRY_FIELD_CURRENT, base, end, step, iterate_callback, NULL);
+    }
+    double iterate_us = per_call(start, rounds) / 1000.0;
+
+    fpv_telemetry_history_dispose(history);
+
+    printf("%d samples (%d s at %d Hz): insert %.0f ns, value_at %.0f ns, stats over 10 s %.0f ns, "
+           "over %d samples %.0f ns, integrate %.0f ns, %d-point iterate %.1f us\n",
+        samples, seconds, rate, insert_ns, value_at_ns, recent_ns, whole_count, whole_ns, integrate_ns, points, iterate_us);
+    printf("Consumed %.1f mAh (expected %.1f)\n", mas / 3.6, expected_mas / 3.6);
+    return fabs(mas / 3.6 - expected_mas / 3.6) > 1e-3 * expected_mas ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Floods the telemetry listener over loopback and reports how many packets it takes per
+// second, and how often it has to wake for them: bench-telemetry-rx-flood [packets [senders]]
+
+#define _GNU_SOURCE
+#include "telemetry_rx.h"
+#include "telemetry_common.h"
+#include "test_common.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static int port;
+static int packets_per_sender;
+static uint64_t updates;
+
+static void update_callback(FPVTelemetryRX * rx, FPVTelemetryUpdate * update, void * context) {
+    __atomic_add_fetch(&updates, 1, __ATOMIC_RELAXED);
+}
+
+static void * sender_entry(void *userinfo) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    FPVTelemetryFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.count = 1;
+    frame.records[0].type = TELEMETRY_TYPE_POWER;
+    frame.records[0].content.power.voltage = 12.0;
+    uint8_t buffer[TELEMETRY_WIRE_MAX_LENGTH];
+    int i;
+    for ( i=0; i<packets_per_sender; i++ ) {
+        frame.sequence = i;
+        int length = fpv_telemetry_frame_encode(&frame, buffer, sizeof(buffer));
+        sendto(sock, buffer, length, 0, (struct sockaddr*)&address, sizeof(address));
+    }
+    close(sock);
+    return NULL;
+}
+
+static long listener_switches(pid_t tid) {
+    char path[64], line[256];
+    long switches = 0;
+    snprintf(path, sizeof(path), "/proc/self/task/%d/status", tid);
+    FILE *file = fopen(path, "r");
+    while ( file && fgets(line, sizeof(line), file) ) {
+        sscanf(line, "voluntary_ctxt_switches: %ld", &switches);
+    }
+    if ( file ) fclose(file);
+    return switches;
+}
+
+int main(int argc, char **argv) {
+    int packets = argc > 1 ? atoi(argv[1]) : 1000000;
+    int senders = argc > 2 ? atoi(argv[2]) : 1;
+    if ( packets < 1 || senders < 1 || senders > 16 ) {
+        fprintf(stderr, "Usage: %s [packets [senders (1-16)]]\n", argv[0]);
+        return 1;
+    }
+    packets_per_sender = packets / senders;
+
+    port = 20000 + getpid() % 20000;
+    FPVTelemetryRX *rx = fpv_telemetry_rx_new(NULL, port);
+    fpv_telemetry_rx_set_callback(rx, update_callback, NULL);
+    if ( fpv_telemetry_rx_listener_start(rx) != 1 ) return 1;
+    usleep(100000);
+
+    // The listener is the only other thread until the senders start
+    pid_t tid = 0;
+    DIR *tasks = opendir("/proc/self/task");
+    struct dirent *entry;
+    while ( tasks && (entry = readdir(tasks)) ) {
+        pid_t task = atoi(entry->d_name);
+        if ( task > 0 && task != syscall(SYS_gettid) ) tid = task;
+    }
+    if ( tasks ) closedir(tasks);
+    long switches = listener_switches(tid);
+
+    pthread_t threads[16];
+    uint64_t start = test_now();
+    int i;
+    for ( i=0; i<senders; i++ ) pthread_create(&threads[i], NULL, sender_entry, NULL);
+    for ( i=0; i<senders; i++ ) pthread_join(threads[i], NULL);
+
+    // Wait for the listener to drain the socket
+    uint64_t last = 0, count;
+    while ( (count = __atomic_load_n(&updates, __ATOMIC_RELAXED)) != last ) {
+        last = count;
+        usleep(20000);
+    }
+    uint64_t elapsed = test_now() - start - 20000;
+    switches = listener_switches(tid) - switches;
+
+    fpv_telemetry_rx_listener_stop(rx);
+    fpv_telemetry_rx_dispose(rx);
+
+    int sent = packets_per_sender * senders;
+    printf("%d packets from %d senders: %llu received (%.1f%%), %.0f packets/s, %.2f listener wakeups per packet\n",
+        sent, senders, (unsigned long long)count, 100.0 * count / sent, count / (elapsed / 1e6),
+        count ? (double)switches / count : 0.0);
+    return 0;
+}
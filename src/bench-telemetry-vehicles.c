@@ -0,0 +1,155 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Load test for multi-vehicle telemetry: simulated senders, each on its own loopback address
+// with its own vehicle ID, share a stream of packets, and the listener thread's CPU time per
+// packet is reported as the number of senders grows: bench-telemetry-vehicles [packets [max senders]]
+
+#define _GNU_SOURCE
+#include "telemetry_rx.h"
+#include "telemetry_common.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static uint64_t updates;
+
+static void update_callback(FPVTelemetryRX * rx, FPVTelemetryUpdate * update, void * context) {
+    __atomic_add_fetch(&updates, 1, __ATOMIC_RELAXED);
+}
+
+static pid_t listener_tid(void) {
+    pid_t tid = 0;
+    DIR *tasks = opendir("/proc/self/task");
+    struct dirent *entry;
+    while ( tasks && (entry = readdir(tasks)) ) {
+        pid_t task = atoi(entry->d_name);
+        if ( task > 0 && task != syscall(SYS_gettid) ) tid = task;
+    }
+    if ( tasks ) closedir(tasks);
+    return tid;
+}
+
+// Nanoseconds the thread has spent on a CPU
+static uint64_t thread_runtime(pid_t tid) {
+    char path[64];
+    unsigned long long runtime = 0;
+    snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", tid);
+    FILE *file = fopen(path, "r");
+    if ( file ) {
+        if ( fscanf(file, "%llu", &runtime) != 1 ) runtime = 0;
+        fclose(file);
+    }
+    return runtime;
+}
+
+static void wait_for_updates(uint64_t expected) {
+    int i;
+    for ( i=0; i<400 && __atomic_load_n(&updates, __ATOMIC_RELAXED) < expected; i++ ) usleep(5000);
+}
+
+static double run(int senders, int packets, int port, uint64_t *received) {
+    struct sockaddr_in address;
+    int sockets[FPV_TELEMETRY_MAX_VEHICLES];
+    int i;
+    for ( i=0; i<senders; i++ ) {
+        sockets[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 0x100 + i);
+        bind(sockets[i], (struct sockaddr*)&address, sizeof(address));
+    }
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    __atomic_store_n(&updates, 0, __ATOMIC_RELAXED);
+    FPVTelemetryRX *rx = fpv_telemetry_rx_new(NULL, port);
+    fpv_telemetry_rx_set_callback(rx, update_callback, NULL);
+    if ( fpv_telemetry_rx_listener_start(rx) != 1 ) exit(1);
+    usleep(100000);
+    pid_t tid = listener_tid();
+
+    // A position and a power record per frame, as a flight controller bridge would send
+    FPVTelemetryFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.count = 2;
+    frame.records[0].type = TELEMETRY_TYPE_POSITION;
+    frame.records[0].content.position.latitude = 48.1;
+    frame.records[0].content.position.longitude = 11.5;
+    frame.records[1].type = TELEMETRY_TYPE_POWER;
+    frame.records[1].content.power.voltage = 12.0;
+    uint8_t buffer[TELEMETRY_WIRE_MAX_LENGTH];
+
+    // Every sender is heard once before timing, so only steady-state lookups are measured
+    for ( i=0; i<senders; i++ ) {
+        frame.vehicle_id = i;
+        int length = fpv_telemetry_frame_encode(&frame, buffer, sizeof(buffer));
+        sendto(sockets[i], buffer, length, 0, (struct sockaddr*)&address, sizeof(address));
+    }
+    wait_for_updates(senders * frame.count);
+    uint64_t before = __atomic_load_n(&updates, __ATOMIC_RELAXED);
+    uint64_t runtime = thread_runtime(tid);
+
+    for ( i=0; i<packets; i++ ) {
+        int sender = i % senders;
+        frame.vehicle_id = sender;
+        frame.sequence = i / senders + 1;
+        frame.records[0].content.position.altitude = i % 1000;
+        int length = fpv_telemetry_frame_encode(&frame, buffer, sizeof(buffer));
+        sendto(sockets[sender], buffer, length, 0, (struct sockaddr*)&address, sizeof(address));
+        // Keep within the socket buffer: on one core the listener only runs when we pause
+        if ( (i & 63) == 63 ) usleep(50);
+    }
+    wait_for_updates(before + (uint64_t)packets * frame.count);
+    runtime = thread_runtime(tid) - runtime;
+    *received = (__atomic_load_n(&updates, __ATOMIC_RELAXED) - before) / frame.count;
+
+    fpv_telemetry_rx_listener_stop(rx);
+    fpv_telemetry_rx_dispose(rx);
+    for ( i=0; i<senders; i++ ) close(sockets[i]);
+    return *received ? (double)runtime / *received : 0.0;
+}
+
+int main(int argc, char **argv) {
+    int packets = argc > 1 ? atoi(argv[1]) : 200000;
+    int max_senders = argc > 2 ? atoi(argv[2]) : FPV_TELEMETRY_MAX_VEHICLES;
+    if ( packets < 1 || max_senders < 1 || max_senders > FPV_TELEMETRY_MAX_VEHICLES ) {
+        fprintf(stderr, "Usage: %s [packets [max senders (1-%d)]]\n", argv[0], FPV_TELEMETRY_MAX_VEHICLES);
+        return 1;
+    }
+
+    int port = 20000 + getpid() % 20000;
+    int senders;
+    for ( senders=1; ; senders *= 2 ) {
+        if ( senders > max_senders ) senders = max_senders;
+        uint64_t received;
+        double cost = run(senders, packets, port, &received);
+        printf("%2d senders: %llu of %d packets received, %.0f ns of listener CPU per packet\n",
+            senders, (unsigned long long)received, packets, cost);
+        if ( senders == max_senders ) break;
+    }
+    return 0;
+}
@@ -0,0 +1,110 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Times encoding and decoding telemetry records in the compact wire format against the XDR
+// encoding it replaced, and compares their sizes: bench-telemetry-wire [rounds]
+
+#include "telemetry_common.h"
+#include "test_common.h"
+#include <rpc/types.h>
+#include <rpc/xdr.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RECORDS 3
+
+static volatile double sink;
+
+static void make_records(FPVTelemetryUpdate records[RECORDS]) {
+    memset(records, 0, sizeof(FPVTelemetryUpdate) * RECORDS);
+    records[0].type = TELEMETRY_TYPE_POSITION;
+    records[0].content.position.latitude = 51.5074123;
+    records[0].content.position.longitude = -0.1277583;
+    records[0].content.position.altitude = 120.5;
+    records[0].content.position.bearing = 271.25;
+    records[1].type = TELEMETRY_TYPE_POWER;
+    records[1].content.power.voltage = 16.62;
+    records[1].content.power.current = 14.3;
+    records[2].type = TELEMETRY_TYPE_SIGNAL;
+    records[2].content.signal.rssi = -52.5;
+}
+
+// One datagram per record, as the XDR sender did
+static uint64_t bench_xdr(const FPVTelemetryUpdate records[RECORDS], int rounds, int *bytes) {
+    char buffer[TELEMETRY_WIRE_MAX_LENGTH];
+    FPVTelemetryUpdate decoded;
+    XDR xdrs;
+    int round, i;
+    *bytes = 0;
+    uint64_t start = test_now();
+    for ( round=0; round<rounds; round++ ) {
+        for ( i=0; i<RECORDS; i++ ) {
+            xdrmem_create(&xdrs, buffer, sizeof(buffer), XDR_ENCODE);
+            xdr_telemetry_update(&xdrs, (FPVTelemetryUpdate*)&records[i]);
+            int length = xdr_getpos(&xdrs);
+            xdr_destroy(&xdrs);
+            if ( round == 0 ) *bytes += length;
+
+            xdrmem_create(&xdrs, buffer, length, XDR_DECODE);
+            xdr_telemetry_update(&xdrs, &decoded);
+            xdr_destroy(&xdrs);
+            sink = decoded.content.signal.rssi;
+        }
+    }
+    return test_now() - start;
+}
+
+// All records in one frame, as the sender now does
+static uint64_t bench_compact(const FPVTelemetryUpdate records[RECORDS], int rounds, int *bytes) {
+    uint8_t buffer[TELEMETRY_WIRE_MAX_LENGTH];
+    FPVTelemetryFrame frame, decoded;
+    memset(&frame, 0, sizeof(frame));
+    memcpy(frame.records, records, sizeof(FPVTelemetryUpdate) * RECORDS);
+    frame.count = RECORDS;
+    int round;
+    uint64_t start = test_now();
+    for ( round=0; round<rounds; round++ ) {
+        frame.sequence = round;
+        int length = fpv_telemetry_frame_encode(&frame, buffer, sizeof(buffer));
+        if ( round == 0 ) *bytes = length;
+        fpv_telemetry_frame_decode(buffer, length, &decoded);
+        sink = decoded.records[RECORDS-1].content.signal.rssi;
+    }
+    return test_now() - start;
+}
+
+int main(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 1000000;
+    if ( rounds < 1 ) {
+        fprintf(stderr, "Usage: %s [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    FPVTelemetryUpdate records[RECORDS];
+    make_records(records);
+
+    int xdr_bytes, compact_bytes;
+    uint64_t xdr = bench_xdr(records, rounds, &xdr_bytes);
+    uint64_t compact = bench_compact(records, rounds, &compact_bytes);
+
+    printf("Position, power and signal, %d rounds of encode and decode:\n", rounds);
+    printf("  XDR:     %d datagrams, %d bytes, %.1f ns/round\n", RECORDS, xdr_bytes, xdr * 1000.0 / rounds);
+    printf("  Compact: 1 datagram,  %d bytes, %.1f ns/round (%.2fx)\n", compact_bytes, compact * 1000.0 / rounds,
+        compact ? (double)xdr / compact : 0.0);
+    return 0;
+}
@@ -0,0 +1,168 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bitrate_controller.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const double LOSS_HIGH = 0.10;
+static const double LOSS_LOW = 0.02;
+static const double LOSS_DECAY = 0.9;                   // Per report; loss is judged over about the last second of packets
+static const double INCREASE_PER_SECOND = 0.08;
+static const double MAX_RECEIVE_RATE_HEADROOM = 1.5;   // Don't grow beyond this multiple of what arrived
+static const uint32_t QUEUE_DELAY_LIMIT = 100000;      // Microseconds of queueing before delay counts as congestion
+static const double DELAY_BACKOFF = 0.85;               // Of the received rate, when the queue is building
+static const uint64_t DECREASE_HOLD = 1000000;          // Microseconds to let the queue drain before growing again
+static const uint64_t REPORT_TIMEOUT = 1000000;
+
+// What one ground station has seen of the stream
+typedef struct {
+    uint64_t last_report;       // 0 until its first report
+    uint32_t last_age_p95;
+    double expected;            // Decaying packet counts behind the loss estimate
+    double received;
+    double loss;
+} bitrate_sender_t;
+
+struct _FPVBitrateController {
+    double bitrate;
+    double min_bitrate;
+    double max_bitrate;
+    uint64_t hold_until;
+    uint64_t last_report;       // 0 until the first report arrives
+    uint64_t last_timeout;
+    uint64_t last_growth;       // When the rate last had the chance to grow
+    bitrate_sender_t senders[BITRATE_CONTROLLER_MAX_SENDERS];
+    FPVBitrateControllerStats stats;
+};
+
+#pragma mark - Forward declarations
+
+static int fpv_bitrate_controller_set(FPVBitrateController * controller, double bitrate);
+
+#pragma mark -
+
+FPVBitrateController * fpv_bitrate_controller_new(int bitrate, int min_bitrate, int max_bitrate) {
+    FPVBitrateController * controller = (FPVBitrateController*)calloc(1, sizeof(FPVBitrateController));
+    controller->min_bitrate = min_bitrate > 0 ? min_bitrate : 1;
+    controller->max_bitrate = max_bitrate > controller->min_bitrate ? max_bitrate : controller->min_bitrate;
+    fpv_bitrate_controller_set(controller, bitrate);
+    return controller;
+}
+
+void fpv_bitrate_controller_dispose(FPVBitrateController * controller) {
+    free(controller);
+}
+
+int fpv_bitrate_controller_report(FPVBitrateController * controller, int sender_index, const FPVLinkFeedbackReport * report, uint64_t now) {
+    controller->last_report = now;
+    controller->stats.reports++;
+    if ( sender_index < 0 || sender_index >= BITRATE_CONTROLLER_MAX_SENDERS ) return (int)controller->bitrate;
+
+    // A station heard from again after a timeout starts over, as may another in its slot
+    bitrate_sender_t *sender = &controller->senders[sender_index];
+    if ( sender->last_report && now - sender->last_report >= REPORT_TIMEOUT ) {
+        memset(sender, 0, sizeof(*sender));
+    }
+    sender->last_report = now;
+    if ( report->interval == 0 || report->expected == 0 ) return (int)controller->bitrate;
+
+    // At video rates a report covers a few dozen packets, where one loss already reads as
+    // several percent; judge loss over decaying counts spanning about the last second
+    double interval = report->interval / 1e6;
+    sender->expected = sender->expected * LOSS_DECAY + report->expected;
+    sender->received = sender->received * LOSS_DECAY + (report->received < report->expected ? report->received : report->expected);
+    double loss = sender->loss = 1.0 - sender->received / sender->expected;
+    double receive_rate = report->bytes * 8.0 / interval;
+    int congested = report->age_p95 > QUEUE_DELAY_LIMIT && report->age_p95 > sender->last_age_p95;
+    sender->last_age_p95 = report->age_p95;
+    controller->stats.loss = loss * 100.0;
+    controller->stats.receive_rate = receive_rate;
+
+    // Every station watches the same stream, so the worst of them sets the rate
+    if ( loss > LOSS_HIGH || congested ) {
+        double bitrate = controller->bitrate * (1.0 - 0.5 * loss);
+        if ( congested && DELAY_BACKOFF * receive_rate < bitrate ) bitrate = DELAY_BACKOFF * receive_rate;
+        controller->hold_until = now + DECREASE_HOLD;
+        int i;
+        for ( i=0; i<BITRATE_CONTROLLER_MAX_SENDERS; i++ ) {
+            controller->senders[i].expected = controller->senders[i].received = controller->senders[i].loss = 0;
+        }
+        controller->stats.decreases++;
+        return fpv_bitrate_controller_set(controller, bitrate);
+    }
+
+    int i;
+    for ( i=0; i<BITRATE_CONTROLLER_MAX_SENDERS; i++ ) {
+        bitrate_sender_t *other = &controller->senders[i];
+        if ( other->last_report && now - other->last_report < REPORT_TIMEOUT && other->loss >= LOSS_LOW ) return (int)controller->bitrate;
+    }
+
+    if ( now >= controller->hold_until ) {
+        // Several stations report over the same time; grow by the time since the last
+        // growth, not per report
+        if ( controller->last_growth && now - controller->last_growth < report->interval ) {
+            interval = (now - controller->last_growth) / 1e6;
+        }
+        controller->last_growth = now;
+        double bitrate = controller->bitrate * (1.0 + INCREASE_PER_SECOND * interval);
+
+        // A quiet scene can leave the encoder well under its target; don't run up a rate
+        // the link has never been shown to carry
+        double ceiling = receive_rate * MAX_RECEIVE_RATE_HEADROOM;
+        if ( bitrate > ceiling ) bitrate = ceiling > controller->bitrate ? ceiling : controller->bitrate;
+        if ( bitrate > controller->bitrate ) controller->stats.increases++;
+        return fpv_bitrate_controller_set(controller, bitrate);
+    }
+
+    return (int)controller->bitrate;
+}
+
+int fpv_bitrate_controller_check_timeout(FPVBitrateController * controller, uint64_t now) {
+    // Never heard from the ground station: leave the configured rate alone
+    if ( !controller->last_report ) return (int)controller->bitrate;
+
+    uint64_t since = controller->last_timeout > controller->last_report ? controller->last_timeout : controller->last_report;
+    if ( now - since < REPORT_TIMEOUT ) return (int)controller->bitrate;
+
+    controller->last_timeout = now;
+    controller->hold_until = now + DECREASE_HOLD;
+    controller->stats.timeouts++;
+    return fpv_bitrate_controller_set(controller, controller->bitrate * 0.5);
+}
+
+int fpv_bitrate_controller_set_limits(FPVBitrateController * controller, int min_bitrate, int max_bitrate) {
+    controller->min_bitrate = min_bitrate > 0 ? min_bitrate : 1;
+    controller->max_bitrate = max_bitrate > controller->min_bitrate ? max_bitrate : controller->min_bitrate;
+    return fpv_bitrate_controller_set(controller, controller->bitrate);
+}
+
+int fpv_bitrate_controller_get_bitrate(FPVBitrateController * controller) {
+    return (int)controller->bitrate;
+}
+
+void fpv_bitrate_controller_get_stats(FPVBitrateController * controller, FPVBitrateControllerStats * stats) {
+    *stats = controller->stats;
+}
+
+static int fpv_bitrate_controller_set(FPVBitrateController * controller, double bitrate) {
+    if ( bitrate < controller->min_bitrate ) bitrate = controller->min_bitrate;
+    if ( bitrate > controller->max_bitrate ) bitrate = controller->max_bitrate;
+    controller->bitrate = bitrate;
+    return (int)bitrate;
+}
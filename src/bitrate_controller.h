@@ -0,0 +1,62 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BITRATE_CONTROLLER_H
+#define __BITRATE_CONTROLLER_H
+
+#include <stdint.h>
+#include "link_feedback.h"
+
+/*
+ * Congestion controller for the video encoder, after the loss-based half of Google
+ * Congestion Control: back off in proportion to loss above 10%, hold between 2% and
+ * 10% (radio links lose packets that have nothing to do with congestion), and grow 8%
+ * a second below that, never far beyond what the ground station actually received.
+ * Rising queueing delay is treated like loss, so the rate comes down before the radio's
+ * buffers overflow. If reports stop arriving after they've been flowing, the rate halves
+ * each timeout until they return. With several ground stations reporting, the one
+ * faring worst sets the rate.
+ */
+
+#define BITRATE_CONTROLLER_MAX_SENDERS 8
+
+typedef struct {
+    uint64_t reports;
+    uint64_t increases;
+    uint64_t decreases;
+    uint64_t timeouts;
+    double loss;            // Percent, over the last report
+    double receive_rate;    // Bits per second, over the last report
+} FPVBitrateControllerStats;
+
+typedef struct _FPVBitrateController FPVBitrateController;
+
+FPVBitrateController * fpv_bitrate_controller_new(int bitrate, int min_bitrate, int max_bitrate);
+void fpv_bitrate_controller_dispose(FPVBitrateController * controller);
+
+// Each returns the new target bitrate, bits per second; now is monotonic microseconds.
+// sender tells the ground stations apart, from 0 to BITRATE_CONTROLLER_MAX_SENDERS - 1.
+int fpv_bitrate_controller_report(FPVBitrateController * controller, int sender, const FPVLinkFeedbackReport * report, uint64_t now);
+int fpv_bitrate_controller_check_timeout(FPVBitrateController * controller, uint64_t now);
+
+int fpv_bitrate_controller_set_limits(FPVBitrateController * controller, int min_bitrate, int max_bitrate);
+
+int fpv_bitrate_controller_get_bitrate(FPVBitrateController * controller);
+void fpv_bitrate_controller_get_stats(FPVBitrateController * controller, FPVBitrateControllerStats * stats);
+
+#endif
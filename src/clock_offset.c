@@ -0,0 +1,69 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "clock_offset.h"
+#include <stdlib.h>
+
+static const int64_t MAX_ROUND_TRIP = 2000000;  // Microseconds; longer exchanges say nothing useful
+
+typedef struct {
+    int64_t offset;
+    int64_t round_trip;
+} clock_sample_t;
+
+struct _FPVClockOffset {
+    clock_sample_t samples[CLOCK_OFFSET_SAMPLES];
+    int count;
+    int next;
+};
+
+FPVClockOffset * fpv_clock_offset_new() {
+    return (FPVClockOffset*)calloc(1, sizeof(FPVClockOffset));
+}
+
+void fpv_clock_offset_dispose(FPVClockOffset * clock) {
+    free(clock);
+}
+
+int fpv_clock_offset_add(FPVClockOffset * clock, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4) {
+    // Both clocks are monotonic, so these only fail for a mangled or mismatched reply
+    if ( t4 < t1 || t3 < t2 ) return 0;
+    int64_t round_trip = (int64_t)(t4 - t1) - (int64_t)(t3 - t2);
+    if ( round_trip < 0 || round_trip > MAX_ROUND_TRIP ) return 0;
+
+    clock_sample_t *sample = &clock->samples[clock->next];
+    sample->offset = (((int64_t)t2 - (int64_t)t1) + ((int64_t)t3 - (int64_t)t4)) / 2;
+    sample->round_trip = round_trip;
+    clock->next = (clock->next + 1) % CLOCK_OFFSET_SAMPLES;
+    if ( clock->count < CLOCK_OFFSET_SAMPLES ) clock->count++;
+    return 1;
+}
+
+int fpv_clock_offset_get(FPVClockOffset * clock, int64_t * offset, int64_t * round_trip) {
+    if ( !clock->count ) return 0;
+
+    const clock_sample_t *best = &clock->samples[0];
+    int i;
+    for ( i=1; i<clock->count; i++ ) {
+        if ( clock->samples[i].round_trip < best->round_trip ) best = &clock->samples[i];
+    }
+
+    if ( offset ) *offset = best->offset;
+    if ( round_trip ) *round_trip = best->round_trip;
+    return 1;
+}
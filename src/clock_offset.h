@@ -0,0 +1,50 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLOCK_OFFSET_H
+#define __CLOCK_OFFSET_H
+
+#include <stdint.h>
+
+#define CLOCK_OFFSET_SAMPLES 16
+
+/*
+ * Estimates the offset between the local monotonic clock and a remote host's from
+ * NTP-style exchanges: the request leaves at t1 and its reply arrives at t4 on the local
+ * clock, having arrived at t2 and left at t3 on the remote one. Each exchange gives
+ *
+ *   offset = ((t2 - t1) + (t3 - t4)) / 2,  round trip = (t4 - t1) - (t3 - t2)
+ *
+ * and is off by at most half its round trip, less when the path is symmetric. Queueing
+ * only ever adds to the round trip, so the estimate is the offset of the quickest of the
+ * last CLOCK_OFFSET_SAMPLES exchanges. Not thread-safe.
+ */
+
+typedef struct _FPVClockOffset FPVClockOffset;
+
+FPVClockOffset * fpv_clock_offset_new();
+void fpv_clock_offset_dispose(FPVClockOffset * clock);
+
+// Microseconds; returns 0 if the exchange is inconsistent and was ignored
+int fpv_clock_offset_add(FPVClockOffset * clock, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4);
+
+// Remote clock minus local clock and that exchange's round trip, microseconds; returns 0
+// until an exchange has completed
+int fpv_clock_offset_get(FPVClockOffset * clock, int64_t * offset, int64_t * round_trip);
+
+#endif
@@ -21,8 +21,11 @@
 
 #define RASPIFPV_PORT_VIDEO 9000
 #define RASPIFPV_PORT_TELEMETRY 9001
+#define RASPIFPV_PORT_FEEDBACK 9002
+#define RASPIFPV_PORT_FEC 9003
 #define RASPIFPV_MULTICAST_ADDR "224.1.1.43"
 
 #define RASPIFPV_DEFAULT_CONFIG_PATH "/etc/raspifpv.conf"
+#define RASPIFPV_DEFAULT_CONTROL_PATH "/run/raspifpvtx.sock"
 
 #endif
\ No newline at end of file
@@ -21,12 +21,14 @@
  */
 
 #include "egl_telemetry_renderer.h"
+#include "geometry.h"
 #include <bcm_host.h>
 #include <EGL/egl.h>
 #include <VG/openvg.h>
 #include <ft2build.h>
 #include <pthread.h>
 #include <assert.h>
+#include <math.h>
 #include FT_FREETYPE_H
 #include FT_STROKER_H
 
@@ -43,8 +45,10 @@ struct _FPVEGLTelemetryRenderer {
     int width;
     int height;
     pthread_t thread;
+    int thread_started;     // Until joined; running alone drops if the thread fails to set up
     int running;
     FPVTelemetryRX *telemetry_rx;
+    FPVLatencyStats *latency;
     int show_altitude;
     DISPMANX_ELEMENT_HANDLE_T dispman_element;
     DISPMANX_DISPLAY_HANDLE_T dispman_display;
@@ -97,9 +101,14 @@ FPVEGLTelemetryRenderer * fpv_egl_telemetry_renderer_new(FPVTelemetryRX * teleme
 }
 
 void fpv_egl_telemetry_renderer_dispose(FPVEGLTelemetryRenderer * renderer) {
+    fpv_egl_telemetry_renderer_stop(renderer);
     free(renderer);
 }
 
+void fpv_egl_telemetry_renderer_set_latency_stats(FPVEGLTelemetryRenderer * renderer, FPVLatencyStats * latency) {
+    renderer->latency = latency;
+}
+
 int fpv_egl_telemetry_renderer_start(FPVEGLTelemetryRenderer * renderer) {
     if ( renderer->running ) {
         fprintf(stderr, "FPVEGLTelemetryRenderer already running\n");
@@ -110,14 +119,19 @@ int fpv_egl_telemetry_renderer_start(FPVEGLTelemetryRenderer * renderer) {
     int result = pthread_create(&renderer->thread, NULL, fpv_egl_telemetry_renderer_thread_entry, renderer);
     if ( result != 0 ) {
         fprintf(stderr, "Unable to launch FPVEGLTelemetryRenderer thread: %s\n", strerror(result));
+        renderer->running = 0;
+    } else {
+        renderer->thread_started = 1;
     }
 
     return result == 0;
 }
 
 void fpv_egl_telemetry_renderer_stop(FPVEGLTelemetryRenderer * renderer) {
+    if ( !renderer->thread_started ) return;
     renderer->running = 0;
     pthread_join(renderer->thread, NULL);
+    renderer->thread_started = 0;
 }
 
 #pragma mark -
@@ -306,7 +320,61 @@ static void * fpv_egl_telemetry_renderer_thread_entry(void *userinfo) {
 static void fpv_egl_telemetry_renderer_render(FPVEGLTelemetryRenderer * renderer) {
     vgClear(0, 0, renderer->width, renderer->height);
 
-    fpv_egl_telemetry_renderer_draw_text(renderer, "hello", (Point){0, renderer->height - 100}, ALIGNMENT_LEFT);
+    // Telemetry arrives a few times a second at best; dead-reckon it to now so the distance
+    // and direction home move at frame rate instead of stepping with each fix
+    telemetry_rx_t telemetry = fpv_telemetry_rx_predict(renderer->telemetry_rx, fpv_telemetry_now());
+    float top = renderer->height * (1.0 - 2.0 * FONT_SIZE);
+    float margin = renderer->height * FONT_SIZE;
+
+    if ( telemetry.location.latitude != 0.0 && telemetry.home_location.latitude != 0.0 ) {
+        double distance = geom_distance_between_coordinates(telemetry.location.latitude, telemetry.location.longitude,
+                                                            telemetry.home_location.latitude, telemetry.home_location.longitude);
+        double bearing = geom_bearing_between_coordinates(telemetry.location.latitude, telemetry.location.longitude,
+                                                          telemetry.home_location.latitude, telemetry.home_location.longitude);
+        double turn = fmod(bearing - telemetry.bearing + 540.0, 360.0) - 180.0;
+        char text[128];
+        if ( distance < 1.0 || fabs(turn) < 5.0 ) {
+            snprintf(text, sizeof(text), "Home %d m ahead", (int)distance);
+        } else {
+            snprintf(text, sizeof(text), "Home %d m, %d deg %s", (int)distance, (int)fabs(turn), turn < 0 ? "left" : "right");
+        }
+        fpv_egl_telemetry_renderer_draw_text(renderer, text, (Point){renderer->width / 2.0, top}, ALIGNMENT_CENTER);
+    }
+
+    if ( telemetry.voltage > 0 ) {
+        char text[128];
+        snprintf(text, sizeof(text), "%0.2fV / %0.2fA", telemetry.voltage, telemetry.current);
+        fpv_egl_telemetry_renderer_draw_text(renderer, text, (Point){margin, top}, ALIGNMENT_LEFT);
+    }
+
+    if ( telemetry.signal_timestamp.received ) {
+        char text[128];
+        snprintf(text, sizeof(text), "%0.2fdB RSSI", telemetry.rssi);
+        fpv_egl_telemetry_renderer_draw_text(renderer, text, (Point){renderer->width - margin, top}, ALIGNMENT_RIGHT);
+    }
+
+    if ( renderer->show_altitude && telemetry.location.altitude > 0 ) {
+        char text[128];
+        snprintf(text, sizeof(text), "%d m alt", (int)telemetry.location.altitude);
+        fpv_egl_telemetry_renderer_draw_text(renderer, text, (Point){renderer->width * 0.75, top - margin * 1.5}, ALIGNMENT_CENTER);
+    }
+
+    FPVLinkStatsSnapshot link;
+    if ( fpv_telemetry_rx_get_link_stats(renderer->telemetry_rx, NULL, &link) && link.received > 0 ) {
+        char text[128];
+        fpv_link_stats_format(&link, text, sizeof(text));
+        fpv_egl_telemetry_renderer_draw_text(renderer, text, (Point){margin, margin * 2.2}, ALIGNMENT_LEFT);
+    }
+
+    FPVLatencyStatsSnapshot latency;
+    if ( renderer->latency ) {
+        fpv_latency_stats_get(renderer->latency, &latency);
+        if ( latency.frames[LATENCY_STAGE_DECODE_DISPLAY] ) {
+            char text[128];
+            fpv_latency_stats_format(&latency, text, sizeof(text));
+            fpv_egl_telemetry_renderer_draw_text(renderer, text, (Point){renderer->height * 0.05, renderer->height * 0.05}, ALIGNMENT_LEFT);
+        }
+    }
 
     eglSwapBuffers(renderer->display, renderer->surface);
 }
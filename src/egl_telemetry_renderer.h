@@ -21,13 +21,19 @@
 
 #include <bcm_host.h>
 #include "telemetry_rx.h"
+#include "latency_stats.h"
 
 typedef struct _FPVEGLTelemetryRenderer FPVEGLTelemetryRenderer;
 
 FPVEGLTelemetryRenderer * fpv_egl_telemetry_renderer_new(FPVTelemetryRX * telemetry_rx);
 void fpv_egl_telemetry_renderer_dispose(FPVEGLTelemetryRenderer * renderer);
 
+// Show video latency along the bottom; NULL for none. The HUD thread reads it, so clear it,
+// or stop the renderer, before the stats go away
+void fpv_egl_telemetry_renderer_set_latency_stats(FPVEGLTelemetryRenderer * renderer, FPVLatencyStats * latency);
+
 int fpv_egl_telemetry_renderer_start(FPVEGLTelemetryRenderer * renderer);
+// Waits for the HUD thread to finish its frame; dispose stops it too
 void fpv_egl_telemetry_renderer_stop(FPVEGLTelemetryRenderer * renderer);
     
 #endif
\ No newline at end of file
@@ -0,0 +1,100 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fast_start.h"
+#include "h264_nal.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const uint64_t REJOIN_GAP = 500000;     // Microseconds without video after which to join again
+
+struct _FPVFastStart {
+    int out_of_band;
+    int joined;
+    uint64_t waiting_since;     // First access unit seen while waiting, 0 before it
+    uint64_t last_unit;
+    FPVFastStartStats stats;
+};
+
+void fpv_fast_start_unit_add_au(FPVFastStartUnit * unit, const uint8_t * au, size_t length, int nal_length_size) {
+    size_t position = 0;
+    FPVH264Nal nal;
+    while ( fpv_h264_next_nal(au, length, nal_length_size, &position, &nal) ) {
+        fpv_fast_start_unit_add_nal(unit, au + nal.header, nal.end - nal.header);
+    }
+}
+
+void fpv_fast_start_unit_add_nal(FPVFastStartUnit * unit, const uint8_t * nal, size_t length) {
+    if ( length < 1 ) return;
+    switch ( fpv_h264_nal_type(nal[0]) ) {
+        case H264_NAL_SPS:
+            unit->sps = 1;
+            break;
+        case H264_NAL_PPS:
+            unit->pps = 1;
+            break;
+        case H264_NAL_IDR:
+            unit->idr = 1;
+            unit->slices++;
+            break;
+        case H264_NAL_SEI:
+            // Encoders put the recovery point in an SEI unit of its own, so the first message will do
+            if ( length >= 2 && nal[1] == H264_SEI_RECOVERY_POINT ) unit->recovery_point = 1;
+            break;
+        default:
+            if ( fpv_h264_nal_type(nal[0]) >= H264_NAL_SLICE && fpv_h264_nal_type(nal[0]) < H264_NAL_IDR ) unit->slices++;
+            break;
+    }
+}
+
+FPVFastStart * fpv_fast_start_new() {
+    return (FPVFastStart*)calloc(1, sizeof(FPVFastStart));
+}
+
+void fpv_fast_start_dispose(FPVFastStart * fast_start) {
+    free(fast_start);
+}
+
+void fpv_fast_start_set_parameter_sets(FPVFastStart * fast_start, int out_of_band) {
+    fast_start->out_of_band = out_of_band;
+}
+
+int fpv_fast_start_filter(FPVFastStart * fast_start, const FPVFastStartUnit * unit, uint64_t now, int * joined) {
+    *joined = 0;
+    if ( fast_start->joined && now - fast_start->last_unit > REJOIN_GAP ) fast_start->joined = 0;
+    fast_start->last_unit = now;
+    if ( fast_start->joined ) return 1;
+
+    if ( !fast_start->waiting_since ) fast_start->waiting_since = now;
+    int parameter_sets = fast_start->out_of_band || (unit->sps && unit->pps);
+    if ( !unit->slices || !(unit->idr || unit->recovery_point) || !parameter_sets ) {
+        fast_start->stats.discarded++;
+        return 0;
+    }
+
+    fast_start->joined = 1;
+    fast_start->stats.joins++;
+    fast_start->stats.last_wait = now - fast_start->waiting_since;
+    fast_start->waiting_since = 0;
+    *joined = 1;
+    return 1;
+}
+
+void fpv_fast_start_get_stats(FPVFastStart * fast_start, FPVFastStartStats * stats) {
+    *stats = fast_start->stats;
+}
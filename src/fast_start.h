@@ -0,0 +1,69 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FAST_START_H
+#define __FAST_START_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Holds a joining receiver's video back until the decoder can make sense of it, rather
+ * than feeding it predicted frames whose references it never had. Access units are
+ * dropped until one it can start from: an IDR, or the recovery point that begins an
+ * intra refresh cycle, carrying its SPS and PPS in-band (or with them known from the
+ * caps). When video stops arriving for long enough that the link was likely lost, the
+ * receiver joins again, as the frames it missed are the references of those to come.
+ *
+ * Works from NAL unit types alone, so the receive pipeline and the time-to-first-frame
+ * benchmark share it.
+ */
+
+typedef struct {
+    int sps;
+    int pps;
+    int idr;
+    int recovery_point;     // SEI recovery point, as x264 sends with intra refresh
+    int slices;
+} FPVFastStartUnit;
+
+typedef struct {
+    uint64_t joins;
+    uint64_t discarded;     // Access units dropped while waiting
+    uint64_t last_wait;     // Microseconds from the first access unit to the join, for the last join
+} FPVFastStartStats;
+
+typedef struct _FPVFastStart FPVFastStart;
+
+// Summarise an access unit, either whole or a NAL unit at a time (nal at its header byte)
+void fpv_fast_start_unit_add_au(FPVFastStartUnit * unit, const uint8_t * au, size_t length, int nal_length_size);
+void fpv_fast_start_unit_add_nal(FPVFastStartUnit * unit, const uint8_t * nal, size_t length);
+
+FPVFastStart * fpv_fast_start_new();
+void fpv_fast_start_dispose(FPVFastStart * fast_start);
+
+// Whether SPS and PPS arrive out of band, as an avc stream's codec_data
+void fpv_fast_start_set_parameter_sets(FPVFastStart * fast_start, int out_of_band);
+
+// Returns 1 to pass the access unit on to the decoder, 0 to drop it. now is monotonic
+// microseconds; joined is set when this unit is the one joined at
+int fpv_fast_start_filter(FPVFastStart * fast_start, const FPVFastStartUnit * unit, uint64_t now, int * joined);
+
+void fpv_fast_start_get_stats(FPVFastStart * fast_start, FPVFastStartStats * stats);
+
+#endif
@@ -0,0 +1,403 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fec.h"
+#include "gf256.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#define FEC_MEDIA_SLOTS 256         // Recent media packets kept for recovery; a power of two
+#define FEC_PENDING_GROUPS 8        // Groups awaiting repair at once
+#define FEC_SYMBOL_LENGTH (2 + FEC_MAX_PACKET_LENGTH)
+
+static const int RTP_HEADER_LENGTH = 12;
+
+// Generator rows: coefficient of media packet i in repair packet j
+static uint8_t fec_coefficients[FEC_MAX_REPAIR_PACKETS][FEC_MAX_MEDIA_PACKETS];
+static pthread_once_t fec_once = PTHREAD_ONCE_INIT;
+
+struct _FPVFecEncoder {
+    int k;
+    int m;
+    int count;                  // Media packets in the open group, 0 if none
+    uint16_t base;
+    int symbol_length;          // Longest symbol in the open group
+    int dirty_length;           // Symbol bytes to clear before the next group
+    uint8_t *repair[FEC_MAX_REPAIR_PACKETS];
+    int repair_lengths[FEC_MAX_REPAIR_PACKETS];
+    FPVFecStats stats;
+};
+
+typedef struct {
+    int valid;
+    uint16_t sequence;
+    int length;
+    uint8_t data[FEC_MAX_PACKET_LENGTH];
+} fec_media_t;
+
+typedef struct {
+    int active;
+    int done;                   // Recovered, or nothing went missing
+    uint16_t base;
+    int k;
+    int m;
+    uint32_t received;          // Bitmask of repair indices held
+    int count;
+    int symbol_length;
+    uint64_t order;             // For replacing the oldest group
+    uint8_t repair[FEC_MAX_REPAIR_PACKETS][FEC_SYMBOL_LENGTH];
+} fec_group_t;
+
+struct _FPVFecDecoder {
+    FPVFecRecoveredCallback callback;
+    void *userinfo;
+    fec_media_t media[FEC_MEDIA_SLOTS];
+    fec_group_t groups[FEC_PENDING_GROUPS];
+    uint64_t order;
+    uint8_t syndromes[FEC_MAX_REPAIR_PACKETS][FEC_SYMBOL_LENGTH];
+    uint8_t symbol[FEC_SYMBOL_LENGTH];
+    FPVFecStats stats;
+};
+
+#pragma mark - Forward declarations
+
+static void fec_build();
+static void fec_symbol_mul_add(uint8_t * symbol, const uint8_t * packet, int length, uint8_t c);
+static int fec_invert(uint8_t matrix[][FEC_MAX_REPAIR_PACKETS], int n);
+static fec_media_t * fec_decoder_media(FPVFecDecoder * decoder, uint16_t sequence);
+static void fec_decoder_recover(FPVFecDecoder * decoder, fec_group_t * group);
+
+static inline uint16_t get_be16(const uint8_t *p) {
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+#pragma mark - Encoder
+
+FPVFecEncoder * fpv_fec_encoder_new(int k, int m) {
+    if ( k < 1 || k > FEC_MAX_MEDIA_PACKETS || m < 1 || m > FEC_MAX_REPAIR_PACKETS ) return NULL;
+    pthread_once(&fec_once, fec_build);
+
+    FPVFecEncoder *encoder = (FPVFecEncoder*)calloc(1, sizeof(FPVFecEncoder));
+    encoder->k = k;
+    encoder->m = m;
+    int j;
+    for ( j=0; j<m; j++ ) {
+        encoder->repair[j] = (uint8_t*)calloc(1, FEC_MAX_REPAIR_LENGTH);
+    }
+    return encoder;
+}
+
+void fpv_fec_encoder_dispose(FPVFecEncoder * encoder) {
+    int j;
+    for ( j=0; j<encoder->m; j++ ) {
+        free(encoder->repair[j]);
+    }
+    free(encoder);
+}
+
+int fpv_fec_encoder_add(FPVFecEncoder * encoder, const uint8_t * packet, int length, uint8_t *** repair, int ** repair_lengths) {
+    struct iovec iov = { (void*)packet, length };
+    return fpv_fec_encoder_addv(encoder, &iov, 1, repair, repair_lengths);
+}
+
+int fpv_fec_encoder_addv(FPVFecEncoder * encoder, const struct iovec * iov, int count, uint8_t *** repair, int ** repair_lengths) {
+    // The header may itself be in pieces
+    uint8_t header[4];
+    int length = 0, i;
+    for ( i=0; i<count; i++ ) {
+        int n = 0;
+        while ( length + n < (int)sizeof(header) && n < (int)iov[i].iov_len ) {
+            header[length + n] = ((const uint8_t*)iov[i].iov_base)[n];
+            n++;
+        }
+        length += iov[i].iov_len;
+    }
+    if ( length < RTP_HEADER_LENGTH ) return 0;
+    uint16_t sequence = get_be16(header + 2);
+
+    // A gap in the sequence abandons the open group: its numbering no longer holds
+    uint16_t index = sequence - encoder->base;
+    if ( encoder->count == 0 || index != encoder->count ) {
+        int j;
+        for ( j=0; j<encoder->m; j++ ) {
+            memset(encoder->repair[j] + FEC_WIRE_HEADER_LENGTH, 0, encoder->dirty_length);
+        }
+        encoder->base = sequence;
+        encoder->count = 0;
+        encoder->symbol_length = encoder->dirty_length = 0;
+        index = 0;
+    }
+
+    // Packets too long to protect leave an empty symbol, which the receiver won't rebuild
+    if ( length <= FEC_MAX_PACKET_LENGTH ) {
+        int j;
+        for ( j=0; j<encoder->m; j++ ) {
+            uint8_t *symbol = encoder->repair[j] + FEC_WIRE_HEADER_LENGTH;
+            uint8_t c = fec_coefficients[j][index];
+            symbol[0] ^= gf256_mul(c, length & 0xFF);
+            symbol[1] ^= gf256_mul(c, length >> 8);
+            int offset = 2;
+            for ( i=0; i<count; i++ ) {
+                gf256_mul_add_region(symbol + offset, (const uint8_t*)iov[i].iov_base, c, iov[i].iov_len);
+                offset += iov[i].iov_len;
+            }
+        }
+        if ( 2 + length > encoder->symbol_length ) encoder->symbol_length = encoder->dirty_length = 2 + length;
+    }
+    encoder->count++;
+
+    int marker = header[1] & 0x80;
+    if ( !marker && encoder->count < encoder->k ) return 0;
+
+    // Close the group, with repair in proportion to its size
+    int k = encoder->count;
+    int m = (encoder->m * k + encoder->k - 1) / encoder->k;
+    int j;
+    for ( j=0; j<m; j++ ) {
+        uint8_t *p = encoder->repair[j];
+        p[0] = FEC_WIRE_MAGIC;
+        p[1] = FEC_WIRE_VERSION;
+        p[2] = k;
+        p[3] = m;
+        p[4] = j;
+        p[5] = 0;
+        p[6] = encoder->base;
+        p[7] = encoder->base >> 8;
+        encoder->repair_lengths[j] = FEC_WIRE_HEADER_LENGTH + encoder->symbol_length;
+    }
+    encoder->count = 0;
+    encoder->stats.groups++;
+    encoder->stats.repairs += m;
+
+    *repair = encoder->repair;
+    *repair_lengths = encoder->repair_lengths;
+    return m;
+}
+
+void fpv_fec_encoder_get_stats(FPVFecEncoder * encoder, FPVFecStats * stats) {
+    *stats = encoder->stats;
+}
+
+#pragma mark - Decoder
+
+FPVFecDecoder * fpv_fec_decoder_new(FPVFecRecoveredCallback callback, void * userinfo) {
+    pthread_once(&fec_once, fec_build);
+
+    FPVFecDecoder *decoder = (FPVFecDecoder*)calloc(1, sizeof(FPVFecDecoder));
+    if ( !decoder ) return NULL;
+    decoder->callback = callback;
+    decoder->userinfo = userinfo;
+    return decoder;
+}
+
+void fpv_fec_decoder_dispose(FPVFecDecoder * decoder) {
+    free(decoder);
+}
+
+void fpv_fec_decoder_add_media(FPVFecDecoder * decoder, const uint8_t * packet, int length) {
+    if ( length < RTP_HEADER_LENGTH || length > FEC_MAX_PACKET_LENGTH ) return;
+    uint16_t sequence = get_be16(packet + 2);
+
+    fec_media_t *media = &decoder->media[sequence & (FEC_MEDIA_SLOTS-1)];
+    media->valid = 1;
+    media->sequence = sequence;
+    media->length = length;
+    memcpy(media->data, packet, length);
+
+    // Usually the group's repair comes after its media, but not if the network reordered them
+    int i;
+    for ( i=0; i<FEC_PENDING_GROUPS; i++ ) {
+        fec_group_t *group = &decoder->groups[i];
+        if ( group->active && !group->done && (uint16_t)(sequence - group->base) < group->k ) {
+            fec_decoder_recover(decoder, group);
+        }
+    }
+}
+
+void fpv_fec_decoder_add_repair(FPVFecDecoder * decoder, const uint8_t * packet, int length) {
+    if ( length < FEC_WIRE_HEADER_LENGTH + 2 || length > FEC_MAX_REPAIR_LENGTH
+            || packet[0] != FEC_WIRE_MAGIC || packet[1] != FEC_WIRE_VERSION ) return;
+    int k = packet[2], m = packet[3], index = packet[4];
+    uint16_t base = packet[6] | ((uint16_t)packet[7] << 8);
+    if ( k < 1 || k > FEC_MAX_MEDIA_PACKETS || m < 1 || m > FEC_MAX_REPAIR_PACKETS || index >= m ) return;
+
+    fec_group_t *group = NULL, *oldest = NULL;
+    int i;
+    for ( i=0; i<FEC_PENDING_GROUPS && !group; i++ ) {
+        fec_group_t *candidate = &decoder->groups[i];
+        if ( candidate->active && candidate->base == base && candidate->k == k && candidate->m == m ) group = candidate;
+        else if ( !oldest || !candidate->active || (oldest->active && candidate->order < oldest->order) ) oldest = candidate;
+    }
+
+    if ( !group ) {
+        group = oldest;
+        if ( group->active && !group->done ) decoder->stats.unrecoverable++;
+        memset(group, 0, offsetof(fec_group_t, repair));
+        group->active = 1;
+        group->base = base;
+        group->k = k;
+        group->m = m;
+        group->symbol_length = length - FEC_WIRE_HEADER_LENGTH;
+        group->order = ++decoder->order;
+        decoder->stats.groups++;
+    }
+
+    decoder->stats.repairs++;
+    if ( group->done || (group->received & (1u << index)) || length - FEC_WIRE_HEADER_LENGTH != group->symbol_length ) return;
+
+    memcpy(group->repair[index], packet + FEC_WIRE_HEADER_LENGTH, group->symbol_length);
+    group->received |= 1u << index;
+    group->count++;
+
+    fec_decoder_recover(decoder, group);
+}
+
+void fpv_fec_decoder_get_stats(FPVFecDecoder * decoder, FPVFecStats * stats) {
+    *stats = decoder->stats;
+}
+
+static fec_media_t * fec_decoder_media(FPVFecDecoder * decoder, uint16_t sequence) {
+    fec_media_t *media = &decoder->media[sequence & (FEC_MEDIA_SLOTS-1)];
+    return media->valid && media->sequence == sequence ? media : NULL;
+}
+
+static void fec_decoder_recover(FPVFecDecoder * decoder, fec_group_t * group) {
+    int lost[FEC_MAX_REPAIR_PACKETS];
+    int lost_count = 0;
+    int i;
+    for ( i=0; i<group->k; i++ ) {
+        if ( fec_decoder_media(decoder, group->base + i) ) continue;
+        if ( lost_count == group->count ) return;   // More missing than repair can rebuild, yet
+        lost[lost_count++] = i;
+    }
+
+    if ( lost_count == 0 ) {
+        group->done = 1;
+        return;
+    }
+
+    // Take as many repair packets as there are losses, and subtract the media that arrived
+    int rows[FEC_MAX_REPAIR_PACKETS];
+    int r, j;
+    for ( j=0, r=0; r<lost_count; j++ ) {
+        if ( !(group->received & (1u << j)) ) continue;
+        rows[r] = j;
+        memcpy(decoder->syndromes[r], group->repair[j], group->symbol_length);
+        r++;
+    }
+
+    for ( i=0; i<group->k; i++ ) {
+        fec_media_t *media = fec_decoder_media(decoder, group->base + i);
+        if ( !media || 2 + media->length > group->symbol_length ) continue;
+        for ( r=0; r<lost_count; r++ ) {
+            fec_symbol_mul_add(decoder->syndromes[r], media->data, media->length, fec_coefficients[rows[r]][i]);
+        }
+    }
+
+    // What's left is the lost symbols through a square Cauchy matrix, which is always invertible
+    uint8_t matrix[FEC_MAX_REPAIR_PACKETS][FEC_MAX_REPAIR_PACKETS];
+    int l;
+    for ( r=0; r<lost_count; r++ ) {
+        for ( l=0; l<lost_count; l++ ) {
+            matrix[r][l] = fec_coefficients[rows[r]][lost[l]];
+        }
+    }
+    group->done = 1;
+    if ( !fec_invert(matrix, lost_count) ) return;
+
+    for ( l=0; l<lost_count; l++ ) {
+        memset(decoder->symbol, 0, group->symbol_length);
+        for ( r=0; r<lost_count; r++ ) {
+            gf256_mul_add_region(decoder->symbol, decoder->syndromes[r], matrix[l][r], group->symbol_length);
+        }
+
+        // Check the rebuilt packet is the one that went missing before passing it on
+        int length = decoder->symbol[0] | (decoder->symbol[1] << 8);
+        const uint8_t *packet = decoder->symbol + 2;
+        uint16_t sequence = group->base + lost[l];
+        if ( length < RTP_HEADER_LENGTH || 2 + length > group->symbol_length
+                || (packet[0] >> 6) != 2 || get_be16(packet + 2) != sequence ) continue;
+
+        fec_media_t *media = &decoder->media[sequence & (FEC_MEDIA_SLOTS-1)];
+        media->valid = 1;
+        media->sequence = sequence;
+        media->length = length;
+        memcpy(media->data, packet, length);
+
+        decoder->stats.recovered++;
+        if ( decoder->callback ) decoder->callback(media->data, length, decoder->userinfo);
+    }
+}
+
+#pragma mark - Coding
+
+static void fec_build() {
+    gf256_init();
+    int i, j;
+    for ( j=0; j<FEC_MAX_REPAIR_PACKETS; j++ ) {
+        for ( i=0; i<FEC_MAX_MEDIA_PACKETS; i++ ) {
+            fec_coefficients[j][i] = gf256_inv(j ^ (FEC_MAX_REPAIR_PACKETS + i));
+        }
+    }
+}
+
+// symbol ^= c * (uint16 length, packet)
+static void fec_symbol_mul_add(uint8_t * symbol, const uint8_t * packet, int length, uint8_t c) {
+    symbol[0] ^= gf256_mul(c, length & 0xFF);
+    symbol[1] ^= gf256_mul(c, length >> 8);
+    gf256_mul_add_region(symbol + 2, packet, c, length);
+}
+
+// Gauss-Jordan inversion in place; returns 0 if the matrix is singular
+static int fec_invert(uint8_t matrix[][FEC_MAX_REPAIR_PACKETS], int n) {
+    uint8_t inverse[FEC_MAX_REPAIR_PACKETS][FEC_MAX_REPAIR_PACKETS];
+    int row, column, i;
+    memset(inverse, 0, sizeof(inverse));
+    for ( i=0; i<n; i++ ) inverse[i][i] = 1;
+
+    for ( column=0; column<n; column++ ) {
+        int pivot = column;
+        while ( pivot < n && !matrix[pivot][column] ) pivot++;
+        if ( pivot == n ) return 0;
+        if ( pivot != column ) {
+            uint8_t swap[FEC_MAX_REPAIR_PACKETS];
+            memcpy(swap, matrix[pivot], n); memcpy(matrix[pivot], matrix[column], n); memcpy(matrix[column], swap, n);
+            memcpy(swap, inverse[pivot], n); memcpy(inverse[pivot], inverse[column], n); memcpy(inverse[column], swap, n);
+        }
+
+        uint8_t scale = gf256_inv(matrix[column][column]);
+        for ( i=0; i<n; i++ ) {
+            matrix[column][i] = gf256_mul(matrix[column][i], scale);
+            inverse[column][i] = gf256_mul(inverse[column][i], scale);
+        }
+
+        for ( row=0; row<n; row++ ) {
+            uint8_t factor = matrix[row][column];
+            if ( row == column || !factor ) continue;
+            for ( i=0; i<n; i++ ) {
+                matrix[row][i] ^= gf256_mul(factor, matrix[column][i]);
+                inverse[row][i] ^= gf256_mul(factor, inverse[column][i]);
+            }
+        }
+    }
+
+    for ( i=0; i<n; i++ ) memcpy(matrix[i], inverse[i], n);
+    return 1;
+}
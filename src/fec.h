@@ -0,0 +1,86 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FEC_H
+#define __FEC_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Packet-level forward error correction for the RTP video stream: a systematic
+ * Reed-Solomon code over GF(256) with a Cauchy generator matrix. The media packets go
+ * out untouched; after each group of up to k of them the sender emits m repair packets,
+ * and a receiver holding any k of the k + m can rebuild the missing media. Groups also
+ * close at the end of each video frame (the RTP marker bit), so repair never waits on
+ * the next frame; a short group gets proportionally fewer repair packets.
+ *
+ * Repair packets travel on their own port, so receivers without FEC ignore them:
+ *   uint8 magic, uint8 version, uint8 k, uint8 m, uint8 index, uint8 reserved,
+ *   uint16 RTP sequence number of the group's first packet (little-endian),
+ *   then the repair symbol. Symbols are each packet's uint16 length followed by the
+ *   packet, zero-padded to the group's longest.
+ */
+
+#define FEC_WIRE_MAGIC 0xF7
+#define FEC_WIRE_VERSION 1
+#define FEC_WIRE_HEADER_LENGTH 8
+#define FEC_MAX_MEDIA_PACKETS 64    // k
+#define FEC_MAX_REPAIR_PACKETS 16   // m
+#define FEC_MAX_PACKET_LENGTH 1500
+#define FEC_MAX_REPAIR_LENGTH (FEC_WIRE_HEADER_LENGTH + 2 + FEC_MAX_PACKET_LENGTH)
+
+typedef struct {
+    uint64_t groups;
+    uint64_t repairs;           // Encoder: repair packets produced; decoder: received
+    uint64_t recovered;         // Decoder: media packets rebuilt
+    uint64_t unrecoverable;     // Decoder: groups that lost more than their repair could cover
+} FPVFecStats;
+
+// Sender side
+
+typedef struct _FPVFecEncoder FPVFecEncoder;
+
+FPVFecEncoder * fpv_fec_encoder_new(int k, int m);
+void fpv_fec_encoder_dispose(FPVFecEncoder * encoder);
+
+// Adds an outgoing RTP packet. When it closes a group, returns the number of repair
+// packets ready and points repair at them (valid until the next call), with their lengths
+int fpv_fec_encoder_add(FPVFecEncoder * encoder, const uint8_t * packet, int length, uint8_t *** repair, int ** repair_lengths);
+
+// The same, for a packet in pieces
+int fpv_fec_encoder_addv(FPVFecEncoder * encoder, const struct iovec * iov, int count, uint8_t *** repair, int ** repair_lengths);
+
+void fpv_fec_encoder_get_stats(FPVFecEncoder * encoder, FPVFecStats * stats);
+
+// Receiver side
+
+typedef void (*FPVFecRecoveredCallback)(const uint8_t * packet, int length, void * userinfo);
+
+typedef struct _FPVFecDecoder FPVFecDecoder;
+
+// Rebuilt packets are handed to callback, from inside whichever add call completed them
+FPVFecDecoder * fpv_fec_decoder_new(FPVFecRecoveredCallback callback, void * userinfo);
+void fpv_fec_decoder_dispose(FPVFecDecoder * decoder);
+
+void fpv_fec_decoder_add_media(FPVFecDecoder * decoder, const uint8_t * packet, int length);
+void fpv_fec_decoder_add_repair(FPVFecDecoder * decoder, const uint8_t * packet, int length);
+
+void fpv_fec_decoder_get_stats(FPVFecDecoder * decoder, FPVFecStats * stats);
+
+#endif
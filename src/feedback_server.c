@@ -0,0 +1,156 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "feedback_server.h"
+#include "telemetry_common.h"
+#include <glib.h>
+#include <glib-unix.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+typedef struct {
+    FPVFeedbackHandler handler;
+    void *userinfo;
+} feedback_handler_t;
+
+struct _FPVFeedbackServer {
+    int sock;
+    guint watch;
+    feedback_handler_t handlers[LINK_FEEDBACK_TYPE_COUNT];
+    FPVLinkFeedbackSenders senders;
+    uint64_t received;
+    uint64_t stale;
+    uint64_t clock_requests;
+};
+
+#pragma mark - Forward declarations
+
+static gboolean on_feedback(gint fd, GIOCondition condition, gpointer user_data);
+static void fpv_feedback_server_reply_clock(FPVFeedbackServer * server, const FPVLinkFeedback * request, uint64_t received,
+                                            const struct sockaddr_in * addr);
+
+#pragma mark -
+
+FPVFeedbackServer * fpv_feedback_server_new() {
+    FPVFeedbackServer *server = (FPVFeedbackServer*)calloc(1, sizeof(FPVFeedbackServer));
+    server->sock = -1;
+    return server;
+}
+
+void fpv_feedback_server_dispose(FPVFeedbackServer * server) {
+    if ( server->sock != -1 ) fpv_feedback_server_stop(server);
+    free(server);
+}
+
+void fpv_feedback_server_set_handler(FPVFeedbackServer * server, int type, FPVFeedbackHandler handler, void * userinfo) {
+    if ( type <= 0 || type >= LINK_FEEDBACK_TYPE_COUNT ) return;
+    server->handlers[type].handler = handler;
+    server->handlers[type].userinfo = userinfo;
+}
+
+int fpv_feedback_server_start(FPVFeedbackServer * server, int port) {
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( sock == -1 ) {
+        perror("socket");
+        return 0;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if ( bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 ) {
+        fprintf(stderr, "Couldn't bind feedback port %d: %s\n", port, strerror(errno));
+        close(sock);
+        return 0;
+    }
+
+    server->sock = sock;
+    server->watch = g_unix_fd_add(sock, G_IO_IN, on_feedback, server);
+
+    printf("Listening for link feedback on port %d\n", port);
+    return 1;
+}
+
+void fpv_feedback_server_stop(FPVFeedbackServer * server) {
+    if ( server->sock == -1 ) return;
+
+    g_source_remove(server->watch);
+    close(server->sock);
+    server->sock = -1;
+
+    printf("Link feedback: %llu received, %llu out of order, %llu clock requests answered\n",
+        (unsigned long long)server->received, (unsigned long long)server->stale, (unsigned long long)server->clock_requests);
+}
+
+static gboolean on_feedback(gint fd, GIOCondition condition, gpointer user_data) {
+    FPVFeedbackServer *server = (FPVFeedbackServer*)user_data;
+
+    uint8_t buffer[LINK_FEEDBACK_MAX_LENGTH];
+    struct sockaddr_in addr;
+    socklen_t addr_length = sizeof(addr);
+    ssize_t length;
+    while ( (length = recvfrom(fd, buffer, sizeof(buffer), 0, (struct sockaddr*)&addr, &addr_length)) > 0 ) {
+        uint64_t now = fpv_telemetry_now();
+        addr_length = sizeof(addr);
+
+        FPVLinkFeedback feedback;
+        if ( !fpv_link_feedback_decode(buffer, length, &feedback) ) continue;
+        server->received++;
+
+        // Reports are deltas; a late one would count its interval twice. Each ground
+        // station keeps its own numbering.
+        int sender = fpv_link_feedback_senders_accept(&server->senders, addr.sin_addr.s_addr, addr.sin_port, feedback.sequence, now);
+        if ( sender < 0 ) {
+            server->stale++;
+            continue;
+        }
+
+        if ( feedback.type == LINK_FEEDBACK_TYPE_CLOCK_REQUEST ) {
+            fpv_feedback_server_reply_clock(server, &feedback, now, &addr);
+        } else if ( feedback.type < LINK_FEEDBACK_TYPE_COUNT && server->handlers[feedback.type].handler ) {
+            server->handlers[feedback.type].handler(&feedback, sender, now, server->handlers[feedback.type].userinfo);
+        }
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void fpv_feedback_server_reply_clock(FPVFeedbackServer * server, const FPVLinkFeedback * request, uint64_t received,
+                                            const struct sockaddr_in * addr) {
+    FPVLinkFeedback reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.type = LINK_FEEDBACK_TYPE_CLOCK_REPLY;
+    reply.sequence = request->sequence;
+    reply.content.clock.originate = request->content.clock.originate;
+    reply.content.clock.receive = received;
+
+    // Stamp as late as possible: time spent here would otherwise count as path delay
+    uint8_t buffer[LINK_FEEDBACK_MAX_LENGTH];
+    reply.content.clock.transmit = fpv_telemetry_now();
+    int length = fpv_link_feedback_encode(&reply, buffer, sizeof(buffer));
+    if ( sendto(server->sock, buffer, length, 0, (const struct sockaddr*)addr, sizeof(*addr)) == length ) {
+        server->clock_requests++;
+    }
+}
@@ -0,0 +1,46 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FEEDBACK_SERVER_H
+#define __FEEDBACK_SERVER_H
+
+#include "link_feedback.h"
+
+/*
+ * The vehicle's end of the link feedback channel (see link_feedback.h). Owns the
+ * feedback port, drops feedback that arrives out of order from each ground station,
+ * answers clock requests itself, and hands everything else to the handler registered
+ * for its type. Runs on the default main context.
+ */
+
+typedef struct _FPVFeedbackServer FPVFeedbackServer;
+
+// sender tells ground stations apart, from 0 to LINK_FEEDBACK_MAX_SENDERS - 1; received
+// is monotonic microseconds, as from fpv_telemetry_now
+typedef void (*FPVFeedbackHandler)(const FPVLinkFeedback * feedback, int sender, uint64_t received, void * userinfo);
+
+FPVFeedbackServer * fpv_feedback_server_new();
+void fpv_feedback_server_dispose(FPVFeedbackServer * server);
+
+// NULL handler to stop handling the type
+void fpv_feedback_server_set_handler(FPVFeedbackServer * server, int type, FPVFeedbackHandler handler, void * userinfo);
+
+int fpv_feedback_server_start(FPVFeedbackServer * server, int port);
+void fpv_feedback_server_stop(FPVFeedbackServer * server);
+
+#endif
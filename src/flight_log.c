@@ -0,0 +1,513 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flight_log.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#define FLIGHT_LOG_HEADER_SIZE 4096
+#define FLIGHT_LOG_INDEX_ENTRY_LENGTH 16
+
+static const uint64_t MIN_LOG_SIZE = 1 << 20;
+static const int RECORDER_QUEUE_CAPACITY = 4096;
+
+// The header is written as a plain struct: every platform we run on is little-endian,
+// and the field order keeps it free of padding
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t index_interval;
+    uint64_t started;           // Wall-clock microseconds since the epoch
+    uint64_t index_offset;
+    uint64_t index_capacity;    // Entries
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint64_t data_length;       // Bytes of records known to be on disk
+    uint64_t index_count;       // Index entries known to be on disk
+} FPVFlightLogHeader;
+
+struct _FPVFlightLog {
+    FPVTelemetryRX *rx;
+    FPVTelemetrySubscription *subscription;
+    char *path;
+    int fd;
+    uint8_t *map;
+    uint64_t size;
+    FPVFlightLogHeader *header;
+    uint8_t *index;
+    uint8_t *data;
+
+    int sync_interval;
+    int index_interval;
+
+    // Writer state, owned by the recorder thread. The header's copies of data_length and
+    // index_count trail these until the next flush.
+    uint64_t data_length;
+    uint64_t index_count;
+    uint64_t records;
+    int full;
+
+    pthread_t thread;
+    int running;
+    int stop_fd;
+
+    uint64_t dropped;
+    uint64_t syncs;
+    uint64_t max_sync_time;
+};
+
+struct _FPVFlightLogReader {
+    int fd;
+    uint8_t *map;
+    uint64_t size;
+    const FPVFlightLogHeader *header;
+    const uint8_t *index;
+    const uint8_t *data;
+    uint64_t data_length;
+    uint64_t index_count;
+    uint64_t position;
+};
+
+#pragma mark - Forward declarations
+
+static void * fpv_flight_log_thread_entry(void *userinfo);
+static int fpv_flight_log_sync_range(FPVFlightLog * log, uint64_t start, uint64_t end);
+static uint64_t fpv_flight_log_reader_received_at(FPVFlightLogReader * reader, uint64_t position);
+
+#pragma mark -
+
+static inline void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline void put_le64(uint8_t *p, uint64_t v) {
+    put_le32(p, (uint32_t)v);
+    put_le32(p+4, (uint32_t)(v >> 32));
+}
+
+static inline uint32_t get_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t get_le64(const uint8_t *p) {
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p+4) << 32);
+}
+
+FPVFlightLog * fpv_flight_log_new(FPVTelemetryRX * rx, const char * path, uint64_t size) {
+    if ( size < MIN_LOG_SIZE ) size = MIN_LOG_SIZE;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if ( fd < 0 ) {
+        fprintf(stderr, "Unable to create flight log %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    // Claim the whole file up front, so running out of space shows up now rather than as
+    // a SIGBUS mid-flight
+    int result = posix_fallocate(fd, 0, size);
+    if ( result != 0 ) {
+        fprintf(stderr, "Unable to allocate %llu bytes for flight log %s: %s\n", (unsigned long long)size, path, strerror(result));
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+
+    uint8_t *map = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if ( map == MAP_FAILED ) {
+        fprintf(stderr, "Unable to map flight log %s: %s\n", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+
+    FPVFlightLog * log = (FPVFlightLog*)calloc(1, sizeof(FPVFlightLog));
+    log->rx = rx;
+    log->path = strdup(path);
+    log->fd = fd;
+    log->map = map;
+    log->size = size;
+    log->header = (FPVFlightLogHeader*)map;
+    log->sync_interval = FLIGHT_LOG_DEFAULT_SYNC_INTERVAL;
+    log->index_interval = FLIGHT_LOG_DEFAULT_INDEX_INTERVAL;
+    log->stop_fd = -1;
+    return log;
+}
+
+void fpv_flight_log_dispose(FPVFlightLog * log) {
+    if ( log->running ) {
+        fpv_flight_log_stop(log);
+    }
+    if ( log->stop_fd != -1 ) {
+        close(log->stop_fd);
+    }
+    if ( log->map ) {
+        munmap(log->map, log->size);
+    }
+    if ( log->fd != -1 ) {
+        close(log->fd);
+    }
+    free(log->path);
+    free(log);
+}
+
+void fpv_flight_log_set_sync_interval(FPVFlightLog * log, int milliseconds) {
+    log->sync_interval = milliseconds > 0 ? milliseconds : FLIGHT_LOG_DEFAULT_SYNC_INTERVAL;
+}
+
+void fpv_flight_log_set_index_interval(FPVFlightLog * log, int records) {
+    log->index_interval = records > 0 ? records : FLIGHT_LOG_DEFAULT_INDEX_INTERVAL;
+}
+
+int fpv_flight_log_start(FPVFlightLog * log) {
+    if ( log->running ) {
+        fprintf(stderr, "FPVFlightLog already running\n");
+        return -1;
+    }
+    if ( !log->map ) {
+        fprintf(stderr, "FPVFlightLog %s has already been closed\n", log->path);
+        return 0;
+    }
+
+    if ( !fpv_flight_log_prepare(log) ) {
+        return 0;
+    }
+
+    if ( log->stop_fd != -1 ) {
+        close(log->stop_fd);
+    }
+    if ( (log->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ) {
+        fprintf(stderr, "Unable to create FPVFlightLog stop event: %s\n", strerror(errno));
+        return 0;
+    }
+
+    // Drop-oldest rather than coalescing: the log wants every update, in order
+    if ( !(log->subscription = fpv_telemetry_rx_subscribe(log->rx, RECORDER_QUEUE_CAPACITY, FPV_TELEMETRY_OVERFLOW_DROP_OLDEST)) ) {
+        return 0;
+    }
+
+    log->running = 1;
+    int result = pthread_create(&log->thread, NULL, fpv_flight_log_thread_entry, log);
+    if ( result != 0 ) {
+        fprintf(stderr, "Unable to launch FPVFlightLog recorder thread: %s\n", strerror(result));
+        log->running = 0;
+        fpv_telemetry_rx_unsubscribe(log->rx, log->subscription);
+        log->subscription = NULL;
+        return 0;
+    }
+
+    printf("Recording flight log to %s (%llu MB)\n", log->path, (unsigned long long)(log->size >> 20));
+
+    return 1;
+}
+
+void fpv_flight_log_stop(FPVFlightLog * log) {
+    log->running = 0;
+    uint64_t value = 1;
+    if ( write(log->stop_fd, &value, sizeof(value)) < 0 ) {
+        fprintf(stderr, "Unable to signal FPVFlightLog recorder thread: %s\n", strerror(errno));
+    }
+    pthread_join(log->thread, NULL);
+
+    FPVTelemetrySubscriptionStats queue;
+    fpv_telemetry_subscription_get_stats(log->subscription, &queue);
+    fpv_telemetry_rx_unsubscribe(log->rx, log->subscription);
+    log->subscription = NULL;
+
+    // Give back the preallocated space the flight didn't use
+    uint64_t length = log->header->data_offset + log->data_length;
+    munmap(log->map, log->size);
+    log->map = NULL;
+    if ( ftruncate(log->fd, length) < 0 || fsync(log->fd) < 0 ) {
+        fprintf(stderr, "Unable to trim flight log %s: %s\n", log->path, strerror(errno));
+    }
+
+    printf("Flight log: %llu records, %llu bytes, %llu dropped, %llu flushes, longest %llu us\n",
+        (unsigned long long)log->records, (unsigned long long)log->data_length,
+        (unsigned long long)(log->dropped + queue.dropped), (unsigned long long)log->syncs,
+        (unsigned long long)log->max_sync_time);
+}
+
+void fpv_flight_log_get_stats(FPVFlightLog * log, FPVFlightLogStats * stats) {
+    FPVTelemetrySubscriptionStats queue = { 0 };
+    if ( log->subscription ) fpv_telemetry_subscription_get_stats(log->subscription, &queue);
+    stats->records = __atomic_load_n(&log->records, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&log->data_length, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED) + queue.dropped;
+    stats->syncs = __atomic_load_n(&log->syncs, __ATOMIC_RELAXED);
+    stats->max_sync_time = __atomic_load_n(&log->max_sync_time, __ATOMIC_RELAXED);
+}
+
+#pragma mark - Recorder
+
+static void * fpv_flight_log_thread_entry(void *userinfo) {
+    FPVFlightLog * log = (FPVFlightLog*)userinfo;
+    struct pollfd fds[2] = {
+        { .fd = fpv_telemetry_subscription_get_fd(log->subscription), .events = POLLIN },
+        { .fd = log->stop_fd, .events = POLLIN },
+    };
+    uint64_t interval = (uint64_t)log->sync_interval * 1000;
+    uint64_t next_sync = fpv_telemetry_now() + interval;
+    FPVTelemetryUpdate update;
+
+    while ( 1 ) {
+        uint64_t now = fpv_telemetry_now();
+        int timeout = next_sync > now ? (int)((next_sync - now + 999) / 1000) : 0;
+        if ( poll(fds, 2, timeout) < 0 && errno != EINTR ) {
+            fprintf(stderr, "Flight log poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        while ( fpv_telemetry_subscription_pop(log->subscription, &update) ) {
+            fpv_flight_log_append(log, &update);
+        }
+
+        if ( fds[1].revents & POLLIN ) break;
+
+        now = fpv_telemetry_now();
+        if ( now >= next_sync ) {
+            fpv_flight_log_sync(log);
+            next_sync += interval;
+            if ( next_sync <= now ) next_sync = now + interval;
+        }
+    }
+
+    // Anything the listener delivered before we were stopped still goes in
+    while ( fpv_telemetry_subscription_pop(log->subscription, &update) ) {
+        fpv_flight_log_append(log, &update);
+    }
+    fpv_flight_log_sync(log);
+
+    return NULL;
+}
+
+int fpv_flight_log_prepare(FPVFlightLog * log) {
+    // Size the index for the smallest possible records, so it can never fill before the data
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t remaining = log->size - FLIGHT_LOG_HEADER_SIZE;
+    uint64_t index_size = remaining / (1 + log->index_interval);
+    index_size = (index_size + page - 1) & ~(uint64_t)(page - 1);
+
+    FPVFlightLogHeader *header = log->header;
+    memset(header, 0, FLIGHT_LOG_HEADER_SIZE);
+    memcpy(header->magic, FLIGHT_LOG_MAGIC, sizeof(FLIGHT_LOG_MAGIC));
+    header->version = FLIGHT_LOG_VERSION;
+    header->index_interval = log->index_interval;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header->started = (uint64_t)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+    header->index_offset = FLIGHT_LOG_HEADER_SIZE;
+    header->index_capacity = index_size / FLIGHT_LOG_INDEX_ENTRY_LENGTH;
+    header->data_offset = FLIGHT_LOG_HEADER_SIZE + index_size;
+    header->data_size = log->size - header->data_offset;
+    if ( msync(log->map, FLIGHT_LOG_HEADER_SIZE, MS_SYNC) < 0 ) {
+        fprintf(stderr, "Unable to write flight log header: %s\n", strerror(errno));
+        return 0;
+    }
+    log->index = log->map + header->index_offset;
+    log->data = log->map + header->data_offset;
+    return 1;
+}
+
+int fpv_flight_log_append(FPVFlightLog * log, const FPVTelemetryUpdate * update) {
+    FPVFlightLogHeader *header = log->header;
+    if ( log->data_length + FLIGHT_LOG_RECORD_HEADER_LENGTH + TELEMETRY_WIRE_MAX_RECORD_LENGTH > header->data_size ) {
+        if ( !log->full ) {
+            fprintf(stderr, "Flight log %s is full; recording stopped\n", log->path);
+            log->full = 1;
+        }
+        __atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    uint8_t *p = log->data + log->data_length;
+    int length = fpv_telemetry_record_encode(update, p + FLIGHT_LOG_RECORD_HEADER_LENGTH);
+    if ( length == 0 ) return 0;
+
+    p[0] = length;
+    p[1] = update->type;
+    p[2] = update->vehicle_id;
+    p[3] = 0;
+    put_le32(p+4, update->timestamp);
+    put_le64(p+8, update->received);
+
+    if ( log->records % log->index_interval == 0 && log->index_count < header->index_capacity ) {
+        uint8_t *entry = log->index + log->index_count * FLIGHT_LOG_INDEX_ENTRY_LENGTH;
+        put_le64(entry, update->received);
+        put_le64(entry+8, log->data_length);
+        log->index_count++;
+    }
+
+    __atomic_store_n(&log->data_length, log->data_length + FLIGHT_LOG_RECORD_HEADER_LENGTH + length, __ATOMIC_RELAXED);
+    __atomic_store_n(&log->records, log->records + 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void fpv_flight_log_sync(FPVFlightLog * log) {
+    FPVFlightLogHeader *header = log->header;
+    if ( header->data_length == log->data_length ) return;
+
+    uint64_t start = fpv_telemetry_now();
+
+    // Records and index entries reach the disk before the header that advertises them,
+    // so after a power cut the header never points past what was written
+    if ( !fpv_flight_log_sync_range(log, header->data_offset + header->data_length, header->data_offset + log->data_length)
+            || !fpv_flight_log_sync_range(log, header->index_offset + header->index_count * FLIGHT_LOG_INDEX_ENTRY_LENGTH,
+                                          header->index_offset + log->index_count * FLIGHT_LOG_INDEX_ENTRY_LENGTH) ) {
+        return;
+    }
+    header->data_length = log->data_length;
+    header->index_count = log->index_count;
+    if ( !fpv_flight_log_sync_range(log, 0, sizeof(FPVFlightLogHeader)) ) return;
+
+    uint64_t elapsed = fpv_telemetry_now() - start;
+    __atomic_add_fetch(&log->syncs, 1, __ATOMIC_RELAXED);
+    if ( elapsed > log->max_sync_time ) __atomic_store_n(&log->max_sync_time, elapsed, __ATOMIC_RELAXED);
+}
+
+static int fpv_flight_log_sync_range(FPVFlightLog * log, uint64_t start, uint64_t end) {
+    if ( end <= start ) return 1;
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    start &= ~(page - 1);
+    if ( msync(log->map + start, end - start, MS_SYNC) < 0 ) {
+        fprintf(stderr, "Unable to flush flight log %s: %s\n", log->path, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+#pragma mark - Reader
+
+FPVFlightLogReader * fpv_flight_log_reader_new(const char * path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if ( fd < 0 ) {
+        fprintf(stderr, "Unable to open flight log %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if ( fstat(fd, &st) < 0 || (uint64_t)st.st_size < FLIGHT_LOG_HEADER_SIZE ) {
+        fprintf(stderr, "%s is not a flight log\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t *map = (uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if ( map == MAP_FAILED ) {
+        fprintf(stderr, "Unable to map flight log %s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    const FPVFlightLogHeader *header = (const FPVFlightLogHeader*)map;
+    uint64_t size = st.st_size;
+    if ( memcmp(header->magic, FLIGHT_LOG_MAGIC, sizeof(FLIGHT_LOG_MAGIC)) != 0 || header->version != FLIGHT_LOG_VERSION
+            || header->data_offset > size || header->data_length > size - header->data_offset
+            || header->index_offset > size || header->index_count > (size - header->index_offset) / FLIGHT_LOG_INDEX_ENTRY_LENGTH ) {
+        fprintf(stderr, "%s is not a flight log, or is an unsupported version\n", path);
+        munmap(map, size);
+        close(fd);
+        return NULL;
+    }
+
+    FPVFlightLogReader * reader = (FPVFlightLogReader*)calloc(1, sizeof(FPVFlightLogReader));
+    reader->fd = fd;
+    reader->map = map;
+    reader->size = size;
+    reader->header = header;
+    reader->index = map + header->index_offset;
+    reader->data = map + header->data_offset;
+    reader->data_length = header->data_length;
+    reader->index_count = header->index_count;
+    return reader;
+}
+
+void fpv_flight_log_reader_dispose(FPVFlightLogReader * reader) {
+    munmap(reader->map, reader->size);
+    close(reader->fd);
+    free(reader);
+}
+
+void fpv_flight_log_reader_get_info(FPVFlightLogReader * reader, uint64_t * started, uint64_t * first, uint64_t * last) {
+    if ( started ) *started = reader->header->started;
+    if ( first ) *first = fpv_flight_log_reader_received_at(reader, 0);
+    if ( last ) {
+        // Walk forward from the last index entry to the final record
+        uint64_t position = reader->index_count ? get_le64(reader->index + (reader->index_count - 1) * FLIGHT_LOG_INDEX_ENTRY_LENGTH + 8) : 0;
+        uint64_t previous = position;
+        while ( position + FLIGHT_LOG_RECORD_HEADER_LENGTH <= reader->data_length ) {
+            previous = position;
+            position += FLIGHT_LOG_RECORD_HEADER_LENGTH + reader->data[position];
+        }
+        *last = fpv_flight_log_reader_received_at(reader, previous);
+    }
+}
+
+void fpv_flight_log_reader_seek(FPVFlightLogReader * reader, uint64_t received) {
+    // Find the last index entry at or before the target, then scan forward
+    uint64_t low = 0, high = reader->index_count;
+    while ( low < high ) {
+        uint64_t middle = low + (high - low) / 2;
+        if ( get_le64(reader->index + middle * FLIGHT_LOG_INDEX_ENTRY_LENGTH) <= received ) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    uint64_t position = low ? get_le64(reader->index + (low - 1) * FLIGHT_LOG_INDEX_ENTRY_LENGTH + 8) : 0;
+    while ( position + FLIGHT_LOG_RECORD_HEADER_LENGTH <= reader->data_length
+            && fpv_flight_log_reader_received_at(reader, position) < received ) {
+        position += FLIGHT_LOG_RECORD_HEADER_LENGTH + reader->data[position];
+    }
+    reader->position = position;
+}
+
+int fpv_flight_log_reader_next(FPVFlightLogReader * reader, FPVTelemetryUpdate * update) {
+    while ( reader->position + FLIGHT_LOG_RECORD_HEADER_LENGTH <= reader->data_length ) {
+        const uint8_t *p = reader->data + reader->position;
+        uint64_t next = reader->position + FLIGHT_LOG_RECORD_HEADER_LENGTH + p[0];
+        if ( next > reader->data_length ) break;
+        reader->position = next;
+
+        // Skip record types this build doesn't know about
+        if ( fpv_telemetry_record_decode(p[1], p + FLIGHT_LOG_RECORD_HEADER_LENGTH, p[0], update) ) {
+            update->vehicle_id = p[2];
+            update->timestamp = get_le32(p+4);
+            update->received = get_le64(p+8);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint64_t fpv_flight_log_reader_received_at(FPVFlightLogReader * reader, uint64_t position) {
+    if ( position + FLIGHT_LOG_RECORD_HEADER_LENGTH > reader->data_length ) return 0;
+    return get_le64(reader->data + position + 8);
+}
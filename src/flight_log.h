@@ -0,0 +1,96 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLIGHT_LOG_H
+#define __FLIGHT_LOG_H
+
+#include <stdint.h>
+#include "telemetry_common.h"
+#include "telemetry_rx.h"
+
+/*
+ * Flight log: every telemetry update the receiver accepts, appended as a compact binary
+ * record to a preallocated, memory-mapped file by a recorder thread of its own. The
+ * receive thread only ever hands updates to a subscription queue, so it never waits on
+ * the disk. The file is flushed on a fixed cadence and the header only ever advertises
+ * data that has reached the disk, so a log cut short by power loss reads back cleanly up
+ * to the last flush.
+ *
+ * File layout, little-endian:
+ *   header (one page)  magic, version, region offsets, durable data length and index count
+ *   index              { uint64 received, uint64 data offset } every index_interval records
+ *   data               records: uint8 payload length, uint8 type, uint8 vehicle id,
+ *                      uint8 reserved, uint32 sender timestamp, uint64 received,
+ *                      then the payload in the telemetry wire encoding
+ *
+ * Received times are monotonic microseconds, as from fpv_telemetry_now.
+ */
+
+#define FLIGHT_LOG_MAGIC "RPFVLOG"
+#define FLIGHT_LOG_VERSION 1
+#define FLIGHT_LOG_RECORD_HEADER_LENGTH 16
+
+#define FLIGHT_LOG_DEFAULT_SYNC_INTERVAL 200    // Milliseconds
+#define FLIGHT_LOG_DEFAULT_INDEX_INTERVAL 64    // Records
+
+typedef struct {
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t dropped;       // Updates lost to a full subscription queue or a full log
+    uint64_t syncs;
+    uint64_t max_sync_time; // Longest flush, microseconds
+} FPVFlightLogStats;
+
+typedef struct _FPVFlightLog FPVFlightLog;
+
+FPVFlightLog * fpv_flight_log_new(FPVTelemetryRX * rx, const char * path, uint64_t size);
+void fpv_flight_log_dispose(FPVFlightLog * log);
+
+// Configuration, before starting
+void fpv_flight_log_set_sync_interval(FPVFlightLog * log, int milliseconds);
+void fpv_flight_log_set_index_interval(FPVFlightLog * log, int records);
+
+int fpv_flight_log_start(FPVFlightLog * log);
+void fpv_flight_log_stop(FPVFlightLog * log);
+
+void fpv_flight_log_get_stats(FPVFlightLog * log, FPVFlightLogStats * stats);
+
+// Recording by hand instead, as the recorder thread does, from a single thread and without
+// starting: prepare the file, then append updates and flush them when it suits
+int fpv_flight_log_prepare(FPVFlightLog * log);
+int fpv_flight_log_append(FPVFlightLog * log, const FPVTelemetryUpdate * update);
+void fpv_flight_log_sync(FPVFlightLog * log);
+
+// Reading back a log, from any process
+
+typedef struct _FPVFlightLogReader FPVFlightLogReader;
+
+FPVFlightLogReader * fpv_flight_log_reader_new(const char * path);
+void fpv_flight_log_reader_dispose(FPVFlightLogReader * reader);
+
+// Wall-clock time the log was started, microseconds since the epoch, and the received
+// time of its first and last records
+void fpv_flight_log_reader_get_info(FPVFlightLogReader * reader, uint64_t * started, uint64_t * first, uint64_t * last);
+
+// Position the reader at the first record received at or after the given time
+void fpv_flight_log_reader_seek(FPVFlightLogReader * reader, uint64_t received);
+
+// Returns 1 with the next record, or 0 at the end of the log
+int fpv_flight_log_reader_next(FPVFlightLogReader * reader, FPVTelemetryUpdate * update);
+
+#endif
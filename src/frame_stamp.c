@@ -0,0 +1,154 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "frame_stamp.h"
+#include "h264_nal.h"
+#include <string.h>
+
+#define FRAME_STAMP_PAYLOAD_LENGTH 37   // UUID, version and fields
+#define FRAME_STAMP_MAX_SEI_LENGTH 64   // Escaped, with the NAL header and trailing bits
+
+static const uint8_t FRAME_STAMP_UUID[16] = { 'R', 'a', 's', 'P', 'i', 'F', 'P', 'V', '-', 'l', 'a', 't', 'e', 'n', 'c', 'y' };
+static const uint8_t FRAME_STAMP_VERSION = 1;
+static const uint8_t SEI_TYPE_USER_DATA_UNREGISTERED = 5;
+
+#pragma mark - Forward declarations
+
+static int fpv_frame_stamp_parse_sei(const uint8_t * nal, size_t length, FPVFrameStamp * stamp);
+
+#pragma mark -
+
+static inline void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline void put_le64(uint8_t *p, uint64_t v) {
+    put_le32(p, (uint32_t)v);
+    put_le32(p+4, (uint32_t)(v >> 32));
+}
+
+static inline uint32_t get_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t get_le64(const uint8_t *p) {
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p+4) << 32);
+}
+
+int fpv_frame_stamp_nal_length_size(const char * stream_format, const uint8_t * codec_data, size_t length) {
+    if ( !stream_format || strcmp(stream_format, "avc") != 0 ) return 0;
+    return codec_data && length >= 5 ? (codec_data[4] & 3) + 1 : 4;
+}
+
+int fpv_frame_stamp_encode(const FPVFrameStamp * stamp, int nal_length_size, uint8_t * buffer, int length) {
+    uint8_t rbsp[FRAME_STAMP_MAX_SEI_LENGTH];
+    uint8_t *p = rbsp;
+    *p++ = H264_NAL_SEI;
+    *p++ = SEI_TYPE_USER_DATA_UNREGISTERED;
+    *p++ = FRAME_STAMP_PAYLOAD_LENGTH;
+    memcpy(p, FRAME_STAMP_UUID, sizeof(FRAME_STAMP_UUID));
+    p += sizeof(FRAME_STAMP_UUID);
+    *p++ = FRAME_STAMP_VERSION;
+    put_le64(p, stamp->captured);
+    put_le64(p+8, stamp->encoded);
+    put_le32(p+16, stamp->send_delay);
+    p += 20;
+    *p++ = 0x80;    // rbsp_trailing_bits
+
+    int prefix = nal_length_size ? nal_length_size : 4;
+    if ( length < prefix + FRAME_STAMP_MAX_SEI_LENGTH ) return 0;
+
+    // Escape any 0x000000 to 0x000003 the timestamps happen to contain
+    uint8_t *out = buffer + prefix;
+    int zeros = 0, i;
+    for ( i=0; i<p-rbsp; i++ ) {
+        if ( zeros >= 2 && rbsp[i] <= 3 ) {
+            *out++ = 3;
+            zeros = 0;
+        }
+        zeros = rbsp[i] == 0 ? zeros + 1 : 0;
+        *out++ = rbsp[i];
+    }
+
+    size_t nal_length = out - (buffer + prefix);
+    if ( nal_length_size ) {
+        for ( i=0; i<nal_length_size; i++ ) buffer[i] = nal_length >> (8 * (nal_length_size - 1 - i));
+    } else {
+        buffer[0] = buffer[1] = buffer[2] = 0;
+        buffer[3] = 1;
+    }
+    return prefix + nal_length;
+}
+
+int fpv_frame_stamp_insert_offset(const uint8_t * au, size_t length, int nal_length_size) {
+    size_t position = 0;
+    FPVH264Nal nal;
+    while ( fpv_h264_next_nal(au, length, nal_length_size, &position, &nal) ) {
+        int type = fpv_h264_nal_type(au[nal.header]);
+        if ( type >= 1 && type <= 5 ) return nal.start;
+    }
+    return -1;
+}
+
+int fpv_frame_stamp_find(const uint8_t * au, size_t length, int nal_length_size, FPVFrameStamp * stamp) {
+    size_t position = 0;
+    FPVH264Nal nal;
+    while ( fpv_h264_next_nal(au, length, nal_length_size, &position, &nal) ) {
+        int type = fpv_h264_nal_type(au[nal.header]);
+        if ( type >= 1 && type <= 5 ) break;
+        if ( type == H264_NAL_SEI && fpv_frame_stamp_parse_sei(au + nal.header, nal.end - nal.header, stamp) ) return 1;
+    }
+    return 0;
+}
+
+static int fpv_frame_stamp_parse_sei(const uint8_t * nal, size_t length, FPVFrameStamp * stamp) {
+    // Undo emulation prevention; only the start of the unit matters, as that's where ours is
+    uint8_t rbsp[FRAME_STAMP_MAX_SEI_LENGTH];
+    size_t i, count = 0;
+    int zeros = 0;
+    for ( i=1; i<length && count<sizeof(rbsp); i++ ) {
+        if ( zeros >= 2 && nal[i] == 3 ) {
+            zeros = 0;
+            continue;
+        }
+        zeros = nal[i] == 0 ? zeros + 1 : 0;
+        rbsp[count++] = nal[i];
+    }
+
+    const uint8_t *p = rbsp, *end = rbsp + count;
+    while ( end - p > 2 ) {
+        int type = 0, size = 0;
+        while ( p < end && *p == 0xFF ) type += *p++;
+        if ( p < end ) type += *p++;
+        while ( p < end && *p == 0xFF ) size += *p++;
+        if ( p < end ) size += *p++;
+
+        if ( type == SEI_TYPE_USER_DATA_UNREGISTERED && size >= FRAME_STAMP_PAYLOAD_LENGTH && end - p >= FRAME_STAMP_PAYLOAD_LENGTH
+                && memcmp(p, FRAME_STAMP_UUID, sizeof(FRAME_STAMP_UUID)) == 0 && p[16] == FRAME_STAMP_VERSION ) {
+            stamp->captured = get_le64(p+17);
+            stamp->encoded = get_le64(p+25);
+            stamp->send_delay = get_le32(p+33);
+            return 1;
+        }
+        p += size;
+    }
+    return 0;
+}
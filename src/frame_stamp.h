@@ -0,0 +1,60 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FRAME_STAMP_H
+#define __FRAME_STAMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FRAME_STAMP_UNKNOWN 0xFFFFFFFF
+
+/*
+ * Per-frame timing carried inside the H.264 stream, so it survives payloading,
+ * FEC and depayloading untouched: an SEI NAL unit with a user-data-unregistered
+ * message, identified by its UUID, inserted ahead of each access unit's first slice.
+ * Decoders that don't recognise the UUID ignore it. The payload is
+ *
+ *   uint8 version, uint64 captured, uint64 encoded, uint32 send delay
+ *
+ * little-endian, with the usual emulation prevention over the top. Access units are
+ * either Annex B byte-stream (nal_length_size 0) or length-prefixed, as in "avc" caps.
+ */
+
+typedef struct {
+    uint64_t captured;      // Sender's monotonic clock when the frame was captured, microseconds
+    uint64_t encoded;       // Sender's monotonic clock when the encoder finished the frame
+    uint32_t send_delay;    // Encoded to last packet sent, for the previous frame; FRAME_STAMP_UNKNOWN if not known
+} FPVFrameStamp;
+
+// NAL length prefix size for caps with the given stream-format and codec_data (an
+// avcC record); 0 for byte-stream
+int fpv_frame_stamp_nal_length_size(const char * stream_format, const uint8_t * codec_data, size_t length);
+
+// Writes the SEI NAL unit, with its start code or length prefix; returns its length,
+// or 0 if the buffer is too short
+int fpv_frame_stamp_encode(const FPVFrameStamp * stamp, int nal_length_size, uint8_t * buffer, int length);
+
+// Byte offset at which to insert the SEI NAL unit, ahead of the first slice; -1 if the
+// access unit has no slice
+int fpv_frame_stamp_insert_offset(const uint8_t * au, size_t length, int nal_length_size);
+
+// Returns 1 if one of the access unit's SEI NAL units carries a stamp
+int fpv_frame_stamp_find(const uint8_t * au, size_t length, int nal_length_size, FPVFrameStamp * stamp);
+
+#endif
@@ -43,6 +43,20 @@ double geom_bearing_between_coordinates(double lat1, double lon1, double lat2, d
     return fmod((atan2(y, x) * (180.0/M_PI)) + 360.0, 360.0);
 }
 
+void geom_displacement_between_coordinates(double lat1, double lon1, double lat2, double lon2, double *north, double *east) {
+    // Flat-earth approximation, good to well under a metre over the distances covered between fixes; results in metres
+    double R = 6371000.0;
+    *north = (lat2 - lat1) * (M_PI/180.0) * R;
+    *east = (lon2 - lon1) * (M_PI/180.0) * R * cos(lat1 * (M_PI/180.0));
+}
+
+void geom_offset_coordinates(double lat, double lon, double north, double east, double *lat_out, double *lon_out) {
+    // Inverse of geom_displacement_between_coordinates; offsets in metres
+    double R = 6371000.0;
+    *lat_out = lat + (north / R) * (180.0/M_PI);
+    *lon_out = lon + (east / (R * cos(lat * (M_PI/180.0)))) * (180.0/M_PI);
+}
+
 
 /*
  * The following is a partial port of the Euclid graphics maths module
@@ -21,6 +21,8 @@
 
 double geom_distance_between_coordinates(double lat1, double lon1, double lat2, double lon2);
 double geom_bearing_between_coordinates(double lat1, double lon1, double lat2, double lon2);
+void geom_displacement_between_coordinates(double lat1, double lon1, double lat2, double lon2, double *north, double *east);
+void geom_offset_coordinates(double lat, double lon, double north, double east, double *lat_out, double *lon_out);
 
 typedef struct {
     double a;    double b;    double c;    double d;
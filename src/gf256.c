@@ -0,0 +1,230 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gf256.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GF256_X86 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define GF256_NEON 1
+#endif
+
+static const unsigned int GF256_POLYNOMIAL = 0x11D;
+
+static uint8_t gf256_exp[510];
+static uint8_t gf256_log[256];
+
+// Products of each constant with every value of the low and the high nibble
+static uint8_t gf256_nibble_low[256][16] __attribute__((aligned(16)));
+static uint8_t gf256_nibble_high[256][16] __attribute__((aligned(16)));
+
+typedef void (*gf256_region_function)(uint8_t * dst, const uint8_t * src, uint8_t c, size_t length);
+
+static gf256_region_function gf256_region = NULL;
+static const char * gf256_region_name = "none";
+static pthread_once_t gf256_once = PTHREAD_ONCE_INIT;
+
+#pragma mark - Forward declarations
+
+static void gf256_build();
+static int gf256_kernel_supported(gf256_region_function function);
+static void gf256_mul_add_region_scalar(uint8_t * dst, const uint8_t * src, uint8_t c, size_t length);
+#if GF256_X86
+static void gf256_mul_add_region_ssse3(uint8_t * dst, const uint8_t * src, uint8_t c, size_t length);
+static void gf256_mul_add_region_avx2(uint8_t * dst, const uint8_t * src, uint8_t c, size_t length);
+#elif GF256_NEON
+static void gf256_mul_add_region_neon(uint8_t * dst, const uint8_t * src, uint8_t c, size_t length);
+#endif
+
+// Best last
+static const struct {
+    const char * name;
+    gf256_region_function function;
+} gf256_kernels[] = {
+    { "scalar", gf256_mul_add_region_scalar },
+#if GF256_X86
+    { "ssse3", gf256_mul_add_region_ssse3 },
+    { "avx2", gf256_mul_add_region_avx2 },
+#elif GF256_NEON
+    { "neon", gf256_mul_add_region_neon },
+#endif
+};
+
+#pragma mark -
+
+void gf256_init() {
+    pthread_once(&gf256_once, gf256_build);
+}
+
+uint8_t gf256_mul(uint8_t a, uint8_t b) {
+    if ( !a || !b ) return 0;
+    return gf256_exp[gf256_log[a] + gf256_log[b]];
+}
+
+uint8_t gf256_inv(uint8_t a) {
+    return gf256_exp[255 - gf256_log[a]];
+}
+
+void gf256_mul_add_region(uint8_t * dst, const uint8_t * src, uint8_t c, size_t length) {
+    if ( c == 0 ) return;
+    if ( c == 1 ) {
+        size_t i;
+        for ( i=0; i<length; i++ ) dst[i] ^= src[i];
+        return;
+    }
+    gf256_region(dst, src, c, length);
+}
+
+const char * gf256_kernel_name() {
+    return gf256_region_name;
+}
+
+int gf256_use_kernel(const char * name) {
+    gf256_init();
+    int i;
+    for ( i=sizeof(gf256_kernels)/sizeof(gf256_kernels[0])-1; i>=0; i-- ) {
+        if ( (!name || strcmp(name, gf256_kernels[i].name) == 0) && gf256_kernel_supported(gf256_kernels[i].function) ) {
+            gf256_region = gf256_kernels[i].function;
+            gf256_region_name = gf256_kernels[i].name;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void gf256_build() {
+    unsigned int x = 1;
+    int i;
+    for ( i=0; i<255; i++ ) {
+        gf256_exp[i] = gf256_exp[i + 255] = x;
+        gf256_log[x] = i;
+        x <<= 1;
+        if ( x & 0x100 ) x ^= GF256_POLYNOMIAL;
+    }
+
+    int c;
+    for ( c=0; c<256; c++ ) {
+        for ( i=0; i<16; i++ ) {
+            gf256_nibble_low[c][i] = gf256_mul(c, i);
+            gf256_nibble_high[c][i] = gf256_mul(c, i << 4);
+        }
+    }
+
+    // The best kernel this CPU can run
+#if GF256_X86
+    __builtin_cpu_init();
+#endif
+    for ( i=sizeof(gf256_kernels)/sizeof(gf256_kernels[0])-1; !gf256_kernel_supported(gf256_kernels[i].function); i-- );
+    gf256_region = gf256_kernels[i].function;
+    gf256_region_name = gf256_kernels[i].name;
+}
+
+static int gf256_kernel_supported(gf256_region_function function) {
+#if GF256_X86
+    if ( function == gf256_mul_add_region_avx2 ) return __builtin_cpu_supports("avx2");
+    if ( function == gf256_mul_add_region_ssse3 ) return __builtin_cpu_supports("ssse3");
+#endif
+    return 1;
+}
+
+#pragma mark - Region kernels
+
+static void gf256_mul_add_region_scalar(uint8_t * dst, const uint8_t * src, uint8_t c, size_t length) {
+    const uint8_t *low = gf256_nibble_low[c];
+    const uint8_t *high = gf256_nibble_high[c];
+    size_t i;
+    for ( i=0; i<length; i++ ) {
+        dst[i] ^= low[src[i] & 0x0F] ^ high[src[i] >> 4];
+    }
+}
+
+#if GF256_X86
+
+__attribute__((target("ssse3")))
+static void gf256_mul_add_region_ssse3(uint8_t * dst, const uint8_t * src, uint8_t c, size_t length) {
+    const __m128i low = _mm_load_si128((const __m128i*)gf256_nibble_low[c]);
+    const __m128i high = _mm_load_si128((const __m128i*)gf256_nibble_high[c]);
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    size_t i = 0;
+    for ( ; i+16<=length; i+=16 ) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low, _mm_and_si128(s, mask)),
+                                        _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(dst + i)), product));
+    }
+    gf256_mul_add_region_scalar(dst + i, src + i, c, length - i);
+}
+
+__attribute__((target("avx2")))
+static void gf256_mul_add_region_avx2(uint8_t * dst, const uint8_t * src, uint8_t c, size_t length) {
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)gf256_nibble_low[c]));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)gf256_nibble_high[c]));
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    size_t i = 0;
+    for ( ; i+32<=length; i+=32 ) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(s, mask)),
+                                           _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(dst + i)), product));
+    }
+
+    // Finish here rather than in the SSSE3 kernel, whose legacy encoding would stall on the dirty upper halves
+    if ( i+16 <= length ) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(_mm256_castsi256_si128(low), _mm_and_si128(s, _mm256_castsi256_si128(mask))),
+                                        _mm_shuffle_epi8(_mm256_castsi256_si128(high), _mm_and_si128(_mm_srli_epi64(s, 4), _mm256_castsi256_si128(mask))));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(dst + i)), product));
+        i += 16;
+    }
+    gf256_mul_add_region_scalar(dst + i, src + i, c, length - i);
+}
+
+#elif GF256_NEON
+
+static void gf256_mul_add_region_neon(uint8_t * dst, const uint8_t * src, uint8_t c, size_t length) {
+    const uint8x16_t mask = vdupq_n_u8(0x0F);
+    size_t i = 0;
+#if defined(__aarch64__)
+    const uint8x16_t low = vld1q_u8(gf256_nibble_low[c]);
+    const uint8x16_t high = vld1q_u8(gf256_nibble_high[c]);
+    for ( ; i+16<=length; i+=16 ) {
+        uint8x16_t s = vld1q_u8(src + i);
+        uint8x16_t product = veorq_u8(vqtbl1q_u8(low, vandq_u8(s, mask)), vqtbl1q_u8(high, vshrq_n_u8(s, 4)));
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), product));
+    }
+#else
+    // ARMv7 only has 8-byte lookups, from a table of up to 32 bytes
+    const uint8x8x2_t low = { { vld1_u8(gf256_nibble_low[c]), vld1_u8(gf256_nibble_low[c] + 8) } };
+    const uint8x8x2_t high = { { vld1_u8(gf256_nibble_high[c]), vld1_u8(gf256_nibble_high[c] + 8) } };
+    for ( ; i+16<=length; i+=16 ) {
+        uint8x16_t s = vld1q_u8(src + i);
+        uint8x16_t l = vandq_u8(s, mask);
+        uint8x16_t h = vshrq_n_u8(s, 4);
+        uint8x16_t product = vcombine_u8(veor_u8(vtbl2_u8(low, vget_low_u8(l)), vtbl2_u8(high, vget_low_u8(h))),
+                                         veor_u8(vtbl2_u8(low, vget_high_u8(l)), vtbl2_u8(high, vget_high_u8(h))));
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), product));
+    }
+#endif
+    gf256_mul_add_region_scalar(dst + i, src + i, c, length - i);
+}
+
+#endif
@@ -0,0 +1,49 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GF256_H
+#define __GF256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Arithmetic in GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1, for erasure
+ * coding. Region operations multiply by a constant using two 16-entry tables, one per
+ * nibble, which maps directly onto byte shuffles: SSSE3 or AVX2 on x86 (chosen at run
+ * time) and NEON on ARM, with a table-driven fallback elsewhere.
+ */
+
+// Builds the tables and picks the region kernel; safe to call more than once
+void gf256_init();
+
+uint8_t gf256_mul(uint8_t a, uint8_t b);
+uint8_t gf256_inv(uint8_t a);   // a must not be 0
+
+// dst ^= c * src, over length bytes
+void gf256_mul_add_region(uint8_t * dst, const uint8_t * src, uint8_t c, size_t length);
+
+// Name of the region kernel in use, for diagnostics
+const char * gf256_kernel_name();
+
+// Switches to the named region kernel ("scalar", "ssse3", "avx2" or "neon"), or with NULL
+// back to the one picked at run time; returns 0 if this build or CPU can't run it. For
+// tests and benchmarks, while nothing else is coding.
+int gf256_use_kernel(const char * name);
+
+#endif
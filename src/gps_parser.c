@@ -0,0 +1,335 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gps_parser.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define GPS_BUFFER_SIZE 1024
+#define NMEA_MAX_FIELDS 24
+static const int NMEA_MAX_LENGTH = 96;
+static const int UBX_HEADER_LENGTH = 6;
+static const int UBX_CHECKSUM_LENGTH = 2;
+static const uint8_t UBX_SYNC_1 = 0xB5;
+static const uint8_t UBX_SYNC_2 = 0x62;
+static const uint8_t UBX_CLASS_NAV = 0x01;
+static const uint8_t UBX_ID_NAV_PVT = 0x07;
+static const int UBX_NAV_PVT_LENGTH = 92;
+static const double KNOTS_TO_METRES_PER_SECOND = 0.514444;
+
+struct _FPVGPSParser {
+    uint8_t buffer[GPS_BUFFER_SIZE];
+    int start;
+    int end;
+    FPVGPSFix fix;
+    FPVGPSParserCallback callback;
+    void * context;
+    FPVGPSParserStats stats;
+};
+
+typedef struct {
+    const char * text;
+    int length;
+} NMEAField;
+
+#pragma mark - Forward declarations
+
+static void fpv_gps_parser_parse(FPVGPSParser * parser);
+static int fpv_gps_parser_parse_nmea(FPVGPSParser * parser, const uint8_t * data, int length);
+static int fpv_gps_parser_parse_ubx(FPVGPSParser * parser, const uint8_t * data, int length);
+
+#pragma mark -
+
+FPVGPSParser * fpv_gps_parser_new(FPVGPSParserCallback callback, void * context) {
+    FPVGPSParser * parser = (FPVGPSParser*)calloc(1, sizeof(FPVGPSParser));
+    parser->callback = callback;
+    parser->context = context;
+    return parser;
+}
+
+void fpv_gps_parser_dispose(FPVGPSParser * parser) {
+    free(parser);
+}
+
+int fpv_gps_parser_read(FPVGPSParser * parser, int fd) {
+    int total = 0;
+    while ( 1 ) {
+        if ( parser->end == GPS_BUFFER_SIZE ) {
+            // Buffer is full of something we can't parse; drop it
+            parser->stats.resyncs += parser->end - parser->start;
+            parser->start = parser->end = 0;
+        }
+
+        int result = read(fd, parser->buffer + parser->end, GPS_BUFFER_SIZE - parser->end);
+        if ( result > 0 ) {
+            parser->end += result;
+            parser->stats.bytes += result;
+            total += result;
+            fpv_gps_parser_parse(parser);
+        } else if ( result == 0 ) {
+            // End of file: the device was unplugged or the other end of the pty closed, and
+            // it would poll readable forever
+            errno = 0;
+            return -1;
+        } else if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+            return total;
+        } else if ( errno != EINTR ) {
+            return -1;
+        }
+    }
+}
+
+void fpv_gps_parser_feed(FPVGPSParser * parser, const uint8_t * data, int length) {
+    while ( length > 0 ) {
+        if ( parser->end == GPS_BUFFER_SIZE ) {
+            parser->stats.resyncs += parser->end - parser->start;
+            parser->start = parser->end = 0;
+        }
+        int chunk = GPS_BUFFER_SIZE - parser->end;
+        if ( chunk > length ) chunk = length;
+        memcpy(parser->buffer + parser->end, data, chunk);
+        parser->end += chunk;
+        parser->stats.bytes += chunk;
+        data += chunk;
+        length -= chunk;
+        fpv_gps_parser_parse(parser);
+    }
+}
+
+void fpv_gps_parser_get_stats(FPVGPSParser * parser, FPVGPSParserStats * stats) {
+    *stats = parser->stats;
+}
+
+#pragma mark - Parsing
+
+static void fpv_gps_parser_parse(FPVGPSParser * parser) {
+    while ( parser->start < parser->end ) {
+        const uint8_t * data = parser->buffer + parser->start;
+        int length = parser->end - parser->start;
+        int result;
+
+        if ( data[0] == '$' ) {
+            result = fpv_gps_parser_parse_nmea(parser, data, length);
+        } else if ( data[0] == UBX_SYNC_1 ) {
+            result = fpv_gps_parser_parse_ubx(parser, data, length);
+        } else {
+            result = -1;
+        }
+
+        if ( result == 0 ) {
+            // Incomplete message; wait for more data
+            break;
+        } else if ( result < 0 ) {
+            // Not a valid message: skip a byte and look for the next start marker
+            parser->start++;
+            parser->stats.resyncs++;
+        } else {
+            parser->start += result;
+        }
+    }
+
+    // Move any partial message to the front, so reads always append contiguously
+    if ( parser->start > 0 ) {
+        memmove(parser->buffer, parser->buffer + parser->start, parser->end - parser->start);
+        parser->end -= parser->start;
+        parser->start = 0;
+    }
+}
+
+static int hex_value(char c) {
+    if ( c >= '0' && c <= '9' ) return c - '0';
+    if ( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+    if ( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+    return -1;
+}
+
+static int parse_decimal(NMEAField field, double * value) {
+    if ( field.length == 0 ) return 0;
+
+    const char * p = field.text;
+    const char * end = field.text + field.length;
+    int negative = 0;
+    if ( *p == '-' ) {
+        negative = 1;
+        p++;
+    }
+
+    double result = 0.0;
+    double scale = 0.0;
+    for ( ; p < end; p++ ) {
+        if ( *p == '.' && scale == 0.0 ) {
+            scale = 1.0;
+        } else if ( *p >= '0' && *p <= '9' ) {
+            result = result * 10.0 + (*p - '0');
+            scale *= 10.0;
+        } else {
+            return 0;
+        }
+    }
+
+    if ( scale > 1.0 ) result /= scale;
+    *value = negative ? -result : result;
+    return 1;
+}
+
+static int parse_coordinate(NMEAField field, NMEAField hemisphere, double * degrees) {
+    // NMEA coordinates are (d)ddmm.mmmm
+    double value;
+    if ( !parse_decimal(field, &value) || hemisphere.length != 1 ) return 0;
+    int whole_degrees = (int)(value / 100.0);
+    *degrees = whole_degrees + (value - whole_degrees * 100.0) / 60.0;
+    if ( hemisphere.text[0] == 'S' || hemisphere.text[0] == 'W' ) *degrees = -*degrees;
+    return 1;
+}
+
+static int sentence_is(NMEAField field, const char * type) {
+    // Ignore the two-character talker ID (GP, GN, GL...)
+    return field.length == 5 && memcmp(field.text + 2, type, 3) == 0;
+}
+
+static int fpv_gps_parser_parse_nmea(FPVGPSParser * parser, const uint8_t * data, int length) {
+    // Find the end of the sentence
+    int limit = length < NMEA_MAX_LENGTH ? length : NMEA_MAX_LENGTH;
+    const uint8_t * newline = memchr(data, '\n', limit);
+    if ( !newline ) {
+        return length < NMEA_MAX_LENGTH ? 0 : -1;
+    }
+    int sentence_length = newline - data + 1;
+
+    // Verify checksum: XOR of everything between '$' and '*'
+    const uint8_t * star = memchr(data, '*', sentence_length);
+    if ( !star || newline - star < 3 ) return -1;
+    uint8_t checksum = 0;
+    const uint8_t * p;
+    for ( p = data + 1; p < star; p++ ) {
+        checksum ^= *p;
+    }
+    int high = hex_value(star[1]), low = hex_value(star[2]);
+    if ( high < 0 || low < 0 || checksum != ((high << 4) | low) ) {
+        parser->stats.checksum_errors++;
+        return -1;
+    }
+
+    // Split into fields in place
+    NMEAField fields[NMEA_MAX_FIELDS];
+    int field_count = 0;
+    const char * field_start = (const char*)data + 1;
+    for ( p = data + 1; p <= star && field_count < NMEA_MAX_FIELDS; p++ ) {
+        if ( *p == ',' || p == star ) {
+            fields[field_count].text = field_start;
+            fields[field_count].length = (const char*)p - field_start;
+            field_count++;
+            field_start = (const char*)p + 1;
+        }
+    }
+
+    parser->stats.messages++;
+    FPVGPSFix *fix = &parser->fix;
+
+    if ( sentence_is(fields[0], "GGA") && field_count >= 10 ) {
+        double quality = 0, satellites = 0, altitude;
+        parse_decimal(fields[6], &quality);
+        parse_decimal(fields[7], &satellites);
+        fix->satellites = (int)satellites;
+        if ( quality < 1 || !parse_coordinate(fields[2], fields[3], &fix->latitude)
+                         || !parse_coordinate(fields[4], fields[5], &fix->longitude) ) {
+            fix->fix = 0;
+            return sentence_length;
+        }
+        if ( parse_decimal(fields[9], &altitude) ) {
+            fix->altitude = altitude;
+            fix->fix = 3;
+        } else {
+            fix->fix = 2;
+        }
+        fix->source = GPS_SOURCE_NMEA_GGA;
+        if ( parser->callback ) parser->callback(parser, fix, parser->context);
+
+    } else if ( sentence_is(fields[0], "RMC") && field_count >= 9 ) {
+        if ( fields[2].length != 1 || fields[2].text[0] != 'A'
+                || !parse_coordinate(fields[3], fields[4], &fix->latitude)
+                || !parse_coordinate(fields[5], fields[6], &fix->longitude) ) {
+            return sentence_length;
+        }
+        double speed, course;
+        if ( parse_decimal(fields[7], &speed) ) fix->speed = speed * KNOTS_TO_METRES_PER_SECOND;
+        if ( parse_decimal(fields[8], &course) ) fix->course = course;
+        if ( fix->fix < 2 ) fix->fix = 2;
+        fix->source = GPS_SOURCE_NMEA_RMC;
+        if ( parser->callback ) parser->callback(parser, fix, parser->context);
+    }
+
+    return sentence_length;
+}
+
+static inline uint16_t get_le16(const uint8_t *p) {
+    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+static inline uint32_t get_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int fpv_gps_parser_parse_ubx(FPVGPSParser * parser, const uint8_t * data, int length) {
+    if ( length < 2 ) return 0;
+    if ( data[1] != UBX_SYNC_2 ) return -1;
+    if ( length < UBX_HEADER_LENGTH ) return 0;
+
+    int payload_length = get_le16(data + 4);
+    int message_length = UBX_HEADER_LENGTH + payload_length + UBX_CHECKSUM_LENGTH;
+    if ( message_length > GPS_BUFFER_SIZE ) return -1;
+    if ( length < message_length ) return 0;
+
+    // 8-bit Fletcher checksum over class, ID, length and payload
+    uint8_t ck_a = 0, ck_b = 0;
+    int i;
+    for ( i=2; i<UBX_HEADER_LENGTH + payload_length; i++ ) {
+        ck_a += data[i];
+        ck_b += ck_a;
+    }
+    if ( ck_a != data[message_length-2] || ck_b != data[message_length-1] ) {
+        parser->stats.checksum_errors++;
+        return -1;
+    }
+
+    parser->stats.messages++;
+
+    if ( data[2] == UBX_CLASS_NAV && data[3] == UBX_ID_NAV_PVT && payload_length >= UBX_NAV_PVT_LENGTH ) {
+        const uint8_t * pvt = data + UBX_HEADER_LENGTH;
+        int fix_type = pvt[20];
+        int fix_ok = pvt[21] & 0x01;
+        FPVGPSFix *fix = &parser->fix;
+        fix->satellites = pvt[23];
+        if ( !fix_ok || fix_type < 2 || fix_type > 4 ) {
+            fix->fix = 0;
+            return message_length;
+        }
+        fix->fix = fix_type == 2 ? 2 : 3;
+        fix->longitude = (int32_t)get_le32(pvt + 24) * 1e-7;
+        fix->latitude = (int32_t)get_le32(pvt + 28) * 1e-7;
+        fix->altitude = (int32_t)get_le32(pvt + 36) * 1e-3;
+        fix->speed = (int32_t)get_le32(pvt + 60) * 1e-3;
+        fix->course = (int32_t)get_le32(pvt + 64) * 1e-5;
+        fix->source = GPS_SOURCE_UBX_NAV_PVT;
+        if ( parser->callback ) parser->callback(parser, fix, parser->context);
+    }
+
+    return message_length;
+}
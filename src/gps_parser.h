@@ -0,0 +1,62 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GPS_PARSER_H
+#define __GPS_PARSER_H
+
+#include <stdint.h>
+
+enum {
+    GPS_SOURCE_NMEA_GGA,
+    GPS_SOURCE_NMEA_RMC,
+    GPS_SOURCE_UBX_NAV_PVT
+};
+
+typedef struct {
+    double latitude;    // Degrees
+    double longitude;   // Degrees
+    double altitude;    // Metres above mean sea level
+    double speed;       // Ground speed, m/s
+    double course;      // Course over ground, degrees
+    int fix;            // 0 = none, 2 = 2D, 3 = 3D
+    int satellites;
+    int source;         // Message that completed this fix
+} FPVGPSFix;
+
+typedef struct {
+    uint64_t bytes;
+    uint64_t messages;
+    uint64_t checksum_errors;
+    uint64_t resyncs;   // Bytes skipped looking for the start of a message
+} FPVGPSParserStats;
+
+typedef struct _FPVGPSParser FPVGPSParser;
+
+typedef void (*FPVGPSParserCallback)(FPVGPSParser * parser, const FPVGPSFix * fix, void * context);
+
+FPVGPSParser * fpv_gps_parser_new(FPVGPSParserCallback callback, void * context);
+void fpv_gps_parser_dispose(FPVGPSParser * parser);
+
+// Reads whatever a non-blocking fd has, returning the byte count, or -1 once it's gone:
+// on a read error, or with errno 0 at end of file
+int fpv_gps_parser_read(FPVGPSParser * parser, int fd);
+void fpv_gps_parser_feed(FPVGPSParser * parser, const uint8_t * data, int length);
+
+void fpv_gps_parser_get_stats(FPVGPSParser * parser, FPVGPSParserStats * stats);
+
+#endif
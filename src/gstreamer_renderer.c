@@ -17,11 +17,27 @@
  */
 
 #include "gstreamer_renderer.h"
+#include "link_stats.h"
+#include "link_feedback.h"
+#include "telemetry_common.h"
+#include "fec.h"
+#include "frame_stamp.h"
+#include "latency_stats.h"
+#include "clock_offset.h"
+#include "fast_start.h"
 #include <gst/gst.h>
+#include <gst/net/net.h>
+#include <gst/app/gstappsrc.h>
+#include <gio/gio.h>
 #include <glib.h>
+#include <glib-unix.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 static const char * oculus_rift_frag_shader = 
     "#extension GL_ARB_texture_rectangle : enable                                     \n"
@@ -113,12 +129,92 @@ static const char * oculus_rift_frag_shader =
 
 const char * shader_source_tmp_path = "/tmp/raspifpv-shader.frag";
 
+#define LATENCY_FRAMES 16   // Frames between the depayloader and the display at once, at most
+
+typedef struct {
+    GstClockTime pts;       // GST_CLOCK_TIME_NONE for a free slot
+    FPVFrameStamp stamp;
+    uint64_t received;
+    uint64_t decoded;       // 0 until the decoder has produced the frame
+} latency_frame_t;
+
 struct _FPVGStreamerRenderer {
     GstPipeline * pipeline;
+
+    // Link feedback, when enabled. The stats, byte count and sender address are written
+    // by the streaming thread and reported from the main loop
+    FPVLinkStats *video_stats;
+    uint64_t video_bytes;
+    uint32_t sender;                // IPv4 address, network order; 0 until video arrives
+    uint32_t rtp_timestamp;         // Streaming thread only
+    uint64_t rtp_extended_timestamp;
+    int feedback_sock;
+    int feedback_port;
+    guint feedback_timer;
+    uint16_t feedback_sequence;
+    FPVLinkStatsSnapshot last_snapshot;
+    uint64_t last_bytes;
+    uint64_t last_report;
+
+    // FEC, when enabled; the decoder is fed from the video and repair streaming threads
+    FPVFecDecoder *fec;
+    pthread_mutex_t fec_lock;
+    GstElement *recovered;
+
+    // Latency measurement, when enabled. Frames are followed from the depayloader and
+    // decoder threads to the sink's, where the stats are fed; clock replies come in on
+    // the main loop
+    FPVLatencyStats *latency;
+    FPVClockOffset *clock;
+    pthread_mutex_t latency_lock;
+    latency_frame_t frames[LATENCY_FRAMES];
+    int next_frame;
+    guint clock_timer;
+    guint clock_watch;
+    guint latency_timer;
+
+    // Fast start, when enabled: access units are gated in the parser's thread, and the
+    // first frame after each join is timed in the decoder's
+    FPVFastStart *fast_start;
+    uint64_t started;
+    uint64_t joined;                // When the last join happened, until its first frame is decoded
+    uint64_t first_frame;           // Decoder thread only
+
+    // Keyframe requests, when enabled. Loss is spotted going into the depayloader, after
+    // any FEC, and keyframes coming out of it, in its thread; decoder warnings on the main
+    // loop. Requests go out from the main loop, repeated until a keyframe arrives
+    int keyframe_requests;
+    uint16_t depay_sequence;        // Depayloader thread only, as is the recovery timing
+    int depay_started;
+    uint64_t recoveries;
+    uint64_t recovery_total;
+    uint64_t recovery_max;
+    int keyframe_wanted;            // Atomic: set on loss, cleared by the next keyframe
+    uint64_t keyframe_lost_at;      // Atomic: when it was set
+    uint32_t lost_since_keyframe;   // Atomic
+    guint keyframe_timer;
+    uint32_t keyframe_attempt;
+    uint64_t keyframe_requests_sent;
+    uint64_t losses;
 };
 
-static const char * GST_PIPELINE_RECEIVE = "udpsrc %s port=%d caps=\"application/x-rtp, media=(string)video, clock-rate=(int)90000, encoding-name=(string)H264\" ! rtph264depay";
-static const char * GST_PIPELINE_DECODE = "h264parse ! omxh264dec";
+static const guint FEEDBACK_INTERVAL = 100;    // Milliseconds between reports to the sender
+static const int RTP_HEADER_LENGTH = 12;
+static const int RTP_CLOCK_RATE = 90000;
+static const int FEC_LATENCY = 50;              // Milliseconds the jitter buffer waits for a missing packet to be rebuilt
+static const guint CLOCK_REQUEST_INTERVAL = 1000;   // Milliseconds between clock requests to the sender
+static const guint LATENCY_LOG_INTERVAL = 10;       // Seconds between latency lines in the log
+static const guint KEYFRAME_REQUEST_INTERVAL = 250; // Milliseconds between keyframe requests, a round trip and an encode or two
+static const int RTP_REORDER_LIMIT = 64;            // Packets a sequence number can go back by and still be a late one, not a restart
+
+#define GST_RTP_H264_CAPS "caps=\"application/x-rtp, media=(string)video, clock-rate=(int)90000, encoding-name=(string)H264\""
+
+static const char * GST_PIPELINE_RECEIVE = "udpsrc name=source %s port=%d " GST_RTP_H264_CAPS " ! rtph264depay name=depay";
+
+// With FEC, rebuilt packets join the stream ahead of a jitter buffer, which puts them back in order
+static const char * GST_PIPELINE_RECEIVE_FEC = "udpsrc name=source %s port=%d " GST_RTP_H264_CAPS " ! funnel name=media ! rtpjitterbuffer latency=%d ! rtph264depay name=depay";
+static const char * GST_PIPELINE_FEC = "appsrc name=recovered is-live=true do-timestamp=true format=time " GST_RTP_H264_CAPS " ! media.  udpsrc name=repair %s port=%d ! fakesink sync=false async=false";
+static const char * GST_PIPELINE_DECODE = "h264parse name=parse ! omxh264dec name=decoder";
 static const char * GST_PIPELINE_SHADER = "glshader name=shader";
 static const char * GST_PIPELINE_SINK = "glimagesink sync=false name=sink";
 
@@ -126,11 +222,40 @@ static const char * GST_PIPELINE_SINK = "glimagesink sync=false name=sink";
 #pragma mark Forward declarations
 
 static gboolean on_message(GstBus * bus, GstMessage * message, gpointer user_data);
+static GstPadProbeReturn on_video_packet(GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static void fpv_gstreamer_renderer_add_packet(FPVGStreamerRenderer * renderer, GstBuffer * buffer, uint64_t received);
+static gboolean on_feedback_timer(gpointer user_data);
+static GstPadProbeReturn on_fec_media(GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static GstPadProbeReturn on_fec_repair(GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static void fpv_gstreamer_renderer_add_fec(FPVGStreamerRenderer * renderer, GstBuffer * buffer, int repair);
+static void on_fec_recovered(const uint8_t * packet, int length, void * userinfo);
+static GstPadProbeReturn on_frame_received(GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static GstPadProbeReturn on_frame_decoded(GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static GstPadProbeReturn on_frame_displayed(GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static GstPadProbeReturn on_access_unit(GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static GstPadProbeReturn on_first_frame_decoded(GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static GstPadProbeReturn on_depay_packet(GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static void fpv_gstreamer_renderer_check_sequence(FPVGStreamerRenderer * renderer, GstBuffer * buffer, uint64_t now);
+static GstPadProbeReturn on_depayloaded(GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static void on_decoder_warning(GstBus * bus, GstMessage * message, gpointer user_data);
+static void fpv_gstreamer_renderer_want_keyframe(FPVGStreamerRenderer * renderer, uint32_t lost, uint64_t now);
+static gboolean on_keyframe_wanted(gpointer user_data);
+static gboolean on_keyframe_timer(gpointer user_data);
+static void fpv_gstreamer_renderer_request_keyframe(FPVGStreamerRenderer * renderer);
+static int fpv_gstreamer_renderer_stream_format(GstPad * pad, int * parameter_sets_in_caps);
+static latency_frame_t * fpv_gstreamer_renderer_find_frame(FPVGStreamerRenderer * renderer, GstClockTime pts);
+static gboolean on_clock_timer(gpointer user_data);
+static gboolean on_clock_reply(gint fd, GIOCondition condition, gpointer user_data);
+static gboolean on_latency_timer(gpointer user_data);
+static int fpv_gstreamer_renderer_open_feedback(FPVGStreamerRenderer * renderer, int port);
+static void fpv_gstreamer_renderer_send_feedback(FPVGStreamerRenderer * renderer, FPVLinkFeedback * feedback);
+static void fpv_gstreamer_renderer_add_probe(FPVGStreamerRenderer * renderer, const char * name, const char * pad_name, GstPadProbeCallback callback);
 
 #pragma mark -
 
-FPVGStreamerRenderer * fpv_gstreamer_renderer_new(GMainLoop * loop, char * multicast_addr, int port) {
+FPVGStreamerRenderer * fpv_gstreamer_renderer_new(GMainLoop * loop, char * multicast_addr, int port, int fec_port) {
     FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)calloc(1, sizeof(FPVGStreamerRenderer));
+    renderer->feedback_sock = -1;
     
     char multicast_str[256] = "";
     if ( multicast_addr && strlen(multicast_addr) > 0 ) {
@@ -138,14 +263,22 @@ FPVGStreamerRenderer * fpv_gstreamer_renderer_new(GMainLoop * loop, char * multi
     }
     
     // Parse and create pipeline
-    char pipeline_description[1024];
-    snprintf(pipeline_description, sizeof(pipeline_description), GST_PIPELINE_RECEIVE, multicast_str, port);
+    char pipeline_description[2048];
+    if ( fec_port ) {
+        snprintf(pipeline_description, sizeof(pipeline_description), GST_PIPELINE_RECEIVE_FEC, multicast_str, port, FEC_LATENCY);
+    } else {
+        snprintf(pipeline_description, sizeof(pipeline_description), GST_PIPELINE_RECEIVE, multicast_str, port);
+    }
     strcat(pipeline_description, " ! ");
     strcat(pipeline_description, GST_PIPELINE_DECODE);
     strcat(pipeline_description, " ! ");
     strcat(pipeline_description, GST_PIPELINE_SHADER);
     strcat(pipeline_description, " ! ");
     strcat(pipeline_description, GST_PIPELINE_SINK);
+    if ( fec_port ) {
+        strcat(pipeline_description, "  ");
+        snprintf(pipeline_description+strlen(pipeline_description), sizeof(pipeline_description)-strlen(pipeline_description), GST_PIPELINE_FEC, multicast_str, fec_port);
+    }
 
     g_debug("Pipeline: %s", pipeline_description);
 
@@ -167,6 +300,15 @@ FPVGStreamerRenderer * fpv_gstreamer_renderer_new(GMainLoop * loop, char * multi
     g_object_set(shader, "location", shader_source_tmp_path, NULL);
     
     printf("Listening for video at %s:%d\n", multicast_addr && strlen(multicast_addr) > 0 ? multicast_addr : "0.0.0.0", port);
+
+    if ( fec_port ) {
+        renderer->fec = fpv_fec_decoder_new(on_fec_recovered, renderer);
+        pthread_mutex_init(&renderer->fec_lock, NULL);
+        renderer->recovered = gst_bin_get_by_name(GST_BIN(renderer->pipeline), "recovered");
+        fpv_gstreamer_renderer_add_probe(renderer, "source", "src", on_fec_media);
+        fpv_gstreamer_renderer_add_probe(renderer, "repair", "src", on_fec_repair);
+        printf("Listening for FEC on port %d\n", fec_port);
+    }
     
     GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(renderer->pipeline));
     gst_bus_add_signal_watch(bus);
@@ -177,11 +319,115 @@ FPVGStreamerRenderer * fpv_gstreamer_renderer_new(GMainLoop * loop, char * multi
 }
 
 void fpv_gstreamer_renderer_dispose(FPVGStreamerRenderer * renderer) {
+    if ( renderer->feedback_timer ) g_source_remove(renderer->feedback_timer);
+    if ( renderer->clock_timer ) g_source_remove(renderer->clock_timer);
+    if ( renderer->clock_watch ) g_source_remove(renderer->clock_watch);
+    if ( renderer->latency_timer ) g_source_remove(renderer->latency_timer);
+    if ( renderer->keyframe_timer ) g_source_remove(renderer->keyframe_timer);
+    if ( renderer->keyframe_requests ) while ( g_idle_remove_by_data(renderer) );
+    if ( renderer->feedback_sock != -1 ) close(renderer->feedback_sock);
+    if ( renderer->recovered ) gst_object_unref(renderer->recovered);
     gst_object_unref(renderer->pipeline);
+    if ( renderer->video_stats ) fpv_link_stats_dispose(renderer->video_stats);
+    if ( renderer->fec ) {
+        FPVFecStats stats;
+        fpv_fec_decoder_get_stats(renderer->fec, &stats);
+        printf("FEC: %llu groups, %llu repair packets, %llu packets recovered, %llu groups unrecoverable\n",
+            (unsigned long long)stats.groups, (unsigned long long)stats.repairs,
+            (unsigned long long)stats.recovered, (unsigned long long)stats.unrecoverable);
+        fpv_fec_decoder_dispose(renderer->fec);
+        pthread_mutex_destroy(&renderer->fec_lock);
+    }
+    if ( renderer->latency ) {
+        fpv_latency_stats_print(renderer->latency, stdout);
+        fpv_latency_stats_dispose(renderer->latency);
+        fpv_clock_offset_dispose(renderer->clock);
+        pthread_mutex_destroy(&renderer->latency_lock);
+    }
+    if ( renderer->fast_start ) {
+        FPVFastStartStats stats;
+        fpv_fast_start_get_stats(renderer->fast_start, &stats);
+        printf("Fast start: %llu joins, %llu frames discarded waiting for a keyframe\n",
+            (unsigned long long)stats.joins, (unsigned long long)stats.discarded);
+        fpv_fast_start_dispose(renderer->fast_start);
+    }
+    if ( renderer->keyframe_requests ) {
+        printf("Keyframe requests: %llu losses, %llu requests sent", (unsigned long long)renderer->losses,
+            (unsigned long long)renderer->keyframe_requests_sent);
+        if ( renderer->recoveries ) {
+            printf(", keyframe %.1f ms after loss on average, %.1f ms worst",
+                renderer->recovery_total / 1000.0 / renderer->recoveries, renderer->recovery_max / 1000.0);
+        }
+        printf("\n");
+    }
     free(renderer);
 }
 
+int fpv_gstreamer_renderer_enable_feedback(FPVGStreamerRenderer * renderer, int port) {
+    if ( renderer->feedback_timer ) return 1;
+    if ( !fpv_gstreamer_renderer_open_feedback(renderer, port) ) return 0;
+
+    renderer->feedback_timer = g_timeout_add(FEEDBACK_INTERVAL, on_feedback_timer, renderer);
+
+    printf("Sending link feedback to the video sender on port %d\n", port);
+    return 1;
+}
+
+int fpv_gstreamer_renderer_enable_latency(FPVGStreamerRenderer * renderer, int port) {
+    if ( renderer->latency ) return 1;
+    if ( !fpv_gstreamer_renderer_open_feedback(renderer, port) ) return 0;
+
+    renderer->latency = fpv_latency_stats_new();
+    renderer->clock = fpv_clock_offset_new();
+    pthread_mutex_init(&renderer->latency_lock, NULL);
+    int i;
+    for ( i=0; i<LATENCY_FRAMES; i++ ) renderer->frames[i].pts = GST_CLOCK_TIME_NONE;
+
+    fpv_gstreamer_renderer_add_probe(renderer, "depay", "src", on_frame_received);
+    fpv_gstreamer_renderer_add_probe(renderer, "decoder", "src", on_frame_decoded);
+    fpv_gstreamer_renderer_add_probe(renderer, "sink", "sink", on_frame_displayed);
+
+    renderer->clock_watch = g_unix_fd_add(renderer->feedback_sock, G_IO_IN, on_clock_reply, renderer);
+    renderer->clock_timer = g_timeout_add(CLOCK_REQUEST_INTERVAL, on_clock_timer, renderer);
+    renderer->latency_timer = g_timeout_add_seconds(LATENCY_LOG_INTERVAL, on_latency_timer, renderer);
+
+    printf("Measuring video latency against the sender's frame stamps\n");
+    return 1;
+}
+
+int fpv_gstreamer_renderer_enable_fast_start(FPVGStreamerRenderer * renderer) {
+    if ( renderer->fast_start ) return 1;
+
+    renderer->fast_start = fpv_fast_start_new();
+    fpv_gstreamer_renderer_add_probe(renderer, "parse", "sink", on_access_unit);
+    fpv_gstreamer_renderer_add_probe(renderer, "decoder", "src", on_first_frame_decoded);
+
+    printf("Holding video back until a keyframe to start from\n");
+    return 1;
+}
+
+int fpv_gstreamer_renderer_enable_keyframe_requests(FPVGStreamerRenderer * renderer, int port) {
+    if ( renderer->keyframe_requests ) return 1;
+    if ( !fpv_gstreamer_renderer_open_feedback(renderer, port) ) return 0;
+
+    renderer->keyframe_requests = 1;
+    fpv_gstreamer_renderer_add_probe(renderer, "depay", "sink", on_depay_packet);
+    fpv_gstreamer_renderer_add_probe(renderer, "depay", "src", on_depayloaded);
+
+    GstBus *bus = gst_pipeline_get_bus(renderer->pipeline);
+    g_signal_connect(G_OBJECT(bus), "message::warning", G_CALLBACK(on_decoder_warning), renderer);
+    gst_object_unref(GST_OBJECT(bus));
+
+    printf("Asking the video sender for a keyframe after losing video\n");
+    return 1;
+}
+
+FPVLatencyStats * fpv_gstreamer_renderer_get_latency_stats(FPVGStreamerRenderer * renderer) {
+    return renderer->latency;
+}
+
 void fpv_gstreamer_renderer_start(FPVGStreamerRenderer * renderer) {
+    renderer->started = fpv_telemetry_now();
     gst_element_set_state(GST_ELEMENT(renderer->pipeline), GST_STATE_PLAYING);
 }
 
@@ -189,6 +435,511 @@ void fpv_gstreamer_renderer_stop(FPVGStreamerRenderer * renderer) {
     gst_element_set_state(GST_ELEMENT(renderer->pipeline), GST_STATE_NULL);
 }
 
+static int fpv_gstreamer_renderer_open_feedback(FPVGStreamerRenderer * renderer, int port) {
+    if ( renderer->feedback_sock != -1 ) return 1;
+
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( sock == -1 ) {
+        perror("socket");
+        return 0;
+    }
+
+    // The packet probe also learns the sender's address, which feedback goes to
+    renderer->video_stats = fpv_link_stats_new();
+    renderer->feedback_sock = sock;
+    renderer->feedback_port = port;
+    fpv_gstreamer_renderer_add_probe(renderer, "source", "src", on_video_packet);
+    return 1;
+}
+
+static void fpv_gstreamer_renderer_send_feedback(FPVGStreamerRenderer * renderer, FPVLinkFeedback * feedback) {
+    uint32_t sender = __atomic_load_n(&renderer->sender, __ATOMIC_RELAXED);
+    if ( !sender ) return;
+
+    feedback->sequence = renderer->feedback_sequence++;
+    uint8_t buffer[LINK_FEEDBACK_MAX_LENGTH];
+    int length = fpv_link_feedback_encode(feedback, buffer, sizeof(buffer));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = sender;
+    addr.sin_port = htons(renderer->feedback_port);
+    sendto(renderer->feedback_sock, buffer, length, 0, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+static void fpv_gstreamer_renderer_add_probe(FPVGStreamerRenderer * renderer, const char * name, const char * pad_name, GstPadProbeCallback callback) {
+    GstElement *element = gst_bin_get_by_name(GST_BIN(renderer->pipeline), name);
+    g_assert(element);
+    GstPad *pad = gst_element_get_static_pad(element, pad_name);
+
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, callback, renderer, NULL);
+    gst_object_unref(pad);
+    gst_object_unref(element);
+}
+
+static GstPadProbeReturn on_video_packet(GstPad * pad, GstPadProbeInfo * info, gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+    uint64_t received = fpv_telemetry_now();
+
+    if ( info->type & GST_PAD_PROBE_TYPE_BUFFER ) {
+        fpv_gstreamer_renderer_add_packet(renderer, GST_PAD_PROBE_INFO_BUFFER(info), received);
+    } else if ( info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST ) {
+        GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        guint i, count = gst_buffer_list_length(list);
+        for ( i=0; i<count; i++ ) {
+            fpv_gstreamer_renderer_add_packet(renderer, gst_buffer_list_get(list, i), received);
+        }
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+static void fpv_gstreamer_renderer_add_packet(FPVGStreamerRenderer * renderer, GstBuffer * buffer, uint64_t received) {
+    uint8_t header[RTP_HEADER_LENGTH];
+    if ( gst_buffer_extract(buffer, 0, header, sizeof(header)) < sizeof(header) || (header[0] >> 6) != 2 ) return;
+
+    uint16_t sequence = ((uint16_t)header[2] << 8) | header[3];
+    uint32_t timestamp = ((uint32_t)header[4] << 24) | ((uint32_t)header[5] << 16) | ((uint32_t)header[6] << 8) | header[7];
+
+    // The RTP timestamp is the sender's capture clock; extend it past its wraparound and
+    // convert to microseconds, which is all the link stats need for jitter and age
+    if ( renderer->rtp_extended_timestamp ) {
+        renderer->rtp_extended_timestamp += (int32_t)(timestamp - renderer->rtp_timestamp);
+    } else {
+        renderer->rtp_extended_timestamp = (uint64_t)1 << 32 | timestamp;
+    }
+    renderer->rtp_timestamp = timestamp;
+    uint32_t sent = (uint32_t)(renderer->rtp_extended_timestamp * 1000000 / RTP_CLOCK_RATE);
+
+    fpv_link_stats_add(renderer->video_stats, sequence, sent, received);
+    __atomic_add_fetch(&renderer->video_bytes, gst_buffer_get_size(buffer), __ATOMIC_RELAXED);
+
+    GstNetAddressMeta *meta = gst_buffer_get_net_address_meta(buffer);
+    if ( meta && G_IS_INET_SOCKET_ADDRESS(meta->addr) ) {
+        GInetAddress *address = g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(meta->addr));
+        if ( g_inet_address_get_family(address) == G_SOCKET_FAMILY_IPV4 ) {
+            uint32_t sender;
+            memcpy(&sender, g_inet_address_to_bytes(address), sizeof(sender));
+            __atomic_store_n(&renderer->sender, sender, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static gboolean on_feedback_timer(gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+
+    FPVLinkStatsSnapshot snapshot;
+    fpv_link_stats_get(renderer->video_stats, &snapshot);
+    uint64_t bytes = __atomic_load_n(&renderer->video_bytes, __ATOMIC_RELAXED);
+    uint64_t now = fpv_telemetry_now();
+
+    FPVLinkFeedback feedback;
+    memset(&feedback, 0, sizeof(feedback));
+    feedback.type = LINK_FEEDBACK_TYPE_REPORT;
+    FPVLinkFeedbackReport *report = &feedback.content.report;
+    report->interval = now - renderer->last_report;
+    report->expected = snapshot.expected - renderer->last_snapshot.expected;
+    report->received = (snapshot.received - snapshot.duplicates) - (renderer->last_snapshot.received - renderer->last_snapshot.duplicates);
+    report->bytes = bytes - renderer->last_bytes;
+    report->jitter = snapshot.jitter * 1000.0;
+    report->age_p95 = snapshot.age_p95 * 1000.0;
+
+    int first = renderer->last_report == 0;
+    renderer->last_snapshot = snapshot;
+    renderer->last_bytes = bytes;
+    renderer->last_report = now;
+
+    // Say nothing while no video arrives, so the sender's report timeout backs it off
+    if ( first || report->expected == 0 ) return G_SOURCE_CONTINUE;
+
+    fpv_gstreamer_renderer_send_feedback(renderer, &feedback);
+    return G_SOURCE_CONTINUE;
+}
+
+static GstPadProbeReturn on_fec_media(GstPad * pad, GstPadProbeInfo * info, gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+
+    if ( info->type & GST_PAD_PROBE_TYPE_BUFFER ) {
+        fpv_gstreamer_renderer_add_fec(renderer, GST_PAD_PROBE_INFO_BUFFER(info), 0);
+    } else if ( info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST ) {
+        GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        guint i, count = gst_buffer_list_length(list);
+        for ( i=0; i<count; i++ ) {
+            fpv_gstreamer_renderer_add_fec(renderer, gst_buffer_list_get(list, i), 0);
+        }
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn on_fec_repair(GstPad * pad, GstPadProbeInfo * info, gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+
+    if ( info->type & GST_PAD_PROBE_TYPE_BUFFER ) {
+        fpv_gstreamer_renderer_add_fec(renderer, GST_PAD_PROBE_INFO_BUFFER(info), 1);
+    } else if ( info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST ) {
+        GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        guint i, count = gst_buffer_list_length(list);
+        for ( i=0; i<count; i++ ) {
+            fpv_gstreamer_renderer_add_fec(renderer, gst_buffer_list_get(list, i), 1);
+        }
+    }
+
+    // Repair has nowhere further to go
+    return GST_PAD_PROBE_DROP;
+}
+
+static void fpv_gstreamer_renderer_add_fec(FPVGStreamerRenderer * renderer, GstBuffer * buffer, int repair) {
+    GstMapInfo map;
+    if ( !gst_buffer_map(buffer, &map, GST_MAP_READ) ) return;
+
+    pthread_mutex_lock(&renderer->fec_lock);
+    if ( repair ) {
+        fpv_fec_decoder_add_repair(renderer->fec, map.data, map.size);
+    } else {
+        fpv_fec_decoder_add_media(renderer->fec, map.data, map.size);
+    }
+    pthread_mutex_unlock(&renderer->fec_lock);
+
+    gst_buffer_unmap(buffer, &map);
+}
+
+static void on_fec_recovered(const uint8_t * packet, int length, void * userinfo) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)userinfo;
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, length, NULL);
+    gst_buffer_fill(buffer, 0, packet, length);
+    gst_app_src_push_buffer(GST_APP_SRC(renderer->recovered), buffer);
+}
+
+static GstPadProbeReturn on_frame_received(GstPad * pad, GstPadProbeInfo * info, gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+    uint64_t received = fpv_telemetry_now();
+    if ( !(info->type & GST_PAD_PROBE_TYPE_BUFFER) ) return GST_PAD_PROBE_OK;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if ( !GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(buffer)) ) return GST_PAD_PROBE_OK;
+
+    int nal_length_size = fpv_gstreamer_renderer_stream_format(pad, NULL);
+
+    FPVFrameStamp stamp;
+    GstMapInfo map;
+    if ( !gst_buffer_map(buffer, &map, GST_MAP_READ) ) return GST_PAD_PROBE_OK;
+    int found = fpv_frame_stamp_find(map.data, map.size, nal_length_size, &stamp);
+    gst_buffer_unmap(buffer, &map);
+    if ( !found ) return GST_PAD_PROBE_OK;
+
+    // Frames the decoder dropped are overwritten in turn
+    pthread_mutex_lock(&renderer->latency_lock);
+    latency_frame_t *frame = &renderer->frames[renderer->next_frame];
+    renderer->next_frame = (renderer->next_frame + 1) % LATENCY_FRAMES;
+    frame->pts = GST_BUFFER_PTS(buffer);
+    frame->stamp = stamp;
+    frame->received = received;
+    frame->decoded = 0;
+    pthread_mutex_unlock(&renderer->latency_lock);
+
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn on_frame_decoded(GstPad * pad, GstPadProbeInfo * info, gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+    uint64_t decoded = fpv_telemetry_now();
+    if ( !(info->type & GST_PAD_PROBE_TYPE_BUFFER) ) return GST_PAD_PROBE_OK;
+
+    pthread_mutex_lock(&renderer->latency_lock);
+    latency_frame_t *frame = fpv_gstreamer_renderer_find_frame(renderer, GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info)));
+    if ( frame && !frame->decoded ) frame->decoded = decoded;
+    pthread_mutex_unlock(&renderer->latency_lock);
+
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn on_frame_displayed(GstPad * pad, GstPadProbeInfo * info, gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+    uint64_t displayed = fpv_telemetry_now();
+    if ( !(info->type & GST_PAD_PROBE_TYPE_BUFFER) ) return GST_PAD_PROBE_OK;
+
+    pthread_mutex_lock(&renderer->latency_lock);
+    latency_frame_t *found = fpv_gstreamer_renderer_find_frame(renderer, GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info)));
+    if ( !found || !found->decoded ) {
+        pthread_mutex_unlock(&renderer->latency_lock);
+        return GST_PAD_PROBE_OK;
+    }
+    latency_frame_t frame = *found;
+    found->pts = GST_CLOCK_TIME_NONE;
+    int64_t offset;
+    int synchronised = fpv_clock_offset_get(renderer->clock, &offset, NULL);
+    pthread_mutex_unlock(&renderer->latency_lock);
+
+    int64_t durations[LATENCY_STAGE_COUNT];
+    durations[LATENCY_STAGE_CAPTURE_ENCODE] = frame.stamp.captured ? (int64_t)(frame.stamp.encoded - frame.stamp.captured) : LATENCY_UNMEASURED;
+    durations[LATENCY_STAGE_ENCODE_SEND] = frame.stamp.send_delay != FRAME_STAMP_UNKNOWN ? (int64_t)frame.stamp.send_delay : LATENCY_UNMEASURED;
+    durations[LATENCY_STAGE_RECEIVE_DECODE] = frame.decoded - frame.received;
+    durations[LATENCY_STAGE_DECODE_DISPLAY] = displayed - frame.decoded;
+    durations[LATENCY_STAGE_NETWORK] = durations[LATENCY_STAGE_TOTAL] = LATENCY_UNMEASURED;
+
+    // Across the two clocks, error is up to half the round trip either way. The stamp
+    // can't know its own frame's send delay, so the previous frame's stands in for it
+    if ( synchronised ) {
+        int64_t sent = frame.stamp.encoded + (frame.stamp.send_delay != FRAME_STAMP_UNKNOWN ? frame.stamp.send_delay : 0);
+        int64_t network = (int64_t)frame.received + offset - sent;
+        durations[LATENCY_STAGE_NETWORK] = network > 0 ? network : 0;
+        if ( frame.stamp.captured ) {
+            int64_t total = (int64_t)displayed + offset - (int64_t)frame.stamp.captured;
+            durations[LATENCY_STAGE_TOTAL] = total > 0 ? total : 0;
+        }
+    }
+
+    fpv_latency_stats_add(renderer->latency, durations, displayed);
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn on_access_unit(GstPad * pad, GstPadProbeInfo * info, gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+    uint64_t now = fpv_telemetry_now();
+    if ( !(info->type & GST_PAD_PROBE_TYPE_BUFFER) ) return GST_PAD_PROBE_OK;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    int parameter_sets_in_caps;
+    int nal_length_size = fpv_gstreamer_renderer_stream_format(pad, &parameter_sets_in_caps);
+    fpv_fast_start_set_parameter_sets(renderer->fast_start, parameter_sets_in_caps);
+
+    FPVFastStartUnit unit;
+    memset(&unit, 0, sizeof(unit));
+    GstMapInfo map;
+    if ( !gst_buffer_map(buffer, &map, GST_MAP_READ) ) return GST_PAD_PROBE_OK;
+    fpv_fast_start_unit_add_au(&unit, map.data, map.size, nal_length_size);
+    gst_buffer_unmap(buffer, &map);
+
+    int joined;
+    if ( !fpv_fast_start_filter(renderer->fast_start, &unit, now, &joined) ) return GST_PAD_PROBE_DROP;
+    if ( !joined ) return GST_PAD_PROBE_OK;
+
+    FPVFastStartStats stats;
+    fpv_fast_start_get_stats(renderer->fast_start, &stats);
+    printf("Joined the video at a keyframe after %.1f ms, %llu frames discarded so far\n",
+        stats.last_wait / 1000.0, (unsigned long long)stats.discarded);
+    __atomic_store_n(&renderer->joined, now, __ATOMIC_RELAXED);
+
+    // Tell the parser there's a gap behind this one
+    buffer = gst_buffer_make_writable(buffer);
+    GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DISCONT);
+    GST_PAD_PROBE_INFO_DATA(info) = buffer;
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn on_first_frame_decoded(GstPad * pad, GstPadProbeInfo * info, gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+    uint64_t joined = __atomic_exchange_n(&renderer->joined, 0, __ATOMIC_RELAXED);
+    if ( !joined ) return GST_PAD_PROBE_OK;
+
+    uint64_t now = fpv_telemetry_now();
+    if ( !renderer->first_frame ) {
+        renderer->first_frame = now;
+        printf("First frame decoded %.1f ms after start, %.1f ms after joining\n", (now - renderer->started) / 1000.0, (now - joined) / 1000.0);
+    } else {
+        printf("First frame decoded %.1f ms after joining again\n", (now - joined) / 1000.0);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn on_depay_packet(GstPad * pad, GstPadProbeInfo * info, gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+    uint64_t now = fpv_telemetry_now();
+
+    if ( info->type & GST_PAD_PROBE_TYPE_BUFFER ) {
+        fpv_gstreamer_renderer_check_sequence(renderer, GST_PAD_PROBE_INFO_BUFFER(info), now);
+    } else if ( info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST ) {
+        GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        guint i, count = gst_buffer_list_length(list);
+        for ( i=0; i<count; i++ ) {
+            fpv_gstreamer_renderer_check_sequence(renderer, gst_buffer_list_get(list, i), now);
+        }
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+// Any gap left here is loss that FEC and the jitter buffer couldn't make good, and the
+// decoder will show it until the next keyframe
+static void fpv_gstreamer_renderer_check_sequence(FPVGStreamerRenderer * renderer, GstBuffer * buffer, uint64_t now) {
+    uint8_t header[RTP_HEADER_LENGTH];
+    if ( gst_buffer_extract(buffer, 0, header, sizeof(header)) < sizeof(header) || (header[0] >> 6) != 2 ) return;
+    uint16_t sequence = ((uint16_t)header[2] << 8) | header[3];
+
+    // Joining mid-stream is a loss too: everything before the first packet
+    if ( !renderer->depay_started ) {
+        renderer->depay_started = 1;
+        renderer->depay_sequence = sequence;
+        fpv_gstreamer_renderer_want_keyframe(renderer, 0, now);
+        return;
+    }
+
+    int16_t step = (int16_t)(sequence - renderer->depay_sequence);
+    if ( step <= 0 && step > -RTP_REORDER_LIMIT ) return;   // Late or repeated
+
+    // A step back any further is a restarted sender, with a new sequence
+    renderer->depay_sequence = sequence;
+    if ( step == 1 ) return;
+    fpv_gstreamer_renderer_want_keyframe(renderer, step > 1 ? step - 1 : 0, now);
+}
+
+static GstPadProbeReturn on_depayloaded(GstPad * pad, GstPadProbeInfo * info, gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+    if ( !(info->type & GST_PAD_PROBE_TYPE_BUFFER) || !__atomic_load_n(&renderer->keyframe_wanted, __ATOMIC_ACQUIRE) ) {
+        return GST_PAD_PROBE_OK;
+    }
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    // The start of an intra refresh cycle will do as well as an IDR frame; the picture
+    // cleans up over the cycle either way
+    int parameter_sets_in_caps;
+    int nal_length_size = fpv_gstreamer_renderer_stream_format(pad, &parameter_sets_in_caps);
+    FPVFastStartUnit unit;
+    memset(&unit, 0, sizeof(unit));
+    GstMapInfo map;
+    if ( !gst_buffer_map(buffer, &map, GST_MAP_READ) ) return GST_PAD_PROBE_OK;
+    fpv_fast_start_unit_add_au(&unit, map.data, map.size, nal_length_size);
+    gst_buffer_unmap(buffer, &map);
+    if ( !unit.slices || !(unit.idr || unit.recovery_point) ) return GST_PAD_PROBE_OK;
+
+    uint64_t recovery = fpv_telemetry_now() - __atomic_load_n(&renderer->keyframe_lost_at, __ATOMIC_RELAXED);
+    __atomic_store_n(&renderer->lost_since_keyframe, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&renderer->keyframe_wanted, 0, __ATOMIC_RELEASE);
+    renderer->recoveries++;
+    renderer->recovery_total += recovery;
+    if ( recovery > renderer->recovery_max ) renderer->recovery_max = recovery;
+    return GST_PAD_PROBE_OK;
+}
+
+// A decoder that complains about its input has had it damaged, whatever the sequence says
+static void on_decoder_warning(GstBus * bus, GstMessage * message, gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+    const char *source = GST_MESSAGE_SRC_NAME(message);
+    if ( source && (strcmp(source, "decoder") == 0 || strcmp(source, "parse") == 0) ) {
+        fpv_gstreamer_renderer_want_keyframe(renderer, 0, fpv_telemetry_now());
+    }
+}
+
+// From any thread
+static void fpv_gstreamer_renderer_want_keyframe(FPVGStreamerRenderer * renderer, uint32_t lost, uint64_t now) {
+    __atomic_add_fetch(&renderer->lost_since_keyframe, lost, __ATOMIC_RELAXED);
+    if ( __atomic_load_n(&renderer->keyframe_wanted, __ATOMIC_ACQUIRE) ) return;
+
+    __atomic_store_n(&renderer->keyframe_lost_at, now, __ATOMIC_RELAXED);
+    if ( __atomic_exchange_n(&renderer->keyframe_wanted, 1, __ATOMIC_ACQ_REL) ) return;
+    g_idle_add(on_keyframe_wanted, renderer);
+}
+
+static gboolean on_keyframe_wanted(gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+    renderer->losses++;
+    renderer->keyframe_attempt = 0;
+
+    // While the last loss's timer runs, it sends this request too, so they stay rate limited
+    if ( renderer->keyframe_timer ) return G_SOURCE_REMOVE;
+    fpv_gstreamer_renderer_request_keyframe(renderer);
+    renderer->keyframe_timer = g_timeout_add(KEYFRAME_REQUEST_INTERVAL, on_keyframe_timer, renderer);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean on_keyframe_timer(gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+    if ( !__atomic_load_n(&renderer->keyframe_wanted, __ATOMIC_ACQUIRE) ) {
+        renderer->keyframe_timer = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    // The request or its keyframe was lost, or the sender can't force one yet; ask again
+    fpv_gstreamer_renderer_request_keyframe(renderer);
+    return G_SOURCE_CONTINUE;
+}
+
+static void fpv_gstreamer_renderer_request_keyframe(FPVGStreamerRenderer * renderer) {
+    FPVLinkFeedback feedback;
+    memset(&feedback, 0, sizeof(feedback));
+    feedback.type = LINK_FEEDBACK_TYPE_KEYFRAME_REQUEST;
+    feedback.content.keyframe_request.lost = __atomic_load_n(&renderer->lost_since_keyframe, __ATOMIC_RELAXED);
+    feedback.content.keyframe_request.attempt = renderer->keyframe_attempt++;
+    fpv_gstreamer_renderer_send_feedback(renderer, &feedback);
+    renderer->keyframe_requests_sent++;
+}
+
+// The depayloader picks whichever stream format downstream prefers. Returns its NAL
+// length size, 0 for byte-stream; for avc, SPS and PPS are in the caps' codec_data
+static int fpv_gstreamer_renderer_stream_format(GstPad * pad, int * parameter_sets_in_caps) {
+    int nal_length_size = 0;
+    int in_caps = 0;
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    if ( caps ) {
+        GstStructure *structure = gst_caps_get_structure(caps, 0);
+        const GValue *value = gst_structure_get_value(structure, "codec_data");
+        GstBuffer *codec_data = value && G_VALUE_HOLDS(value, GST_TYPE_BUFFER) ? gst_value_get_buffer(value) : NULL;
+        GstMapInfo map = { 0 };
+        if ( codec_data && !gst_buffer_map(codec_data, &map, GST_MAP_READ) ) codec_data = NULL;
+        nal_length_size = fpv_frame_stamp_nal_length_size(gst_structure_get_string(structure, "stream-format"), map.data, map.size);
+        in_caps = nal_length_size && codec_data;
+        if ( codec_data ) gst_buffer_unmap(codec_data, &map);
+        gst_caps_unref(caps);
+    }
+    if ( parameter_sets_in_caps ) *parameter_sets_in_caps = in_caps;
+    return nal_length_size;
+}
+
+static latency_frame_t * fpv_gstreamer_renderer_find_frame(FPVGStreamerRenderer * renderer, GstClockTime pts) {
+    if ( !GST_CLOCK_TIME_IS_VALID(pts) ) return NULL;
+    int i;
+    for ( i=0; i<LATENCY_FRAMES; i++ ) {
+        if ( renderer->frames[i].pts == pts ) return &renderer->frames[i];
+    }
+    return NULL;
+}
+
+static gboolean on_clock_timer(gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+
+    FPVLinkFeedback feedback;
+    memset(&feedback, 0, sizeof(feedback));
+    feedback.type = LINK_FEEDBACK_TYPE_CLOCK_REQUEST;
+    feedback.content.clock.originate = fpv_telemetry_now();
+    fpv_gstreamer_renderer_send_feedback(renderer, &feedback);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_clock_reply(gint fd, GIOCondition condition, gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+
+    uint8_t buffer[LINK_FEEDBACK_MAX_LENGTH];
+    ssize_t length;
+    while ( (length = recv(fd, buffer, sizeof(buffer), 0)) > 0 ) {
+        uint64_t received = fpv_telemetry_now();
+        FPVLinkFeedback feedback;
+        if ( !fpv_link_feedback_decode(buffer, length, &feedback) || feedback.type != LINK_FEEDBACK_TYPE_CLOCK_REPLY ) continue;
+
+        const FPVLinkFeedbackClock *clock = &feedback.content.clock;
+        pthread_mutex_lock(&renderer->latency_lock);
+        fpv_clock_offset_add(renderer->clock, clock->originate, clock->receive, clock->transmit, received);
+        pthread_mutex_unlock(&renderer->latency_lock);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_latency_timer(gpointer user_data) {
+    FPVGStreamerRenderer *renderer = (FPVGStreamerRenderer*)user_data;
+
+    FPVLatencyStatsSnapshot snapshot;
+    fpv_latency_stats_get(renderer->latency, &snapshot);
+    if ( snapshot.frames[LATENCY_STAGE_DECODE_DISPLAY] ) {
+        char text[128];
+        fpv_latency_stats_format(&snapshot, text, sizeof(text));
+        printf("%s\n", text);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
 static gboolean on_message(GstBus * bus, GstMessage * message, gpointer user_data) {
     GMainLoop *loop = (GMainLoop*)user_data;
 
@@ -20,12 +20,36 @@
 #define __GSTREAMER_RENDERER_H
 
 #include <glib.h>
+#include "latency_stats.h"
 
 typedef struct _FPVGStreamerRenderer FPVGStreamerRenderer;
 
-FPVGStreamerRenderer * fpv_gstreamer_renderer_new(GMainLoop * loop, char * multicast_addr, int port);
+// fec_port receives repair packets for the video (see fec.h); 0 for none
+FPVGStreamerRenderer * fpv_gstreamer_renderer_new(GMainLoop * loop, char * multicast_addr, int port, int fec_port);
 void fpv_gstreamer_renderer_dispose(FPVGStreamerRenderer * renderer);
 
+// Measure loss, jitter and queueing of the incoming RTP stream and report them to the
+// feedback port of the video's sender, so it can adapt its bitrate
+int fpv_gstreamer_renderer_enable_feedback(FPVGStreamerRenderer * renderer, int port);
+
+// Measure each frame's latency, stage by stage, from the stamps the sender puts in the
+// video (see latency_stamper.h), asking the sender's feedback port for its clock to
+// relate its stages to ours. The stats are logged periodically and on dispose
+int fpv_gstreamer_renderer_enable_latency(FPVGStreamerRenderer * renderer, int port);
+
+// Drop video until a keyframe the decoder can start from, on starting and after losing
+// the link (see fast_start.h), and log how long the first frame took each time
+int fpv_gstreamer_renderer_enable_fast_start(FPVGStreamerRenderer * renderer);
+
+// Ask the video's sender for a keyframe, at its feedback port, on joining and whenever
+// video is lost for good (a gap in the RTP sequence after FEC) or the decoder complains,
+// repeating until one arrives, rather than showing damaged frames until the next
+// periodic one
+int fpv_gstreamer_renderer_enable_keyframe_requests(FPVGStreamerRenderer * renderer, int port);
+
+// NULL unless latency measurement is enabled
+FPVLatencyStats * fpv_gstreamer_renderer_get_latency_stats(FPVGStreamerRenderer * renderer);
+
 void fpv_gstreamer_renderer_start(FPVGStreamerRenderer * gstrx);
 void fpv_gstreamer_renderer_stop(FPVGStreamerRenderer * gstrx);
 
@@ -0,0 +1,64 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "h264_nal.h"
+
+#pragma mark - Forward declarations
+
+static size_t find_start_code(const uint8_t * au, size_t from, size_t length);
+
+#pragma mark -
+
+int fpv_h264_next_nal(const uint8_t * au, size_t length, int nal_length_size, size_t * position, FPVH264Nal * nal) {
+    if ( nal_length_size ) {
+        if ( *position + nal_length_size >= length ) return 0;
+        size_t nal_length = 0;
+        int i;
+        for ( i=0; i<nal_length_size; i++ ) nal_length = (nal_length << 8) | au[*position + i];
+        nal->start = *position;
+        nal->header = *position + nal_length_size;
+        nal->end = nal->header + nal_length;
+        if ( nal_length == 0 || nal->end > length ) return 0;
+        *position = nal->end;
+        return 1;
+    }
+
+    size_t start_code = find_start_code(au, *position, length);
+    if ( start_code + 3 >= length ) return 0;
+
+    // Leading zeros belong with the start code; trailing ones with the next
+    nal->start = start_code;
+    while ( nal->start > *position && au[nal->start - 1] == 0 ) nal->start--;
+    nal->header = start_code + 3;
+    nal->end = find_start_code(au, nal->header, length);
+    while ( nal->end > nal->header && au[nal->end - 1] == 0 ) nal->end--;
+    *position = nal->end;
+    return 1;
+}
+
+static size_t find_start_code(const uint8_t * au, size_t from, size_t length) {
+    size_t i;
+    for ( i=from; i+2<length; i++ ) {
+        if ( au[i+2] > 1 ) {
+            i += 2;
+        } else if ( au[i] == 0 && au[i+1] == 0 && au[i+2] == 1 ) {
+            return i;
+        }
+    }
+    return length;
+}
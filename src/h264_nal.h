@@ -0,0 +1,51 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __H264_NAL_H
+#define __H264_NAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Walks the NAL units of an H.264 access unit, either Annex B byte-stream
+ * (nal_length_size 0) or length-prefixed, as in "avc" caps.
+ */
+
+#define H264_NAL_SLICE 1
+#define H264_NAL_IDR 5
+#define H264_NAL_SEI 6
+#define H264_NAL_SPS 7
+#define H264_NAL_PPS 8
+
+#define H264_SEI_RECOVERY_POINT 6
+
+typedef struct {
+    size_t start;       // Start code or length prefix
+    size_t header;      // NAL unit header byte
+    size_t end;
+} FPVH264Nal;
+
+static inline int fpv_h264_nal_type(uint8_t header) {
+    return header & 0x1F;
+}
+
+// Start position at 0; returns 0 once there are no more units
+int fpv_h264_next_nal(const uint8_t * au, size_t length, int nal_length_size, size_t * position, FPVH264Nal * nal);
+
+#endif
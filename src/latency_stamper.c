@@ -0,0 +1,182 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "latency_stamper.h"
+#include "frame_stamp.h"
+#include "latency_stats.h"
+#include "telemetry_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define LATENCY_STAMPER_MAX_SEI_LENGTH 128
+
+struct _FPVLatencyStamper {
+    GstElement *pipeline;
+    GstPad *pad;
+    gulong probe;
+    FPVRTPSender *sender;
+    FPVLatencyStats *stats;
+
+    // Streaming thread only
+    int nal_length_size;
+    GstSegment segment;
+    uint64_t last_encoded;      // 0 before the first frame
+    uint64_t frames;
+    uint64_t unstamped;         // No slice to put the stamp ahead of
+};
+
+#pragma mark - Forward declarations
+
+static GstPadProbeReturn on_payloader_data(GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static void fpv_latency_stamper_set_caps(FPVLatencyStamper * stamper, GstCaps * caps);
+static uint64_t fpv_latency_stamper_capture_time(FPVLatencyStamper * stamper, GstBuffer * buffer, uint64_t now);
+static GstBuffer * fpv_latency_stamper_stamp(FPVLatencyStamper * stamper, GstBuffer * buffer, const FPVFrameStamp * stamp);
+
+#pragma mark -
+
+FPVLatencyStamper * fpv_latency_stamper_new(GstPipeline * pipeline, FPVRTPSender * sender) {
+    GstElement *payloader = gst_bin_get_by_name(GST_BIN(pipeline), "pay");
+    if ( !payloader ) {
+        fprintf(stderr, "No payloader named 'pay' in the video pipeline\n");
+        return NULL;
+    }
+
+    FPVLatencyStamper *stamper = (FPVLatencyStamper*)calloc(1, sizeof(FPVLatencyStamper));
+    stamper->pipeline = gst_object_ref(GST_ELEMENT(pipeline));
+    stamper->sender = sender;
+    stamper->stats = fpv_latency_stats_new();
+    gst_segment_init(&stamper->segment, GST_FORMAT_TIME);
+
+    stamper->pad = gst_element_get_static_pad(payloader, "sink");
+    stamper->probe = gst_pad_add_probe(stamper->pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                                       on_payloader_data, stamper, NULL);
+    gst_object_unref(payloader);
+
+    printf("Stamping video frames for latency measurement\n");
+    return stamper;
+}
+
+void fpv_latency_stamper_dispose(FPVLatencyStamper * stamper) {
+    gst_pad_remove_probe(stamper->pad, stamper->probe);
+    gst_object_unref(stamper->pad);
+    gst_object_unref(stamper->pipeline);
+
+    printf("Latency stamps: %llu frames, %llu without a slice to stamp\n",
+        (unsigned long long)stamper->frames, (unsigned long long)stamper->unstamped);
+    fpv_latency_stats_print(stamper->stats, stdout);
+    fpv_latency_stats_dispose(stamper->stats);
+    free(stamper);
+}
+
+static GstPadProbeReturn on_payloader_data(GstPad * pad, GstPadProbeInfo * info, gpointer user_data) {
+    FPVLatencyStamper *stamper = (FPVLatencyStamper*)user_data;
+
+    if ( info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM ) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if ( GST_EVENT_TYPE(event) == GST_EVENT_CAPS ) {
+            GstCaps *caps;
+            gst_event_parse_caps(event, &caps);
+            fpv_latency_stamper_set_caps(stamper, caps);
+        } else if ( GST_EVENT_TYPE(event) == GST_EVENT_SEGMENT ) {
+            gst_event_copy_segment(event, &stamper->segment);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    uint64_t now = fpv_telemetry_now();
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    FPVFrameStamp stamp;
+    stamp.captured = fpv_latency_stamper_capture_time(stamper, buffer, now);
+    stamp.encoded = now;
+    stamp.send_delay = FRAME_STAMP_UNKNOWN;
+
+    // The sender finished the last frame in this thread before this one got here
+    FPVRTPSenderStats sender_stats;
+    fpv_rtp_sender_get_stats(stamper->sender, &sender_stats);
+    if ( stamper->last_encoded && sender_stats.last_sent >= stamper->last_encoded ) {
+        stamp.send_delay = sender_stats.last_sent - stamper->last_encoded;
+    }
+
+    GstBuffer *stamped = fpv_latency_stamper_stamp(stamper, buffer, &stamp);
+    if ( !stamped ) {
+        stamper->unstamped++;
+        return GST_PAD_PROBE_OK;
+    }
+    GST_PAD_PROBE_INFO_DATA(info) = stamped;
+    gst_buffer_unref(buffer);
+
+    int64_t durations[LATENCY_STAGE_COUNT];
+    int stage;
+    for ( stage=0; stage<LATENCY_STAGE_COUNT; stage++ ) durations[stage] = LATENCY_UNMEASURED;
+    if ( stamp.captured ) durations[LATENCY_STAGE_CAPTURE_ENCODE] = stamp.encoded - stamp.captured;
+    if ( stamp.send_delay != FRAME_STAMP_UNKNOWN ) durations[LATENCY_STAGE_ENCODE_SEND] = stamp.send_delay;
+    fpv_latency_stats_add(stamper->stats, durations, now);
+
+    stamper->last_encoded = now;
+    stamper->frames++;
+    return GST_PAD_PROBE_OK;
+}
+
+static void fpv_latency_stamper_set_caps(FPVLatencyStamper * stamper, GstCaps * caps) {
+    GstStructure *structure = gst_caps_get_structure(caps, 0);
+    const GValue *value = gst_structure_get_value(structure, "codec_data");
+    GstMapInfo map = { 0 };
+    GstBuffer *codec_data = value && G_VALUE_HOLDS(value, GST_TYPE_BUFFER) ? gst_value_get_buffer(value) : NULL;
+    if ( codec_data && !gst_buffer_map(codec_data, &map, GST_MAP_READ) ) codec_data = NULL;
+
+    stamper->nal_length_size = fpv_frame_stamp_nal_length_size(gst_structure_get_string(structure, "stream-format"),
+                                                               map.data, map.size);
+    if ( codec_data ) gst_buffer_unmap(codec_data, &map);
+}
+
+static uint64_t fpv_latency_stamper_capture_time(FPVLatencyStamper * stamper, GstBuffer * buffer, uint64_t now) {
+    GstClockTime running = gst_segment_to_running_time(&stamper->segment, GST_FORMAT_TIME, GST_BUFFER_PTS(buffer));
+    GstClock *clock = gst_element_get_clock(stamper->pipeline);
+    if ( !GST_CLOCK_TIME_IS_VALID(running) || !clock ) {
+        if ( clock ) gst_object_unref(clock);
+        return 0;
+    }
+
+    // The pipeline clock needn't be ours; carry the frame's age on it over to our clock
+    GstClockTime captured = gst_element_get_base_time(stamper->pipeline) + running;
+    GstClockTime clock_now = gst_clock_get_time(clock);
+    gst_object_unref(clock);
+    uint64_t age = clock_now > captured ? (clock_now - captured) / 1000 : 0;
+    return age < now ? now - age : 0;
+}
+
+static GstBuffer * fpv_latency_stamper_stamp(FPVLatencyStamper * stamper, GstBuffer * buffer, const FPVFrameStamp * stamp) {
+    GstMapInfo map;
+    if ( !gst_buffer_map(buffer, &map, GST_MAP_READ) ) return NULL;
+    int offset = fpv_frame_stamp_insert_offset(map.data, map.size, stamper->nal_length_size);
+    gst_buffer_unmap(buffer, &map);
+    if ( offset < 0 ) return NULL;
+
+    uint8_t *sei = (uint8_t*)g_malloc(LATENCY_STAMPER_MAX_SEI_LENGTH);
+    int length = fpv_frame_stamp_encode(stamp, stamper->nal_length_size, sei, LATENCY_STAMPER_MAX_SEI_LENGTH);
+
+    // Share the encoder's memory either side of the SEI rather than copying the frame
+    GstBuffer *stamped = gst_buffer_new();
+    gst_buffer_copy_into(stamped, buffer, GST_BUFFER_COPY_METADATA, 0, -1);
+    if ( offset > 0 ) gst_buffer_copy_into(stamped, buffer, GST_BUFFER_COPY_MEMORY, 0, offset);
+    gst_buffer_append_memory(stamped, gst_memory_new_wrapped(0, sei, LATENCY_STAMPER_MAX_SEI_LENGTH, 0, length, sei, g_free));
+    gst_buffer_copy_into(stamped, buffer, GST_BUFFER_COPY_MEMORY, offset, -1);
+    return stamped;
+}
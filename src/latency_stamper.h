@@ -0,0 +1,41 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LATENCY_STAMPER_H
+#define __LATENCY_STAMPER_H
+
+#include <gst/gst.h>
+#include "rtp_sender.h"
+
+/*
+ * Stamps each frame of the outgoing video with when it was captured and when the
+ * encoder finished it (see frame_stamp.h), so the ground station can measure latency
+ * from glass to glass. Probes the sink pad of the payloader, which must be named "pay".
+ * Capture time is the frame's timestamp, so sources should be live and timestamp their
+ * frames as they're captured, as v4l2src does. How long each frame took to send comes
+ * from the RTP sender, and rides along in the next frame's stamp.
+ */
+
+typedef struct _FPVLatencyStamper FPVLatencyStamper;
+
+FPVLatencyStamper * fpv_latency_stamper_new(GstPipeline * pipeline, FPVRTPSender * sender);
+
+// Only once the pipeline has stopped; logs the sender's stages
+void fpv_latency_stamper_dispose(FPVLatencyStamper * stamper);
+
+#endif
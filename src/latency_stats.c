@@ -0,0 +1,188 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "latency_stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define LATENCY_BUCKETS 96  // Four per power of two, up to 2^24 us
+
+static const uint64_t LATENCY_EPOCH = 5000000;  // Percentiles cover the last one or two of these
+
+static const char * LATENCY_STAGE_NAMES[LATENCY_STAGE_COUNT] = {
+    "capture-encode", "encode-send", "network", "receive-decode", "decode-display", "glass-to-glass"
+};
+
+// Everything a reader sees, published under the seqlock
+typedef struct {
+    uint64_t frames[LATENCY_STAGE_COUNT];
+    uint32_t recent[2][LATENCY_STAGE_COUNT][LATENCY_BUCKETS];
+} FPVLatencyStatsCounters;
+
+struct _FPVLatencyStats {
+    // Seqlock over counters: odd while the feeding thread is writing
+    unsigned int seq;
+    FPVLatencyStatsCounters counters;
+
+    // Feeding thread only, until the feeding stops
+    uint64_t totals[LATENCY_STAGE_COUNT][LATENCY_BUCKETS];
+    int epoch;
+    uint64_t epoch_start;
+};
+
+#pragma mark - Forward declarations
+
+static int fpv_latency_stats_bucket(int64_t duration);
+static double fpv_latency_stats_bucket_top(int bucket);
+static void fpv_latency_stats_percentiles(const uint64_t * buckets, const double * percentiles, double * durations, int count);
+
+#pragma mark -
+
+FPVLatencyStats * fpv_latency_stats_new() {
+    return (FPVLatencyStats*)calloc(1, sizeof(FPVLatencyStats));
+}
+
+void fpv_latency_stats_dispose(FPVLatencyStats * stats) {
+    free(stats);
+}
+
+void fpv_latency_stats_add(FPVLatencyStats * stats, const int64_t * durations, uint64_t now) {
+    __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    FPVLatencyStatsCounters *counters = &stats->counters;
+    if ( !stats->epoch_start ) {
+        stats->epoch_start = now;
+    } else if ( now - stats->epoch_start >= LATENCY_EPOCH ) {
+        stats->epoch ^= 1;
+        stats->epoch_start = now;
+        memset(counters->recent[stats->epoch], 0, sizeof(counters->recent[stats->epoch]));
+    }
+
+    int stage;
+    for ( stage=0; stage<LATENCY_STAGE_COUNT; stage++ ) {
+        if ( durations[stage] == LATENCY_UNMEASURED ) continue;
+        int bucket = fpv_latency_stats_bucket(durations[stage]);
+        counters->frames[stage]++;
+        counters->recent[stats->epoch][stage][bucket]++;
+        stats->totals[stage][bucket]++;
+    }
+
+    __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELEASE);
+}
+
+void fpv_latency_stats_get(FPVLatencyStats * stats, FPVLatencyStatsSnapshot * snapshot) {
+    FPVLatencyStatsCounters counters;
+    unsigned int before, after;
+    do {
+        before = __atomic_load_n(&stats->seq, __ATOMIC_ACQUIRE);
+        if ( before & 1 ) continue;
+        counters = stats->counters;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&stats->seq, __ATOMIC_RELAXED);
+    } while ( (before & 1) || before != after );
+
+    const double percentiles[3] = { 0.50, 0.95, 0.99 };
+    int stage, i;
+    for ( stage=0; stage<LATENCY_STAGE_COUNT; stage++ ) {
+        uint64_t buckets[LATENCY_BUCKETS];
+        for ( i=0; i<LATENCY_BUCKETS; i++ ) {
+            buckets[i] = counters.recent[0][stage][i] + counters.recent[1][stage][i];
+        }
+        double durations[3];
+        fpv_latency_stats_percentiles(buckets, percentiles, durations, 3);
+        snapshot->frames[stage] = counters.frames[stage];
+        snapshot->p50[stage] = durations[0];
+        snapshot->p95[stage] = durations[1];
+        snapshot->p99[stage] = durations[2];
+    }
+}
+
+int fpv_latency_stats_format(const FPVLatencyStatsSnapshot * snapshot, char * text, size_t length) {
+    static const char * labels[LATENCY_STAGE_TOTAL] = { "enc", "send", "net", "dec", "disp" };
+
+    size_t written = 0;
+    if ( snapshot->frames[LATENCY_STAGE_TOTAL] ) {
+        written = snprintf(text, length, "Latency %.0f/%.0f ms:", snapshot->p50[LATENCY_STAGE_TOTAL], snapshot->p95[LATENCY_STAGE_TOTAL]);
+    } else {
+        written = snprintf(text, length, "Latency -:");
+    }
+
+    int stage;
+    for ( stage=0; stage<LATENCY_STAGE_TOTAL && written<length; stage++ ) {
+        if ( snapshot->frames[stage] ) {
+            written += snprintf(text + written, length - written, " %s %.0f", labels[stage], snapshot->p50[stage]);
+        } else {
+            written += snprintf(text + written, length - written, " %s -", labels[stage]);
+        }
+    }
+    return written;
+}
+
+void fpv_latency_stats_print(FPVLatencyStats * stats, FILE * file) {
+    const double percentiles[3] = { 0.50, 0.95, 0.99 };
+    int stage, i;
+    for ( stage=0; stage<LATENCY_STAGE_COUNT; stage++ ) {
+        uint64_t count = 0;
+        for ( i=0; i<LATENCY_BUCKETS; i++ ) count += stats->totals[stage][i];
+        if ( !count ) continue;
+
+        double durations[3];
+        fpv_latency_stats_percentiles(stats->totals[stage], percentiles, durations, 3);
+        fprintf(file, "Latency %s: %llu frames, p50 %.1f ms, p95 %.1f ms, p99 %.1f ms\n", LATENCY_STAGE_NAMES[stage],
+            (unsigned long long)count, durations[0], durations[1], durations[2]);
+
+        // Each bucket as its upper bound in milliseconds and its share of frames
+        fprintf(file, " ");
+        for ( i=0; i<LATENCY_BUCKETS; i++ ) {
+            if ( !stats->totals[stage][i] ) continue;
+            fprintf(file, " <%.4g:%.1f%%", fpv_latency_stats_bucket_top(i), 100.0 * stats->totals[stage][i] / count);
+        }
+        fprintf(file, "\n");
+    }
+}
+
+const char * fpv_latency_stats_stage_name(int stage) {
+    return stage >= 0 && stage < LATENCY_STAGE_COUNT ? LATENCY_STAGE_NAMES[stage] : NULL;
+}
+
+static int fpv_latency_stats_bucket(int64_t duration) {
+    if ( duration < 4 ) return duration > 0 ? (int)duration : 0;
+    int msb = 63 - __builtin_clzll((uint64_t)duration);
+    int bucket = msb * 4 + (int)((duration >> (msb - 2)) & 3);
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+static double fpv_latency_stats_bucket_top(int bucket) {
+    return bucket < 4 ? (bucket + 1) / 1000.0 : (double)((uint64_t)(4 + (bucket & 3) + 1) << (bucket / 4 - 2)) / 1000.0;
+}
+
+static void fpv_latency_stats_percentiles(const uint64_t * buckets, const double * percentiles, double * durations, int count) {
+    uint64_t total = 0, seen = 0;
+    int i, p = 0;
+    for ( i=0; i<LATENCY_BUCKETS; i++ ) total += buckets[i];
+
+    // Report the top of the bucket each percentile falls in, in milliseconds; percentiles ascend
+    for ( i=0; i<LATENCY_BUCKETS && p<count; i++ ) {
+        seen += buckets[i];
+        while ( p < count && total && seen > (uint64_t)(percentiles[p] * total) ) {
+            durations[p++] = fpv_latency_stats_bucket_top(i);
+        }
+    }
+    while ( p < count ) durations[p++] = 0;
+}
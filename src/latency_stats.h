@@ -0,0 +1,73 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LATENCY_STATS_H
+#define __LATENCY_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define LATENCY_UNMEASURED (-1)
+
+/*
+ * Histograms of where a video frame's time goes between the camera and the screen,
+ * one per stage, with buckets four to a power of two from a microsecond to 16 s.
+ * Percentiles cover the last one or two 5 s epochs, so they follow the link as it
+ * changes; the full histograms are kept for the log. Stages that need the sender's
+ * clock related to the receiver's (see clock_offset.h) go unmeasured until it is.
+ * One thread feeds the stats; any thread can read them without locking.
+ */
+
+enum {
+    LATENCY_STAGE_CAPTURE_ENCODE,   // Sender: captured to encoded
+    LATENCY_STAGE_ENCODE_SEND,      // Sender: encoded to last packet sent
+    LATENCY_STAGE_NETWORK,          // Sent to received, across both clocks
+    LATENCY_STAGE_RECEIVE_DECODE,   // Receiver: whole frame received to decoded
+    LATENCY_STAGE_DECODE_DISPLAY,   // Receiver: decoded to handed to the display
+    LATENCY_STAGE_TOTAL,            // Glass to glass: captured to displayed
+    LATENCY_STAGE_COUNT
+};
+
+typedef struct {
+    uint64_t frames[LATENCY_STAGE_COUNT];   // Measurements to date, per stage
+    double p50[LATENCY_STAGE_COUNT];        // Milliseconds, recent
+    double p95[LATENCY_STAGE_COUNT];
+    double p99[LATENCY_STAGE_COUNT];
+} FPVLatencyStatsSnapshot;
+
+typedef struct _FPVLatencyStats FPVLatencyStats;
+
+FPVLatencyStats * fpv_latency_stats_new();
+void fpv_latency_stats_dispose(FPVLatencyStats * stats);
+
+// Feeding thread only. One duration per stage in microseconds, LATENCY_UNMEASURED for
+// stages this frame says nothing about; now is monotonic microseconds
+void fpv_latency_stats_add(FPVLatencyStats * stats, const int64_t * durations, uint64_t now);
+
+void fpv_latency_stats_get(FPVLatencyStats * stats, FPVLatencyStatsSnapshot * snapshot);
+
+// One line for a display, e.g. "Latency 92/110 ms: enc 21 send 4 net 6 dec 24 disp 17"
+int fpv_latency_stats_format(const FPVLatencyStatsSnapshot * snapshot, char * text, size_t length);
+
+// Once feeding has stopped: percentiles and the full histogram of each measured stage
+void fpv_latency_stats_print(FPVLatencyStats * stats, FILE * file);
+
+const char * fpv_latency_stats_stage_name(int stage);
+
+#endif
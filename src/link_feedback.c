@@ -0,0 +1,161 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "link_feedback.h"
+#include <string.h>
+
+#define LINK_FEEDBACK_HEADER_LENGTH 6
+
+static const int LINK_FEEDBACK_REPORT_LENGTH = 24;
+static const int LINK_FEEDBACK_CLOCK_LENGTH = 24;
+static const int LINK_FEEDBACK_KEYFRAME_REQUEST_LENGTH = 8;
+
+static inline void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline void put_le64(uint8_t *p, uint64_t v) {
+    put_le32(p, (uint32_t)v);
+    put_le32(p+4, (uint32_t)(v >> 32));
+}
+
+static inline uint16_t get_le16(const uint8_t *p) {
+    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+static inline uint32_t get_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t get_le64(const uint8_t *p) {
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p+4) << 32);
+}
+
+int fpv_link_feedback_encode(const FPVLinkFeedback * feedback, uint8_t * buffer, int length) {
+    if ( length < LINK_FEEDBACK_MAX_LENGTH ) return 0;
+
+    buffer[0] = LINK_FEEDBACK_MAGIC;
+    buffer[1] = LINK_FEEDBACK_VERSION;
+    buffer[2] = feedback->type;
+    buffer[3] = 0;
+    put_le16(buffer+4, feedback->sequence);
+    uint8_t *p = buffer + LINK_FEEDBACK_HEADER_LENGTH;
+
+    switch ( feedback->type ) {
+        case LINK_FEEDBACK_TYPE_REPORT: {
+            const FPVLinkFeedbackReport *report = &feedback->content.report;
+            put_le32(p, report->interval);
+            put_le32(p+4, report->expected);
+            put_le32(p+8, report->received);
+            put_le32(p+12, report->bytes);
+            put_le32(p+16, report->jitter);
+            put_le32(p+20, report->age_p95);
+            return LINK_FEEDBACK_HEADER_LENGTH + LINK_FEEDBACK_REPORT_LENGTH;
+        }
+        case LINK_FEEDBACK_TYPE_CLOCK_REQUEST:
+        case LINK_FEEDBACK_TYPE_CLOCK_REPLY: {
+            const FPVLinkFeedbackClock *clock = &feedback->content.clock;
+            put_le64(p, clock->originate);
+            put_le64(p+8, clock->receive);
+            put_le64(p+16, clock->transmit);
+            return LINK_FEEDBACK_HEADER_LENGTH + LINK_FEEDBACK_CLOCK_LENGTH;
+        }
+        case LINK_FEEDBACK_TYPE_KEYFRAME_REQUEST: {
+            const FPVLinkFeedbackKeyframeRequest *request = &feedback->content.keyframe_request;
+            put_le32(p, request->lost);
+            put_le32(p+4, request->attempt);
+            return LINK_FEEDBACK_HEADER_LENGTH + LINK_FEEDBACK_KEYFRAME_REQUEST_LENGTH;
+        }
+        default:
+            return 0;
+    }
+}
+
+int fpv_link_feedback_decode(const uint8_t * buffer, int length, FPVLinkFeedback * feedback) {
+    if ( length < LINK_FEEDBACK_HEADER_LENGTH || buffer[0] != LINK_FEEDBACK_MAGIC || buffer[1] != LINK_FEEDBACK_VERSION ) return 0;
+
+    memset(feedback, 0, sizeof(*feedback));
+    feedback->type = buffer[2];
+    feedback->sequence = get_le16(buffer+4);
+    const uint8_t *p = buffer + LINK_FEEDBACK_HEADER_LENGTH;
+    length -= LINK_FEEDBACK_HEADER_LENGTH;
+
+    switch ( feedback->type ) {
+        case LINK_FEEDBACK_TYPE_REPORT: {
+            if ( length < LINK_FEEDBACK_REPORT_LENGTH ) return 0;
+            FPVLinkFeedbackReport *report = &feedback->content.report;
+            report->interval = get_le32(p);
+            report->expected = get_le32(p+4);
+            report->received = get_le32(p+8);
+            report->bytes = get_le32(p+12);
+            report->jitter = get_le32(p+16);
+            report->age_p95 = get_le32(p+20);
+            return 1;
+        }
+        case LINK_FEEDBACK_TYPE_CLOCK_REQUEST:
+        case LINK_FEEDBACK_TYPE_CLOCK_REPLY: {
+            if ( length < LINK_FEEDBACK_CLOCK_LENGTH ) return 0;
+            FPVLinkFeedbackClock *clock = &feedback->content.clock;
+            clock->originate = get_le64(p);
+            clock->receive = get_le64(p+8);
+            clock->transmit = get_le64(p+16);
+            return 1;
+        }
+        case LINK_FEEDBACK_TYPE_KEYFRAME_REQUEST: {
+            if ( length < LINK_FEEDBACK_KEYFRAME_REQUEST_LENGTH ) return 0;
+            FPVLinkFeedbackKeyframeRequest *request = &feedback->content.keyframe_request;
+            request->lost = get_le32(p);
+            request->attempt = get_le32(p+4);
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+int fpv_link_feedback_senders_accept(FPVLinkFeedbackSenders * senders, uint32_t address, uint16_t port, uint16_t sequence, uint64_t now) {
+    FPVLinkFeedbackSender *sender = NULL, *oldest = NULL;
+    int i;
+    for ( i=0; i<LINK_FEEDBACK_MAX_SENDERS && !sender; i++ ) {
+        FPVLinkFeedbackSender *candidate = &senders->senders[i];
+        if ( candidate->last_feedback && candidate->address == address && candidate->port == port ) sender = candidate;
+        else if ( !oldest || candidate->last_feedback < oldest->last_feedback ) oldest = candidate;
+    }
+
+    if ( sender && now - sender->last_feedback < LINK_FEEDBACK_SEQUENCE_RESET
+            && (int16_t)(sequence - sender->last_sequence) <= 0 ) {
+        return -1;
+    }
+
+    if ( !sender ) {
+        sender = oldest;
+        sender->address = address;
+        sender->port = port;
+    }
+    sender->last_sequence = sequence;
+    sender->last_feedback = now;
+    return sender - senders->senders;
+}
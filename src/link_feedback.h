@@ -0,0 +1,106 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LINK_FEEDBACK_H
+#define __LINK_FEEDBACK_H
+
+#include <stdint.h>
+
+/*
+ * Ground station to vehicle feedback, sent as small UDP datagrams to the feedback port
+ * of whichever host the video is coming from. Reports describe how the video stream
+ * arrived over the last interval, so the sender can fit its bitrate to the link. Clock
+ * requests are answered straight back to the requesting socket with a clock reply,
+ * NTP-style, so the ground station can relate the vehicle's clock to its own. Keyframe
+ * requests ask for an IDR frame after losing video the decoder can't do without, like
+ * an RTCP picture loss indication; the ground station repeats them until one arrives.
+ *
+ * Wire format, little-endian:
+ *   uint8 magic, uint8 version, uint8 type, uint8 reserved, uint16 sequence,
+ *   then the body for the type
+ */
+
+#define LINK_FEEDBACK_MAGIC 0xF6
+#define LINK_FEEDBACK_VERSION 1
+#define LINK_FEEDBACK_MAX_LENGTH 64
+
+enum {
+    LINK_FEEDBACK_TYPE_REPORT = 1,
+    LINK_FEEDBACK_TYPE_CLOCK_REQUEST,
+    LINK_FEEDBACK_TYPE_CLOCK_REPLY,
+    LINK_FEEDBACK_TYPE_KEYFRAME_REQUEST,
+    LINK_FEEDBACK_TYPE_COUNT
+};
+
+typedef struct {
+    uint32_t interval;      // Microseconds covered by the report
+    uint32_t expected;      // RTP sequence numbers spanned during the interval
+    uint32_t received;      // Distinct RTP packets received during the interval
+    uint32_t bytes;         // RTP bytes received during the interval
+    uint32_t jitter;        // RFC 3550 interarrival jitter, microseconds
+    uint32_t age_p95;       // 95th percentile queueing delay, microseconds
+} FPVLinkFeedbackReport;
+
+// Monotonic microseconds. A request fills in originate; its reply echoes it and adds
+// the responder's clock as the request arrived and as the reply left
+typedef struct {
+    uint64_t originate;
+    uint64_t receive;
+    uint64_t transmit;
+} FPVLinkFeedbackClock;
+
+typedef struct {
+    uint32_t lost;          // RTP packets lost since the last keyframe, for the log
+    uint32_t attempt;       // 0 for the first request after a loss, counting up as it's repeated
+} FPVLinkFeedbackKeyframeRequest;
+
+typedef struct {
+    uint8_t type;
+    uint16_t sequence;
+    union {
+        FPVLinkFeedbackReport report;
+        FPVLinkFeedbackClock clock;
+        FPVLinkFeedbackKeyframeRequest keyframe_request;
+    } content;
+} FPVLinkFeedback;
+
+// Returns the encoded length, or 0 if the buffer is too small or the type unknown
+int fpv_link_feedback_encode(const FPVLinkFeedback * feedback, uint8_t * buffer, int length);
+int fpv_link_feedback_decode(const uint8_t * buffer, int length, FPVLinkFeedback * feedback);
+
+// Every ground station numbers its feedback from 0, so order is kept per sender: each
+// address and port gets a slot, the longest silent giving way when they're all taken
+#define LINK_FEEDBACK_MAX_SENDERS 8
+#define LINK_FEEDBACK_SEQUENCE_RESET 2000000    // Microseconds of silence after which a sender starts afresh, as on a restart
+
+typedef struct {
+    uint32_t address;       // Network byte order, as is port
+    uint16_t port;
+    uint16_t last_sequence;
+    uint64_t last_feedback; // Monotonic microseconds; 0 for a free slot
+} FPVLinkFeedbackSender;
+
+typedef struct {
+    FPVLinkFeedbackSender senders[LINK_FEEDBACK_MAX_SENDERS];
+} FPVLinkFeedbackSenders;
+
+// The sender's slot, from 0 to LINK_FEEDBACK_MAX_SENDERS - 1, or -1 if the feedback is no
+// newer than the last accepted from the same sender
+int fpv_link_feedback_senders_accept(FPVLinkFeedbackSenders * senders, uint32_t address, uint16_t port, uint16_t sequence, uint64_t now);
+
+#endif
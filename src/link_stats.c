@@ -0,0 +1,266 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "link_stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define AGE_BUCKETS 96  // Four per power of two, up to 2^24 us
+#define WINDOW_WORDS (LINK_STATS_WINDOW / 64)
+
+static const uint64_t AGE_EPOCH = 5000000;      // Age percentiles and the delay baseline cover the last one or two of these
+static const int32_t MAX_SEQUENCE_JUMP = 4096;  // Further than this either way and the sender has restarted
+
+// Everything a reader sees, published under the seqlock
+typedef struct {
+    uint64_t received;
+    uint64_t expected;
+    uint64_t lost;
+    uint64_t duplicates;
+    uint64_t reordered;
+    uint32_t window_expected;
+    uint32_t window_received;
+    double jitter;              // Microseconds
+    uint32_t ages[2][AGE_BUCKETS];
+} FPVLinkStatsCounters;
+
+struct _FPVLinkStats {
+    // Seqlock over counters: odd while the feeding thread is writing
+    unsigned int seq;
+    FPVLinkStatsCounters counters;
+
+    // Feeding thread only
+    int started;
+    uint32_t highest;           // Highest sequence number seen, extended past 16 bits
+    uint64_t window[WINDOW_WORDS];  // Bit per sequence number in (highest - LINK_STATS_WINDOW, highest]
+    int has_transit;
+    int64_t last_sent;          // Sender timestamp, extended past 32 bits
+    int64_t last_transit;
+    int64_t min_transit[2];
+    int epoch;
+    uint64_t epoch_start;
+};
+
+#pragma mark - Forward declarations
+
+static void fpv_link_stats_add_sequence(FPVLinkStats * stats, uint16_t sequence);
+static void fpv_link_stats_add_timing(FPVLinkStats * stats, uint32_t sent, uint64_t received);
+static int fpv_link_stats_age_bucket(int64_t age);
+static void fpv_link_stats_age_percentiles(const FPVLinkStatsCounters * counters, const double * percentiles, double * ages, int count);
+
+#pragma mark -
+
+static inline int window_test(const FPVLinkStats * stats, uint32_t sequence) {
+    uint32_t bit = sequence % LINK_STATS_WINDOW;
+    return (stats->window[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void window_set(FPVLinkStats * stats, uint32_t sequence) {
+    uint32_t bit = sequence % LINK_STATS_WINDOW;
+    stats->window[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static inline void window_clear(FPVLinkStats * stats, uint32_t sequence) {
+    uint32_t bit = sequence % LINK_STATS_WINDOW;
+    stats->window[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+FPVLinkStats * fpv_link_stats_new() {
+    FPVLinkStats * stats = (FPVLinkStats*)calloc(1, sizeof(FPVLinkStats));
+    fpv_link_stats_reset(stats);
+    return stats;
+}
+
+void fpv_link_stats_dispose(FPVLinkStats * stats) {
+    free(stats);
+}
+
+void fpv_link_stats_reset(FPVLinkStats * stats) {
+    __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memset(&stats->counters, 0, sizeof(stats->counters));
+    __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELEASE);
+
+    stats->started = 0;
+    stats->has_transit = 0;
+    memset(stats->window, 0, sizeof(stats->window));
+    stats->min_transit[0] = stats->min_transit[1] = INT64_MAX;
+    stats->epoch = 0;
+    stats->epoch_start = 0;
+}
+
+void fpv_link_stats_add(FPVLinkStats * stats, uint16_t sequence, uint32_t sent, uint64_t received) {
+    // Only one thread feeds the stats, so a plain increment is enough on the writer side
+    __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    stats->counters.received++;
+    fpv_link_stats_add_sequence(stats, sequence);
+    if ( sent ) fpv_link_stats_add_timing(stats, sent, received);
+
+    __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELEASE);
+}
+
+void fpv_link_stats_get(FPVLinkStats * stats, FPVLinkStatsSnapshot * snapshot) {
+    FPVLinkStatsCounters counters;
+    unsigned int before, after;
+    do {
+        before = __atomic_load_n(&stats->seq, __ATOMIC_ACQUIRE);
+        if ( before & 1 ) continue;
+        counters = stats->counters;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&stats->seq, __ATOMIC_RELAXED);
+    } while ( (before & 1) || before != after );
+
+    snapshot->received = counters.received;
+    snapshot->expected = counters.expected;
+    snapshot->lost = counters.lost;
+    snapshot->duplicates = counters.duplicates;
+    snapshot->reordered = counters.reordered;
+    snapshot->loss = counters.window_expected
+        ? 100.0 * (counters.window_expected - counters.window_received) / counters.window_expected : 0;
+    snapshot->jitter = counters.jitter / 1000.0;
+
+    const double percentiles[3] = { 0.50, 0.95, 0.99 };
+    double ages[3];
+    fpv_link_stats_age_percentiles(&counters, percentiles, ages, 3);
+    snapshot->age_p50 = ages[0];
+    snapshot->age_p95 = ages[1];
+    snapshot->age_p99 = ages[2];
+}
+
+int fpv_link_stats_format(const FPVLinkStatsSnapshot * snapshot, char * text, size_t length) {
+    return snprintf(text, length, "Loss %.1f%% Jitter %.0f ms Age %.0f/%.0f ms",
+        snapshot->loss, snapshot->jitter, snapshot->age_p50, snapshot->age_p95);
+}
+
+static void fpv_link_stats_add_sequence(FPVLinkStats * stats, uint16_t sequence) {
+    FPVLinkStatsCounters *counters = &stats->counters;
+    int32_t delta = (int16_t)(sequence - (uint16_t)stats->highest);
+
+    if ( stats->started && (delta > MAX_SEQUENCE_JUMP || delta < -MAX_SEQUENCE_JUMP) ) {
+        // Sender restarted: begin a new window, keeping the running totals
+        memset(stats->window, 0, sizeof(stats->window));
+        counters->window_expected = counters->window_received = 0;
+        stats->started = 0;
+    }
+
+    if ( !stats->started ) {
+        stats->started = 1;
+        stats->highest = sequence;
+        counters->expected++;
+        window_set(stats, sequence);
+        counters->window_expected = counters->window_received = 1;
+        return;
+    }
+
+    if ( delta > 0 ) {
+        // Slide the window forward; anything that falls out of it unreceived is lost
+        uint32_t next = stats->highest + delta;
+        counters->expected += delta;
+        uint32_t s;
+        for ( s=stats->highest+1; s!=next+1; s++ ) {
+            if ( counters->window_expected == LINK_STATS_WINDOW ) {
+                if ( window_test(stats, s) ) {
+                    counters->window_received--;
+                } else {
+                    counters->lost++;
+                }
+            } else {
+                counters->window_expected++;
+            }
+            window_clear(stats, s);
+        }
+        window_set(stats, next);
+        counters->window_received++;
+        stats->highest = next;
+        return;
+    }
+
+    uint32_t extended = stats->highest + delta;
+    if ( delta == 0 || (-delta < (int32_t)counters->window_expected && window_test(stats, extended)) ) {
+        counters->duplicates++;
+        return;
+    }
+
+    counters->reordered++;
+    if ( -delta < (int32_t)counters->window_expected ) {
+        window_set(stats, extended);
+        counters->window_received++;
+    }
+}
+
+static void fpv_link_stats_add_timing(FPVLinkStats * stats, uint32_t sent, uint64_t received) {
+    FPVLinkStatsCounters *counters = &stats->counters;
+
+    // Sender timestamps wrap every 71 minutes; carry them on past 32 bits
+    int64_t sent_extended = stats->has_transit ? stats->last_sent + (int32_t)(sent - (uint32_t)stats->last_sent) : sent;
+    int64_t transit = (int64_t)received - sent_extended;
+
+    if ( stats->has_transit ) {
+        // RFC 3550 section 6.4.1: J += (|D| - J) / 16
+        int64_t d = transit - stats->last_transit;
+        if ( d < 0 ) d = -d;
+        counters->jitter += (d - counters->jitter) / 16.0;
+    }
+    stats->has_transit = 1;
+    stats->last_sent = sent_extended;
+    stats->last_transit = transit;
+
+    // Age is delay over the quickest packet of the last epoch or two, which keeps the
+    // baseline honest as the two clocks drift apart
+    if ( !stats->epoch_start ) {
+        stats->epoch_start = received;
+    } else if ( received - stats->epoch_start >= AGE_EPOCH ) {
+        stats->epoch ^= 1;
+        stats->epoch_start = received;
+        stats->min_transit[stats->epoch] = INT64_MAX;
+        memset(counters->ages[stats->epoch], 0, sizeof(counters->ages[stats->epoch]));
+    }
+    if ( transit < stats->min_transit[stats->epoch] ) stats->min_transit[stats->epoch] = transit;
+
+    int64_t baseline = stats->min_transit[0] < stats->min_transit[1] ? stats->min_transit[0] : stats->min_transit[1];
+    counters->ages[stats->epoch][fpv_link_stats_age_bucket(transit - baseline)]++;
+}
+
+static int fpv_link_stats_age_bucket(int64_t age) {
+    if ( age < 4 ) return age > 0 ? (int)age : 0;
+    int msb = 63 - __builtin_clzll((uint64_t)age);
+    int bucket = msb * 4 + (int)((age >> (msb - 2)) & 3);
+    return bucket < AGE_BUCKETS ? bucket : AGE_BUCKETS - 1;
+}
+
+static void fpv_link_stats_age_percentiles(const FPVLinkStatsCounters * counters, const double * percentiles, double * ages, int count) {
+    uint32_t buckets[AGE_BUCKETS];
+    uint64_t total = 0, seen = 0;
+    int i, p = 0;
+    for ( i=0; i<AGE_BUCKETS; i++ ) {
+        buckets[i] = counters->ages[0][i] + counters->ages[1][i];
+        total += buckets[i];
+    }
+
+    // Report the top of the bucket each percentile falls in, in milliseconds; percentiles ascend
+    for ( i=0; i<AGE_BUCKETS && p<count; i++ ) {
+        seen += buckets[i];
+        while ( p < count && total && seen > (uint64_t)(percentiles[p] * total) ) {
+            ages[p++] = i < 4 ? i / 1000.0 : (double)((uint64_t)(4 + (i & 3) + 1) << (i / 4 - 2)) / 1000.0;
+        }
+    }
+    while ( p < count ) ages[p++] = 0;
+}
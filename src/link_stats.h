@@ -0,0 +1,64 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LINK_STATS_H
+#define __LINK_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LINK_STATS_WINDOW 256   // Sequence numbers covered by the loss percentage; a multiple of 64
+
+/*
+ * Health of one sender's link, from the sequence number and sender timestamp of each
+ * packet as it arrives: loss over a rolling window of sequence numbers, duplicates,
+ * reordering, RFC 3550 interarrival jitter, and percentiles of packet age. Sender and
+ * receiver clocks aren't synchronised, so age is one-way delay above the quickest
+ * recent packet: queueing and retransmission delay, not absolute latency. Memory is
+ * fixed. One thread feeds the stats; any thread can read them without locking.
+ */
+
+typedef struct {
+    uint64_t received;
+    uint64_t expected;      // Sequence numbers spanned, so expected - (received - duplicates) is loss to date
+    uint64_t lost;          // Never arrived before leaving the loss window
+    uint64_t duplicates;
+    uint64_t reordered;     // Arrived after a later sequence number
+    double loss;            // Percent of the last LINK_STATS_WINDOW sequence numbers missing
+    double jitter;          // Milliseconds
+    double age_p50;         // Milliseconds
+    double age_p95;
+    double age_p99;
+} FPVLinkStatsSnapshot;
+
+typedef struct _FPVLinkStats FPVLinkStats;
+
+FPVLinkStats * fpv_link_stats_new();
+void fpv_link_stats_dispose(FPVLinkStats * stats);
+
+// Feeding thread only. sent is the sender's timestamp in microseconds (0 if it has none);
+// received is monotonic microseconds, as from fpv_telemetry_now
+void fpv_link_stats_add(FPVLinkStats * stats, uint16_t sequence, uint32_t sent, uint64_t received);
+void fpv_link_stats_reset(FPVLinkStats * stats);
+
+void fpv_link_stats_get(FPVLinkStats * stats, FPVLinkStatsSnapshot * snapshot);
+
+// One line for a display, e.g. "Loss 1.2% Jitter 3 ms Age 4/12 ms"
+int fpv_link_stats_format(const FPVLinkStatsSnapshot * snapshot, char * text, size_t length);
+
+#endif
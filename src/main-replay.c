@@ -0,0 +1,319 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // sendmmsg
+
+#include <glib.h>
+#include <stdio.h>
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "common.h"
+#include "telemetry_common.h"
+#include "flight_log.h"
+#include "pcap_reader.h"
+
+/*
+ * raspifpv-replay: retransmits a recorded flight log, or the telemetry packets in a pcap
+ * capture, to a UDP or multicast address at original, scaled, or unthrottled speed, so
+ * the ground station can be exercised without a vehicle. Each packet is due at an
+ * absolute deadline measured from the start of the pass, so pacing errors never
+ * accumulate. At speed 0 packets go out back to back in sendmmsg batches, which makes
+ * this the load generator for the receive and render paths.
+ */
+
+#define REPLAY_BATCH 32
+
+typedef struct {
+    uint8_t data[TELEMETRY_WIRE_MAX_LENGTH];
+    int length;
+    uint64_t time;  // Microseconds, on the source's own clock
+} ReplayPacket;
+
+typedef struct {
+    // Flight log source
+    FPVFlightLogReader *log;
+    FPVTelemetryUpdate pending;
+    int has_pending;
+    uint16_t sequences[256];
+
+    // Capture source
+    FPVPcapReader *pcap;
+} ReplaySource;
+
+typedef struct {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t late;          // Packets sent more than a millisecond after their deadline
+    uint64_t max_lateness;  // Microseconds
+} ReplayStats;
+
+#pragma mark - Flight log source
+
+static int replay_log_next(ReplaySource *source, ReplayPacket *packet) {
+    // Records that arrived in one packet share a receive time, vehicle and sender
+    // timestamp; put them back together into one frame
+    FPVTelemetryFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    if ( !source->has_pending && !fpv_flight_log_reader_next(source->log, &source->pending) ) return 0;
+    frame.records[frame.count++] = source->pending;
+    source->has_pending = 0;
+
+    FPVTelemetryUpdate update;
+    while ( fpv_flight_log_reader_next(source->log, &update) ) {
+        if ( update.received != frame.records[0].received || update.vehicle_id != frame.records[0].vehicle_id
+                || update.timestamp != frame.records[0].timestamp || frame.count == TELEMETRY_FRAME_MAX_RECORDS ) {
+            source->pending = update;
+            source->has_pending = 1;
+            break;
+        }
+        frame.records[frame.count++] = update;
+    }
+
+    frame.vehicle_id = frame.records[0].vehicle_id;
+    frame.timestamp = frame.records[0].timestamp;
+    frame.sequence = source->sequences[frame.vehicle_id]++;
+    packet->length = fpv_telemetry_frame_encode(&frame, packet->data, sizeof(packet->data));
+    packet->time = frame.records[0].received;
+    return 1;
+}
+
+#pragma mark - Capture source
+
+static int replay_pcap_next(ReplaySource *source, ReplayPacket *packet) {
+    const uint8_t *payload;
+    int length;
+    while ( (payload = fpv_pcap_reader_next(source->pcap, &length, &packet->time)) ) {
+        if ( length > (int)sizeof(packet->data) ) continue;
+        memcpy(packet->data, payload, length);
+        packet->length = length;
+        return 1;
+    }
+    return 0;
+}
+
+#pragma mark - Sending
+
+static int replay_source_open(ReplaySource *source, const char *path, int port) {
+    memset(source, 0, sizeof(*source));
+
+    FILE *file = fopen(path, "rb");
+    if ( !file ) {
+        g_print("Couldn't open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    source->pcap = fpv_pcap_reader_new(file, port);
+    if ( source->pcap ) return 1;
+    fclose(file);
+
+    source->log = fpv_flight_log_reader_new(path);
+    return source->log != NULL;
+}
+
+static void replay_source_rewind(ReplaySource *source) {
+    if ( source->log ) {
+        fpv_flight_log_reader_seek(source->log, 0);
+        source->has_pending = 0;
+    } else {
+        fpv_pcap_reader_rewind(source->pcap);
+    }
+}
+
+static int replay_source_next(ReplaySource *source, ReplayPacket *packet) {
+    return source->log ? replay_log_next(source, packet) : replay_pcap_next(source, packet);
+}
+
+static void replay_source_close(ReplaySource *source) {
+    if ( source->log ) fpv_flight_log_reader_dispose(source->log);
+    if ( source->pcap ) fpv_pcap_reader_dispose(source->pcap);
+}
+
+static uint64_t replay_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static int replay_flush(int fd, struct sockaddr_in *destination, ReplayPacket *batch, int count, ReplayStats *stats) {
+    struct mmsghdr messages[REPLAY_BATCH];
+    struct iovec iovecs[REPLAY_BATCH];
+    int i, sent = 0;
+    for ( i=0; i<count; i++ ) {
+        iovecs[i].iov_base = batch[i].data;
+        iovecs[i].iov_len = batch[i].length;
+        memset(&messages[i], 0, sizeof(messages[i]));
+        messages[i].msg_hdr.msg_name = destination;
+        messages[i].msg_hdr.msg_namelen = sizeof(*destination);
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    while ( sent < count ) {
+        int result = sendmmsg(fd, messages + sent, count - sent, 0);
+        if ( result < 0 ) {
+            if ( errno == EINTR || errno == ENOBUFS ) continue;
+            g_print("Send failed: %s\n", strerror(errno));
+            return 0;
+        }
+        for ( i=sent; i<sent+result; i++ ) stats->bytes += batch[i].length;
+        sent += result;
+        stats->packets += result;
+    }
+    return 1;
+}
+
+// Sends one pass over the source, returning 0 on a send error
+static int replay_pass(ReplaySource *source, int fd, struct sockaddr_in *destination, double speed, ReplayStats *stats) {
+    ReplayPacket batch[REPLAY_BATCH];
+    int count = 0;
+    uint64_t first = 0, start = 0;
+
+    while ( replay_source_next(source, &batch[count]) ) {
+        ReplayPacket *packet = &batch[count];
+        if ( packet->length <= 0 ) continue;
+
+        if ( speed > 0 ) {
+            if ( !start ) {
+                first = packet->time;
+                start = replay_now();
+            }
+
+            // Deadlines are absolute, so time spent sending never pushes later packets back
+            uint64_t offset = packet->time > first ? (uint64_t)((packet->time - first) / speed) : 0;
+            uint64_t deadline = start + offset;
+            struct timespec when = { .tv_sec = deadline / 1000000ULL, .tv_nsec = (deadline % 1000000ULL) * 1000 };
+            while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) == EINTR );
+
+            uint64_t now = replay_now();
+            uint64_t lateness = now > deadline ? now - deadline : 0;
+            if ( lateness > 1000 ) stats->late++;
+            if ( lateness > stats->max_lateness ) stats->max_lateness = lateness;
+
+            if ( !replay_flush(fd, destination, packet, 1, stats) ) return 0;
+            continue;
+        }
+
+        if ( ++count == REPLAY_BATCH ) {
+            if ( !replay_flush(fd, destination, batch, count, stats) ) return 0;
+            count = 0;
+        }
+    }
+
+    return count ? replay_flush(fd, destination, batch, count, stats) : 1;
+}
+
+static char *config_path = NULL;
+static char *address = NULL;
+static int port = 0;
+static int capture_port = 0;
+static double speed = 1.0;
+static int repeat = 1;
+static GOptionEntry options[] = {
+    { "config", 0, 0, G_OPTION_ARG_FILENAME, &config_path, "Config file path (default " RASPIFPV_DEFAULT_CONFIG_PATH ")", "PATH"},
+    { "address", 'a', 0, G_OPTION_ARG_STRING, &address, "Destination address (default: the configured multicast address)", "ADDRESS"},
+    { "port", 'p', 0, G_OPTION_ARG_INT, &port, "Destination port (default: the configured telemetry port)", "PORT"},
+    { "capture-port", 0, 0, G_OPTION_ARG_INT, &capture_port, "Telemetry port to pick out of a pcap capture (default: the destination port)", "PORT"},
+    { "speed", 's', 0, G_OPTION_ARG_DOUBLE, &speed, "Playback speed: 1 for real time, 10 for ten times faster, 0 for as fast as possible", "FACTOR"},
+    { "repeat", 'r', 0, G_OPTION_ARG_INT, &repeat, "Number of passes over the input, 0 to repeat forever (default 1)", "COUNT"},
+    NULL
+};
+
+int main(int argc, char ** argv) {
+
+    // Parse options
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new("FILE - replay a flight log or pcap capture as live telemetry");
+    g_option_context_add_main_entries(context, options, NULL);
+    if ( !g_option_context_parse(context, &argc, &argv, &error) ) {
+        g_print("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    if ( argc != 2 || speed < 0 ) {
+        g_print("%s", g_option_context_get_help(context, TRUE, NULL));
+        exit(1);
+    }
+
+    // Load configuration, for the default destination
+    GKeyFile *keyfile = g_key_file_new();
+    if ( !g_key_file_load_from_file(keyfile, config_path ? config_path : RASPIFPV_DEFAULT_CONFIG_PATH, 0, &error) ) {
+        g_key_file_free(keyfile);
+        keyfile = NULL;
+        if ( config_path ) {
+            g_print("Couldn't load config %s: %s\n", config_path, error->message);
+            exit(1);
+        }
+    }
+    if ( !address ) address = keyfile ? g_key_file_get_string(keyfile, "Networking", "multicast_address", NULL) : NULL;
+    if ( !address ) address = RASPIFPV_MULTICAST_ADDR;
+    if ( !port ) port = keyfile ? g_key_file_get_integer(keyfile, "Networking", "telemetry_port", NULL) : 0;
+    if ( !port ) port = RASPIFPV_PORT_TELEMETRY;
+
+    ReplaySource source;
+    if ( !replay_source_open(&source, argv[1], capture_port ? capture_port : port) ) {
+        g_print("Couldn't read %s as a flight log or pcap capture\n", argv[1]);
+        exit(1);
+    }
+
+    struct sockaddr_in destination = { .sin_family = AF_INET, .sin_port = htons(port) };
+    if ( !inet_pton(AF_INET, address, &destination.sin_addr) ) {
+        g_print("Invalid address '%s'\n", address);
+        exit(1);
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if ( fd < 0 ) {
+        g_print("Couldn't create socket: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    // Loop multicast back, so a receiver on this machine sees the replay too
+    unsigned char loop = 1;
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+    char rate[32];
+    if ( speed > 0 ) snprintf(rate, sizeof(rate), "%gx", speed); else strcpy(rate, "full speed");
+    printf("Replaying %s to %s:%d at %s\n", argv[1], address, port, rate);
+
+    ReplayStats stats;
+    memset(&stats, 0, sizeof(stats));
+    uint64_t start = replay_now();
+    int pass;
+    for ( pass=0; repeat == 0 || pass < repeat; pass++ ) {
+        if ( pass ) replay_source_rewind(&source);
+        uint64_t sent = stats.packets;
+        if ( !replay_pass(&source, fd, &destination, speed, &stats) || stats.packets == sent ) break;
+    }
+    double elapsed = (replay_now() - start) / 1e6;
+
+    printf("Sent %llu packets, %llu bytes in %.3f s (%.0f packets/s)",
+        (unsigned long long)stats.packets, (unsigned long long)stats.bytes, elapsed, elapsed > 0 ? stats.packets / elapsed : 0);
+    if ( speed > 0 ) {
+        printf(", %llu more than 1 ms late, worst %llu us", (unsigned long long)stats.late, (unsigned long long)stats.max_lateness);
+    }
+    printf("\n");
+
+    close(fd);
+    replay_source_close(&source);
+    if ( keyfile ) g_key_file_free(keyfile);
+
+    return 0;
+}
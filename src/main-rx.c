@@ -23,19 +23,53 @@
 #include <config.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "common.h"
 #include "gstreamer_renderer.h"
 #include "egl_telemetry_renderer.h"
 #include "telemetry_rx.h"
+#include "flight_log.h"
+
+static const int DEFAULT_TELEMETRY_HISTORY_LENGTH = 36000;
+static const char * DEFAULT_FLIGHT_LOG_DIRECTORY = "/var/log/raspifpv";
+static const int DEFAULT_FLIGHT_LOG_SIZE = 64;
 
 static FPVGStreamerRenderer* init_renderer(GKeyFile * keyfile, GMainLoop *loop) {
     char * multicast_addr = keyfile ? g_key_file_get_string(keyfile, "Networking", "multicast_address", NULL) : NULL;
     int port = keyfile ? g_key_file_get_integer(keyfile, "Networking", "video_port", NULL) : 0;
     
+    int fec_port = keyfile ? g_key_file_get_integer(keyfile, "Networking", "fec_port", NULL) : 0;
+    int fec_group = keyfile ? g_key_file_get_integer(keyfile, "Video", "fec_group", NULL) : 0;
+    
     if ( !multicast_addr ) multicast_addr = RASPIFPV_MULTICAST_ADDR;
     if ( !port ) port = RASPIFPV_PORT_VIDEO;
+    if ( !fec_port ) fec_port = RASPIFPV_PORT_FEC;
     
-    FPVGStreamerRenderer *renderer = fpv_gstreamer_renderer_new(loop, multicast_addr, port);
+    FPVGStreamerRenderer *renderer = fpv_gstreamer_renderer_new(loop, multicast_addr, port, fec_group > 0 ? fec_port : 0);
+
+    // Report link quality back to the sender, which adapts its bitrate to it
+    if ( renderer && keyfile && g_key_file_get_boolean(keyfile, "Video", "adaptive_bitrate", NULL) ) {
+        int feedback_port = g_key_file_get_integer(keyfile, "Networking", "feedback_port", NULL);
+        fpv_gstreamer_renderer_enable_feedback(renderer, feedback_port ? feedback_port : RASPIFPV_PORT_FEEDBACK);
+    }
+
+    // Measure latency against the sender's frame stamps, which it asks the sender's clock to relate to ours
+    if ( renderer && keyfile && g_key_file_get_boolean(keyfile, "Video", "measure_latency", NULL) ) {
+        int feedback_port = g_key_file_get_integer(keyfile, "Networking", "feedback_port", NULL);
+        fpv_gstreamer_renderer_enable_latency(renderer, feedback_port ? feedback_port : RASPIFPV_PORT_FEEDBACK);
+    }
+
+    // Hold video back until a keyframe, rather than decode garbage on joining mid-stream
+    if ( renderer && keyfile && g_key_file_get_boolean(keyfile, "Video", "fast_start", NULL) ) {
+        fpv_gstreamer_renderer_enable_fast_start(renderer);
+    }
+
+    // Ask the sender for a keyframe after losing video, instead of waiting for the next periodic one
+    if ( renderer && keyfile && g_key_file_get_boolean(keyfile, "Video", "keyframe_requests", NULL) ) {
+        int feedback_port = g_key_file_get_integer(keyfile, "Networking", "feedback_port", NULL);
+        fpv_gstreamer_renderer_enable_keyframe_requests(renderer, feedback_port ? feedback_port : RASPIFPV_PORT_FEEDBACK);
+    }
+
     return renderer;
 }
 
@@ -44,10 +78,46 @@ static FPVTelemetryRX* init_telemetry_rx(GKeyFile *keyfile) {
     int port = keyfile ? g_key_file_get_integer(keyfile, "Networking", "telemetry_port", NULL) : 0;
     
     FPVTelemetryRX *telemetry_rx = fpv_telemetry_rx_new(address ? address : RASPIFPV_MULTICAST_ADDR, port ? port : RASPIFPV_PORT_TELEMETRY);
+    if ( !telemetry_rx ) return NULL;
+
+    int history_length = keyfile && g_key_file_has_key(keyfile, "Telemetry", "history_length", NULL)
+        ? g_key_file_get_integer(keyfile, "Telemetry", "history_length", NULL) : DEFAULT_TELEMETRY_HISTORY_LENGTH;
+    fpv_telemetry_rx_enable_history(telemetry_rx, history_length);
+
+    if ( keyfile && g_key_file_has_key(keyfile, "Telemetry", "max_extrapolation", NULL) ) {
+        fpv_telemetry_rx_set_max_extrapolation(telemetry_rx, g_key_file_get_double(keyfile, "Telemetry", "max_extrapolation", NULL));
+    }
+
+    if ( keyfile && g_key_file_has_key(keyfile, "Telemetry", "follow_vehicle", NULL) ) {
+        fpv_telemetry_rx_follow(telemetry_rx, g_key_file_get_integer(keyfile, "Telemetry", "follow_vehicle", NULL));
+    }
 
     return telemetry_rx;
 }
 
+static FPVFlightLog* init_flight_log(GKeyFile *keyfile, FPVTelemetryRX * telemetry) {
+    if ( !keyfile || !g_key_file_get_boolean(keyfile, "Logging", "flight_log", NULL) ) return NULL;
+
+    char *directory = g_key_file_get_string(keyfile, "Logging", "directory", NULL);
+    int size = g_key_file_get_integer(keyfile, "Logging", "size", NULL);
+
+    // One log per run, named for the local time it started
+    char name[64];
+    time_t now = time(NULL);
+    strftime(name, sizeof(name), "flight-%Y%m%d-%H%M%S.log", localtime(&now));
+    char *path = g_build_filename(directory ? directory : DEFAULT_FLIGHT_LOG_DIRECTORY, name, NULL);
+
+    FPVFlightLog *log = fpv_flight_log_new(telemetry, path, (uint64_t)(size > 0 ? size : DEFAULT_FLIGHT_LOG_SIZE) << 20);
+    if ( log ) {
+        fpv_flight_log_set_sync_interval(log, g_key_file_get_integer(keyfile, "Logging", "sync_interval", NULL));
+        fpv_flight_log_set_index_interval(log, g_key_file_get_integer(keyfile, "Logging", "index_interval", NULL));
+    }
+
+    g_free(path);
+    g_free(directory);
+    return log;
+}
+
 static FPVEGLTelemetryRenderer* init_telemetry_renderer(GKeyFile * keyfile, FPVTelemetryRX * telemetry) {
     FPVEGLTelemetryRenderer * renderer = fpv_egl_telemetry_renderer_new(telemetry);
     return renderer;
@@ -88,6 +158,9 @@ int main(int argc, char ** argv) {
         exit(1);
     }
 
+    // Init flight log; running without one beats not flying
+    FPVFlightLog * flight_log = init_flight_log(keyfile, telemetry_rx);
+
     // Init telemetry renderer
     FPVEGLTelemetryRenderer * telemetry_renderer = init_telemetry_renderer(keyfile, telemetry_rx);
     if ( !telemetry_renderer ) {
@@ -105,11 +178,17 @@ int main(int argc, char ** argv) {
         g_print("Couldn't init renderer\n");
         exit(1);
     }
+    fpv_egl_telemetry_renderer_set_latency_stats(telemetry_renderer, fpv_gstreamer_renderer_get_latency_stats(renderer));
 
     // Start telemetry receiver
     int started = fpv_telemetry_rx_listener_start(telemetry_rx);
     g_assert(started);
 
+    // Start flight log
+    if ( flight_log && fpv_flight_log_start(flight_log) != 1 ) {
+        g_print("Couldn't start flight log; continuing without one\n");
+    }
+
     // Start video pipeline
     fpv_gstreamer_renderer_start(renderer);
     
@@ -121,11 +200,16 @@ int main(int argc, char ** argv) {
     
     g_print("Shutting down\n");
     
+    // Stop the HUD first: it reads the video renderer's latency stats and the telemetry
+    fpv_egl_telemetry_renderer_stop(telemetry_renderer);
+    fpv_egl_telemetry_renderer_set_latency_stats(telemetry_renderer, NULL);
+
     // Stop video pipeline and clean up
     fpv_gstreamer_renderer_stop(renderer);
     g_main_destroy(loop);
     fpv_gstreamer_renderer_dispose(renderer);
     fpv_egl_telemetry_renderer_dispose(telemetry_renderer);
+    if ( flight_log ) fpv_flight_log_dispose(flight_log);
     fpv_telemetry_rx_dispose(telemetry_rx);
     if ( keyfile ) g_key_file_free(keyfile);
 
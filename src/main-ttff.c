@@ -0,0 +1,230 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "common.h"
+#include "pcap_reader.h"
+#include "h264_nal.h"
+#include "fast_start.h"
+
+/*
+ * raspifpv-ttff: measures time to first frame against a pcap capture of the RTP video
+ * port. The stream is depacketized into access units, and a receiver joining at each
+ * one in turn is put through the same fast-start gate raspifpvrx uses, to find how long
+ * it would wait, and how many frames it would throw away, before one it can decode.
+ *
+ * Times are in stream time, from the first packet the receiver saw to the last packet
+ * of the access unit it joined at; decoder and display latency come on top.
+ */
+
+#define RTP_HEADER_LENGTH 12
+
+enum {
+    RTP_H264_STAP_A = 24,
+    RTP_H264_FU_A = 28
+};
+
+typedef struct {
+    uint64_t first;     // Capture time of the first and last packets
+    uint64_t last;
+    FPVFastStartUnit unit;
+} TTFFAccessUnit;
+
+typedef struct {
+    TTFFAccessUnit *units;
+    int count;
+    int allocated;
+    uint32_t timestamp;
+    int open;           // The last access unit may gain more packets
+    uint64_t packets;
+    uint64_t malformed;
+} TTFFStream;
+
+static TTFFAccessUnit * ttff_stream_unit(TTFFStream *stream, uint32_t timestamp, uint64_t time) {
+    if ( stream->open && timestamp == stream->timestamp ) {
+        TTFFAccessUnit *unit = &stream->units[stream->count-1];
+        unit->last = time;
+        return unit;
+    }
+    if ( stream->count == stream->allocated ) {
+        stream->allocated = stream->allocated ? stream->allocated * 2 : 1024;
+        stream->units = (TTFFAccessUnit*)realloc(stream->units, stream->allocated * sizeof(TTFFAccessUnit));
+    }
+    TTFFAccessUnit *unit = &stream->units[stream->count++];
+    memset(unit, 0, sizeof(*unit));
+    unit->first = unit->last = time;
+    stream->timestamp = timestamp;
+    stream->open = 1;
+    return unit;
+}
+
+// Summarises the NAL units in one RTP packet (RFC 6184: single NAL unit, STAP-A, FU-A)
+static int ttff_stream_add(TTFFStream *stream, const uint8_t *packet, int length, uint64_t time) {
+    if ( length < RTP_HEADER_LENGTH || (packet[0] >> 6) != 2 ) return 0;
+    int header_length = RTP_HEADER_LENGTH + (packet[0] & 0x0f) * 4;
+    if ( (packet[0] & 0x10) && length >= header_length + 4 ) {
+        header_length += 4 + ((packet[header_length+2] << 8) | packet[header_length+3]) * 4;
+    }
+    if ( packet[0] & 0x20 ) length -= packet[length-1];
+    if ( length <= header_length ) return 0;
+
+    int marker = packet[1] & 0x80;
+    uint32_t timestamp = (packet[4] << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+    const uint8_t *payload = packet + header_length;
+    int payload_length = length - header_length;
+
+    TTFFAccessUnit *unit = ttff_stream_unit(stream, timestamp, time);
+    switch ( fpv_h264_nal_type(payload[0]) ) {
+        case RTP_H264_STAP_A: {
+            int position = 1;
+            while ( position + 2 < payload_length ) {
+                int size = (payload[position] << 8) | payload[position+1];
+                position += 2;
+                if ( size > payload_length - position ) return 0;
+                fpv_fast_start_unit_add_nal(&unit->unit, payload + position, size);
+                position += size;
+            }
+            break;
+        }
+        case RTP_H264_FU_A:
+            if ( payload_length < 3 ) return 0;
+            if ( payload[1] & 0x80 ) {
+                // Only the start fragment matters: rebuild the NAL header, and keep the byte after it for SEI
+                uint8_t nal[2] = { (payload[0] & 0xe0) | (payload[1] & 0x1f), payload[2] };
+                fpv_fast_start_unit_add_nal(&unit->unit, nal, sizeof(nal));
+            }
+            break;
+        default:
+            fpv_fast_start_unit_add_nal(&unit->unit, payload, payload_length);
+            break;
+    }
+
+    if ( marker ) stream->open = 0;
+    return 1;
+}
+
+static int ttff_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int port = 0;
+static gboolean out_of_band = FALSE;
+static GOptionEntry options[] = {
+    { "port", 'p', 0, G_OPTION_ARG_INT, &port, "Video port to pick out of the capture (default 9000)", "PORT"},
+    { "out-of-band", 0, 0, G_OPTION_ARG_NONE, &out_of_band, "Take SPS and PPS as known from the caps, rather than waiting for them in-band", NULL},
+    NULL
+};
+
+int main(int argc, char ** argv) {
+
+    // Parse options
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new("FILE - measure time to first frame for a pcap capture of the video stream");
+    g_option_context_add_main_entries(context, options, NULL);
+    if ( !g_option_context_parse(context, &argc, &argv, &error) ) {
+        g_print("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    if ( argc != 2 ) {
+        g_print("%s", g_option_context_get_help(context, TRUE, NULL));
+        exit(1);
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if ( !file ) {
+        g_print("Couldn't open %s: %s\n", argv[1], strerror(errno));
+        exit(1);
+    }
+    FPVPcapReader *reader = fpv_pcap_reader_new(file, port ? port : RASPIFPV_PORT_VIDEO);
+    if ( !reader ) {
+        g_print("Couldn't read %s as a pcap capture\n", argv[1]);
+        exit(1);
+    }
+
+    // Depacketize
+    TTFFStream stream;
+    memset(&stream, 0, sizeof(stream));
+    const uint8_t *payload;
+    int length;
+    uint64_t time;
+    while ( (payload = fpv_pcap_reader_next(reader, &length, &time)) ) {
+        stream.packets++;
+        if ( !ttff_stream_add(&stream, payload, length, time) ) stream.malformed++;
+    }
+    fpv_pcap_reader_dispose(reader);
+
+    if ( !stream.count ) {
+        g_print("No video in %s on port %d\n", argv[1], port ? port : RASPIFPV_PORT_VIDEO);
+        exit(1);
+    }
+
+    int i, j, join_points = 0;
+    for ( i=0; i<stream.count; i++ ) {
+        const FPVFastStartUnit *unit = &stream.units[i].unit;
+        if ( unit->slices && (unit->idr || unit->recovery_point) && (out_of_band || (unit->sps && unit->pps)) ) join_points++;
+    }
+
+    // Join at every access unit in turn
+    uint64_t *waits = (uint64_t*)malloc(stream.count * sizeof(uint64_t));
+    uint64_t discarded = 0, wait_total = 0;
+    int joins = 0;
+    for ( i=0; i<stream.count; i++ ) {
+        FPVFastStart *fast_start = fpv_fast_start_new();
+        fpv_fast_start_set_parameter_sets(fast_start, out_of_band);
+        for ( j=i; j<stream.count; j++ ) {
+            int joined = 0;
+            fpv_fast_start_filter(fast_start, &stream.units[j].unit, stream.units[j].first, &joined);
+            if ( !joined ) continue;
+
+            waits[joins] = stream.units[j].last - stream.units[i].first;
+            wait_total += waits[joins];
+            joins++;
+            discarded += j - i;
+            break;
+        }
+        fpv_fast_start_dispose(fast_start);
+    }
+
+    double duration = (stream.units[stream.count-1].last - stream.units[0].first) / 1e6;
+    printf("%llu packets (%llu malformed), %d access units over %.3f s, %d join points",
+        (unsigned long long)stream.packets, (unsigned long long)stream.malformed, stream.count, duration, join_points);
+    if ( join_points > 1 ) printf(", one every %.0f ms", duration * 1000 / join_points);
+    printf("\n");
+
+    if ( joins ) {
+        qsort(waits, joins, sizeof(uint64_t), ttff_compare);
+        printf("Time to first frame: mean %.1f ms, p50 %.1f ms, p95 %.1f ms, max %.1f ms; %.1f frames discarded on average\n",
+            wait_total / 1e3 / joins, waits[joins / 2] / 1e3, waits[(joins * 95) / 100] / 1e3, waits[joins-1] / 1e3,
+            (double)discarded / joins);
+    }
+    if ( joins < stream.count ) {
+        printf("%d of %d joins (%.1f%%) found nothing to start from before the capture ended\n",
+            stream.count - joins, stream.count, (stream.count - joins) * 100.0 / stream.count);
+    }
+
+    free(waits);
+    free(stream.units);
+
+    return 0;
+}
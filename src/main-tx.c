@@ -18,20 +18,30 @@
 
 #include <gst/gst.h>
 #include <glib.h>
+#include <glib-unix.h>
 #include <stdio.h>
 #include <config.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include "common.h"
 #include "telemetry_tx.h"
+#include "feedback_server.h"
+#include "adaptive_bitrate.h"
+#include "rtp_sender.h"
+#include "latency_stamper.h"
+#include "video_control.h"
 
 static const int DEFAULT_VIDEO_WIDTH = 1280;
 static const int DEFAULT_VIDEO_HEIGHT = 720;
 static const int DEFAULT_VIDEO_FRAMERATE = 30;
 static const int DEFAULT_VIDEO_BITRATE = 1048576;
+static const int DEFAULT_MIN_VIDEO_BITRATE = 262144;
+static const int DEFAULT_FEC_REPAIR = 4;
 
 static const char * GST_PIPELINE_SOURCE = "v4l2src ! video/x-raw, width=%d, height=%d, framerate=%d/1 ! queue ! videoconvert ! omxh264enc target-bitrate=%d control-rate=1";
-static const char * GST_PIPELINE_TRANSMIT = "rtph264pay !  udpsink host=%s port=%d";
+// SPS and PPS go in-band ahead of every IDR frame, so a ground station joining mid-stream can start at the next one
+static const char * GST_PIPELINE_TRANSMIT = "rtph264pay name=pay config-interval=-1 ! appsink name=sender sync=false buffer-list=true enable-last-sample=false";
 
 static gboolean on_message(GstBus * bus, GstMessage * message, gpointer user_data) {
     GMainLoop *loop = (GMainLoop*)user_data;
@@ -70,6 +80,8 @@ static FPVTelemetryTX* init_telemetry_tx(GKeyFile *keyfile) {
 
     // Setup telemetry
     if ( telemetry_tx && keyfile ) {
+        fpv_telemetry_tx_set_vehicle_id(telemetry_tx, g_key_file_get_integer(keyfile, "Telemetry", "vehicle_id", NULL));
+
         int spi_bus = keyfile ? g_key_file_get_integer(keyfile, "Telemetry", "spi_bus", NULL) : 0;
         int spi_device = keyfile ? g_key_file_get_integer(keyfile, "Telemetry", "spi_device", NULL) : 0;
         if ( spi_bus != 0 || spi_device != 0 ) {
@@ -114,23 +126,87 @@ static FPVTelemetryTX* init_telemetry_tx(GKeyFile *keyfile) {
             fpv_telemetry_tx_get_rssi_sensor(telemetry_tx, has_rssi_adc_channel ? NULL : &rssi_adc_channel, has_rssi_sensor_min ? NULL : &rssi_sensor_min, has_rssi_sensor_max ? NULL : &rssi_sensor_max);
             fpv_telemetry_tx_set_rssi_sensor(telemetry_tx, rssi_adc_channel, rssi_sensor_min, rssi_sensor_max);
         }
+
+        // Per-sensor sampling rates (Hz) and filtering
+        const char * sensor_names[FPV_TELEMETRY_SENSOR_COUNT] = {
+            [FPV_TELEMETRY_SENSOR_VOLTAGE] = "voltage",
+            [FPV_TELEMETRY_SENSOR_CURRENT] = "current",
+            [FPV_TELEMETRY_SENSOR_RSSI] = "rssi",
+            [FPV_TELEMETRY_SENSOR_POSITION] = "position" };
+        int sensor;
+        for ( sensor=0; sensor<FPV_TELEMETRY_SENSOR_COUNT; sensor++ ) {
+            char key[64];
+
+            // Only the ADC sensors are filtered; GPS fixes go out as the receiver gives them
+            if ( sensor != FPV_TELEMETRY_SENSOR_POSITION ) {
+                FPVSensorFilterConfig filter;
+                fpv_telemetry_tx_get_sensor_filter(telemetry_tx, sensor, &filter);
+                snprintf(key, sizeof(key), "%s_median", sensor_names[sensor]);
+                if ( g_key_file_has_key(keyfile, "Telemetry", key, NULL) ) filter.median = g_key_file_get_integer(keyfile, "Telemetry", key, NULL);
+                snprintf(key, sizeof(key), "%s_oversample", sensor_names[sensor]);
+                if ( g_key_file_has_key(keyfile, "Telemetry", key, NULL) ) filter.oversample = g_key_file_get_integer(keyfile, "Telemetry", key, NULL);
+                snprintf(key, sizeof(key), "%s_lowpass", sensor_names[sensor]);
+                if ( g_key_file_has_key(keyfile, "Telemetry", key, NULL) ) filter.lowpass_shift = g_key_file_get_integer(keyfile, "Telemetry", key, NULL);
+                fpv_telemetry_tx_set_sensor_filter(telemetry_tx, sensor, &filter);
+            }
+
+            snprintf(key, sizeof(key), "%s_rate", sensor_names[sensor]);
+            if ( g_key_file_has_key(keyfile, "Telemetry", key, NULL) ) {
+                fpv_telemetry_tx_set_sensor_rate(telemetry_tx, sensor, g_key_file_get_double(keyfile, "Telemetry", key, NULL));
+            }
+
+            snprintf(key, sizeof(key), "%s_deadband", sensor_names[sensor]);
+            if ( g_key_file_has_key(keyfile, "Telemetry", key, NULL) ) {
+                fpv_telemetry_tx_set_deadband(telemetry_tx, sensor, g_key_file_get_double(keyfile, "Telemetry", key, NULL));
+            }
+        }
+
+        // GPS receiver (NMEA or u-blox UBX) on a serial port
+        char *gps_device = g_key_file_get_string(keyfile, "Telemetry", "gps_device", NULL);
+        if ( gps_device ) {
+            int gps_baud = g_key_file_get_integer(keyfile, "Telemetry", "gps_baud", NULL);
+            fpv_telemetry_tx_set_gps(telemetry_tx, gps_device, gps_baud ? gps_baud : 9600);
+            g_free(gps_device);
+        }
+
+        // Flight controller telemetry over MAVLink, from a serial port or a UDP port
+        char *mavlink_device = g_key_file_get_string(keyfile, "Telemetry", "mavlink_device", NULL);
+        if ( mavlink_device ) {
+            int mavlink_baud = g_key_file_get_integer(keyfile, "Telemetry", "mavlink_baud", NULL);
+            fpv_telemetry_tx_set_mavlink(telemetry_tx, mavlink_device, mavlink_baud ? mavlink_baud : 57600);
+            g_free(mavlink_device);
+        } else if ( g_key_file_has_key(keyfile, "Telemetry", "mavlink_udp_port", NULL) ) {
+            fpv_telemetry_tx_set_mavlink_udp(telemetry_tx, g_key_file_get_integer(keyfile, "Telemetry", "mavlink_udp_port", NULL));
+        }
+
+        // Change-driven transmission
+        if ( g_key_file_get_boolean(keyfile, "Telemetry", "change_driven", NULL) ) {
+            double max_age = g_key_file_get_double(keyfile, "Telemetry", "max_age", NULL);
+            double keyframe_interval = g_key_file_get_double(keyfile, "Telemetry", "keyframe_interval", NULL);
+            fpv_telemetry_tx_set_change_driven(telemetry_tx, 1, max_age, keyframe_interval);
+        }
     }
 
     return telemetry_tx;
 }
 
-static GstPipeline* init_gst_pipeline(GKeyFile *keyfile) {
+static void read_video_settings(GKeyFile *keyfile, FPVVideoSettings *settings) {
+    settings->width = keyfile ? g_key_file_get_integer(keyfile, "Video", "video_width", NULL) : 0;
+    settings->height = keyfile ? g_key_file_get_integer(keyfile, "Video", "video_height", NULL) : 0;
+    settings->framerate = keyfile ? g_key_file_get_integer(keyfile, "Video", "video_framerate", NULL) : 0;
+    settings->bitrate = keyfile ? g_key_file_get_integer(keyfile, "Video", "video_bitrate", NULL) : 0;
+    settings->keyframe_interval = keyfile ? g_key_file_get_integer(keyfile, "Video", "keyframe_interval", NULL) : 0;
+
+    if ( !settings->width ) settings->width = DEFAULT_VIDEO_WIDTH;
+    if ( !settings->height ) settings->height = DEFAULT_VIDEO_HEIGHT;
+    if ( !settings->framerate ) settings->framerate = DEFAULT_VIDEO_FRAMERATE;
+    if ( !settings->bitrate ) settings->bitrate = DEFAULT_VIDEO_BITRATE;
+}
+
+static GstPipeline* init_gst_pipeline(GKeyFile *keyfile, const FPVVideoSettings *settings) {
 
-    int video_width = keyfile ? g_key_file_get_integer(keyfile, "Video", "video_width", NULL) : 0;
-    int video_height = keyfile ? g_key_file_get_integer(keyfile, "Video", "video_height", NULL) : 0;
-    int video_framerate = keyfile ? g_key_file_get_integer(keyfile, "Video", "video_framerate", NULL) : 0;
-    int video_bitrate = keyfile ? g_key_file_get_integer(keyfile, "Video", "video_bitrate", NULL) : 0;
-    char * multicast_addr = keyfile ? g_key_file_get_string(keyfile, "Networking", "multicast_address", NULL) : NULL;
-    int port = keyfile ? g_key_file_get_integer(keyfile, "Networking", "video_port", NULL) : 0;
     char * source_pipeline = keyfile ? g_key_file_get_string(keyfile, "Video", "sender_source_pipeline", NULL) : NULL;
     
-    if ( !multicast_addr ) multicast_addr = RASPIFPV_MULTICAST_ADDR;
-    if ( !port ) port = RASPIFPV_PORT_VIDEO;
     if ( !source_pipeline ) source_pipeline = (char*)GST_PIPELINE_SOURCE;
 
     // Make sure source pipeline is valid
@@ -149,13 +225,10 @@ static GstPipeline* init_gst_pipeline(GKeyFile *keyfile) {
         exit(1);
     }
 
-    snprintf(pipeline_description, sizeof(pipeline_description), source_pipeline, 
-        video_width ? video_width : DEFAULT_VIDEO_WIDTH, 
-        video_height ? video_height : DEFAULT_VIDEO_HEIGHT,
-        video_framerate ? video_framerate : DEFAULT_VIDEO_FRAMERATE,
-        video_bitrate ? video_bitrate : DEFAULT_VIDEO_BITRATE);
+    snprintf(pipeline_description, sizeof(pipeline_description), source_pipeline,
+        settings->width, settings->height, settings->framerate, settings->bitrate);
     strcat(pipeline_description, " ! ");
-    snprintf(pipeline_description+strlen(pipeline_description), sizeof(pipeline_description)-strlen(pipeline_description), GST_PIPELINE_TRANSMIT, multicast_addr, port);
+    strcat(pipeline_description, GST_PIPELINE_TRANSMIT);
 
     GError *error = NULL;
     GstPipeline *pipeline = GST_PIPELINE(gst_parse_launch(pipeline_description, &error));
@@ -163,12 +236,105 @@ static GstPipeline* init_gst_pipeline(GKeyFile *keyfile) {
         g_error("Could not create pipeline %s: %s", pipeline_description, error->message);
     }
 
-    printf("Sending video to %s:%d\n", multicast_addr, port);
-
     return pipeline;
 }
 
+static FPVFeedbackServer* init_feedback_server(GKeyFile *keyfile) {
+    int port = keyfile ? g_key_file_get_integer(keyfile, "Networking", "feedback_port", NULL) : 0;
+
+    FPVFeedbackServer *server = fpv_feedback_server_new();
+    if ( !fpv_feedback_server_start(server, port ? port : RASPIFPV_PORT_FEEDBACK) ) {
+        fpv_feedback_server_dispose(server);
+        return NULL;
+    }
+    return server;
+}
+
+static FPVAdaptiveBitrate* init_adaptive_bitrate(GKeyFile *keyfile, GstPipeline *pipeline) {
+    if ( !keyfile || !g_key_file_get_boolean(keyfile, "Video", "adaptive_bitrate", NULL) ) return NULL;
+
+    int video_bitrate = g_key_file_get_integer(keyfile, "Video", "video_bitrate", NULL);
+    int min_bitrate = g_key_file_get_integer(keyfile, "Video", "min_bitrate", NULL);
+    int max_bitrate = g_key_file_get_integer(keyfile, "Video", "max_bitrate", NULL);
+
+    if ( !video_bitrate ) video_bitrate = DEFAULT_VIDEO_BITRATE;
+    if ( !min_bitrate ) min_bitrate = DEFAULT_MIN_VIDEO_BITRATE < video_bitrate ? DEFAULT_MIN_VIDEO_BITRATE : video_bitrate;
+    if ( !max_bitrate ) max_bitrate = video_bitrate;
+
+    return fpv_adaptive_bitrate_new(pipeline, video_bitrate, min_bitrate, max_bitrate);
+}
+
+static FPVRTPSender* init_rtp_sender(GKeyFile *keyfile, GstPipeline *pipeline) {
+    char * multicast_addr = keyfile ? g_key_file_get_string(keyfile, "Networking", "multicast_address", NULL) : NULL;
+    int port = keyfile ? g_key_file_get_integer(keyfile, "Networking", "video_port", NULL) : 0;
+    int fec_port = keyfile ? g_key_file_get_integer(keyfile, "Networking", "fec_port", NULL) : 0;
+    int fec_group = keyfile ? g_key_file_get_integer(keyfile, "Video", "fec_group", NULL) : 0;
+    int fec_repair = keyfile ? g_key_file_get_integer(keyfile, "Video", "fec_repair", NULL) : 0;
+    double pacing = keyfile ? g_key_file_get_double(keyfile, "Video", "pacing", NULL) : 0;
+    int video_framerate = keyfile ? g_key_file_get_integer(keyfile, "Video", "video_framerate", NULL) : 0;
+
+    if ( !multicast_addr ) multicast_addr = RASPIFPV_MULTICAST_ADDR;
+    if ( !port ) port = RASPIFPV_PORT_VIDEO;
+    if ( !fec_port ) fec_port = RASPIFPV_PORT_FEC;
+    if ( !fec_repair ) fec_repair = DEFAULT_FEC_REPAIR;
+
+    FPVRTPSender *sender = fpv_rtp_sender_new(pipeline, multicast_addr, port);
+    if ( !sender ) return NULL;
+
+    fpv_rtp_sender_set_pacing(sender, pacing, video_framerate ? video_framerate : DEFAULT_VIDEO_FRAMERATE);
+    if ( fec_group > 0 && !fpv_rtp_sender_enable_fec(sender, fec_port, fec_group, fec_repair) ) {
+        fpv_rtp_sender_dispose(sender);
+        return NULL;
+    }
+    return sender;
+}
+
+static FPVLatencyStamper* init_latency_stamper(GKeyFile *keyfile, GstPipeline *pipeline, FPVRTPSender *sender) {
+    if ( !keyfile || !g_key_file_get_boolean(keyfile, "Video", "measure_latency", NULL) ) return NULL;
+    return fpv_latency_stamper_new(pipeline, sender);
+}
+
+static FPVVideoControl* init_video_control(GKeyFile *keyfile, GstPipeline *pipeline, FPVRTPSender *sender,
+                                           FPVAdaptiveBitrate *adaptive_bitrate, const FPVVideoSettings *settings) {
+    char * socket_path = keyfile ? g_key_file_get_string(keyfile, "Video", "control_socket", NULL) : NULL;
+
+    FPVVideoControl *control = fpv_video_control_new(pipeline, sender, adaptive_bitrate, settings);
+    if ( control && keyfile && g_key_file_get_boolean(keyfile, "Video", "intra_refresh", NULL)
+            && !fpv_video_control_set_intra_refresh(control, 1) ) {
+        g_print("The encoder doesn't do intra refresh; sending IDR frames instead\n");
+    }
+    if ( control && !(socket_path && !*socket_path) ) {
+        if ( !fpv_video_control_start(control, socket_path ? socket_path : RASPIFPV_DEFAULT_CONTROL_PATH) ) {
+            g_print("Couldn't open the video control socket; settings can still be reloaded with SIGHUP\n");
+        }
+    }
+    g_free(socket_path);
+    return control;
+}
+
 static char *config_path = NULL;
+
+static gboolean on_reload(gpointer user_data) {
+    FPVVideoControl *video_control = (FPVVideoControl*)user_data;
+    const char *path = config_path ? config_path : RASPIFPV_DEFAULT_CONFIG_PATH;
+
+    // Only the video settings; everything else still needs a restart
+    GError *error = NULL;
+    GKeyFile *keyfile = g_key_file_new();
+    if ( g_key_file_load_from_file(keyfile, path, 0, &error) ) {
+        FPVVideoSettings settings;
+        char message[128];
+        read_video_settings(keyfile, &settings);
+        if ( !fpv_video_control_apply(video_control, &settings, message, sizeof(message)) ) {
+            g_print("Couldn't apply video settings from %s: %s\n", path, message);
+        }
+    } else {
+        g_print("Couldn't reload config %s: %s\n", path, error->message);
+        g_error_free(error);
+    }
+    g_key_file_free(keyfile);
+    return G_SOURCE_CONTINUE;
+}
 static GOptionEntry options[] = {
     { "config", 0, 0, G_OPTION_ARG_FILENAME, &config_path, "Config file path (default " RASPIFPV_DEFAULT_CONFIG_PATH ")", "PATH"},
     NULL
@@ -207,12 +373,30 @@ int main(int argc, char ** argv) {
 
     // Init GStreamer
     gst_init(&argc, &argv);
-    GstPipeline *pipeline = init_gst_pipeline(keyfile);
+    FPVVideoSettings video_settings;
+    read_video_settings(keyfile, &video_settings);
+    GstPipeline *pipeline = init_gst_pipeline(keyfile, &video_settings);
     GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
     gst_bus_add_signal_watch(bus);
     g_signal_connect(G_OBJECT(bus), "message", G_CALLBACK(on_message), loop);
     gst_object_unref(GST_OBJECT(bus));
 
+    // Init adaptive bitrate; without it the encoder keeps its configured bitrate
+    FPVAdaptiveBitrate *adaptive_bitrate = init_adaptive_bitrate(keyfile, pipeline);
+
+    // Init RTP sender
+    FPVRTPSender *rtp_sender = init_rtp_sender(keyfile, pipeline);
+    if ( !rtp_sender ) {
+        exit(1);
+    }
+
+    // Init latency stamps, for the ground station to measure against
+    FPVLatencyStamper *latency_stamper = init_latency_stamper(keyfile, pipeline, rtp_sender);
+
+    // Init live video settings, from the control socket or a config reload on SIGHUP
+    FPVVideoControl *video_control = init_video_control(keyfile, pipeline, rtp_sender, adaptive_bitrate, &video_settings);
+    guint reload_watch = video_control ? g_unix_signal_add(SIGHUP, on_reload, video_control) : 0;
+
     // Start telemetry
     int started = fpv_telemetry_tx_sender_start(telemetry_tx);
     g_assert(started);
@@ -220,11 +404,36 @@ int main(int argc, char ** argv) {
     // Start video pipeline
     gst_element_set_state(GST_ELEMENT(pipeline), GST_STATE_PLAYING);
 
+    // Start listening for link feedback: reports for adaptive bitrate, clock requests for latency,
+    // keyframe requests after the ground station loses video
+    gboolean keyframe_requests = keyfile && g_key_file_get_boolean(keyfile, "Video", "keyframe_requests", NULL);
+    FPVFeedbackServer *feedback_server = adaptive_bitrate || latency_stamper || keyframe_requests ? init_feedback_server(keyfile) : NULL;
+    if ( adaptive_bitrate && (!feedback_server || !fpv_adaptive_bitrate_start(adaptive_bitrate, feedback_server)) ) {
+        g_print("Couldn't start adaptive bitrate; continuing at a fixed bitrate\n");
+    }
+    if ( keyframe_requests ) {
+        if ( feedback_server && video_control ) {
+            fpv_video_control_start_keyframe_requests(video_control, feedback_server);
+        } else {
+            g_print("Couldn't take keyframe requests; the ground station will wait for periodic keyframes\n");
+        }
+    }
+
     // Run main loop
     g_main_loop_run (loop);
 
     // Stop video pipeline and clean up
+    if ( reload_watch ) g_source_remove(reload_watch);
+    if ( video_control ) {
+        fpv_video_control_stop(video_control);
+        fpv_video_control_stop_keyframe_requests(video_control);
+    }
+    if ( adaptive_bitrate ) fpv_adaptive_bitrate_dispose(adaptive_bitrate);
+    if ( feedback_server ) fpv_feedback_server_dispose(feedback_server);
     gst_element_set_state(GST_ELEMENT(pipeline), GST_STATE_NULL);
+    if ( latency_stamper ) fpv_latency_stamper_dispose(latency_stamper);
+    if ( video_control ) fpv_video_control_dispose(video_control);
+    fpv_rtp_sender_dispose(rtp_sender);
     gst_object_unref (pipeline);
     g_main_destroy(loop);
     fpv_telemetry_tx_dispose(telemetry_tx);
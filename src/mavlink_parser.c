@@ -0,0 +1,345 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mavlink_parser.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <math.h>
+
+#define MAVLINK_BUFFER_SIZE 2048
+#define MAVLINK_MAX_PAYLOAD_LENGTH 255
+static const uint8_t MAVLINK_V1_STX = 0xFE;
+static const uint8_t MAVLINK_V2_STX = 0xFD;
+static const int MAVLINK_V1_HEADER_LENGTH = 6;
+static const int MAVLINK_V2_HEADER_LENGTH = 10;
+static const int MAVLINK_CHECKSUM_LENGTH = 2;
+static const int MAVLINK_SIGNATURE_LENGTH = 13;
+static const uint8_t MAVLINK_IFLAG_SIGNED = 0x01;
+static const double RADIANS_TO_DEGREES = 180.0 / M_PI;
+
+enum {
+    MAVLINK_MSG_ID_HEARTBEAT = 0,
+    MAVLINK_MSG_ID_SYS_STATUS = 1,
+    MAVLINK_MSG_ID_ATTITUDE = 30,
+    MAVLINK_MSG_ID_GLOBAL_POSITION_INT = 33,
+    MAVLINK_MSG_ID_RADIO_STATUS = 109,
+    MAVLINK_MSG_ID_BATTERY_STATUS = 147
+};
+
+struct _FPVMAVLinkParser {
+    uint8_t buffer[MAVLINK_BUFFER_SIZE];
+    int start;
+    int end;
+    FPVMAVLinkParserCallback callback;
+    void * context;
+    FPVMAVLinkParserStats stats;
+};
+
+typedef int (*FPVMAVLinkHandler)(const uint8_t * payload, FPVTelemetryUpdate * update);
+
+typedef struct {
+    uint8_t known;
+    uint8_t crc_extra;          // Seeded into the CRC, so a definition mismatch fails validation
+    uint8_t length;             // Full (untruncated) payload length
+    FPVMAVLinkHandler handler;  // NULL for messages we validate but don't map
+} FPVMAVLinkMessage;
+
+#pragma mark - Forward declarations
+
+static void fpv_mavlink_parser_parse(FPVMAVLinkParser * parser);
+static int fpv_mavlink_parser_parse_message(FPVMAVLinkParser * parser, const uint8_t * data, int length);
+static int fpv_mavlink_handle_sys_status(const uint8_t * payload, FPVTelemetryUpdate * update);
+static int fpv_mavlink_handle_attitude(const uint8_t * payload, FPVTelemetryUpdate * update);
+static int fpv_mavlink_handle_global_position_int(const uint8_t * payload, FPVTelemetryUpdate * update);
+static int fpv_mavlink_handle_radio_status(const uint8_t * payload, FPVTelemetryUpdate * update);
+static int fpv_mavlink_handle_battery_status(const uint8_t * payload, FPVTelemetryUpdate * update);
+
+// Indexed by message ID; every message we map lives in the 8-bit ID range shared by v1 and v2
+static const FPVMAVLinkMessage MAVLINK_MESSAGES[256] = {
+    [MAVLINK_MSG_ID_HEARTBEAT] =           { 1, 50, 9, NULL },
+    [MAVLINK_MSG_ID_SYS_STATUS] =          { 1, 124, 31, fpv_mavlink_handle_sys_status },
+    [MAVLINK_MSG_ID_ATTITUDE] =            { 1, 39, 28, fpv_mavlink_handle_attitude },
+    [MAVLINK_MSG_ID_GLOBAL_POSITION_INT] = { 1, 104, 28, fpv_mavlink_handle_global_position_int },
+    [MAVLINK_MSG_ID_RADIO_STATUS] =        { 1, 185, 9, fpv_mavlink_handle_radio_status },
+    [MAVLINK_MSG_ID_BATTERY_STATUS] =      { 1, 154, 36, fpv_mavlink_handle_battery_status },
+};
+
+#pragma mark -
+
+FPVMAVLinkParser * fpv_mavlink_parser_new(FPVMAVLinkParserCallback callback, void * context) {
+    FPVMAVLinkParser * parser = (FPVMAVLinkParser*)calloc(1, sizeof(FPVMAVLinkParser));
+    parser->callback = callback;
+    parser->context = context;
+    return parser;
+}
+
+void fpv_mavlink_parser_dispose(FPVMAVLinkParser * parser) {
+    free(parser);
+}
+
+int fpv_mavlink_parser_read(FPVMAVLinkParser * parser, int fd) {
+    // Works for both serial ports and UDP sockets: a partial message never exceeds one frame,
+    // so there's always room left for a full datagram
+    int total = 0;
+    while ( 1 ) {
+        if ( parser->end == MAVLINK_BUFFER_SIZE ) {
+            parser->stats.resyncs += parser->end - parser->start;
+            parser->start = parser->end = 0;
+        }
+
+        int result = read(fd, parser->buffer + parser->end, MAVLINK_BUFFER_SIZE - parser->end);
+        if ( result > 0 ) {
+            parser->end += result;
+            parser->stats.bytes += result;
+            total += result;
+            fpv_mavlink_parser_parse(parser);
+        } else if ( result == 0 ) {
+            // An empty datagram is just that; on a serial port it's end of file, as when the
+            // flight controller's USB is unplugged, and the fd would poll readable forever
+            int type;
+            socklen_t type_length = sizeof(type);
+            if ( getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_length) == 0 && type == SOCK_DGRAM ) continue;
+            errno = 0;
+            return -1;
+        } else if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+            return total;
+        } else if ( errno != EINTR ) {
+            return -1;
+        }
+    }
+}
+
+void fpv_mavlink_parser_feed(FPVMAVLinkParser * parser, const uint8_t * data, int length) {
+    while ( length > 0 ) {
+        if ( parser->end == MAVLINK_BUFFER_SIZE ) {
+            parser->stats.resyncs += parser->end - parser->start;
+            parser->start = parser->end = 0;
+        }
+        int chunk = MAVLINK_BUFFER_SIZE - parser->end;
+        if ( chunk > length ) chunk = length;
+        memcpy(parser->buffer + parser->end, data, chunk);
+        parser->end += chunk;
+        parser->stats.bytes += chunk;
+        data += chunk;
+        length -= chunk;
+        fpv_mavlink_parser_parse(parser);
+    }
+}
+
+void fpv_mavlink_parser_get_stats(FPVMAVLinkParser * parser, FPVMAVLinkParserStats * stats) {
+    *stats = parser->stats;
+}
+
+#pragma mark - Parsing
+
+static void fpv_mavlink_parser_parse(FPVMAVLinkParser * parser) {
+    while ( parser->start < parser->end ) {
+        const uint8_t * data = parser->buffer + parser->start;
+        int length = parser->end - parser->start;
+
+        if ( data[0] != MAVLINK_V1_STX && data[0] != MAVLINK_V2_STX ) {
+            // Jump straight to the next candidate start marker
+            const uint8_t * p = data + 1;
+            const uint8_t * end = data + length;
+            while ( p < end && *p != MAVLINK_V1_STX && *p != MAVLINK_V2_STX ) p++;
+            parser->stats.resyncs += p - data;
+            parser->start += p - data;
+            continue;
+        }
+
+        int result = fpv_mavlink_parser_parse_message(parser, data, length);
+        if ( result == 0 ) {
+            // Incomplete message; wait for more data
+            break;
+        } else if ( result < 0 ) {
+            // Not a valid message: skip the marker and look for the next one
+            parser->start++;
+            parser->stats.resyncs++;
+        } else {
+            parser->start += result;
+        }
+    }
+
+    // Move any partial message to the front, so reads always append contiguously
+    if ( parser->start > 0 ) {
+        memmove(parser->buffer, parser->buffer + parser->start, parser->end - parser->start);
+        parser->end -= parser->start;
+        parser->start = 0;
+    }
+}
+
+static inline uint16_t crc_accumulate(uint8_t byte, uint16_t crc) {
+    // CRC-16/MCRF4XX (X.25), as used by MAVLink
+    uint8_t tmp = byte ^ (uint8_t)(crc & 0xff);
+    tmp ^= (tmp << 4);
+    return (crc >> 8) ^ ((uint16_t)tmp << 8) ^ ((uint16_t)tmp << 3) ^ (tmp >> 4);
+}
+
+static int fpv_mavlink_parser_parse_message(FPVMAVLinkParser * parser, const uint8_t * data, int length) {
+    int v2 = data[0] == MAVLINK_V2_STX;
+    int header_length = v2 ? MAVLINK_V2_HEADER_LENGTH : MAVLINK_V1_HEADER_LENGTH;
+    if ( length < header_length ) return 0;
+
+    int payload_length = data[1];
+    uint32_t message_id;
+    int message_length = header_length + payload_length + MAVLINK_CHECKSUM_LENGTH;
+    if ( v2 ) {
+        message_id = (uint32_t)data[7] | ((uint32_t)data[8] << 8) | ((uint32_t)data[9] << 16);
+        if ( data[2] & MAVLINK_IFLAG_SIGNED ) message_length += MAVLINK_SIGNATURE_LENGTH;
+    } else {
+        message_id = data[5];
+    }
+
+    const FPVMAVLinkMessage * message = message_id < 256 && MAVLINK_MESSAGES[message_id].known ? &MAVLINK_MESSAGES[message_id] : NULL;
+    if ( !v2 && message && payload_length != message->length ) {
+        // v1 payloads are never truncated, so a length mismatch means this isn't a real frame
+        return -1;
+    }
+    if ( length < message_length ) return 0;
+
+    if ( !message ) {
+        // We can't validate a message without its CRC extra byte, so only trust its length once the
+        // next frame's marker lines up with where it ends; otherwise a stray marker byte would make
+        // us skip up to 280 bytes of real frames
+        if ( length == message_length ) return 0;
+        uint8_t next = data[message_length];
+        if ( next != MAVLINK_V1_STX && next != MAVLINK_V2_STX ) return -1;
+        parser->stats.unhandled++;
+        return message_length;
+    }
+
+    uint16_t crc = 0xFFFF;
+    int i;
+    for ( i=1; i<header_length + payload_length; i++ ) {
+        crc = crc_accumulate(data[i], crc);
+    }
+    crc = crc_accumulate(message->crc_extra, crc);
+    const uint8_t * checksum = data + header_length + payload_length;
+    if ( checksum[0] != (crc & 0xff) || checksum[1] != (crc >> 8) ) {
+        parser->stats.crc_errors++;
+        return -1;
+    }
+
+    parser->stats.messages++;
+    if ( !message->handler ) return message_length;
+
+    // v2 senders strip trailing zero bytes from the payload; put them back before decoding
+    const uint8_t * payload = data + header_length;
+    uint8_t padded[MAVLINK_MAX_PAYLOAD_LENGTH];
+    if ( payload_length < message->length ) {
+        memcpy(padded, payload, payload_length);
+        memset(padded + payload_length, 0, message->length - payload_length);
+        payload = padded;
+    }
+
+    FPVTelemetryUpdate update;
+    memset(&update, 0, sizeof(update));
+    if ( message->handler(payload, &update) && parser->callback ) {
+        parser->callback(parser, &update, parser->context);
+    }
+
+    return message_length;
+}
+
+#pragma mark - Message handlers
+
+static inline uint16_t get_le16(const uint8_t *p) {
+    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+static inline uint32_t get_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline float get_float(const uint8_t *p) {
+    uint32_t bits = get_le32(p);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static int fpv_mavlink_handle_sys_status(const uint8_t * payload, FPVTelemetryUpdate * update) {
+    uint16_t voltage = get_le16(payload + 14);
+    int16_t current = (int16_t)get_le16(payload + 16);
+    if ( voltage == UINT16_MAX ) return 0;
+    update->type = TELEMETRY_TYPE_POWER;
+    update->content.power.voltage = voltage * 0.001;
+    update->content.power.current = current >= 0 ? current * 0.01 : 0.0;
+    return 1;
+}
+
+static int fpv_mavlink_handle_attitude(const uint8_t * payload, FPVTelemetryUpdate * update) {
+    update->type = TELEMETRY_TYPE_ATTITUDE;
+    update->content.attitude.roll = get_float(payload + 4) * RADIANS_TO_DEGREES;
+    update->content.attitude.pitch = get_float(payload + 8) * RADIANS_TO_DEGREES;
+    update->content.attitude.yaw = fmod(get_float(payload + 12) * RADIANS_TO_DEGREES + 360.0, 360.0);
+    return 1;
+}
+
+static int fpv_mavlink_handle_global_position_int(const uint8_t * payload, FPVTelemetryUpdate * update) {
+    int32_t latitude = (int32_t)get_le32(payload + 4);
+    int32_t longitude = (int32_t)get_le32(payload + 8);
+    if ( latitude == 0 && longitude == 0 ) return 0;
+    update->type = TELEMETRY_TYPE_POSITION;
+    update->content.position.latitude = latitude * 1e-7;
+    update->content.position.longitude = longitude * 1e-7;
+    update->content.position.altitude = (int32_t)get_le32(payload + 12) * 0.001;
+
+    uint16_t heading = get_le16(payload + 26);
+    if ( heading != UINT16_MAX ) {
+        update->content.position.bearing = heading * 0.01;
+    } else {
+        // No heading estimate: fall back to the direction of travel
+        double north = (int16_t)get_le16(payload + 20), east = (int16_t)get_le16(payload + 22);
+        update->content.position.bearing = fmod(atan2(east, north) * RADIANS_TO_DEGREES + 360.0, 360.0);
+    }
+    return 1;
+}
+
+static int fpv_mavlink_handle_radio_status(const uint8_t * payload, FPVTelemetryUpdate * update) {
+    uint8_t rssi = payload[4];
+    if ( rssi == UINT8_MAX ) return 0;
+    // SiK radios report RSSI in units that map to roughly 1.9 per dB, from -127 dBm
+    update->type = TELEMETRY_TYPE_SIGNAL;
+    update->content.signal.rssi = rssi / 1.9 - 127.0;
+    return 1;
+}
+
+static int fpv_mavlink_handle_battery_status(const uint8_t * payload, FPVTelemetryUpdate * update) {
+    // Only the primary battery feeds the power record
+    if ( payload[32] != 0 ) return 0;
+
+    double voltage = 0.0;
+    int i, cells = 0;
+    for ( i=0; i<10; i++ ) {
+        uint16_t cell = get_le16(payload + 10 + i*2);
+        if ( cell == UINT16_MAX ) continue;
+        voltage += cell * 0.001;
+        cells++;
+    }
+    if ( !cells ) return 0;
+
+    int16_t current = (int16_t)get_le16(payload + 30);
+    update->type = TELEMETRY_TYPE_POWER;
+    update->content.power.voltage = voltage;
+    update->content.power.current = current >= 0 ? current * 0.01 : 0.0;
+    return 1;
+}
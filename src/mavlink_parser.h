@@ -0,0 +1,47 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MAVLINK_PARSER_H
+#define __MAVLINK_PARSER_H
+
+#include <stdint.h>
+#include "telemetry_common.h"
+
+typedef struct {
+    uint64_t bytes;
+    uint64_t messages;
+    uint64_t crc_errors;
+    uint64_t unhandled;     // Well-formed messages with an ID we don't map to telemetry
+    uint64_t resyncs;       // Bytes skipped looking for the start of a message
+} FPVMAVLinkParserStats;
+
+typedef struct _FPVMAVLinkParser FPVMAVLinkParser;
+
+typedef void (*FPVMAVLinkParserCallback)(FPVMAVLinkParser * parser, const FPVTelemetryUpdate * update, void * context);
+
+FPVMAVLinkParser * fpv_mavlink_parser_new(FPVMAVLinkParserCallback callback, void * context);
+void fpv_mavlink_parser_dispose(FPVMAVLinkParser * parser);
+
+// Reads whatever a non-blocking serial port or UDP socket has, returning the byte count,
+// or -1 once it's gone: on a read error, or with errno 0 at a serial port's end of file
+int fpv_mavlink_parser_read(FPVMAVLinkParser * parser, int fd);
+void fpv_mavlink_parser_feed(FPVMAVLinkParser * parser, const uint8_t * data, int length);
+
+void fpv_mavlink_parser_get_stats(FPVMAVLinkParser * parser, FPVMAVLinkParserStats * stats);
+
+#endif
@@ -0,0 +1,154 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pcap_reader.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PCAP_MAX_FRAME 65536
+
+static const uint32_t PCAP_MAGIC = 0xa1b2c3d4;
+static const uint32_t PCAP_MAGIC_NANOSECONDS = 0xa1b23c4d;
+static const int PCAP_HEADER_LENGTH = 24;
+static const int PCAP_RECORD_HEADER_LENGTH = 16;
+
+enum {
+    LINKTYPE_NULL = 0,
+    LINKTYPE_ETHERNET = 1,
+    LINKTYPE_RAW = 101,
+    LINKTYPE_LINUX_SLL = 113,
+    LINKTYPE_IPV4 = 228,
+    LINKTYPE_LINUX_SLL2 = 276
+};
+
+struct _FPVPcapReader {
+    FILE *file;
+    int swapped;
+    int nanoseconds;
+    uint32_t linktype;
+    int port;
+    uint8_t frame[PCAP_MAX_FRAME];
+};
+
+#pragma mark - Forward declarations
+
+static const uint8_t * fpv_pcap_reader_payload(FPVPcapReader * reader, const uint8_t * p, int length, int * payload_length);
+
+#pragma mark -
+
+static inline uint32_t pcap_u32(const FPVPcapReader * reader, const uint8_t * p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return reader->swapped ? __builtin_bswap32(value) : value;
+}
+
+FPVPcapReader * fpv_pcap_reader_new(FILE * file, int port) {
+    uint8_t header[PCAP_HEADER_LENGTH];
+    if ( fread(header, 1, sizeof(header), file) != sizeof(header) ) return NULL;
+
+    int swapped;
+    uint32_t magic;
+    memcpy(&magic, header, sizeof(magic));
+    if ( magic == PCAP_MAGIC || magic == PCAP_MAGIC_NANOSECONDS ) {
+        swapped = 0;
+    } else if ( __builtin_bswap32(magic) == PCAP_MAGIC || __builtin_bswap32(magic) == PCAP_MAGIC_NANOSECONDS ) {
+        swapped = 1;
+        magic = __builtin_bswap32(magic);
+    } else {
+        return NULL;
+    }
+
+    FPVPcapReader *reader = (FPVPcapReader*)calloc(1, sizeof(FPVPcapReader));
+    reader->swapped = swapped;
+    reader->nanoseconds = magic == PCAP_MAGIC_NANOSECONDS;
+    reader->linktype = pcap_u32(reader, header + 20) & 0xffff;
+    reader->file = file;
+    reader->port = port;
+    return reader;
+}
+
+void fpv_pcap_reader_dispose(FPVPcapReader * reader) {
+    fclose(reader->file);
+    free(reader);
+}
+
+void fpv_pcap_reader_rewind(FPVPcapReader * reader) {
+    fseek(reader->file, PCAP_HEADER_LENGTH, SEEK_SET);
+}
+
+const uint8_t * fpv_pcap_reader_next(FPVPcapReader * reader, int * length, uint64_t * time) {
+    uint8_t header[PCAP_RECORD_HEADER_LENGTH];
+    while ( fread(header, 1, sizeof(header), reader->file) == sizeof(header) ) {
+        uint32_t captured = pcap_u32(reader, header + 8);
+        if ( captured > sizeof(reader->frame) || fread(reader->frame, 1, captured, reader->file) != captured ) break;
+
+        const uint8_t *payload = fpv_pcap_reader_payload(reader, reader->frame, captured, length);
+        if ( !payload || *length <= 0 ) continue;
+
+        uint64_t fraction = pcap_u32(reader, header + 4);
+        *time = (uint64_t)pcap_u32(reader, header) * 1000000ULL + (reader->nanoseconds ? fraction / 1000 : fraction);
+        return payload;
+    }
+    return NULL;
+}
+
+// Finds the UDP payload sent to the port, or returns NULL for any other packet
+static const uint8_t * fpv_pcap_reader_payload(FPVPcapReader * reader, const uint8_t * p, int length, int * payload_length) {
+    const uint8_t *end = p + length;
+    uint16_t ethertype = 0x0800;
+    switch ( reader->linktype ) {
+        case LINKTYPE_NULL:
+            p += 4;
+            break;
+        case LINKTYPE_ETHERNET:
+            if ( length < 14 ) return NULL;
+            ethertype = (p[12] << 8) | p[13];
+            p += 14;
+            if ( ethertype == 0x8100 && end - p >= 4 ) { // 802.1Q tag
+                ethertype = (p[2] << 8) | p[3];
+                p += 4;
+            }
+            break;
+        case LINKTYPE_LINUX_SLL:
+            if ( length < 16 ) return NULL;
+            ethertype = (p[14] << 8) | p[15];
+            p += 16;
+            break;
+        case LINKTYPE_LINUX_SLL2:
+            if ( length < 20 ) return NULL;
+            ethertype = (p[0] << 8) | p[1];
+            p += 20;
+            break;
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+            break;
+        default:
+            return NULL;
+    }
+
+    // IPv4, unfragmented, UDP
+    if ( ethertype != 0x0800 || end - p < 20 || (p[0] >> 4) != 4 ) return NULL;
+    int ip_header_length = (p[0] & 0x0f) * 4;
+    if ( p[9] != 17 || ((p[6] & 0x3f) | p[7]) != 0 || end - p < ip_header_length + 8 ) return NULL;
+    p += ip_header_length;
+
+    int udp_length = (p[4] << 8) | p[5];
+    if ( ((p[2] << 8) | p[3]) != reader->port || udp_length < 8 || udp_length > end - p ) return NULL;
+    *payload_length = udp_length - 8;
+    return p + 8;
+}
@@ -0,0 +1,43 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PCAP_READER_H
+#define __PCAP_READER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Picks the UDP payloads sent to one port out of a pcap capture (not pcapng), as
+ * tcpdump -w writes it. Understands Ethernet (with or without an 802.1Q tag), Linux
+ * cooked, BSD loopback and raw IP captures; IPv4 only, and unfragmented.
+ */
+
+typedef struct _FPVPcapReader FPVPcapReader;
+
+// Takes the file if it's a pcap capture; returns NULL, leaving it open, if not
+FPVPcapReader * fpv_pcap_reader_new(FILE * file, int port);
+void fpv_pcap_reader_dispose(FPVPcapReader * reader);
+
+void fpv_pcap_reader_rewind(FPVPcapReader * reader);
+
+// The next payload, valid until the next call, or NULL at the end of the capture. time
+// is when it was captured, in microseconds
+const uint8_t * fpv_pcap_reader_next(FPVPcapReader * reader, int * length, uint64_t * time);
+
+#endif
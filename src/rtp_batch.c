@@ -0,0 +1,350 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // sendmmsg
+#include "rtp_batch.h"
+#include "fec.h"
+#include "telemetry_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#define RTP_BATCH_PACKETS 64            // Packets, media and repair, per sendmmsg
+#define RTP_BATCH_COPY_LENGTH 2048
+
+static const int MAX_GSO_SEGMENTS = 64;
+static const int MAX_GSO_LENGTH = 65000;
+static const int PACING_BURST = 4;      // Packets sent together when pacing
+
+typedef struct {
+    struct sockaddr_in *addr;
+    int iov_start;
+    int iov_count;
+    int length;
+} rtp_packet_t;
+
+struct _FPVRTPBatch {
+    int sock;
+    int gso;
+    struct sockaddr_in video_addr;
+    struct sockaddr_in fec_addr;
+    FPVFecEncoder *fec;
+    FPVRTPBatchReleaseCallback release;
+    void *userinfo;
+
+    double pacing;
+    uint64_t frame_interval;    // Microseconds
+    uint64_t frame_start;       // When the frame being sent may start, and when the next may
+    uint64_t next_frame;
+    uint32_t frame_timestamp;
+    int frame_packets;
+    int frame_sent;
+
+    // The batch being built: packets and their pieces
+    rtp_packet_t packets[RTP_BATCH_PACKETS];
+    int packet_count;
+    int media_count;
+    struct iovec iov[RTP_BATCH_PACKETS * RTP_BATCH_MAX_PIECES];
+    int iov_count;
+    uint8_t copies[RTP_BATCH_PACKETS][RTP_BATCH_COPY_LENGTH];
+
+    struct mmsghdr messages[RTP_BATCH_PACKETS];
+    int message_packets[RTP_BATCH_PACKETS][2];  // First packet and count for each message
+    uint8_t controls[RTP_BATCH_PACKETS][CMSG_SPACE(sizeof(uint16_t))];
+
+    FPVRTPBatchStats stats;
+};
+
+#pragma mark - Forward declarations
+
+static void fpv_rtp_batch_queue_repair(FPVRTPBatch * batch, uint8_t * data, int length);
+static void fpv_rtp_batch_flush(FPVRTPBatch * batch);
+static void fpv_rtp_batch_send_singly(FPVRTPBatch * batch, int first, int count);
+
+#pragma mark -
+
+FPVRTPBatch * fpv_rtp_batch_new(const char * address, int port, FPVRTPBatchReleaseCallback release, void * userinfo) {
+    FPVRTPBatch *batch = (FPVRTPBatch*)calloc(1, sizeof(FPVRTPBatch));
+    batch->video_addr.sin_family = AF_INET;
+    if ( !inet_pton(AF_INET, address, &batch->video_addr.sin_addr) ) {
+        fprintf(stderr, "Invalid video address '%s'\n", address);
+        free(batch);
+        return NULL;
+    }
+    batch->video_addr.sin_port = htons(port);
+    batch->release = release;
+    batch->userinfo = userinfo;
+
+    batch->sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    u_char loop = 0;
+    setsockopt(batch->sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+    // Kernels before 4.18 don't know the option at all
+    int segment = 0;
+    batch->gso = setsockopt(batch->sock, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0;
+
+    printf("Sending video to %s:%d%s\n", address, port, batch->gso ? " (UDP GSO)" : "");
+    return batch;
+}
+
+void fpv_rtp_batch_dispose(FPVRTPBatch * batch) {
+    printf("RTP sender: %llu packets, %.1f MB, %.1f packets per send call, %llu GSO sends, %llu errors\n",
+        (unsigned long long)batch->stats.packets, batch->stats.bytes / 1e6,
+        batch->stats.syscalls ? (double)batch->stats.packets / batch->stats.syscalls : 0.0,
+        (unsigned long long)batch->stats.segments, (unsigned long long)batch->stats.errors);
+
+    if ( batch->fec ) {
+        FPVFecStats stats;
+        fpv_fec_encoder_get_stats(batch->fec, &stats);
+        printf("FEC: %llu groups, %llu repair packets\n", (unsigned long long)stats.groups, (unsigned long long)stats.repairs);
+        fpv_fec_encoder_dispose(batch->fec);
+    }
+
+    close(batch->sock);
+    free(batch);
+}
+
+void fpv_rtp_batch_set_pacing(FPVRTPBatch * batch, double pacing, int framerate) {
+    batch->pacing = pacing > 1.0 ? 1.0 : pacing < 0 ? 0 : pacing;
+    batch->frame_interval = framerate > 0 ? 1000000 / framerate : 0;
+}
+
+void fpv_rtp_batch_set_framerate(FPVRTPBatch * batch, int framerate) {
+    batch->frame_interval = framerate > 0 ? 1000000 / framerate : 0;
+}
+
+int fpv_rtp_batch_enable_fec(FPVRTPBatch * batch, int fec_port, int k, int m) {
+    batch->fec = fpv_fec_encoder_new(k, m);
+    if ( !batch->fec ) {
+        fprintf(stderr, "FEC groups must have 1-%d media and 1-%d repair packets\n", FEC_MAX_MEDIA_PACKETS, FEC_MAX_REPAIR_PACKETS);
+        return 0;
+    }
+    batch->fec_addr = batch->video_addr;
+    batch->fec_addr.sin_port = htons(fec_port);
+
+    char address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &batch->fec_addr.sin_addr, address, sizeof(address));
+    printf("Sending FEC to %s:%d, %d repair packets per %d media packets\n", address, fec_port, m, k);
+    return 1;
+}
+
+int fpv_rtp_batch_set_gso(FPVRTPBatch * batch, int enabled) {
+    int segment = 0;
+    batch->gso = enabled && setsockopt(batch->sock, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0;
+    return batch->gso;
+}
+
+void fpv_rtp_batch_begin_frame(FPVRTPBatch * batch, int packets, uint32_t timestamp) {
+    if ( batch->pacing > 0 && batch->frame_interval ) {
+        uint64_t now = fpv_telemetry_now();
+        if ( batch->frame_packets && timestamp == batch->frame_timestamp ) {
+            // More of the same frame: spread it over what's left of the slot
+            batch->frame_start = now < batch->next_frame ? now : batch->next_frame;
+        } else {
+            batch->frame_start = batch->next_frame > now ? batch->next_frame : now;
+            batch->next_frame = batch->frame_start + (uint64_t)(batch->frame_interval * batch->pacing);
+            batch->frame_timestamp = timestamp;
+        }
+        batch->frame_packets = packets;
+        batch->frame_sent = 0;
+    }
+}
+
+void fpv_rtp_batch_queue(FPVRTPBatch * batch, const struct iovec * iov, int count) {
+    rtp_packet_t *packet = &batch->packets[batch->packet_count];
+    packet->addr = &batch->video_addr;
+    packet->iov_start = batch->iov_count;
+    packet->length = 0;
+
+    int i;
+    if ( count <= RTP_BATCH_MAX_PIECES ) {
+        for ( i=0; i<count; i++ ) {
+            batch->iov[batch->iov_count++] = iov[i];
+            packet->length += iov[i].iov_len;
+        }
+    } else {
+        uint8_t *copy = batch->copies[batch->packet_count];
+        for ( i=0; i<count && packet->length < RTP_BATCH_COPY_LENGTH; i++ ) {
+            int length = iov[i].iov_len;
+            if ( packet->length + length > RTP_BATCH_COPY_LENGTH ) length = RTP_BATCH_COPY_LENGTH - packet->length;
+            memcpy(copy + packet->length, iov[i].iov_base, length);
+            packet->length += length;
+        }
+        batch->iov[batch->iov_count].iov_base = copy;
+        batch->iov[batch->iov_count].iov_len = packet->length;
+        batch->iov_count++;
+    }
+    packet->iov_count = batch->iov_count - packet->iov_start;
+    batch->packet_count++;
+    batch->media_count++;
+
+    if ( batch->fec ) {
+        uint8_t **repair;
+        int *repair_lengths;
+        int repairs = fpv_fec_encoder_addv(batch->fec, &batch->iov[packet->iov_start], packet->iov_count, &repair, &repair_lengths);
+        for ( i=0; i<repairs; i++ ) {
+            fpv_rtp_batch_queue_repair(batch, repair[i], repair_lengths[i]);
+        }
+
+        // The encoder reuses its repair buffers for the next group
+        if ( repairs ) fpv_rtp_batch_flush(batch);
+    }
+
+    // Keep room for another packet and a full group's repair
+    if ( batch->packet_count + 1 + FEC_MAX_REPAIR_PACKETS > RTP_BATCH_PACKETS
+            || batch->iov_count + RTP_BATCH_MAX_PIECES + FEC_MAX_REPAIR_PACKETS > RTP_BATCH_PACKETS * RTP_BATCH_MAX_PIECES
+            || (batch->pacing > 0 && batch->media_count >= PACING_BURST) ) {
+        fpv_rtp_batch_flush(batch);
+    }
+}
+
+void fpv_rtp_batch_end_frame(FPVRTPBatch * batch) {
+    fpv_rtp_batch_flush(batch);
+    batch->stats.last_sent = fpv_telemetry_now();
+}
+
+void fpv_rtp_batch_get_stats(FPVRTPBatch * batch, FPVRTPBatchStats * stats) {
+    *stats = batch->stats;
+}
+
+#pragma mark - Sending
+
+static void fpv_rtp_batch_queue_repair(FPVRTPBatch * batch, uint8_t * data, int length) {
+    rtp_packet_t *packet = &batch->packets[batch->packet_count++];
+    packet->addr = &batch->fec_addr;
+    packet->iov_start = batch->iov_count;
+    packet->iov_count = 1;
+    packet->length = length;
+    batch->iov[batch->iov_count].iov_base = data;
+    batch->iov[batch->iov_count].iov_len = length;
+    batch->iov_count++;
+}
+
+static void fpv_rtp_batch_flush(FPVRTPBatch * batch) {
+    if ( !batch->packet_count ) return;
+
+    // Pace against absolute deadlines through the frame, so send time doesn't accumulate
+    if ( batch->pacing > 0 && batch->frame_packets ) {
+        uint64_t deadline = batch->frame_start + (batch->next_frame - batch->frame_start) * batch->frame_sent / batch->frame_packets;
+        struct timespec when = { .tv_sec = deadline / 1000000ULL, .tv_nsec = (deadline % 1000000ULL) * 1000 };
+        while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) == EINTR );
+        batch->frame_sent += batch->media_count;
+    }
+
+    // Coalesce runs of same-sized packets to one destination into GSO sends; only the
+    // last packet of a run may be shorter
+    int count = 0, i = 0;
+    while ( i < batch->packet_count ) {
+        rtp_packet_t *first = &batch->packets[i];
+        int n = 1, length = first->length, iov_count = first->iov_count;
+        if ( batch->gso ) {
+            while ( i + n < batch->packet_count && n < MAX_GSO_SEGMENTS ) {
+                rtp_packet_t *next = &batch->packets[i + n];
+                if ( next->addr != first->addr || next->length > first->length
+                        || batch->packets[i + n - 1].length != first->length || length + next->length > MAX_GSO_LENGTH ) break;
+                length += next->length;
+                iov_count += next->iov_count;
+                n++;
+            }
+        }
+
+        struct msghdr *message = &batch->messages[count].msg_hdr;
+        memset(message, 0, sizeof(*message));
+        message->msg_name = first->addr;
+        message->msg_namelen = sizeof(*first->addr);
+        message->msg_iov = &batch->iov[first->iov_start];
+        message->msg_iovlen = iov_count;
+        if ( n > 1 ) {
+            message->msg_control = batch->controls[count];
+            message->msg_controllen = sizeof(batch->controls[count]);
+            struct cmsghdr *control = CMSG_FIRSTHDR(message);
+            control->cmsg_level = SOL_UDP;
+            control->cmsg_type = UDP_SEGMENT;
+            control->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t segment = first->length;
+            memcpy(CMSG_DATA(control), &segment, sizeof(segment));
+        }
+        batch->message_packets[count][0] = i;
+        batch->message_packets[count][1] = n;
+        count++;
+        i += n;
+    }
+
+    int sent = 0;
+    while ( sent < count ) {
+        int result = sendmmsg(batch->sock, batch->messages + sent, count - sent, 0);
+        batch->stats.syscalls++;
+        if ( result < 0 ) {
+            if ( errno == EINTR ) continue;
+
+            // Some drivers can't take GSO (no checksum offload); send that message's packets
+            // one at a time, and stop coalescing
+            int n = batch->message_packets[sent][1];
+            if ( n > 1 ) {
+                batch->gso = 0;
+                fpv_rtp_batch_send_singly(batch, batch->message_packets[sent][0], n);
+            } else {
+                batch->stats.errors++;
+            }
+            sent++;
+            continue;
+        }
+        for ( i=sent; i<sent+result; i++ ) {
+            int n = batch->message_packets[i][1];
+            batch->stats.packets += n;
+            batch->stats.bytes += batch->messages[i].msg_len;
+            if ( n > 1 ) batch->stats.segments++;
+        }
+        sent += result;
+    }
+
+    batch->iov_count = batch->packet_count = batch->media_count = 0;
+    if ( batch->release ) batch->release(batch->userinfo);
+}
+
+static void fpv_rtp_batch_send_singly(FPVRTPBatch * batch, int first, int count) {
+    int i;
+    for ( i=first; i<first+count; i++ ) {
+        rtp_packet_t *packet = &batch->packets[i];
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_name = packet->addr;
+        message.msg_namelen = sizeof(*packet->addr);
+        message.msg_iov = &batch->iov[packet->iov_start];
+        message.msg_iovlen = packet->iov_count;
+        ssize_t result = sendmsg(batch->sock, &message, 0);
+        batch->stats.syscalls++;
+        if ( result < 0 ) {
+            batch->stats.errors++;
+        } else {
+            batch->stats.packets++;
+            batch->stats.bytes += result;
+        }
+    }
+}
@@ -0,0 +1,74 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RTP_BATCH_H
+#define __RTP_BATCH_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * The sending half of the RTP sender, apart from GStreamer. Packets are queued as the
+ * caller's own pieces of memory and go out many per sendmmsg call, with runs of
+ * equal-sized packets as a single UDP GSO segment where the kernel supports it. FEC
+ * repair (see fec.h) goes out in the same batches, right behind the group it covers.
+ * Optionally, each frame's packets are paced out over part of the frame interval rather
+ * than bursting into the radio's queue.
+ */
+
+#define RTP_BATCH_MAX_PIECES 8      // Pieces per packet sent in place; packets in more are copied
+
+typedef struct {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t syscalls;
+    uint64_t segments;      // GSO sends, each covering several packets
+    uint64_t errors;
+    uint64_t last_sent;     // Monotonic microseconds when the last frame's packets had all gone
+} FPVRTPBatchStats;
+
+// Called after each send, once every packet queued so far has been copied by the kernel
+// and its memory may be released
+typedef void (*FPVRTPBatchReleaseCallback)(void * userinfo);
+
+typedef struct _FPVRTPBatch FPVRTPBatch;
+
+FPVRTPBatch * fpv_rtp_batch_new(const char * address, int port, FPVRTPBatchReleaseCallback release, void * userinfo);
+void fpv_rtp_batch_dispose(FPVRTPBatch * batch);
+
+// pacing is the fraction of the frame interval to spread a frame's packets over; 0, the
+// default, sends each frame as fast as possible
+void fpv_rtp_batch_set_pacing(FPVRTPBatch * batch, double pacing, int framerate);
+void fpv_rtp_batch_set_framerate(FPVRTPBatch * batch, int framerate);
+int fpv_rtp_batch_enable_fec(FPVRTPBatch * batch, int fec_port, int k, int m);
+
+// GSO is used where the kernel has it, unless turned off; returns whether it's in use
+int fpv_rtp_batch_set_gso(FPVRTPBatch * batch, int enabled);
+
+// A frame of the given number of packets, with the RTP timestamp they carry: queue each,
+// then end the frame to send what's left. Packets in up to RTP_BATCH_MAX_PIECES pieces are
+// sent in place, so their memory must stay put until the release callback; others are
+// copied as they're queued. When pacing, a frame with the same timestamp as the one before
+// it, like a keyframe behind its parameter sets, shares that frame's slot.
+void fpv_rtp_batch_begin_frame(FPVRTPBatch * batch, int packets, uint32_t timestamp);
+void fpv_rtp_batch_queue(FPVRTPBatch * batch, const struct iovec * iov, int count);
+void fpv_rtp_batch_end_frame(FPVRTPBatch * batch);
+
+void fpv_rtp_batch_get_stats(FPVRTPBatch * batch, FPVRTPBatchStats * stats);
+
+#endif
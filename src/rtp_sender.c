@@ -0,0 +1,154 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rtp_sender.h"
+#include <gst/app/gstappsink.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <arpa/inet.h>
+
+#define RTP_SENDER_MAX_MAPS 512     // Memories mapped at once; the batch sends well before it holds this many pieces
+#define RTP_SENDER_MAX_MEMORIES 16  // Per buffer, as GStreamer allows
+
+struct _FPVRTPSender {
+    GstElement *sink;
+    FPVRTPBatch *batch;
+
+    // Memory mapped for the packets the batch holds
+    GstMemory *memories[RTP_SENDER_MAX_MAPS];
+    GstMapInfo maps[RTP_SENDER_MAX_MAPS];
+    int map_count;
+};
+
+#pragma mark - Forward declarations
+
+static GstFlowReturn on_new_sample(GstAppSink * sink, gpointer user_data);
+static void fpv_rtp_sender_queue(FPVRTPSender * sender, GstBuffer * buffer);
+static void fpv_rtp_sender_release(void * userinfo);
+
+#pragma mark -
+
+FPVRTPSender * fpv_rtp_sender_new(GstPipeline * pipeline, const char * address, int port) {
+    FPVRTPSender *sender = (FPVRTPSender*)calloc(1, sizeof(FPVRTPSender));
+    sender->sink = gst_bin_get_by_name(GST_BIN(pipeline), "sender");
+    if ( !sender->sink ) {
+        fprintf(stderr, "No appsink named 'sender' in the video pipeline\n");
+        free(sender);
+        return NULL;
+    }
+
+    sender->batch = fpv_rtp_batch_new(address, port, fpv_rtp_sender_release, sender);
+    if ( !sender->batch ) {
+        gst_object_unref(sender->sink);
+        free(sender);
+        return NULL;
+    }
+
+    GstAppSinkCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.new_sample = on_new_sample;
+    gst_app_sink_set_callbacks(GST_APP_SINK(sender->sink), &callbacks, sender, NULL);
+    return sender;
+}
+
+void fpv_rtp_sender_dispose(FPVRTPSender * sender) {
+    fpv_rtp_batch_dispose(sender->batch);
+    fpv_rtp_sender_release(sender);
+    gst_object_unref(sender->sink);
+    free(sender);
+}
+
+void fpv_rtp_sender_set_pacing(FPVRTPSender * sender, double pacing, int framerate) {
+    fpv_rtp_batch_set_pacing(sender->batch, pacing, framerate);
+}
+
+void fpv_rtp_sender_set_framerate(FPVRTPSender * sender, int framerate) {
+    fpv_rtp_batch_set_framerate(sender->batch, framerate);
+}
+
+int fpv_rtp_sender_enable_fec(FPVRTPSender * sender, int fec_port, int k, int m) {
+    return fpv_rtp_batch_enable_fec(sender->batch, fec_port, k, m);
+}
+
+void fpv_rtp_sender_get_stats(FPVRTPSender * sender, FPVRTPSenderStats * stats) {
+    fpv_rtp_batch_get_stats(sender->batch, stats);
+}
+
+static GstFlowReturn on_new_sample(GstAppSink * sink, gpointer user_data) {
+    FPVRTPSender *sender = (FPVRTPSender*)user_data;
+    GstSample *sample = gst_app_sink_pull_sample(sink);
+    if ( !sample ) return GST_FLOW_EOS;
+
+    // The payloader pushes a list per frame, or per NAL unit for parameter sets
+    GstBufferList *list = gst_sample_get_buffer_list(sample);
+    guint i, count = list ? gst_buffer_list_length(list) : 1;
+
+    // Parameter sets carry the keyframe's timestamp, so the batch paces them as part of it
+    uint32_t timestamp = 0;
+    GstBuffer *first = list ? (count ? gst_buffer_list_get(list, 0) : NULL) : gst_sample_get_buffer(sample);
+    if ( first ) gst_buffer_extract(first, 4, &timestamp, sizeof(timestamp));
+
+    fpv_rtp_batch_begin_frame(sender->batch, count, ntohl(timestamp));
+    if ( list ) {
+        for ( i=0; i<count; i++ ) {
+            fpv_rtp_sender_queue(sender, gst_buffer_list_get(list, i));
+        }
+    } else if ( gst_sample_get_buffer(sample) ) {
+        fpv_rtp_sender_queue(sender, gst_sample_get_buffer(sample));
+    }
+    fpv_rtp_batch_end_frame(sender->batch);
+
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
+
+static void fpv_rtp_sender_queue(FPVRTPSender * sender, GstBuffer * buffer) {
+    struct iovec iov[RTP_SENDER_MAX_MEMORIES];
+    int first = sender->map_count, count = 0;
+    guint pieces = gst_buffer_n_memory(buffer), i;
+
+    // rtph264pay's header and payload stay in their own memories; the batch sends them as they are
+    for ( i=0; i<pieces && i<RTP_SENDER_MAX_MEMORIES; i++ ) {
+        GstMemory *memory = gst_buffer_peek_memory(buffer, i);
+        GstMapInfo *map = &sender->maps[sender->map_count];
+        if ( !gst_memory_map(memory, map, GST_MAP_READ) ) continue;
+        sender->memories[sender->map_count++] = memory;
+        iov[count].iov_base = map->data;
+        iov[count].iov_len = map->size;
+        count++;
+    }
+    fpv_rtp_batch_queue(sender->batch, iov, count);
+
+    // Packets in more pieces than the batch sends in place have been copied already
+    if ( count > RTP_BATCH_MAX_PIECES ) {
+        while ( sender->map_count > first ) {
+            sender->map_count--;
+            gst_memory_unmap(sender->memories[sender->map_count], &sender->maps[sender->map_count]);
+        }
+    }
+}
+
+static void fpv_rtp_sender_release(void * userinfo) {
+    FPVRTPSender *sender = (FPVRTPSender*)userinfo;
+    int i;
+    for ( i=0; i<sender->map_count; i++ ) {
+        gst_memory_unmap(sender->memories[i], &sender->maps[i]);
+    }
+    sender->map_count = 0;
+}
@@ -0,0 +1,51 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RTP_SENDER_H
+#define __RTP_SENDER_H
+
+#include <gst/gst.h>
+#include "rtp_batch.h"
+
+/*
+ * Sends the video pipeline's RTP packets in place of udpsink. The payloader's output
+ * arrives at an appsink (named "sender", with buffer-list=true) a frame's packets at a
+ * time, and goes to an FPVRTPBatch (see rtp_batch.h) straight from the buffers' memory.
+ */
+
+typedef FPVRTPBatchStats FPVRTPSenderStats;
+
+typedef struct _FPVRTPSender FPVRTPSender;
+
+FPVRTPSender * fpv_rtp_sender_new(GstPipeline * pipeline, const char * address, int port);
+
+// Only once the pipeline has stopped
+void fpv_rtp_sender_dispose(FPVRTPSender * sender);
+
+// Before the pipeline starts. pacing is the fraction of the frame interval to spread a
+// frame's packets over; 0, the default, sends each frame as fast as possible
+void fpv_rtp_sender_set_pacing(FPVRTPSender * sender, double pacing, int framerate);
+int fpv_rtp_sender_enable_fec(FPVRTPSender * sender, int fec_port, int k, int m);
+
+// From the streaming thread, when the framerate is renegotiated
+void fpv_rtp_sender_set_framerate(FPVRTPSender * sender, int framerate);
+
+// From the streaming thread, or once the pipeline has stopped
+void fpv_rtp_sender_get_stats(FPVRTPSender * sender, FPVRTPSenderStats * stats);
+
+#endif
@@ -0,0 +1,85 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sensor_filter.h"
+#include <string.h>
+
+void fpv_sensor_filter_init(FPVSensorFilter *filter, const FPVSensorFilterConfig *config) {
+    memset(filter, 0, sizeof(FPVSensorFilter));
+
+    filter->config.median = config && config->median > 1 ? config->median | 1 : 1;
+    if ( filter->config.median > SENSOR_FILTER_MAX_MEDIAN ) filter->config.median = SENSOR_FILTER_MAX_MEDIAN;
+
+    filter->config.oversample = config && config->oversample > 1 ? config->oversample : 1;
+    if ( filter->config.oversample > SENSOR_FILTER_MAX_OVERSAMPLE ) filter->config.oversample = SENSOR_FILTER_MAX_OVERSAMPLE;
+
+    filter->config.lowpass_shift = config && config->lowpass_shift > 0 ? config->lowpass_shift : 0;
+    if ( filter->config.lowpass_shift > 15 ) filter->config.lowpass_shift = 15;
+}
+
+void fpv_sensor_filter_reset(FPVSensorFilter *filter) {
+    FPVSensorFilterConfig config = filter->config;
+    fpv_sensor_filter_init(filter, &config);
+}
+
+static uint16_t fpv_sensor_filter_median(FPVSensorFilter *filter, uint16_t sample) {
+    filter->median_window[filter->median_index] = sample;
+    filter->median_index = (filter->median_index + 1) % filter->config.median;
+    if ( filter->median_count < filter->config.median ) filter->median_count++;
+
+    // Insertion sort a copy of the window; it's at most SENSOR_FILTER_MAX_MEDIAN long
+    uint16_t sorted[SENSOR_FILTER_MAX_MEDIAN];
+    int i, j;
+    for ( i=0; i<filter->median_count; i++ ) {
+        uint16_t value = filter->median_window[i];
+        for ( j=i; j>0 && sorted[j-1] > value; j-- ) {
+            sorted[j] = sorted[j-1];
+        }
+        sorted[j] = value;
+    }
+    return sorted[filter->median_count / 2];
+}
+
+int fpv_sensor_filter_push(FPVSensorFilter *filter, uint16_t sample, int32_t *output) {
+    if ( filter->config.median > 1 ) {
+        sample = fpv_sensor_filter_median(filter, sample);
+    }
+
+    filter->accumulator += sample;
+    if ( ++filter->accumulated < filter->config.oversample ) {
+        return 0;
+    }
+
+    // Decimate: the average gains log2(oversample)/2 bits of resolution, which Q16 keeps
+    int32_t value = (int32_t)(((uint64_t)filter->accumulator << SENSOR_FILTER_Q) / filter->accumulated);
+    filter->accumulator = 0;
+    filter->accumulated = 0;
+
+    if ( filter->config.lowpass_shift ) {
+        if ( !filter->lowpass_primed ) {
+            filter->lowpass = value;
+            filter->lowpass_primed = 1;
+        } else {
+            filter->lowpass += (value - filter->lowpass) >> filter->config.lowpass_shift;
+        }
+        value = filter->lowpass;
+    }
+
+    *output = value;
+    return 1;
+}
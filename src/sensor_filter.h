@@ -0,0 +1,60 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SENSOR_FILTER_H
+#define __SENSOR_FILTER_H
+
+#include <stdint.h>
+
+/*
+ * Fixed-point filter chain for raw ADC samples: a median-of-N spike filter, then
+ * oversample-and-decimate, then a first-order IIR low-pass. Outputs are in Q16
+ * (ADC counts << 16). Filters are plain structs with no allocation, so one can be
+ * embedded per channel and pushed at kHz sample rates.
+ */
+
+#define SENSOR_FILTER_MAX_MEDIAN 9
+#define SENSOR_FILTER_MAX_OVERSAMPLE 64
+#define SENSOR_FILTER_Q 16
+
+typedef struct {
+    int median;         // Median window length (odd, 1 disables)
+    int oversample;     // Samples averaged per output (1 disables)
+    int lowpass_shift;  // Low-pass smoothing, y += (x - y) / 2^shift (0 disables)
+} FPVSensorFilterConfig;
+
+typedef struct {
+    FPVSensorFilterConfig config;
+
+    uint16_t median_window[SENSOR_FILTER_MAX_MEDIAN];
+    int median_count;
+    int median_index;
+
+    uint32_t accumulator;
+    int accumulated;
+
+    int32_t lowpass;
+    int lowpass_primed;
+} FPVSensorFilter;
+
+void fpv_sensor_filter_init(FPVSensorFilter *filter, const FPVSensorFilterConfig *config);
+void fpv_sensor_filter_reset(FPVSensorFilter *filter);
+
+int fpv_sensor_filter_push(FPVSensorFilter *filter, uint16_t sample, int32_t *output);
+
+#endif
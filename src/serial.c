@@ -0,0 +1,80 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "serial.h"
+#include <stdio.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+static speed_t serial_speed(int baud) {
+    switch ( baud ) {
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        case 921600: return B921600;
+        default: return 0;
+    }
+}
+
+int serial_open(const char *device, int baud) {
+    int fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if ( fd == -1 ) {
+        fprintf(stderr, "Couldn't open serial device %s: %s\n", device, strerror(errno));
+        return -1;
+    }
+
+    // Pseudo-terminals (used to replay recorded logs) have no line settings to configure
+    struct termios tio;
+    if ( tcgetattr(fd, &tio) == -1 ) {
+        return fd;
+    }
+
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    // With VMIN 0 an empty read returns 0, which the parsers take as end of file; with VMIN 1 and
+    // O_NONBLOCK it fails with EAGAIN, and 0 only comes once the device hangs up
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+
+    speed_t speed = serial_speed(baud);
+    if ( baud && !speed ) {
+        fprintf(stderr, "Unsupported baud rate %d for %s\n", baud, device);
+        close(fd);
+        return -1;
+    }
+    if ( speed ) {
+        cfsetispeed(&tio, speed);
+        cfsetospeed(&tio, speed);
+    }
+
+    if ( tcsetattr(fd, TCSANOW, &tio) == -1 ) {
+        fprintf(stderr, "Couldn't configure serial device %s: %s\n", device, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
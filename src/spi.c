@@ -25,6 +25,7 @@
 #include <sys/ioctl.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
 struct _SPIInterface {
     int fd;
@@ -81,3 +82,34 @@ int spi_transaction(SPIInterface *spi, uint8_t *txbuffer, uint8_t *rxbuffer, int
     return 0;
 }
 
+
+int spi_transaction_batch(SPIInterface *spi, SPITransfer *transfers, int count) {
+    if ( count <= 0 ) return 0;
+    if ( count > SPI_MAX_BATCH_TRANSFERS ) {
+        fprintf(stderr, "Too many SPI transfers in one batch (%d, max %d)\n", count, SPI_MAX_BATCH_TRANSFERS);
+        return -1;
+    }
+
+    struct spi_ioc_transfer transfer[SPI_MAX_BATCH_TRANSFERS];
+    memset(transfer, 0, sizeof(struct spi_ioc_transfer) * count);
+
+    int i;
+    for ( i=0; i<count; i++ ) {
+        transfer[i].tx_buf = (unsigned long)transfers[i].txbuffer;
+        transfer[i].rx_buf = (unsigned long)transfers[i].rxbuffer;
+        transfer[i].len = transfers[i].length;
+        transfer[i].speed_hz = spi->max_speed;
+        transfer[i].bits_per_word = spi->bits_per_word;
+        transfer[i].delay_usecs = 0;
+
+        // Deselect the device between transfers, so each one is seen as a separate transaction
+        transfer[i].cs_change = i < count-1 ? 1 : 0;
+    }
+
+    if ( ioctl(spi->fd, SPI_IOC_MESSAGE(count), transfer) < 0 ) {
+        fprintf(stderr, "Couldn't communicate with SPI interface: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
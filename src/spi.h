@@ -23,9 +23,18 @@
 
 typedef struct _SPIInterface SPIInterface;
 
+#define SPI_MAX_BATCH_TRANSFERS 16
+
+typedef struct {
+    uint8_t *txbuffer;
+    uint8_t *rxbuffer;
+    int length;
+} SPITransfer;
+
 SPIInterface * spi_new(int bus, int device);
 void spi_dispose(SPIInterface *spi);
 
 int spi_transaction(SPIInterface *spi, uint8_t *txbuffer, uint8_t *rxbuffer, int length);
+int spi_transaction_batch(SPIInterface *spi, SPITransfer *transfers, int count);
 
 #endif
\ No newline at end of file
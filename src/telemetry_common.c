@@ -17,6 +17,20 @@
  */
 
 #include "telemetry_common.h"
+#include <rpc/types.h>
+#include <rpc/xdr.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+static const int TELEMETRY_WIRE_RECORD_HEADER_LENGTH = 3;
+static const int TELEMETRY_WIRE_FRAME_HEADER_LENGTH = 9;
+static const int TELEMETRY_WIRE_VEHICLE_FRAME_HEADER_LENGTH = 10;
+static const int TELEMETRY_WIRE_TLV_HEADER_LENGTH = 2;
+static const int TELEMETRY_WIRE_POSITION_LENGTH = 14;
+static const int TELEMETRY_WIRE_POWER_LENGTH = 4;
+static const int TELEMETRY_WIRE_SIGNAL_LENGTH = 2;
+static const int TELEMETRY_WIRE_ATTITUDE_LENGTH = 6;
 
 int xdr_telemetry_update(XDR * xdrs, struct telemetry_update_t *header) {
     if ( !xdr_u_char(xdrs, &header->type) ) return 0;
@@ -37,4 +51,169 @@ int xdr_telemetry_update(XDR * xdrs, struct telemetry_update_t *header) {
         default:
             return 0;
     }
-}
\ No newline at end of file
+}
+#pragma mark - Compact wire format
+
+static inline int32_t clamp_scaled(double value, double scale, double min, double max) {
+    double scaled = value * scale;
+    scaled = scaled < min ? min : scaled > max ? max : scaled;
+    return (int32_t)lrint(scaled);
+}
+
+static inline void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint16_t get_le16(const uint8_t *p) {
+    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+static inline uint32_t get_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int fpv_telemetry_record_encode(const FPVTelemetryUpdate *update, uint8_t *p) {
+    switch ( update->type ) {
+        case TELEMETRY_TYPE_POSITION:
+            put_le32(p, clamp_scaled(update->content.position.latitude, 1e7, -900000000, 900000000));
+            put_le32(p+4, clamp_scaled(update->content.position.longitude, 1e7, -1800000000, 1800000000));
+            put_le32(p+8, clamp_scaled(update->content.position.altitude, 100, INT32_MIN, INT32_MAX));
+            put_le16(p+12, clamp_scaled(fmod(update->content.position.bearing + 360.0, 360.0), 100, 0, 35999));
+            return TELEMETRY_WIRE_POSITION_LENGTH;
+        case TELEMETRY_TYPE_POWER:
+            put_le16(p, clamp_scaled(update->content.power.voltage, 1000, 0, UINT16_MAX));
+            put_le16(p+2, clamp_scaled(update->content.power.current, 100, 0, UINT16_MAX));
+            return TELEMETRY_WIRE_POWER_LENGTH;
+        case TELEMETRY_TYPE_SIGNAL:
+            put_le16(p, clamp_scaled(update->content.signal.rssi, 100, INT16_MIN, INT16_MAX));
+            return TELEMETRY_WIRE_SIGNAL_LENGTH;
+        case TELEMETRY_TYPE_ATTITUDE:
+            put_le16(p, clamp_scaled(update->content.attitude.roll, 100, -18000, 18000));
+            put_le16(p+2, clamp_scaled(update->content.attitude.pitch, 100, -18000, 18000));
+            put_le16(p+4, clamp_scaled(fmod(update->content.attitude.yaw + 360.0, 360.0), 100, 0, 35999));
+            return TELEMETRY_WIRE_ATTITUDE_LENGTH;
+        default:
+            return 0;
+    }
+}
+
+int fpv_telemetry_record_decode(uint8_t type, const uint8_t *p, int length, FPVTelemetryUpdate *update) {
+    update->type = type;
+    switch ( type ) {
+        case TELEMETRY_TYPE_POSITION:
+            if ( length < TELEMETRY_WIRE_POSITION_LENGTH ) return 0;
+            update->content.position.latitude = (int32_t)get_le32(p) * 1e-7;
+            update->content.position.longitude = (int32_t)get_le32(p+4) * 1e-7;
+            update->content.position.altitude = (int32_t)get_le32(p+8) * 0.01;
+            update->content.position.bearing = get_le16(p+12) * 0.01;
+            return 1;
+        case TELEMETRY_TYPE_POWER:
+            if ( length < TELEMETRY_WIRE_POWER_LENGTH ) return 0;
+            update->content.power.voltage = get_le16(p) * 0.001;
+            update->content.power.current = get_le16(p+2) * 0.01;
+            return 1;
+        case TELEMETRY_TYPE_SIGNAL:
+            if ( length < TELEMETRY_WIRE_SIGNAL_LENGTH ) return 0;
+            update->content.signal.rssi = (int16_t)get_le16(p) * 0.01;
+            return 1;
+        case TELEMETRY_TYPE_ATTITUDE:
+            if ( length < TELEMETRY_WIRE_ATTITUDE_LENGTH ) return 0;
+            update->content.attitude.roll = (int16_t)get_le16(p) * 0.01;
+            update->content.attitude.pitch = (int16_t)get_le16(p+2) * 0.01;
+            update->content.attitude.yaw = get_le16(p+4) * 0.01;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+int fpv_telemetry_frame_encode(const FPVTelemetryFrame *frame, uint8_t *buffer, int length) {
+    if ( length < TELEMETRY_WIRE_MAX_LENGTH || frame->count > TELEMETRY_FRAME_MAX_RECORDS ) return 0;
+
+    // Vehicle 0 keeps sending version 2 frames, so receivers that predate vehicle IDs still understand it
+    uint8_t *p = buffer;
+    *p++ = TELEMETRY_WIRE_MAGIC;
+    *p++ = frame->vehicle_id ? TELEMETRY_WIRE_VERSION_VEHICLE_FRAME : TELEMETRY_WIRE_VERSION_FRAME;
+    *p++ = frame->flags & ~TELEMETRY_FRAME_FLAG_UNSEQUENCED;
+    if ( frame->vehicle_id ) *p++ = frame->vehicle_id;
+    put_le16(p, frame->sequence);
+    put_le32(p+2, frame->timestamp);
+    p += 6;
+
+    int i;
+    for ( i=0; i<frame->count; i++ ) {
+        int record_length = fpv_telemetry_record_encode(&frame->records[i], p + TELEMETRY_WIRE_TLV_HEADER_LENGTH);
+        if ( !record_length ) continue;
+        p[0] = frame->records[i].type;
+        p[1] = record_length;
+        p += TELEMETRY_WIRE_TLV_HEADER_LENGTH + record_length;
+    }
+
+    return p - buffer;
+}
+
+int fpv_telemetry_frame_decode(const uint8_t *buffer, int length, FPVTelemetryFrame *frame) {
+    if ( length < 2 || buffer[0] != TELEMETRY_WIRE_MAGIC ) return 0;
+
+    frame->count = 0;
+
+    if ( buffer[1] == TELEMETRY_WIRE_VERSION_RECORD ) {
+        if ( length < TELEMETRY_WIRE_RECORD_HEADER_LENGTH ) return 0;
+        frame->flags = TELEMETRY_FRAME_FLAG_UNSEQUENCED;
+        frame->vehicle_id = 0;
+        frame->sequence = 0;
+        frame->timestamp = 0;
+        if ( fpv_telemetry_record_decode(buffer[2], buffer + TELEMETRY_WIRE_RECORD_HEADER_LENGTH,
+                                         length - TELEMETRY_WIRE_RECORD_HEADER_LENGTH, &frame->records[0]) ) {
+            frame->records[0].timestamp = 0;
+            frame->records[0].vehicle_id = 0;
+            frame->count = 1;
+        }
+        return frame->count;
+    }
+
+    const uint8_t *p = buffer + 3;
+    if ( buffer[1] == TELEMETRY_WIRE_VERSION_FRAME && length >= TELEMETRY_WIRE_FRAME_HEADER_LENGTH ) {
+        frame->vehicle_id = 0;
+    } else if ( buffer[1] == TELEMETRY_WIRE_VERSION_VEHICLE_FRAME && length >= TELEMETRY_WIRE_VEHICLE_FRAME_HEADER_LENGTH ) {
+        frame->vehicle_id = *p++;
+    } else {
+        return 0;
+    }
+
+    frame->flags = buffer[2] & ~TELEMETRY_FRAME_FLAG_UNSEQUENCED;
+    frame->sequence = get_le16(p);
+    frame->timestamp = get_le32(p+2);
+    p += 6;
+
+    const uint8_t *end = buffer + length;
+    while ( end - p >= TELEMETRY_WIRE_TLV_HEADER_LENGTH && frame->count < TELEMETRY_FRAME_MAX_RECORDS ) {
+        int record_length = p[1];
+        if ( end - p < TELEMETRY_WIRE_TLV_HEADER_LENGTH + record_length ) break;
+
+        // Unknown record types are skipped, so newer senders can add records
+        FPVTelemetryUpdate *record = &frame->records[frame->count];
+        if ( fpv_telemetry_record_decode(p[0], p + TELEMETRY_WIRE_TLV_HEADER_LENGTH, record_length, record) ) {
+            record->timestamp = frame->timestamp;
+            record->vehicle_id = frame->vehicle_id;
+            frame->count++;
+        }
+        p += TELEMETRY_WIRE_TLV_HEADER_LENGTH + record_length;
+    }
+
+    return frame->count;
+}
+
+uint64_t fpv_telemetry_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
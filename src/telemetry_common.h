@@ -19,10 +19,48 @@
 #ifndef __TELEMETRY_COMMON_H
 #define __TELEMETRY_COMMON_H
 
+#include <stdint.h>
+
+/*
+ * Compact wire format. Each datagram is a frame: a magic byte and version, then
+ *
+ *   uint8 flags, uint16 sequence, uint32 sender timestamp (monotonic microseconds, wrapping)
+ *
+ * followed by type-length-value records, each a uint8 type and uint8 payload length, with
+ * payloads of packed little-endian fixed-point fields:
+ *
+ *   position: int32 latitude, int32 longitude (1e-7 degrees), int32 altitude (cm), uint16 bearing (0.01 degrees)
+ *   power:    uint16 voltage (mV), uint16 current (10 mA)
+ *   signal:   int16 rssi (0.01 dB)
+ *   attitude: int16 roll, int16 pitch, uint16 yaw (0.01 degrees)
+ *
+ * Version 3 frames insert a uint8 vehicle ID after the flags, so several aircraft can share a
+ * multicast group. Version 2 frames come from vehicle 0, and are still what vehicle 0 sends.
+ *
+ * Version 1 packets carry a single record (type, then payload) with no frame header. The magic
+ * byte can never start an XDR-encoded update, so all formats can share a port.
+ */
+#define TELEMETRY_WIRE_MAGIC 0xF5
+#define TELEMETRY_WIRE_VERSION_RECORD 1
+#define TELEMETRY_WIRE_VERSION_FRAME 2
+#define TELEMETRY_WIRE_VERSION_VEHICLE_FRAME 3
+#define TELEMETRY_WIRE_MAX_LENGTH 256
+#define TELEMETRY_WIRE_MAX_RECORD_LENGTH 14
+
+#define TELEMETRY_FRAME_MAX_RECORDS 8
+
+// Frame carries the sender's full state, not just the values that changed
+#define TELEMETRY_FRAME_FLAG_KEYFRAME 0x01
+
+// Set locally on frames decoded from a legacy packet, which has no sequence number or timestamp
+#define TELEMETRY_FRAME_FLAG_UNSEQUENCED 0x80
+
 enum {
     TELEMETRY_TYPE_POSITION,
     TELEMETRY_TYPE_POWER,
-    TELEMETRY_TYPE_SIGNAL
+    TELEMETRY_TYPE_SIGNAL,
+    TELEMETRY_TYPE_ATTITUDE,
+    TELEMETRY_TYPE_COUNT
 };
 
 struct telemetry_position_t {
@@ -41,17 +79,46 @@ struct telemetry_signal_t {
     double rssi;
 };
 
+struct telemetry_attitude_t {
+    double roll;    // Degrees, positive right wing down
+    double pitch;   // Degrees, positive nose up
+    double yaw;     // Degrees from north
+};
+
 typedef struct telemetry_update_t {
     unsigned char type;
+    uint8_t vehicle_id; // Vehicle that sent the frame carrying this record
+    uint32_t timestamp; // Sender timestamp of the frame carrying this record, microseconds
+    uint64_t received;  // Local monotonic receive time, microseconds (receivers only)
+
     union {
         struct telemetry_position_t position;
         struct telemetry_power_t power;
         struct telemetry_signal_t signal;
+        struct telemetry_attitude_t attitude;
     } content;
 } FPVTelemetryUpdate;
 
+typedef struct telemetry_frame_t {
+    uint8_t flags;
+    uint8_t vehicle_id;
+    uint16_t sequence;
+    uint32_t timestamp;
+    int count;
+    FPVTelemetryUpdate records[TELEMETRY_FRAME_MAX_RECORDS];
+} FPVTelemetryFrame;
+
 typedef struct XDR XDR;
 
 int xdr_telemetry_update(XDR * xdrs, struct telemetry_update_t *header);
 
+// Single record payloads, without type or length; encode returns the payload length
+int fpv_telemetry_record_encode(const FPVTelemetryUpdate *update, uint8_t *buffer);
+int fpv_telemetry_record_decode(uint8_t type, const uint8_t *buffer, int length, FPVTelemetryUpdate *update);
+
+int fpv_telemetry_frame_encode(const FPVTelemetryFrame *frame, uint8_t *buffer, int length);
+int fpv_telemetry_frame_decode(const uint8_t *buffer, int length, FPVTelemetryFrame *frame);
+
+uint64_t fpv_telemetry_now();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,341 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "telemetry_history.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define HISTORY_BLOCK 64
+#define HISTORY_MAX_COLUMNS 4
+
+typedef struct {
+    int columns;
+    int capacity;                               // Multiple of HISTORY_BLOCK
+    uint64_t *timestamps;
+    double *values[HISTORY_MAX_COLUMNS];
+    double *integrals[HISTORY_MAX_COLUMNS];     // Running trapezoidal integral up to each sample, value-seconds
+    double *block_min[HISTORY_MAX_COLUMNS];     // Per-block summaries, for range min/max without a full scan
+    double *block_max[HISTORY_MAX_COLUMNS];
+
+    // Samples the writer has started (reserved) and finished (committed). A reader's samples
+    // are intact as long as none of them has fallen behind reserved - capacity.
+    uint64_t reserved;
+    uint64_t committed;
+    uint64_t start;         // First sample since the history was last cleared
+} FPVTelemetrySeries;
+
+struct _FPVTelemetryHistory {
+    FPVTelemetrySeries series[TELEMETRY_TYPE_COUNT];
+};
+
+static const int TYPE_COLUMNS[TELEMETRY_TYPE_COUNT] = {
+    [TELEMETRY_TYPE_POSITION] = 4,
+    [TELEMETRY_TYPE_POWER] = 2,
+    [TELEMETRY_TYPE_SIGNAL] = 1,
+    [TELEMETRY_TYPE_ATTITUDE] = 3 };
+
+static const struct {
+    int type;
+    int column;
+} FIELD_COLUMNS[FPV_TELEMETRY_FIELD_COUNT] = {
+    [FPV_TELEMETRY_FIELD_LATITUDE] =  { TELEMETRY_TYPE_POSITION, 0 },
+    [FPV_TELEMETRY_FIELD_LONGITUDE] = { TELEMETRY_TYPE_POSITION, 1 },
+    [FPV_TELEMETRY_FIELD_ALTITUDE] =  { TELEMETRY_TYPE_POSITION, 2 },
+    [FPV_TELEMETRY_FIELD_BEARING] =   { TELEMETRY_TYPE_POSITION, 3 },
+    [FPV_TELEMETRY_FIELD_VOLTAGE] =   { TELEMETRY_TYPE_POWER, 0 },
+    [FPV_TELEMETRY_FIELD_CURRENT] =   { TELEMETRY_TYPE_POWER, 1 },
+    [FPV_TELEMETRY_FIELD_RSSI] =      { TELEMETRY_TYPE_SIGNAL, 0 },
+    [FPV_TELEMETRY_FIELD_ROLL] =      { TELEMETRY_TYPE_ATTITUDE, 0 },
+    [FPV_TELEMETRY_FIELD_PITCH] =     { TELEMETRY_TYPE_ATTITUDE, 1 },
+    [FPV_TELEMETRY_FIELD_YAW] =       { TELEMETRY_TYPE_ATTITUDE, 2 } };
+
+#pragma mark - Forward declarations
+
+static int fpv_telemetry_series_window(FPVTelemetrySeries * series, uint64_t * first, uint64_t * end);
+static int fpv_telemetry_series_intact(FPVTelemetrySeries * series, uint64_t lowest);
+static uint64_t fpv_telemetry_series_search(FPVTelemetrySeries * series, uint64_t first, uint64_t end, uint64_t timestamp);
+static double fpv_telemetry_series_integral_at(FPVTelemetrySeries * series, int column, uint64_t first, uint64_t end, uint64_t timestamp);
+
+#pragma mark -
+
+FPVTelemetryHistory * fpv_telemetry_history_new(int capacity) {
+    if ( capacity < 2 * HISTORY_BLOCK ) capacity = 2 * HISTORY_BLOCK;
+    capacity = (capacity + HISTORY_BLOCK - 1) / HISTORY_BLOCK * HISTORY_BLOCK;
+    int blocks = capacity / HISTORY_BLOCK;
+
+    FPVTelemetryHistory * history = (FPVTelemetryHistory*)calloc(1, sizeof(FPVTelemetryHistory));
+    int type, column;
+    for ( type=0; type<TELEMETRY_TYPE_COUNT; type++ ) {
+        FPVTelemetrySeries *series = &history->series[type];
+        series->columns = TYPE_COLUMNS[type];
+        series->capacity = capacity;
+        series->timestamps = (uint64_t*)malloc(capacity * sizeof(uint64_t));
+        int ok = series->timestamps != NULL;
+        for ( column=0; column<series->columns; column++ ) {
+            series->values[column] = (double*)malloc(capacity * sizeof(double));
+            series->integrals[column] = (double*)malloc(capacity * sizeof(double));
+            series->block_min[column] = (double*)malloc(blocks * sizeof(double));
+            series->block_max[column] = (double*)malloc(blocks * sizeof(double));
+            ok = ok && series->values[column] && series->integrals[column] && series->block_min[column] && series->block_max[column];
+        }
+        if ( !ok ) {
+            fprintf(stderr, "Unable to allocate telemetry history of %d samples\n", capacity);
+            fpv_telemetry_history_dispose(history);
+            return NULL;
+        }
+    }
+    return history;
+}
+
+void fpv_telemetry_history_dispose(FPVTelemetryHistory * history) {
+    int type, column;
+    for ( type=0; type<TELEMETRY_TYPE_COUNT; type++ ) {
+        FPVTelemetrySeries *series = &history->series[type];
+        free(series->timestamps);
+        for ( column=0; column<HISTORY_MAX_COLUMNS; column++ ) {
+            free(series->values[column]);
+            free(series->integrals[column]);
+            free(series->block_min[column]);
+            free(series->block_max[column]);
+        }
+    }
+    free(history);
+}
+
+void fpv_telemetry_history_add(FPVTelemetryHistory * history, const FPVTelemetryUpdate * update, uint64_t timestamp) {
+    if ( update->type >= TELEMETRY_TYPE_COUNT ) return;
+    FPVTelemetrySeries *series = &history->series[update->type];
+
+    double values[HISTORY_MAX_COLUMNS];
+    switch ( update->type ) {
+        case TELEMETRY_TYPE_POSITION:
+            values[0] = update->content.position.latitude;
+            values[1] = update->content.position.longitude;
+            values[2] = update->content.position.altitude;
+            values[3] = update->content.position.bearing;
+            break;
+        case TELEMETRY_TYPE_POWER:
+            values[0] = update->content.power.voltage;
+            values[1] = update->content.power.current;
+            break;
+        case TELEMETRY_TYPE_SIGNAL:
+            values[0] = update->content.signal.rssi;
+            break;
+        case TELEMETRY_TYPE_ATTITUDE:
+            values[0] = update->content.attitude.roll;
+            values[1] = update->content.attitude.pitch;
+            values[2] = update->content.attitude.yaw;
+            break;
+    }
+
+    // Only this thread writes, so the counters can be read plainly here
+    uint64_t index = series->committed;
+    int slot = index % series->capacity;
+    int previous = (index + series->capacity - 1) % series->capacity;
+    int block = (index / HISTORY_BLOCK) % (series->capacity / HISTORY_BLOCK);
+    double elapsed = 0.0;
+    if ( index > series->start ) {
+        // Keep timestamps ordered for the binary searches, even if the clock source hiccups
+        if ( timestamp < series->timestamps[previous] ) timestamp = series->timestamps[previous];
+        elapsed = (timestamp - series->timestamps[previous]) * 1e-6;
+    }
+
+    __atomic_store_n(&series->reserved, index + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    series->timestamps[slot] = timestamp;
+    int column;
+    for ( column=0; column<series->columns; column++ ) {
+        double value = values[column];
+        series->values[column][slot] = value;
+        series->integrals[column][slot] = index > series->start
+            ? series->integrals[column][previous] + (series->values[column][previous] + value) * 0.5 * elapsed
+            : 0.0;
+        if ( index % HISTORY_BLOCK == 0 ) {
+            series->block_min[column][block] = series->block_max[column][block] = value;
+        } else {
+            if ( value < series->block_min[column][block] ) series->block_min[column][block] = value;
+            if ( value > series->block_max[column][block] ) series->block_max[column][block] = value;
+        }
+    }
+
+    __atomic_store_n(&series->committed, index + 1, __ATOMIC_RELEASE);
+}
+
+void fpv_telemetry_history_clear(FPVTelemetryHistory * history) {
+    // Samples stay where they are; readers just stop looking before the new start
+    int type;
+    for ( type=0; type<TELEMETRY_TYPE_COUNT; type++ ) {
+        FPVTelemetrySeries *series = &history->series[type];
+        __atomic_store_n(&series->start, series->committed, __ATOMIC_RELEASE);
+    }
+}
+
+int fpv_telemetry_history_value_at(FPVTelemetryHistory * history, FPVTelemetryField field, uint64_t timestamp, double * value) {
+    if ( field < 0 || field >= FPV_TELEMETRY_FIELD_COUNT ) return 0;
+    FPVTelemetrySeries *series = &history->series[FIELD_COLUMNS[field].type];
+    int column = FIELD_COLUMNS[field].column;
+
+    uint64_t first, end;
+    double result;
+    do {
+        if ( !fpv_telemetry_series_window(series, &first, &end) ) return 0;
+        uint64_t upper = fpv_telemetry_series_search(series, first, end, timestamp);
+        if ( upper == first ) return 0;
+        result = series->values[column][(upper - 1) % series->capacity];
+    } while ( !fpv_telemetry_series_intact(series, first) );
+
+    if ( value ) *value = result;
+    return 1;
+}
+
+int fpv_telemetry_history_get_stats(FPVTelemetryHistory * history, FPVTelemetryField field, uint64_t since, uint64_t until, FPVTelemetryHistoryStats * stats) {
+    if ( field < 0 || field >= FPV_TELEMETRY_FIELD_COUNT ) return 0;
+    FPVTelemetrySeries *series = &history->series[FIELD_COLUMNS[field].type];
+    int column = FIELD_COLUMNS[field].column;
+    const double *values = series->values[column];
+    int capacity = series->capacity;
+    int blocks = capacity / HISTORY_BLOCK;
+
+    uint64_t first, end;
+    FPVTelemetryHistoryStats result;
+    do {
+        memset(&result, 0, sizeof(result));
+        if ( !fpv_telemetry_series_window(series, &first, &end) ) break;
+        uint64_t lower = since > 0 ? fpv_telemetry_series_search(series, first, end, since - 1) : first;
+        uint64_t upper = fpv_telemetry_series_search(series, first, end, until);
+        if ( upper <= lower ) continue;
+
+        result.count = upper - lower;
+        result.min = result.max = values[lower % capacity];
+
+        // Scan up to a block boundary, take whole blocks from their summaries, then scan the rest
+        uint64_t i = lower;
+        for ( ; i < upper && i % HISTORY_BLOCK; i++ ) {
+            double value = values[i % capacity];
+            if ( value < result.min ) result.min = value;
+            if ( value > result.max ) result.max = value;
+        }
+        for ( ; i + HISTORY_BLOCK <= upper; i += HISTORY_BLOCK ) {
+            int block = (i / HISTORY_BLOCK) % blocks;
+            if ( series->block_min[column][block] < result.min ) result.min = series->block_min[column][block];
+            if ( series->block_max[column][block] > result.max ) result.max = series->block_max[column][block];
+        }
+        for ( ; i < upper; i++ ) {
+            double value = values[i % capacity];
+            if ( value < result.min ) result.min = value;
+            if ( value > result.max ) result.max = value;
+        }
+
+        uint64_t start = series->timestamps[lower % capacity];
+        uint64_t stop = series->timestamps[(upper - 1) % capacity];
+        result.mean = stop > start
+            ? (series->integrals[column][(upper - 1) % capacity] - series->integrals[column][lower % capacity]) / ((stop - start) * 1e-6)
+            : values[(upper - 1) % capacity];
+    } while ( !fpv_telemetry_series_intact(series, first) );
+
+    if ( stats ) *stats = result;
+    return result.count;
+}
+
+double fpv_telemetry_history_integrate(FPVTelemetryHistory * history, FPVTelemetryField field, uint64_t since, uint64_t until) {
+    if ( field < 0 || field >= FPV_TELEMETRY_FIELD_COUNT || until <= since ) return 0.0;
+    FPVTelemetrySeries *series = &history->series[FIELD_COLUMNS[field].type];
+    int column = FIELD_COLUMNS[field].column;
+
+    uint64_t first, end;
+    double result;
+    do {
+        if ( !fpv_telemetry_series_window(series, &first, &end) ) return 0.0;
+        result = fpv_telemetry_series_integral_at(series, column, first, end, until)
+               - fpv_telemetry_series_integral_at(series, column, first, end, since);
+    } while ( !fpv_telemetry_series_intact(series, first) );
+
+    return result;
+}
+
+int fpv_telemetry_history_iterate(FPVTelemetryHistory * history, FPVTelemetryField field, uint64_t since, uint64_t until,
+                                  uint64_t step, FPVTelemetryHistoryCallback callback, void * context) {
+    if ( field < 0 || field >= FPV_TELEMETRY_FIELD_COUNT || !step ) return 0;
+
+    int calls = 0;
+    uint64_t timestamp;
+    for ( timestamp = since; timestamp <= until; timestamp += step ) {
+        double value;
+        if ( fpv_telemetry_history_value_at(history, field, timestamp, &value) ) {
+            callback(timestamp, value, context);
+            calls++;
+        }
+        if ( timestamp + step < timestamp ) break;
+    }
+    return calls;
+}
+
+#pragma mark - Series access
+
+static int fpv_telemetry_series_window(FPVTelemetrySeries * series, uint64_t * first, uint64_t * end) {
+    // Leave the oldest block alone: the writer is about to overwrite it
+    uint64_t start = __atomic_load_n(&series->start, __ATOMIC_ACQUIRE);
+    *end = __atomic_load_n(&series->committed, __ATOMIC_ACQUIRE);
+    uint64_t span = series->capacity - HISTORY_BLOCK;
+    *first = *end > span ? *end - span : 0;
+    if ( *first < start ) *first = start;
+    return *end > *first;
+}
+
+static int fpv_telemetry_series_intact(FPVTelemetrySeries * series, uint64_t lowest) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&series->reserved, __ATOMIC_RELAXED) <= lowest + series->capacity;
+}
+
+static uint64_t fpv_telemetry_series_search(FPVTelemetrySeries * series, uint64_t first, uint64_t end, uint64_t timestamp) {
+    // Index of the first sample newer than timestamp
+    uint64_t low = first, high = end;
+    while ( low < high ) {
+        uint64_t middle = low + (high - low) / 2;
+        if ( series->timestamps[middle % series->capacity] <= timestamp ) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static double fpv_telemetry_series_integral_at(FPVTelemetrySeries * series, int column, uint64_t first, uint64_t end, uint64_t timestamp) {
+    uint64_t upper = fpv_telemetry_series_search(series, first, end, timestamp);
+    if ( upper == first ) {
+        return series->integrals[column][first % series->capacity];
+    }
+
+    int slot = (upper - 1) % series->capacity;
+    double integral = series->integrals[column][slot];
+    if ( upper == end ) {
+        // No extrapolation past the newest sample
+        return integral;
+    }
+
+    // Interpolate linearly towards the next sample
+    int next = upper % series->capacity;
+    double value = series->values[column][slot];
+    double span = (series->timestamps[next] - series->timestamps[slot]) * 1e-6;
+    double elapsed = (timestamp - series->timestamps[slot]) * 1e-6;
+    double value_at = span > 0.0 ? value + (series->values[column][next] - value) * elapsed / span : value;
+    return integral + (value + value_at) * 0.5 * elapsed;
+}
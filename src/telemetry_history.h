@@ -0,0 +1,79 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TELEMETRY_HISTORY_H
+#define __TELEMETRY_HISTORY_H
+
+#include <stdint.h>
+#include "telemetry_common.h"
+
+/*
+ * Fixed-capacity history of received telemetry, one preallocated ring per record type
+ * with a column per field (structure of arrays), ordered by receive time. Lookups by
+ * time are binary searches; min/max use per-block summaries and means/integrals use a
+ * running integral, so range queries don't scan the whole window.
+ *
+ * A single writer (the telemetry listener) appends; any number of readers may query
+ * concurrently without locking. Readers detect samples overwritten mid-query and retry.
+ */
+
+typedef enum {
+    FPV_TELEMETRY_FIELD_LATITUDE,
+    FPV_TELEMETRY_FIELD_LONGITUDE,
+    FPV_TELEMETRY_FIELD_ALTITUDE,
+    FPV_TELEMETRY_FIELD_BEARING,
+    FPV_TELEMETRY_FIELD_VOLTAGE,
+    FPV_TELEMETRY_FIELD_CURRENT,
+    FPV_TELEMETRY_FIELD_RSSI,
+    FPV_TELEMETRY_FIELD_ROLL,
+    FPV_TELEMETRY_FIELD_PITCH,
+    FPV_TELEMETRY_FIELD_YAW,
+    FPV_TELEMETRY_FIELD_COUNT
+} FPVTelemetryField;
+
+typedef struct {
+    int count;      // Samples in the range
+    double min;
+    double max;
+    double mean;    // Time-weighted, treating values as linear between samples
+} FPVTelemetryHistoryStats;
+
+typedef struct _FPVTelemetryHistory FPVTelemetryHistory;
+
+typedef void (*FPVTelemetryHistoryCallback)(uint64_t timestamp, double value, void * context);
+
+FPVTelemetryHistory * fpv_telemetry_history_new(int capacity);
+void fpv_telemetry_history_dispose(FPVTelemetryHistory * history);
+
+// Timestamps are monotonic microseconds, as from fpv_telemetry_now
+void fpv_telemetry_history_add(FPVTelemetryHistory * history, const FPVTelemetryUpdate * update, uint64_t timestamp);
+
+// Writer only: forget everything added so far, as when recording a different vehicle
+void fpv_telemetry_history_clear(FPVTelemetryHistory * history);
+
+int fpv_telemetry_history_value_at(FPVTelemetryHistory * history, FPVTelemetryField field, uint64_t timestamp, double * value);
+int fpv_telemetry_history_get_stats(FPVTelemetryHistory * history, FPVTelemetryField field, uint64_t since, uint64_t until, FPVTelemetryHistoryStats * stats);
+
+// Integral of a field over time, in value-seconds (current gives amp-seconds: divide by 3.6 for mAh)
+double fpv_telemetry_history_integrate(FPVTelemetryHistory * history, FPVTelemetryField field, uint64_t since, uint64_t until);
+
+// Calls back with the value held at each step from since to until; returns the number of calls
+int fpv_telemetry_history_iterate(FPVTelemetryHistory * history, FPVTelemetryField field, uint64_t since, uint64_t until,
+                                  uint64_t step, FPVTelemetryHistoryCallback callback, void * context);
+
+#endif
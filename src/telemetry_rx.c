@@ -16,34 +16,107 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE // recvmmsg
+
 #include "telemetry_rx.h"
 #include "common.h"
 #include "telemetry_common.h"
+#include "telemetry_history.h"
+#include "telemetry_subscription.h"
+#include "geometry.h"
+#include "link_stats.h"
 #include <rpc/types.h>
 #include <rpc/xdr.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <math.h>
+#include <time.h>
 
-struct _FPVTelemetryRX {
+#define TELEMETRY_RX_BATCH 16
+#define TELEMETRY_RX_BUFFER_SIZE 1024
+#define TELEMETRY_RX_VEHICLE_SLOTS 128 // Power of two, never more than half full so probe sequences stay short
+
+static const double DEFAULT_MAX_EXTRAPOLATION = 1.0;
+static const double MAX_MOTION_INTERVAL = 2.0;  // Fixes further apart than this (seconds) say nothing about current motion
+static const double MOTION_SMOOTHING = 0.5;     // Weight of the newest fix in the motion estimate
+static const double MIN_TURN_SPEED = 1.0;       // Below this (m/s) GPS course is noise, so don't extrapolate turns
+
+typedef struct {
+    int in_use;                 // Set once, after key; slots are never reused, so readers can hold on to one
+    FPVTelemetryVehicle key;
+
+    // Seqlock over telemetry: odd while the listener is writing, so readers retry rather than see a torn state
+    unsigned int seq;
     telemetry_rx_t telemetry;
+
+    FPVLinkStats *link;         // Fed by the listener from sequenced frames
+} FPVTelemetryVehicleState;
+
+typedef struct {
+    int count;
+    FPVTelemetrySubscription *items[];
+} FPVTelemetrySubscriptionList;
+
+struct _FPVTelemetryRX {
+    // Per-vehicle state, open-addressed by sender address and vehicle ID. Only the listener inserts.
+    FPVTelemetryVehicleState vehicles[TELEMETRY_RX_VEHICLE_SLOTS];
+    int vehicle_count;
+    int vehicle_limit_warned;
+    int follow_id;              // Vehicle ID to show, or -1 for the first one heard
+    int followed;               // Slot of the vehicle being shown, or -1
+    double max_extrapolation;   // Seconds
+
     pthread_t thread;
     struct sockaddr_in sourceaddr;
     int running;
+    int stop_fd;
     FPVTelemetryRXCallback callback;
     void * callback_context;
+    FPVTelemetryHistory * history;
+    int history_slot;           // Slot the history is of; listener only
+
+    // Subscriber lists are replaced, never modified, so the listener can walk one without
+    // locking; a replaced list is freed once the listener is seen outside a dispatch
+    pthread_mutex_t subscriptions_lock;
+    FPVTelemetrySubscriptionList * subscriptions;
+    int dispatching;
+
+    // Receive batch, preallocated so draining a burst costs one recvmmsg call and no allocation
+    struct mmsghdr messages[TELEMETRY_RX_BATCH];
+    struct iovec iovecs[TELEMETRY_RX_BATCH];
+    uint8_t buffers[TELEMETRY_RX_BATCH][TELEMETRY_RX_BUFFER_SIZE];
+    uint8_t controls[TELEMETRY_RX_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+    struct sockaddr_in names[TELEMETRY_RX_BATCH];
 };
 
+static int fpv_telemetry_rx_decode(uint8_t *buffer, int length, FPVTelemetryFrame *frame);
+static FPVTelemetryVehicleState * fpv_telemetry_rx_vehicle_state(FPVTelemetryRX * rx, uint32_t address, uint8_t vehicle_id);
+static void fpv_telemetry_rx_check_follow(FPVTelemetryRX * rx, FPVTelemetryVehicleState * state);
+static FPVTelemetryVehicleState * fpv_telemetry_rx_find_vehicle(FPVTelemetryRX * rx, const FPVTelemetryVehicle * vehicle);
+static telemetry_rx_t fpv_telemetry_rx_snapshot(FPVTelemetryVehicleState * state);
+static void fpv_telemetry_rx_apply_update(telemetry_rx_t * telemetry, FPVTelemetryUpdate *update, uint64_t received);
+static int fpv_telemetry_rx_position_is_stale(const telemetry_rx_t * telemetry, const telemetry_timestamp_t * timestamp);
+static void fpv_telemetry_rx_update_motion(telemetry_rx_t * telemetry, const struct telemetry_position_t * position, const telemetry_timestamp_t * timestamp);
+static void fpv_telemetry_rx_write_begin(FPVTelemetryVehicleState * state);
+static void fpv_telemetry_rx_write_end(FPVTelemetryVehicleState * state);
+static void fpv_telemetry_rx_handle_packet(FPVTelemetryRX * rx, uint8_t *buffer, int length, uint32_t source, uint64_t received);
+static int fpv_telemetry_rx_receive_batch(FPVTelemetryRX * rx, int sock);
+static void fpv_telemetry_rx_wait_for_dispatch(FPVTelemetryRX * rx);
 static void * fpv_telemetry_rx_thread_entry(void *userinfo);
 
 FPVTelemetryRX * fpv_telemetry_rx_new(char * address, int port) {
     FPVTelemetryRX * rx = (FPVTelemetryRX*)calloc(1, sizeof(FPVTelemetryRX));
+    rx->sourceaddr.sin_family = AF_INET;
     if ( address && strlen(address) > 0 ) {
         if ( !inet_pton(AF_INET, address, &(rx->sourceaddr.sin_addr)) ) {
             fprintf(stderr, "Invalid telemetry address '%s'\n", address);
@@ -51,10 +124,15 @@ FPVTelemetryRX * fpv_telemetry_rx_new(char * address, int port) {
             return NULL;
         }
     } else {
-        rx->sourceaddr.sin_family = AF_INET;
         rx->sourceaddr.sin_addr.s_addr = htonl(INADDR_ANY);
     }
     rx->sourceaddr.sin_port = htons(port);
+    rx->stop_fd = -1;
+    rx->follow_id = -1;
+    rx->followed = -1;
+    rx->history_slot = -1;
+    rx->max_extrapolation = DEFAULT_MAX_EXTRAPOLATION;
+    pthread_mutex_init(&rx->subscriptions_lock, NULL);
     return rx;
 }
 
@@ -62,6 +140,24 @@ void fpv_telemetry_rx_dispose(FPVTelemetryRX * rx) {
     if ( rx->running ) {
         fpv_telemetry_rx_listener_stop(rx);
     }
+    if ( rx->stop_fd != -1 ) {
+        close(rx->stop_fd);
+    }
+    if ( rx->history ) {
+        fpv_telemetry_history_dispose(rx->history);
+    }
+    int slot;
+    for ( slot=0; slot<TELEMETRY_RX_VEHICLE_SLOTS; slot++ ) {
+        if ( rx->vehicles[slot].link ) fpv_link_stats_dispose(rx->vehicles[slot].link);
+    }
+    if ( rx->subscriptions ) {
+        int i;
+        for ( i=0; i<rx->subscriptions->count; i++ ) {
+            fpv_telemetry_subscription_dispose(rx->subscriptions->items[i]);
+        }
+        free(rx->subscriptions);
+    }
+    pthread_mutex_destroy(&rx->subscriptions_lock);
     free(rx);
 }
 
@@ -71,7 +167,140 @@ void fpv_telemetry_rx_set_callback(FPVTelemetryRX * rx, FPVTelemetryRXCallback c
 }
 
 telemetry_rx_t fpv_telemetry_rx_get(FPVTelemetryRX * rx) {
-    return rx->telemetry;
+    int followed = __atomic_load_n(&rx->followed, __ATOMIC_ACQUIRE);
+    if ( followed < 0 ) {
+        telemetry_rx_t empty;
+        memset(&empty, 0, sizeof(empty));
+        return empty;
+    }
+    return fpv_telemetry_rx_snapshot(&rx->vehicles[followed]);
+}
+
+telemetry_rx_t fpv_telemetry_rx_predict(FPVTelemetryRX * rx, uint64_t timestamp) {
+    telemetry_rx_t telemetry = fpv_telemetry_rx_get(rx);
+    fpv_telemetry_rx_predict_vehicle(&telemetry, timestamp, rx->max_extrapolation, &telemetry);
+    return telemetry;
+}
+
+void fpv_telemetry_rx_predict_vehicle(const telemetry_rx_t * telemetry, uint64_t timestamp, double max_extrapolation, telemetry_rx_t * prediction) {
+    if ( prediction != telemetry ) *prediction = *telemetry;
+    uint64_t fix = telemetry->position_timestamp.received;
+    if ( !fix || timestamp <= fix ) return;
+
+    // Hold still once the fix is too old to trust, rather than fly off along a stale heading
+    double elapsed = (timestamp - fix) / 1e6;
+    if ( elapsed > max_extrapolation ) elapsed = max_extrapolation;
+
+    geom_offset_coordinates(telemetry->location.latitude, telemetry->location.longitude,
+                            telemetry->velocity_north * elapsed, telemetry->velocity_east * elapsed,
+                            &prediction->location.latitude, &prediction->location.longitude);
+    prediction->location.altitude = telemetry->location.altitude + telemetry->climb_rate * elapsed;
+    prediction->bearing = fmod(telemetry->bearing + telemetry->bearing_rate * elapsed + 360.0, 360.0);
+}
+
+void fpv_telemetry_rx_set_max_extrapolation(FPVTelemetryRX * rx, double seconds) {
+    rx->max_extrapolation = seconds >= 0 ? seconds : DEFAULT_MAX_EXTRAPOLATION;
+}
+
+int fpv_telemetry_rx_get_vehicle(FPVTelemetryRX * rx, const FPVTelemetryVehicle * vehicle, telemetry_rx_t * telemetry) {
+    FPVTelemetryVehicleState *state = fpv_telemetry_rx_find_vehicle(rx, vehicle);
+    if ( !state ) return 0;
+    if ( telemetry ) *telemetry = fpv_telemetry_rx_snapshot(state);
+    return 1;
+}
+
+int fpv_telemetry_rx_get_link_stats(FPVTelemetryRX * rx, const FPVTelemetryVehicle * vehicle, FPVLinkStatsSnapshot * stats) {
+    FPVTelemetryVehicleState *state = fpv_telemetry_rx_find_vehicle(rx, vehicle);
+    if ( !state ) return 0;
+    fpv_link_stats_get(state->link, stats);
+    return 1;
+}
+
+int fpv_telemetry_rx_get_vehicles(FPVTelemetryRX * rx, FPVTelemetryVehicle * vehicles, int max) {
+    int i, count = 0;
+    for ( i=0; i<TELEMETRY_RX_VEHICLE_SLOTS && count < max; i++ ) {
+        if ( __atomic_load_n(&rx->vehicles[i].in_use, __ATOMIC_ACQUIRE) ) {
+            vehicles[count++] = rx->vehicles[i].key;
+        }
+    }
+    return count;
+}
+
+void fpv_telemetry_rx_follow(FPVTelemetryRX * rx, int vehicle_id) {
+    __atomic_store_n(&rx->follow_id, vehicle_id, __ATOMIC_RELEASE);
+
+    // Switch now if we've already heard from it; otherwise the listener picks it up on its next packet
+    int i, followed = -1;
+    for ( i=0; i<TELEMETRY_RX_VEHICLE_SLOTS; i++ ) {
+        if ( __atomic_load_n(&rx->vehicles[i].in_use, __ATOMIC_ACQUIRE)
+                && (vehicle_id < 0 || rx->vehicles[i].key.vehicle_id == vehicle_id) ) {
+            followed = i;
+            break;
+        }
+    }
+    __atomic_store_n(&rx->followed, followed, __ATOMIC_RELEASE);
+}
+
+FPVTelemetrySubscription * fpv_telemetry_rx_subscribe(FPVTelemetryRX * rx, int capacity, FPVTelemetryOverflowPolicy policy) {
+    FPVTelemetrySubscription *subscription = fpv_telemetry_subscription_new(capacity, policy);
+    if ( !subscription ) return NULL;
+
+    pthread_mutex_lock(&rx->subscriptions_lock);
+    FPVTelemetrySubscriptionList *old = rx->subscriptions;
+    int count = old ? old->count : 0;
+    FPVTelemetrySubscriptionList *list = (FPVTelemetrySubscriptionList*)malloc(sizeof(FPVTelemetrySubscriptionList) + (count + 1) * sizeof(FPVTelemetrySubscription*));
+    if ( count ) memcpy(list->items, old->items, count * sizeof(FPVTelemetrySubscription*));
+    list->items[count] = subscription;
+    list->count = count + 1;
+    __atomic_store_n(&rx->subscriptions, list, __ATOMIC_SEQ_CST);
+    fpv_telemetry_rx_wait_for_dispatch(rx);
+    pthread_mutex_unlock(&rx->subscriptions_lock);
+
+    free(old);
+    return subscription;
+}
+
+void fpv_telemetry_rx_unsubscribe(FPVTelemetryRX * rx, FPVTelemetrySubscription * subscription) {
+    pthread_mutex_lock(&rx->subscriptions_lock);
+    FPVTelemetrySubscriptionList *old = rx->subscriptions;
+    int i, found;
+    for ( found=0; old && found<old->count && old->items[found] != subscription; found++ );
+    if ( !old || found == old->count ) {
+        pthread_mutex_unlock(&rx->subscriptions_lock);
+        fprintf(stderr, "Telemetry subscription not found\n");
+        return;
+    }
+
+    FPVTelemetrySubscriptionList *list = NULL;
+    if ( old->count > 1 ) {
+        list = (FPVTelemetrySubscriptionList*)malloc(sizeof(FPVTelemetrySubscriptionList) + (old->count - 1) * sizeof(FPVTelemetrySubscription*));
+        list->count = 0;
+        for ( i=0; i<old->count; i++ ) {
+            if ( i != found ) list->items[list->count++] = old->items[i];
+        }
+    }
+    __atomic_store_n(&rx->subscriptions, list, __ATOMIC_SEQ_CST);
+    fpv_telemetry_rx_wait_for_dispatch(rx);
+    pthread_mutex_unlock(&rx->subscriptions_lock);
+
+    free(old);
+    fpv_telemetry_subscription_dispose(subscription);
+}
+
+int fpv_telemetry_rx_enable_history(FPVTelemetryRX * rx, int capacity) {
+    if ( rx->running ) {
+        fprintf(stderr, "FPVTelemetryRX history must be enabled before the listener starts\n");
+        return 0;
+    }
+    if ( rx->history ) {
+        fpv_telemetry_history_dispose(rx->history);
+    }
+    rx->history = capacity > 0 ? fpv_telemetry_history_new(capacity) : NULL;
+    return rx->history != NULL;
+}
+
+FPVTelemetryHistory * fpv_telemetry_rx_get_history(FPVTelemetryRX * rx) {
+    return rx->history;
 }
 
 int fpv_telemetry_rx_listener_start(FPVTelemetryRX * rx) {
@@ -80,6 +309,14 @@ int fpv_telemetry_rx_listener_start(FPVTelemetryRX * rx) {
         return -1;
     }
 
+    if ( rx->stop_fd != -1 ) {
+        close(rx->stop_fd);
+    }
+    if ( (rx->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ) {
+        fprintf(stderr, "Unable to create FPVTelemetryRX stop event: %s\n", strerror(errno));
+        return 0;
+    }
+
     rx->running = 1;
     int result = pthread_create(&rx->thread, NULL, fpv_telemetry_rx_thread_entry, rx);
     if ( result != 0 ) {
@@ -94,15 +331,309 @@ int fpv_telemetry_rx_listener_start(FPVTelemetryRX * rx) {
 
 void fpv_telemetry_rx_listener_stop(FPVTelemetryRX * rx) {
     rx->running = 0;
+    uint64_t value = 1;
+    if ( write(rx->stop_fd, &value, sizeof(value)) < 0 ) {
+        fprintf(stderr, "Unable to signal FPVTelemetryRX listener thread: %s\n", strerror(errno));
+    }
     pthread_join(rx->thread, NULL);
 }
 
 
+static int fpv_telemetry_rx_decode(uint8_t *buffer, int length, FPVTelemetryFrame *frame) {
+    if ( length > 0 && buffer[0] == TELEMETRY_WIRE_MAGIC ) {
+        return fpv_telemetry_frame_decode(buffer, length, frame);
+    }
+
+    // Fall back to the legacy XDR encoding, for senders that haven't been upgraded yet
+    memset(frame, 0, sizeof(*frame));
+    frame->flags = TELEMETRY_FRAME_FLAG_UNSEQUENCED;
+    XDR xdrs;
+    xdrmem_create(&xdrs, (char*)buffer, length, XDR_DECODE);
+    if ( xdr_telemetry_update(&xdrs, &frame->records[0]) ) {
+        frame->count = 1;
+    }
+    xdr_destroy(&xdrs);
+    return frame->count;
+}
+
+static FPVTelemetryVehicleState * fpv_telemetry_rx_vehicle_state(FPVTelemetryRX * rx, uint32_t address, uint8_t vehicle_id) {
+    uint32_t hash = (address ^ (vehicle_id * 0x9E3779B9u)) * 0x85EBCA6Bu;
+    hash ^= hash >> 16;
+
+    int i;
+    for ( i=0; i<TELEMETRY_RX_VEHICLE_SLOTS; i++ ) {
+        int slot = (hash + i) & (TELEMETRY_RX_VEHICLE_SLOTS - 1);
+        FPVTelemetryVehicleState *state = &rx->vehicles[slot];
+        if ( state->in_use ) {
+            if ( state->key.address == address && state->key.vehicle_id == vehicle_id ) return state;
+            continue;
+        }
+
+        if ( rx->vehicle_count >= FPV_TELEMETRY_MAX_VEHICLES ) {
+            if ( !rx->vehicle_limit_warned ) {
+                rx->vehicle_limit_warned = 1;
+                fprintf(stderr, "Ignoring telemetry from more than %d vehicles\n", FPV_TELEMETRY_MAX_VEHICLES);
+            }
+            return NULL;
+        }
+
+        state->key.address = address;
+        state->key.vehicle_id = vehicle_id;
+        state->telemetry.vehicle_id = vehicle_id;
+        state->link = fpv_link_stats_new();
+        __atomic_store_n(&state->in_use, 1, __ATOMIC_RELEASE);
+        rx->vehicle_count++;
+        return state;
+    }
+    return NULL;
+}
+
+static void fpv_telemetry_rx_check_follow(FPVTelemetryRX * rx, FPVTelemetryVehicleState * state) {
+    // Checked on every packet rather than only when a vehicle first appears, so a follow
+    // request that races with the listener still settles on the vehicle's next packet
+    int follow_id = __atomic_load_n(&rx->follow_id, __ATOMIC_ACQUIRE);
+    if ( follow_id >= 0 && state->key.vehicle_id != follow_id ) return;
+
+    int slot = (int)(state - rx->vehicles);
+    int followed = __atomic_load_n(&rx->followed, __ATOMIC_ACQUIRE);
+    if ( followed == slot || (followed >= 0 && (follow_id < 0 || rx->vehicles[followed].key.vehicle_id == follow_id)) ) return;
+    __atomic_compare_exchange_n(&rx->followed, &followed, slot, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static FPVTelemetryVehicleState * fpv_telemetry_rx_find_vehicle(FPVTelemetryRX * rx, const FPVTelemetryVehicle * vehicle) {
+    if ( !vehicle ) {
+        int followed = __atomic_load_n(&rx->followed, __ATOMIC_ACQUIRE);
+        return followed >= 0 ? &rx->vehicles[followed] : NULL;
+    }
+
+    int i;
+    for ( i=0; i<TELEMETRY_RX_VEHICLE_SLOTS; i++ ) {
+        FPVTelemetryVehicleState *state = &rx->vehicles[i];
+        if ( __atomic_load_n(&state->in_use, __ATOMIC_ACQUIRE) && state->key.address == vehicle->address
+                && state->key.vehicle_id == vehicle->vehicle_id ) {
+            return state;
+        }
+    }
+    return NULL;
+}
+
+static telemetry_rx_t fpv_telemetry_rx_snapshot(FPVTelemetryVehicleState * state) {
+    telemetry_rx_t snapshot;
+    unsigned int before, after;
+    do {
+        before = __atomic_load_n(&state->seq, __ATOMIC_ACQUIRE);
+        if ( before & 1 ) continue;
+        snapshot = state->telemetry;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&state->seq, __ATOMIC_RELAXED);
+    } while ( (before & 1) || before != after );
+    return snapshot;
+}
+
+static void fpv_telemetry_rx_write_begin(FPVTelemetryVehicleState * state) {
+    // Only the listener thread writes, so a plain increment is enough on the writer side
+    __atomic_store_n(&state->seq, state->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void fpv_telemetry_rx_write_end(FPVTelemetryVehicleState * state) {
+    __atomic_store_n(&state->seq, state->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void fpv_telemetry_rx_apply_update(telemetry_rx_t * telemetry, FPVTelemetryUpdate *update, uint64_t received) {
+    telemetry_timestamp_t timestamp = { .received = received, .sent = update->timestamp };
+    switch ( update->type ) {
+        case TELEMETRY_TYPE_POSITION:
+            if ( fpv_telemetry_rx_position_is_stale(telemetry, &timestamp) ) break;
+            fpv_telemetry_rx_update_motion(telemetry, &update->content.position, &timestamp);
+            telemetry->location.latitude = update->content.position.latitude;
+            telemetry->location.longitude = update->content.position.longitude;
+            telemetry->location.altitude = update->content.position.altitude;
+            telemetry->bearing = update->content.position.bearing;
+            if ( telemetry->home_location.latitude == 0 ) {
+                telemetry->home_location = telemetry->location;
+            }
+            telemetry->position_timestamp = timestamp;
+            break;
+        case TELEMETRY_TYPE_POWER:
+            telemetry->voltage = update->content.power.voltage;
+            telemetry->current = update->content.power.current;
+            telemetry->power_timestamp = timestamp;
+            break;
+        case TELEMETRY_TYPE_SIGNAL:
+            telemetry->rssi = update->content.signal.rssi;
+            telemetry->signal_timestamp = timestamp;
+            break;
+        case TELEMETRY_TYPE_ATTITUDE:
+            telemetry->roll = update->content.attitude.roll;
+            telemetry->pitch = update->content.attitude.pitch;
+            telemetry->yaw = update->content.attitude.yaw;
+            telemetry->attitude_timestamp = timestamp;
+            break;
+    }
+}
+
+static int fpv_telemetry_rx_position_is_stale(const telemetry_rx_t * telemetry, const telemetry_timestamp_t * timestamp) {
+    // A fix the network delivered behind a newer one would move the vehicle back and upset
+    // the motion estimate. After a long enough silence the sender may have restarted its
+    // clock, so take what comes.
+    const telemetry_timestamp_t *last = &telemetry->position_timestamp;
+    return last->sent && timestamp->sent && (int32_t)(timestamp->sent - last->sent) < 0
+        && timestamp->received - last->received < (uint64_t)(MAX_MOTION_INTERVAL * 1e6);
+}
+
+static void fpv_telemetry_rx_update_motion(telemetry_rx_t * telemetry, const struct telemetry_position_t * position, const telemetry_timestamp_t * timestamp) {
+    // Time between fixes by the sender's clock where we have it, which network jitter doesn't reach
+    const telemetry_timestamp_t *last = &telemetry->position_timestamp;
+    double interval = last->sent && timestamp->sent
+        ? (uint32_t)(timestamp->sent - last->sent) / 1e6
+        : ((int64_t)timestamp->received - (int64_t)last->received) / 1e6;
+    if ( last->received && interval == 0 ) {
+        // The same fix again, or two in one batch from a sender without a clock: nothing to go on
+        return;
+    }
+    if ( !last->received || interval <= 0 || interval > MAX_MOTION_INTERVAL ) {
+        telemetry->velocity_north = telemetry->velocity_east = telemetry->climb_rate = telemetry->bearing_rate = 0;
+        return;
+    }
+
+    double north, east;
+    geom_displacement_between_coordinates(telemetry->location.latitude, telemetry->location.longitude,
+                                          position->latitude, position->longitude, &north, &east);
+    double turn = fmod(position->bearing - telemetry->bearing + 540.0, 360.0) - 180.0;
+    double velocity_north = north / interval;
+    double velocity_east = east / interval;
+
+    telemetry->velocity_north += MOTION_SMOOTHING * (velocity_north - telemetry->velocity_north);
+    telemetry->velocity_east += MOTION_SMOOTHING * (velocity_east - telemetry->velocity_east);
+    telemetry->climb_rate += MOTION_SMOOTHING * ((position->altitude - telemetry->location.altitude) / interval - telemetry->climb_rate);
+    if ( hypot(velocity_north, velocity_east) < MIN_TURN_SPEED ) {
+        telemetry->bearing_rate = 0;
+    } else {
+        telemetry->bearing_rate += MOTION_SMOOTHING * (turn / interval - telemetry->bearing_rate);
+    }
+}
+
+static void fpv_telemetry_rx_handle_packet(FPVTelemetryRX * rx, uint8_t *buffer, int length, uint32_t source, uint64_t received) {
+    FPVTelemetryFrame frame;
+    if ( !fpv_telemetry_rx_decode(buffer, length, &frame) ) {
+        return;
+    }
+
+    FPVTelemetryVehicleState *state = fpv_telemetry_rx_vehicle_state(rx, source, frame.vehicle_id);
+    if ( !state ) {
+        return;
+    }
+    fpv_telemetry_rx_check_follow(rx, state);
+
+    if ( !(frame.flags & TELEMETRY_FRAME_FLAG_UNSEQUENCED) ) {
+        fpv_link_stats_add(state->link, frame.sequence, frame.timestamp, received);
+    }
+
+    // Publish the whole frame at once, so readers never mix records from different packets
+    int i;
+    fpv_telemetry_rx_write_begin(state);
+    if ( !(frame.flags & TELEMETRY_FRAME_FLAG_UNSEQUENCED) ) {
+        state->telemetry.sequence = frame.sequence;
+    }
+    for ( i=0; i<frame.count; i++ ) {
+        frame.records[i].received = received;
+        fpv_telemetry_rx_apply_update(&state->telemetry, &frame.records[i], received);
+    }
+    fpv_telemetry_rx_write_end(state);
+
+    // History follows whichever vehicle the HUD is showing
+    int followed = __atomic_load_n(&rx->followed, __ATOMIC_ACQUIRE);
+    if ( rx->history && followed >= 0 && state == &rx->vehicles[followed] ) {
+        // It's of one vehicle at a time, so start afresh when the HUD switches
+        if ( followed != rx->history_slot ) {
+            fpv_telemetry_history_clear(rx->history);
+            rx->history_slot = followed;
+        }
+        for ( i=0; i<frame.count; i++ ) {
+            fpv_telemetry_history_add(rx->history, &frame.records[i], received);
+        }
+    }
+
+    // Hand the frame to every subscriber's queue; none of them can hold up the listener
+    __atomic_store_n(&rx->dispatching, 1, __ATOMIC_SEQ_CST);
+    FPVTelemetrySubscriptionList *subscriptions = __atomic_load_n(&rx->subscriptions, __ATOMIC_SEQ_CST);
+    if ( subscriptions ) {
+        for ( i=0; i<subscriptions->count; i++ ) {
+            fpv_telemetry_subscription_publish(subscriptions->items[i], frame.records, frame.count);
+        }
+    }
+    __atomic_store_n(&rx->dispatching, 0, __ATOMIC_RELEASE);
+
+    if ( rx->callback ) {
+        for ( i=0; i<frame.count; i++ ) {
+            rx->callback(rx, &frame.records[i], rx->callback_context);
+        }
+    }
+}
+
+static void fpv_telemetry_rx_wait_for_dispatch(FPVTelemetryRX * rx) {
+    // Any dispatch that could still see the old subscriber list is over once the listener
+    // has been observed outside one
+    while ( __atomic_load_n(&rx->dispatching, __ATOMIC_SEQ_CST) ) {
+        sched_yield();
+    }
+}
+
+static int fpv_telemetry_rx_receive_batch(FPVTelemetryRX * rx, int sock) {
+    int i;
+    for ( i=0; i<TELEMETRY_RX_BATCH; i++ ) {
+        // recvmmsg writes the lengths back, so restore them before every call
+        rx->iovecs[i].iov_base = rx->buffers[i];
+        rx->iovecs[i].iov_len = TELEMETRY_RX_BUFFER_SIZE;
+        memset(&rx->messages[i].msg_hdr, 0, sizeof(rx->messages[i].msg_hdr));
+        rx->messages[i].msg_hdr.msg_name = &rx->names[i];
+        rx->messages[i].msg_hdr.msg_namelen = sizeof(rx->names[i]);
+        rx->messages[i].msg_hdr.msg_iov = &rx->iovecs[i];
+        rx->messages[i].msg_hdr.msg_iovlen = 1;
+        rx->messages[i].msg_hdr.msg_control = rx->controls[i];
+        rx->messages[i].msg_hdr.msg_controllen = sizeof(rx->controls[i]);
+    }
+
+    int count = recvmmsg(sock, rx->messages, TELEMETRY_RX_BATCH, MSG_DONTWAIT, NULL);
+    if ( count <= 0 ) {
+        return count;
+    }
+
+    // Kernel timestamps are wall-clock; map them onto the monotonic clock the rest of the
+    // telemetry uses, by way of how long ago each packet arrived
+    struct timespec realtime;
+    uint64_t now = fpv_telemetry_now();
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    int64_t realtime_now = (int64_t)realtime.tv_sec * 1000000 + realtime.tv_nsec / 1000;
+
+    for ( i=0; i<count; i++ ) {
+        struct msghdr *header = &rx->messages[i].msg_hdr;
+        uint64_t received = now;
+        struct cmsghdr *control;
+        for ( control = CMSG_FIRSTHDR(header); control; control = CMSG_NXTHDR(header, control) ) {
+            if ( control->cmsg_level == SOL_SOCKET && control->cmsg_type == SCM_TIMESTAMPNS ) {
+                struct timespec stamp;
+                memcpy(&stamp, CMSG_DATA(control), sizeof(stamp));
+                int64_t age = realtime_now - ((int64_t)stamp.tv_sec * 1000000 + stamp.tv_nsec / 1000);
+                if ( age > 0 && (uint64_t)age < now ) received = now - age;
+            }
+        }
+        if ( header->msg_flags & MSG_TRUNC ) continue;
+        fpv_telemetry_rx_handle_packet(rx, rx->buffers[i], rx->messages[i].msg_len, rx->names[i].sin_addr.s_addr, received);
+    }
+
+    return count;
+}
+
 static void * fpv_telemetry_rx_thread_entry(void *userinfo) {
     FPVTelemetryRX *rx = (FPVTelemetryRX*)userinfo;
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &(struct timeval) { .tv_sec = 0, .tv_usec = 100 }, sizeof(struct timeval));
+    int timestamps = 1;
+    if ( setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &timestamps, sizeof(timestamps)) < 0 ) {
+        fprintf(stderr, "Kernel receive timestamps unavailable for telemetry: %s\n", strerror(errno));
+    }
 
     bind(sock, (struct sockaddr*)&rx->sourceaddr, sizeof(rx->sourceaddr));
 
@@ -113,48 +644,38 @@ static void * fpv_telemetry_rx_thread_entry(void *userinfo) {
         group.imr_interface.s_addr = htonl(INADDR_ANY);
         if ( setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &group, sizeof(group)) < 0 ) {
             fprintf(stderr, "Unable to join multicast group for telemetry: %s\n", strerror(errno));
+            close(sock);
             rx->running = 0;
             return NULL;
         }
     }
-    
-    char recvbuffer[1024];
-    FPVTelemetryUpdate update;
+
+    // Sleep until a packet or a stop request arrives
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = sock };
+    struct epoll_event stop_event = { .events = EPOLLIN, .data.fd = rx->stop_fd };
+    if ( epoll_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) < 0
+            || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, rx->stop_fd, &stop_event) < 0 ) {
+        fprintf(stderr, "Unable to wait for telemetry: %s\n", strerror(errno));
+        if ( epoll_fd != -1 ) close(epoll_fd);
+        close(sock);
+        rx->running = 0;
+        return NULL;
+    }
+
+    struct epoll_event events[2];
 
     while ( rx->running ) {
-        int result = recvfrom(sock, recvbuffer, sizeof(recvbuffer), 0, NULL, NULL);
-        if ( result == -1 ) {
+        // The stop event only needs to wake us: running has already been cleared
+        if ( epoll_wait(epoll_fd, events, sizeof(events)/sizeof(events[0]), -1) <= 0 ) {
             continue;
         }
 
-        XDR xdrs;
-        xdrmem_create(&xdrs, recvbuffer, result, XDR_DECODE);
-        if ( xdr_telemetry_update(&xdrs, &update) ) {
-            switch ( update.type ) {
-                case TELEMETRY_TYPE_POSITION:
-                    rx->telemetry.location.latitude = update.content.position.latitude;
-                    rx->telemetry.location.longitude = update.content.position.longitude;
-                    rx->telemetry.location.altitude = update.content.position.altitude;
-                    rx->telemetry.bearing = update.content.position.bearing;
-                    if ( rx->telemetry.home_location.latitude == 0 ) {
-                        rx->telemetry.home_location = rx->telemetry.location;
-                    }
-                    break;
-                case TELEMETRY_TYPE_POWER:
-                    rx->telemetry.voltage = update.content.power.voltage;
-                    rx->telemetry.current = update.content.power.current;
-                    break;
-                case TELEMETRY_TYPE_SIGNAL:
-                    rx->telemetry.rssi = update.content.signal.rssi;
-                    break;
-            }
-            if ( rx->callback ) {
-                rx->callback(rx, &update, rx->callback_context);
-            }
-        }
-        xdr_destroy(&xdrs);
+        // Drain everything queued, then go back to sleep
+        while ( rx->running && fpv_telemetry_rx_receive_batch(rx, sock) == TELEMETRY_RX_BATCH );
     }
 
+    close(epoll_fd);
     close(sock);
     sock = 0;
     rx->running = 0;
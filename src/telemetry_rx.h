@@ -20,6 +20,9 @@
 #define __TELEMETRY_RX_H
 
 #include "telemetry_common.h"
+#include "telemetry_history.h"
+#include "telemetry_subscription.h"
+#include "link_stats.h"
 
 typedef struct {
     double latitude;
@@ -28,14 +31,44 @@ typedef struct {
 } telemetry_coord;
 
 typedef struct {
+    uint64_t received;  // Local monotonic receive time, microseconds (0 if never received)
+    uint32_t sent;      // Sender timestamp, microseconds (0 if the sender doesn't provide one)
+} telemetry_timestamp_t;
+
+#define FPV_TELEMETRY_MAX_VEHICLES 64
+
+typedef struct {
+    uint32_t address;   // Sender's IPv4 address, network byte order
+    uint8_t vehicle_id;
+} FPVTelemetryVehicle;
+
+typedef struct {
+    uint8_t vehicle_id;
+
     telemetry_coord location;
     double bearing;
     telemetry_coord home_location;
 
+    // Motion estimated from successive position fixes, for dead reckoning (zero until two recent fixes)
+    double velocity_north;  // m/s
+    double velocity_east;   // m/s
+    double climb_rate;      // m/s
+    double bearing_rate;    // Degrees/s, clockwise
+
     double voltage;
     double current;
 
     double rssi;
+
+    double roll;
+    double pitch;
+    double yaw;
+
+    uint16_t sequence;
+    telemetry_timestamp_t position_timestamp;
+    telemetry_timestamp_t power_timestamp;
+    telemetry_timestamp_t signal_timestamp;
+    telemetry_timestamp_t attitude_timestamp;
 } telemetry_rx_t;
 
 typedef struct _FPVTelemetryRX FPVTelemetryRX;
@@ -47,7 +80,33 @@ void fpv_telemetry_rx_dispose(FPVTelemetryRX * rx);
 
 void fpv_telemetry_rx_set_callback(FPVTelemetryRX * rx, FPVTelemetryRXCallback callback, void * context);
 
+// Consistent snapshot of the latest telemetry from the followed vehicle; safe to call from any
+// thread, never blocks the listener
 telemetry_rx_t fpv_telemetry_rx_get(FPVTelemetryRX * rx);
+int fpv_telemetry_rx_get_vehicle(FPVTelemetryRX * rx, const FPVTelemetryVehicle * vehicle, telemetry_rx_t * telemetry);
+int fpv_telemetry_rx_get_vehicles(FPVTelemetryRX * rx, FPVTelemetryVehicle * vehicles, int max);
+
+// Link health for a vehicle (NULL for the followed one); lock-free, safe from any thread
+int fpv_telemetry_rx_get_link_stats(FPVTelemetryRX * rx, const FPVTelemetryVehicle * vehicle, FPVLinkStatsSnapshot * stats);
+
+// Snapshot of the followed vehicle with position and bearing dead-reckoned forward to the given
+// monotonic time (as from fpv_telemetry_now), so a display can move at its own frame rate
+// between fixes. Extrapolation stops max_extrapolation seconds after the last fix.
+telemetry_rx_t fpv_telemetry_rx_predict(FPVTelemetryRX * rx, uint64_t timestamp);
+void fpv_telemetry_rx_predict_vehicle(const telemetry_rx_t * telemetry, uint64_t timestamp, double max_extrapolation, telemetry_rx_t * prediction);
+void fpv_telemetry_rx_set_max_extrapolation(FPVTelemetryRX * rx, double seconds);
+
+// Show telemetry from the given vehicle ID (-1 for the first vehicle heard)
+void fpv_telemetry_rx_follow(FPVTelemetryRX * rx, int vehicle_id);
+
+// Queue received updates for a consumer on another thread; the listener never waits for it.
+// Unsubscribing disposes of the subscription.
+FPVTelemetrySubscription * fpv_telemetry_rx_subscribe(FPVTelemetryRX * rx, int capacity, FPVTelemetryOverflowPolicy policy);
+void fpv_telemetry_rx_unsubscribe(FPVTelemetryRX * rx, FPVTelemetrySubscription * subscription);
+
+// Keep the last capacity samples of each record type from the followed vehicle, for trend queries (0 disables)
+int fpv_telemetry_rx_enable_history(FPVTelemetryRX * rx, int capacity);
+FPVTelemetryHistory * fpv_telemetry_rx_get_history(FPVTelemetryRX * rx);
 
 int fpv_telemetry_rx_listener_start(FPVTelemetryRX * rx);
 void fpv_telemetry_rx_listener_stop(FPVTelemetryRX * rx);
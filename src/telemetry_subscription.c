@@ -0,0 +1,218 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "telemetry_subscription.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+static const int DEFAULT_SUBSCRIPTION_CAPACITY = 64;
+
+typedef struct {
+    unsigned int seq;
+    unsigned int taken;     // seq of the last update the consumer popped from this slot
+    FPVTelemetryUpdate update;
+} FPVTelemetrySubscriptionSlot;
+
+struct _FPVTelemetrySubscription {
+    FPVTelemetryOverflowPolicy policy;
+    int event_fd;
+
+    // Drop-oldest ring. head is only written by the producer; tail is advanced by the
+    // consumer when it pops, and by the producer when it discards the oldest update, so
+    // both sides move it with compare-and-swap. A consumer that loses the race throws
+    // away its copy and retries.
+    FPVTelemetryUpdate *ring;
+    uint32_t mask;
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+
+    // Coalescing slots, one per record type under its own sequence counter, plus a mask
+    // of the slots written since the consumer last looked
+    FPVTelemetrySubscriptionSlot latest[TELEMETRY_TYPE_COUNT];
+    unsigned int pending;
+
+    uint64_t published;
+    uint64_t dropped;
+};
+
+#pragma mark - Forward declarations
+
+static void fpv_telemetry_subscription_signal(FPVTelemetrySubscription * subscription);
+static int fpv_telemetry_subscription_pop_ring(FPVTelemetrySubscription * subscription, FPVTelemetryUpdate * update);
+static int fpv_telemetry_subscription_pop_latest(FPVTelemetrySubscription * subscription, FPVTelemetryUpdate * update);
+
+#pragma mark -
+
+FPVTelemetrySubscription * fpv_telemetry_subscription_new(int capacity, FPVTelemetryOverflowPolicy policy) {
+    FPVTelemetrySubscription * subscription = (FPVTelemetrySubscription*)calloc(1, sizeof(FPVTelemetrySubscription));
+    subscription->policy = policy;
+
+    if ( (subscription->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ) {
+        fprintf(stderr, "Unable to create telemetry subscription event: %s\n", strerror(errno));
+        free(subscription);
+        return NULL;
+    }
+
+    if ( policy == FPV_TELEMETRY_OVERFLOW_DROP_OLDEST ) {
+        // Round up to a power of two so indices can wrap freely
+        uint32_t size = 1;
+        if ( capacity <= 0 ) capacity = DEFAULT_SUBSCRIPTION_CAPACITY;
+        while ( size < (uint32_t)capacity ) size <<= 1;
+        subscription->ring = (FPVTelemetryUpdate*)calloc(size, sizeof(FPVTelemetryUpdate));
+        subscription->mask = size - 1;
+        if ( !subscription->ring ) {
+            fprintf(stderr, "Unable to allocate telemetry subscription queue of %u updates\n", size);
+            fpv_telemetry_subscription_dispose(subscription);
+            return NULL;
+        }
+    }
+
+    return subscription;
+}
+
+void fpv_telemetry_subscription_dispose(FPVTelemetrySubscription * subscription) {
+    if ( subscription->event_fd != -1 ) {
+        close(subscription->event_fd);
+    }
+    free(subscription->ring);
+    free(subscription);
+}
+
+void fpv_telemetry_subscription_publish(FPVTelemetrySubscription * subscription, const FPVTelemetryUpdate * updates, int count) {
+    int signal = 0;
+    int i;
+
+    for ( i=0; i<count; i++ ) {
+        const FPVTelemetryUpdate *update = &updates[i];
+
+        if ( subscription->policy == FPV_TELEMETRY_OVERFLOW_COALESCE ) {
+            if ( update->type >= TELEMETRY_TYPE_COUNT ) continue;
+            unsigned int bit = 1 << update->type;
+            FPVTelemetrySubscriptionSlot *slot = &subscription->latest[update->type];
+
+            // Replacing an update the consumer hasn't taken loses it
+            if ( slot->seq && __atomic_load_n(&slot->taken, __ATOMIC_ACQUIRE) != slot->seq ) {
+                __atomic_add_fetch(&subscription->dropped, 1, __ATOMIC_RELAXED);
+            }
+
+            __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            slot->update = *update;
+            __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+
+            unsigned int pending = __atomic_fetch_or(&subscription->pending, bit, __ATOMIC_ACQ_REL);
+            if ( !pending ) signal = 1;
+
+        } else {
+            uint32_t head = subscription->head;
+            uint32_t tail = __atomic_load_n(&subscription->tail, __ATOMIC_ACQUIRE);
+            if ( head == tail ) signal = 1;
+            while ( head - tail > subscription->mask ) {
+                // Full: discard the oldest update, unless the consumer takes it first
+                if ( __atomic_compare_exchange_n(&subscription->tail, &tail, tail + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+                    __atomic_add_fetch(&subscription->dropped, 1, __ATOMIC_RELAXED);
+                    break;
+                }
+            }
+            subscription->ring[head & subscription->mask] = *update;
+            __atomic_store_n(&subscription->head, head + 1, __ATOMIC_RELEASE);
+        }
+
+        __atomic_add_fetch(&subscription->published, 1, __ATOMIC_RELAXED);
+    }
+
+    // Only wake the consumer when its queue goes from empty to non-empty
+    if ( signal ) {
+        fpv_telemetry_subscription_signal(subscription);
+    }
+}
+
+int fpv_telemetry_subscription_get_fd(FPVTelemetrySubscription * subscription) {
+    return subscription->event_fd;
+}
+
+int fpv_telemetry_subscription_pop(FPVTelemetrySubscription * subscription, FPVTelemetryUpdate * update) {
+    int (*pop)(FPVTelemetrySubscription*, FPVTelemetryUpdate*) = subscription->policy == FPV_TELEMETRY_OVERFLOW_COALESCE
+        ? fpv_telemetry_subscription_pop_latest : fpv_telemetry_subscription_pop_ring;
+
+    if ( pop(subscription, update) ) {
+        return 1;
+    }
+
+    // Empty: clear the wakeup, then look again in case an update slipped in before we did
+    uint64_t value;
+    if ( read(subscription->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN ) {
+        fprintf(stderr, "Unable to clear telemetry subscription event: %s\n", strerror(errno));
+    }
+    return pop(subscription, update);
+}
+
+void fpv_telemetry_subscription_get_stats(FPVTelemetrySubscription * subscription, FPVTelemetrySubscriptionStats * stats) {
+    stats->published = __atomic_load_n(&subscription->published, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&subscription->dropped, __ATOMIC_RELAXED);
+}
+
+#pragma mark - Queue access
+
+static void fpv_telemetry_subscription_signal(FPVTelemetrySubscription * subscription) {
+    uint64_t value = 1;
+    if ( write(subscription->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN ) {
+        fprintf(stderr, "Unable to signal telemetry subscriber: %s\n", strerror(errno));
+    }
+}
+
+static int fpv_telemetry_subscription_pop_ring(FPVTelemetrySubscription * subscription, FPVTelemetryUpdate * update) {
+    uint32_t tail = __atomic_load_n(&subscription->tail, __ATOMIC_ACQUIRE);
+    while ( 1 ) {
+        uint32_t head = __atomic_load_n(&subscription->head, __ATOMIC_ACQUIRE);
+        if ( tail == head ) return 0;
+        *update = subscription->ring[tail & subscription->mask];
+        if ( __atomic_compare_exchange_n(&subscription->tail, &tail, tail + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+            return 1;
+        }
+    }
+}
+
+static int fpv_telemetry_subscription_pop_latest(FPVTelemetrySubscription * subscription, FPVTelemetryUpdate * update) {
+    unsigned int pending;
+    while ( (pending = __atomic_load_n(&subscription->pending, __ATOMIC_ACQUIRE)) ) {
+        int type = __builtin_ctz(pending);
+        __atomic_fetch_and(&subscription->pending, ~(1u << type), __ATOMIC_ACQ_REL);
+
+        FPVTelemetrySubscriptionSlot *slot = &subscription->latest[type];
+        unsigned int before, after;
+        do {
+            before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            if ( before & 1 ) continue;
+            *update = slot->update;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            after = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        } while ( (before & 1) || before != after );
+
+        // The producer marks a slot pending after writing it, so an earlier pop may already
+        // have taken this update
+        if ( before == slot->taken ) continue;
+        __atomic_store_n(&slot->taken, before, __ATOMIC_RELEASE);
+        return 1;
+    }
+    return 0;
+}
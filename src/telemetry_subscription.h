@@ -0,0 +1,57 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TELEMETRY_SUBSCRIPTION_H
+#define __TELEMETRY_SUBSCRIPTION_H
+
+#include <stdint.h>
+#include "telemetry_common.h"
+
+/*
+ * A subscriber's view of received telemetry: a bounded lock-free queue filled by the
+ * listener thread and drained by one consumer thread, with an eventfd that becomes
+ * readable when updates are waiting (suitable for poll, epoll or g_unix_fd_add). The
+ * listener never blocks on a subscriber; when a queue is full the subscriber's overflow
+ * policy decides what is lost.
+ */
+
+typedef enum {
+    FPV_TELEMETRY_OVERFLOW_DROP_OLDEST, // Keep every update in order, discarding the oldest when full
+    FPV_TELEMETRY_OVERFLOW_COALESCE     // Keep only the latest update of each record type
+} FPVTelemetryOverflowPolicy;
+
+typedef struct {
+    uint64_t published;
+    uint64_t dropped;       // Updates discarded or overwritten before the consumer saw them
+} FPVTelemetrySubscriptionStats;
+
+typedef struct _FPVTelemetrySubscription FPVTelemetrySubscription;
+
+FPVTelemetrySubscription * fpv_telemetry_subscription_new(int capacity, FPVTelemetryOverflowPolicy policy);
+void fpv_telemetry_subscription_dispose(FPVTelemetrySubscription * subscription);
+
+// Producer side: called by the listener thread only
+void fpv_telemetry_subscription_publish(FPVTelemetrySubscription * subscription, const FPVTelemetryUpdate * updates, int count);
+
+// Consumer side: called by the subscriber's thread only
+int fpv_telemetry_subscription_get_fd(FPVTelemetrySubscription * subscription);
+int fpv_telemetry_subscription_pop(FPVTelemetrySubscription * subscription, FPVTelemetryUpdate * update);
+
+void fpv_telemetry_subscription_get_stats(FPVTelemetrySubscription * subscription, FPVTelemetrySubscriptionStats * stats);
+
+#endif
@@ -20,25 +20,47 @@
 #include "common.h"
 #include "telemetry_common.h"
 #include "spi.h"
-#include <rpc/types.h>
-#include <rpc/xdr.h>
+#include "sensor_filter.h"
+#include "geometry.h"
+#include "gps_parser.h"
+#include "mavlink_parser.h"
+#include "serial.h"
 #include <pthread.h>
 #include <stdio.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
-
-static const float UPDATE_INTERVAL = 0.1;
+#include <math.h>
+#include <errno.h>
+
+static const double DEFAULT_SENSOR_RATE = 10.0;
+static const uint64_t LATE_TICK_THRESHOLD = 1000;
+static const double DEFAULT_MAX_AGE = 1.0;
+static const double DEFAULT_KEYFRAME_INTERVAL = 5.0;
+static const double DEFAULT_VOLTAGE_DEADBAND = 0.05;
+static const double DEFAULT_CURRENT_DEADBAND = 0.2;
+static const double DEFAULT_RSSI_DEADBAND = 1.0;
+static const double DEFAULT_POSITION_DEADBAND = 2.0;
+static const double BEARING_DEADBAND = 2.0;
+static const double ATTITUDE_DEADBAND = 1.0;
 static const int ADC_MAX = 1023;
+#define ADC_CHANNEL_COUNT 8
 static const double DEFAULT_SENSOR_MAX_VOLTS = 51.8;
 static const double DEFAULT_SENSOR_MAX_AMPS = 89.4;
 static const double DEFAULT_SENSOR_MIN_RSSI = -20.0;
 static const double DEFAULT_SENSOR_MAX_RSSI = 0;
 static const void * NO_SPI = (void*)1;
 
+// Due bit for records that arrived from the flight controller rather than a scheduled sensor
+#define MAVLINK_DUE (1 << FPV_TELEMETRY_SENSOR_COUNT)
+
 struct _FPVTelemetryTX {
     pthread_t thread;
     int running;
@@ -57,15 +79,58 @@ struct _FPVTelemetryTX {
     int rssi_channel;
     double min_rssi;
     double max_rssi;
+
+    FPVSensorFilter filters[FPV_TELEMETRY_SENSOR_COUNT];
+    double sensor_values[FPV_TELEMETRY_SENSOR_COUNT];
+
+    uint16_t sequence;
+    uint8_t vehicle_id;
+
+    int stop_fd;
+    struct {
+        double rate;
+        uint64_t interval;
+        uint64_t deadline;
+    } schedule[FPV_TELEMETRY_SENSOR_COUNT];
+    FPVTelemetryTXSchedulerStats scheduler_stats;
+
+    int change_driven;
+    uint64_t max_age;
+    uint64_t keyframe_interval;
+    uint64_t last_keyframe;
+    double deadbands[FPV_TELEMETRY_SENSOR_COUNT];
+    struct {
+        FPVTelemetryUpdate update;
+        int valid;
+        uint64_t time;
+    } latest[TELEMETRY_TYPE_COUNT], sent[TELEMETRY_TYPE_COUNT];
+    FPVTelemetryTXSuppressionStats suppression_stats;
+
+    int gps_fd;
+    FPVGPSParser *gps_parser;
+    FPVGPSFix gps_fix;
+    int gps_fix_fresh;
+
+    int mavlink_fd;
+    FPVMAVLinkParser *mavlink_parser;
+    FPVTelemetryUpdate mavlink_records[TELEMETRY_TYPE_COUNT];
+    unsigned int mavlink_fresh;
 };
 
 #pragma mark - Forward declarations
 
-static double fpv_telemetry_tx_read_channel(FPVTelemetryTX * tx, int channel);
+static int fpv_telemetry_tx_read_channels(FPVTelemetryTX * tx, const int *channels, uint16_t *values, int count);
+static unsigned int fpv_telemetry_tx_sample_adc(FPVTelemetryTX * tx, unsigned int sensors);
+static unsigned int fpv_telemetry_tx_wait_for_sensors(FPVTelemetryTX * tx, int timer_fd);
+static void fpv_telemetry_tx_gps_fix(FPVGPSParser * parser, const FPVGPSFix * fix, void * context);
+static void fpv_telemetry_tx_mavlink_update(FPVMAVLinkParser * parser, const FPVTelemetryUpdate * update, void * context);
+static void fpv_telemetry_tx_add_mavlink_records(FPVTelemetryTX * tx, FPVTelemetryFrame *frame);
 static int fpv_telemetry_tx_check_power(FPVTelemetryTX * tx, FPVTelemetryUpdate *update);
 static int fpv_telemetry_tx_check_rssi(FPVTelemetryTX * tx, FPVTelemetryUpdate *update);
 static int fpv_telemetry_tx_check_position(FPVTelemetryTX * tx, FPVTelemetryUpdate *update);
-static void fpv_telemetry_tx_send_update(int socket, struct sockaddr_in * destaddr, FPVTelemetryUpdate *update);
+static int fpv_telemetry_tx_record_changed(FPVTelemetryTX * tx, FPVTelemetryUpdate *record, FPVTelemetryUpdate *last);
+static void fpv_telemetry_tx_suppress_unchanged(FPVTelemetryTX * tx, FPVTelemetryFrame *frame, uint64_t now);
+static void fpv_telemetry_tx_send_frame(FPVTelemetryTX * tx, int socket, FPVTelemetryFrame *frame);
 static void * fpv_telemetry_tx_thread_entry(void *userinfo);
 
 #pragma mark -
@@ -79,6 +144,22 @@ FPVTelemetryTX * fpv_telemetry_tx_new(char * address, int port) {
     tx->rssi_channel = 2;
     tx->max_amps = DEFAULT_SENSOR_MAX_AMPS;
     tx->max_volts = DEFAULT_SENSOR_MAX_VOLTS;
+    tx->min_rssi = DEFAULT_SENSOR_MIN_RSSI;
+    tx->max_rssi = DEFAULT_SENSOR_MAX_RSSI;
+    int i;
+    for ( i=0; i<FPV_TELEMETRY_SENSOR_COUNT; i++ ) {
+        fpv_sensor_filter_init(&tx->filters[i], NULL);
+        fpv_telemetry_tx_set_sensor_rate(tx, i, DEFAULT_SENSOR_RATE);
+    }
+    tx->max_age = DEFAULT_MAX_AGE * 1e6;
+    tx->keyframe_interval = DEFAULT_KEYFRAME_INTERVAL * 1e6;
+    tx->deadbands[FPV_TELEMETRY_SENSOR_VOLTAGE] = DEFAULT_VOLTAGE_DEADBAND;
+    tx->deadbands[FPV_TELEMETRY_SENSOR_CURRENT] = DEFAULT_CURRENT_DEADBAND;
+    tx->deadbands[FPV_TELEMETRY_SENSOR_RSSI] = DEFAULT_RSSI_DEADBAND;
+    tx->deadbands[FPV_TELEMETRY_SENSOR_POSITION] = DEFAULT_POSITION_DEADBAND;
+    tx->stop_fd = -1;
+    tx->gps_fd = -1;
+    tx->mavlink_fd = -1;
     tx->destaddr.sin_family = AF_INET;
     if ( !inet_pton(AF_INET, address, &(tx->destaddr.sin_addr)) ) {
         fprintf(stderr, "Invalid telemetry address '%s'", address);
@@ -96,6 +177,21 @@ void fpv_telemetry_tx_dispose(FPVTelemetryTX * tx) {
     if ( tx->running ) {
         fpv_telemetry_tx_sender_stop(tx);
     }
+    if ( tx->stop_fd != -1 ) {
+        close(tx->stop_fd);
+    }
+    if ( tx->gps_fd != -1 ) {
+        close(tx->gps_fd);
+    }
+    if ( tx->gps_parser ) {
+        fpv_gps_parser_dispose(tx->gps_parser);
+    }
+    if ( tx->mavlink_fd != -1 ) {
+        close(tx->mavlink_fd);
+    }
+    if ( tx->mavlink_parser ) {
+        fpv_mavlink_parser_dispose(tx->mavlink_parser);
+    }
     free(tx);
 }
 
@@ -105,6 +201,14 @@ int fpv_telemetry_tx_sender_start(FPVTelemetryTX * tx) {
         return -1;
     }
 
+    if ( tx->stop_fd != -1 ) {
+        close(tx->stop_fd);
+    }
+    if ( (tx->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ) {
+        fprintf(stderr, "Unable to create FPVTelemetryTX stop event: %s\n", strerror(errno));
+        return 0;
+    }
+
     tx->running = 1;
     int result = pthread_create(&tx->thread, NULL, fpv_telemetry_tx_thread_entry, tx);
     if ( result != 0 ) {
@@ -119,7 +223,29 @@ int fpv_telemetry_tx_sender_start(FPVTelemetryTX * tx) {
 
 void fpv_telemetry_tx_sender_stop(FPVTelemetryTX * tx) {
     tx->running = 0;
+    uint64_t value = 1;
+    if ( write(tx->stop_fd, &value, sizeof(value)) < 0 ) {
+        fprintf(stderr, "Unable to signal FPVTelemetryTX sender thread: %s\n", strerror(errno));
+    }
     pthread_join(tx->thread, NULL);
+
+    FPVTelemetryTXSchedulerStats *stats = &tx->scheduler_stats;
+    printf("Telemetry scheduler: %llu ticks, %llu late, %llu missed deadlines, jitter mean %.0f us, max %llu us\n",
+        (unsigned long long)stats->ticks, (unsigned long long)stats->late_ticks, (unsigned long long)stats->missed_deadlines,
+        stats->mean_jitter, (unsigned long long)stats->max_jitter);
+
+    FPVTelemetryTXSuppressionStats *suppression = &tx->suppression_stats;
+    printf("Telemetry sent: %llu frames (%llu keyframes), %llu records sent, %llu suppressed\n",
+        (unsigned long long)suppression->frames_sent, (unsigned long long)suppression->keyframes_sent,
+        (unsigned long long)suppression->records_sent, (unsigned long long)suppression->records_suppressed);
+
+    if ( tx->mavlink_parser ) {
+        FPVMAVLinkParserStats mavlink;
+        fpv_mavlink_parser_get_stats(tx->mavlink_parser, &mavlink);
+        printf("MAVLink: %llu messages (%llu unhandled), %llu CRC errors, %llu bytes skipped\n",
+            (unsigned long long)mavlink.messages, (unsigned long long)mavlink.unhandled,
+            (unsigned long long)mavlink.crc_errors, (unsigned long long)mavlink.resyncs);
+    }
 }
 
 int fpv_telemetry_tx_set_spi(FPVTelemetryTX * tx, int bus, int device) {
@@ -137,6 +263,59 @@ int fpv_telemetry_tx_set_spi(FPVTelemetryTX * tx, int bus, int device) {
     return 1;
 }
 
+int fpv_telemetry_tx_set_gps(FPVTelemetryTX * tx, const char * device, int baud) {
+    if ( tx->gps_fd != -1 ) {
+        close(tx->gps_fd);
+    }
+    if ( !tx->gps_parser ) {
+        tx->gps_parser = fpv_gps_parser_new(fpv_telemetry_tx_gps_fix, tx);
+    }
+    tx->gps_fd = serial_open(device, baud);
+    if ( tx->gps_fd == -1 ) {
+        fprintf(stderr, "GPS position telemetry will be disabled\n");
+        return 0;
+    }
+    return 1;
+}
+
+int fpv_telemetry_tx_set_mavlink(FPVTelemetryTX * tx, const char * device, int baud) {
+    if ( tx->mavlink_fd != -1 ) {
+        close(tx->mavlink_fd);
+    }
+    if ( !tx->mavlink_parser ) {
+        tx->mavlink_parser = fpv_mavlink_parser_new(fpv_telemetry_tx_mavlink_update, tx);
+    }
+    tx->mavlink_fd = serial_open(device, baud);
+    if ( tx->mavlink_fd == -1 ) {
+        fprintf(stderr, "MAVLink telemetry will be disabled\n");
+        return 0;
+    }
+    return 1;
+}
+
+int fpv_telemetry_tx_set_mavlink_udp(FPVTelemetryTX * tx, int port) {
+    if ( tx->mavlink_fd != -1 ) {
+        close(tx->mavlink_fd);
+    }
+    if ( !tx->mavlink_parser ) {
+        tx->mavlink_parser = fpv_mavlink_parser_new(fpv_telemetry_tx_mavlink_update, tx);
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    tx->mavlink_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( tx->mavlink_fd == -1 || bind(tx->mavlink_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ) {
+        fprintf(stderr, "Unable to listen for MAVLink on UDP port %d: %s\n", port, strerror(errno));
+        if ( tx->mavlink_fd != -1 ) close(tx->mavlink_fd);
+        tx->mavlink_fd = -1;
+        fprintf(stderr, "MAVLink telemetry will be disabled\n");
+        return 0;
+    }
+    return 1;
+}
+
 void fpv_telemetry_tx_set_voltage_sensor(FPVTelemetryTX * tx, int adc_channel, double max_volts) {
     tx->voltage_channel = adc_channel;
     tx->max_volts = max_volts;
@@ -153,6 +332,68 @@ void fpv_telemetry_tx_set_rssi_sensor(FPVTelemetryTX * tx, int adc_channel, doub
     tx->max_rssi = max_rssi;
 }
 
+void fpv_telemetry_tx_set_sensor_rate(FPVTelemetryTX * tx, FPVTelemetrySensor sensor, double rate) {
+    if ( sensor < 0 || sensor >= FPV_TELEMETRY_SENSOR_COUNT ) return;
+    tx->schedule[sensor].rate = rate > 0.0 ? rate : 0.0;
+    // ADC sensors are sampled fast enough to feed their filter's oversampling at the output rate
+    tx->schedule[sensor].interval = rate > 0.0 ? (uint64_t)(1.0e6 / (rate * tx->filters[sensor].config.oversample)) : 0;
+    tx->schedule[sensor].deadline = fpv_telemetry_now();
+}
+
+double fpv_telemetry_tx_get_sensor_rate(FPVTelemetryTX * tx, FPVTelemetrySensor sensor) {
+    if ( sensor < 0 || sensor >= FPV_TELEMETRY_SENSOR_COUNT ) return 0.0;
+    return tx->schedule[sensor].rate;
+}
+
+void fpv_telemetry_tx_set_sensor_filter(FPVTelemetryTX * tx, FPVTelemetrySensor sensor, const FPVSensorFilterConfig *config) {
+    if ( sensor < 0 || sensor >= FPV_TELEMETRY_SENSOR_COUNT ) return;
+    fpv_sensor_filter_init(&tx->filters[sensor], config);
+    fpv_telemetry_tx_set_sensor_rate(tx, sensor, tx->schedule[sensor].rate);
+}
+
+void fpv_telemetry_tx_get_sensor_filter(FPVTelemetryTX * tx, FPVTelemetrySensor sensor, FPVSensorFilterConfig *config) {
+    if ( sensor < 0 || sensor >= FPV_TELEMETRY_SENSOR_COUNT ) return;
+    *config = tx->filters[sensor].config;
+}
+
+void fpv_telemetry_tx_set_change_driven(FPVTelemetryTX * tx, int change_driven, double max_age, double keyframe_interval) {
+    tx->change_driven = change_driven;
+    tx->max_age = max_age > 0.0 ? max_age * 1e6 : DEFAULT_MAX_AGE * 1e6;
+    tx->keyframe_interval = keyframe_interval > 0.0 ? keyframe_interval * 1e6 : DEFAULT_KEYFRAME_INTERVAL * 1e6;
+}
+
+int fpv_telemetry_tx_get_change_driven(FPVTelemetryTX * tx, double *max_age, double *keyframe_interval) {
+    if ( max_age ) *max_age = tx->max_age / 1e6;
+    if ( keyframe_interval ) *keyframe_interval = tx->keyframe_interval / 1e6;
+    return tx->change_driven;
+}
+
+void fpv_telemetry_tx_set_deadband(FPVTelemetryTX * tx, FPVTelemetrySensor sensor, double deadband) {
+    if ( sensor < 0 || sensor >= FPV_TELEMETRY_SENSOR_COUNT ) return;
+    tx->deadbands[sensor] = deadband;
+}
+
+double fpv_telemetry_tx_get_deadband(FPVTelemetryTX * tx, FPVTelemetrySensor sensor) {
+    if ( sensor < 0 || sensor >= FPV_TELEMETRY_SENSOR_COUNT ) return 0.0;
+    return tx->deadbands[sensor];
+}
+
+void fpv_telemetry_tx_get_scheduler_stats(FPVTelemetryTX * tx, FPVTelemetryTXSchedulerStats *stats) {
+    *stats = tx->scheduler_stats;
+}
+
+void fpv_telemetry_tx_get_suppression_stats(FPVTelemetryTX * tx, FPVTelemetryTXSuppressionStats *stats) {
+    *stats = tx->suppression_stats;
+}
+
+void fpv_telemetry_tx_set_vehicle_id(FPVTelemetryTX * tx, uint8_t vehicle_id) {
+    tx->vehicle_id = vehicle_id;
+}
+
+uint8_t fpv_telemetry_tx_get_vehicle_id(FPVTelemetryTX * tx) {
+    return tx->vehicle_id;
+}
+
 void fpv_telemetry_tx_get_spi(FPVTelemetryTX * tx, int *bus, int *device) {
     if ( bus ) *bus = tx->spi_bus;
     if ( device ) *device = tx->spi_device;
@@ -175,28 +416,80 @@ void fpv_telemetry_tx_get_rssi_sensor(FPVTelemetryTX * tx, int *adc_channel, dou
 }
 
 
-static double fpv_telemetry_tx_read_channel(FPVTelemetryTX * tx, int channel) {
-    if ( tx->spi == NO_SPI ) return 0.0;
+static int fpv_telemetry_tx_read_channels(FPVTelemetryTX * tx, const int *channels, uint16_t *values, int count) {
+    if ( tx->spi == NO_SPI ) return 0;
 
     if ( !tx->spi ) {
         tx->spi = spi_new(tx->spi_bus, tx->spi_device);
         if ( !tx->spi ) {
             fprintf(stderr, "SPI-based telemetry transmission will be disabled\n");
             tx->spi = (SPIInterface*)NO_SPI;
-            return 0.0;
+            return 0;
         }
     }
 
-    uint8_t outbuf[3];
-    uint8_t inbuf[3] = {1, (8+channel) << 4, 0};
-    spi_transaction(tx->spi, inbuf, outbuf, sizeof(outbuf));
-    int output = ((outbuf[1] & 3) << 8) + outbuf[2];
-    return (double)output / (double)ADC_MAX;
+    // Read all requested MCP3008 channels with a single SPI_IOC_MESSAGE ioctl
+    uint8_t outbuf[ADC_CHANNEL_COUNT][3];
+    uint8_t inbuf[ADC_CHANNEL_COUNT][3];
+    SPITransfer transfers[ADC_CHANNEL_COUNT];
+    int i;
+    if ( count > ADC_CHANNEL_COUNT ) count = ADC_CHANNEL_COUNT;
+    for ( i=0; i<count; i++ ) {
+        inbuf[i][0] = 1;
+        inbuf[i][1] = (8+channels[i]) << 4;
+        inbuf[i][2] = 0;
+        transfers[i].txbuffer = inbuf[i];
+        transfers[i].rxbuffer = outbuf[i];
+        transfers[i].length = sizeof(outbuf[i]);
+    }
+
+    if ( spi_transaction_batch(tx->spi, transfers, count) < 0 ) {
+        return 0;
+    }
+
+    for ( i=0; i<count; i++ ) {
+        values[i] = ((outbuf[i][1] & 3) << 8) + outbuf[i][2];
+    }
+    return count;
+}
+
+static unsigned int fpv_telemetry_tx_sample_adc(FPVTelemetryTX * tx, unsigned int sensors) {
+    // Gather each channel due for sampling once, then sample them all in one pass
+    int configured[] = {
+        [FPV_TELEMETRY_SENSOR_VOLTAGE] = sensors & (1 << FPV_TELEMETRY_SENSOR_VOLTAGE) ? tx->voltage_channel : -1,
+        [FPV_TELEMETRY_SENSOR_CURRENT] = sensors & (1 << FPV_TELEMETRY_SENSOR_CURRENT) ? tx->current_channel : -1,
+        [FPV_TELEMETRY_SENSOR_RSSI] = sensors & (1 << FPV_TELEMETRY_SENSOR_RSSI) ? tx->rssi_channel : -1 };
+    int channels[ADC_CHANNEL_COUNT];
+    uint16_t values[ADC_CHANNEL_COUNT];
+    int count = 0;
+    int i, j;
+    for ( i=0; i<sizeof(configured)/sizeof(configured[0]); i++ ) {
+        if ( configured[i] < 0 || configured[i] >= ADC_CHANNEL_COUNT ) continue;
+        for ( j=0; j<count && channels[j] != configured[i]; j++ );
+        if ( j == count ) channels[count++] = configured[i];
+    }
+    if ( count == 0 ) return 0;
+
+    count = fpv_telemetry_tx_read_channels(tx, channels, values, count);
+
+    // Run each sensor's sample through its filter; report which ones produced a new value
+    unsigned int updated = 0;
+    for ( i=0; i<sizeof(configured)/sizeof(configured[0]); i++ ) {
+        for ( j=0; j<count && channels[j] != configured[i]; j++ );
+        if ( j == count ) continue;
+
+        int32_t output;
+        if ( fpv_sensor_filter_push(&tx->filters[i], values[j], &output) ) {
+            tx->sensor_values[i] = (double)output / (double)(ADC_MAX << SENSOR_FILTER_Q);
+            updated |= 1 << i;
+        }
+    }
+    return updated;
 }
 
 static int fpv_telemetry_tx_check_power(FPVTelemetryTX * tx, FPVTelemetryUpdate *update) {
-    double voltage = fpv_telemetry_tx_read_channel(tx, tx->voltage_channel) / tx->max_volts;
-    double current = fpv_telemetry_tx_read_channel(tx, tx->current_channel) / tx->max_amps;
+    double voltage = tx->sensor_values[FPV_TELEMETRY_SENSOR_VOLTAGE] * tx->max_volts;
+    double current = tx->sensor_values[FPV_TELEMETRY_SENSOR_CURRENT] * tx->max_amps;
     if ( voltage > 0.0 || current > 0.0 ) {
         update->type = TELEMETRY_TYPE_POWER;
         update->content.power.voltage = voltage;
@@ -207,22 +500,230 @@ static int fpv_telemetry_tx_check_power(FPVTelemetryTX * tx, FPVTelemetryUpdate
 }
 
 static int fpv_telemetry_tx_check_rssi(FPVTelemetryTX * tx, FPVTelemetryUpdate *update) {
-    return 0;
+    // Only called once the filter has a value; dB can be anything, so no zero check as for power
+    update->type = TELEMETRY_TYPE_SIGNAL;
+    update->content.signal.rssi = tx->min_rssi + tx->sensor_values[FPV_TELEMETRY_SENSOR_RSSI] * (tx->max_rssi - tx->min_rssi);
+    return 1;
 }
 
 static int fpv_telemetry_tx_check_position(FPVTelemetryTX * tx, FPVTelemetryUpdate *update) {
-    return 0;
+    if ( !tx->gps_fix_fresh || tx->gps_fix.fix < 2 ) {
+        return 0;
+    }
+    tx->gps_fix_fresh = 0;
+    update->type = TELEMETRY_TYPE_POSITION;
+    update->content.position.latitude = tx->gps_fix.latitude;
+    update->content.position.longitude = tx->gps_fix.longitude;
+    update->content.position.altitude = tx->gps_fix.altitude;
+    update->content.position.bearing = tx->gps_fix.course;
+    return 1;
+}
+
+static void fpv_telemetry_tx_gps_fix(FPVGPSParser * parser, const FPVGPSFix * fix, void * context) {
+    FPVTelemetryTX *tx = (FPVTelemetryTX*)context;
+    tx->gps_fix = *fix;
+    tx->gps_fix_fresh = 1;
+}
+
+static void fpv_telemetry_tx_mavlink_update(FPVMAVLinkParser * parser, const FPVTelemetryUpdate * update, void * context) {
+    FPVTelemetryTX *tx = (FPVTelemetryTX*)context;
+    if ( update->type >= TELEMETRY_TYPE_COUNT ) return;
+    tx->mavlink_records[update->type] = *update;
+    tx->mavlink_fresh |= 1 << update->type;
+}
+
+static void fpv_telemetry_tx_add_mavlink_records(FPVTelemetryTX * tx, FPVTelemetryFrame *frame) {
+    int type, i;
+    for ( type=0; type<TELEMETRY_TYPE_COUNT && frame->count < TELEMETRY_FRAME_MAX_RECORDS; type++ ) {
+        if ( !(tx->mavlink_fresh & (1 << type)) ) continue;
+        // A locally-wired sensor sampled on this tick takes precedence over the flight controller's value
+        for ( i=0; i<frame->count && frame->records[i].type != type; i++ );
+        if ( i == frame->count ) {
+            frame->records[frame->count++] = tx->mavlink_records[type];
+        }
+    }
+    tx->mavlink_fresh = 0;
+}
+
+static int fpv_telemetry_tx_record_changed(FPVTelemetryTX * tx, FPVTelemetryUpdate *record, FPVTelemetryUpdate *last) {
+    switch ( record->type ) {
+        case TELEMETRY_TYPE_POSITION: {
+            struct telemetry_position_t *a = &record->content.position, *b = &last->content.position;
+            double bearing_change = fabs(fmod(a->bearing - b->bearing + 540.0, 360.0) - 180.0);
+            return geom_distance_between_coordinates(a->latitude, a->longitude, b->latitude, b->longitude) > tx->deadbands[FPV_TELEMETRY_SENSOR_POSITION]
+                || fabs(a->altitude - b->altitude) > tx->deadbands[FPV_TELEMETRY_SENSOR_POSITION]
+                || bearing_change > BEARING_DEADBAND;
+        }
+        case TELEMETRY_TYPE_POWER:
+            return fabs(record->content.power.voltage - last->content.power.voltage) > tx->deadbands[FPV_TELEMETRY_SENSOR_VOLTAGE]
+                || fabs(record->content.power.current - last->content.power.current) > tx->deadbands[FPV_TELEMETRY_SENSOR_CURRENT];
+        case TELEMETRY_TYPE_SIGNAL:
+            return fabs(record->content.signal.rssi - last->content.signal.rssi) > tx->deadbands[FPV_TELEMETRY_SENSOR_RSSI];
+        case TELEMETRY_TYPE_ATTITUDE: {
+            struct telemetry_attitude_t *a = &record->content.attitude, *b = &last->content.attitude;
+            double yaw_change = fabs(fmod(a->yaw - b->yaw + 540.0, 360.0) - 180.0);
+            return fabs(a->roll - b->roll) > ATTITUDE_DEADBAND || fabs(a->pitch - b->pitch) > ATTITUDE_DEADBAND
+                || yaw_change > ATTITUDE_DEADBAND;
+        }
+        default:
+            return 1;
+    }
+}
+
+static void fpv_telemetry_tx_suppress_unchanged(FPVTelemetryTX * tx, FPVTelemetryFrame *frame, uint64_t now) {
+    FPVTelemetryTXSuppressionStats *stats = &tx->suppression_stats;
+    int i;
+    for ( i=0; i<frame->count; i++ ) {
+        int type = frame->records[i].type;
+        if ( type >= TELEMETRY_TYPE_COUNT ) continue;
+        tx->latest[type].update = frame->records[i];
+        tx->latest[type].valid = 1;
+        tx->latest[type].time = now;
+    }
+
+    if ( !tx->change_driven ) {
+        stats->records_sent += frame->count;
+        return;
+    }
+
+    if ( !tx->last_keyframe || now - tx->last_keyframe >= tx->keyframe_interval ) {
+        // Send the full latest state, so late-joining receivers catch up. Values not updated since the
+        // last keyframe come from a source that has gone quiet (GPS fix or flight controller lost), so
+        // leave them out rather than keep presenting them as current.
+        frame->count = 0;
+        for ( i=0; i<TELEMETRY_TYPE_COUNT; i++ ) {
+            if ( !tx->latest[i].valid ) continue;
+            if ( tx->last_keyframe && tx->latest[i].time < tx->last_keyframe ) {
+                stats->records_suppressed++;
+                continue;
+            }
+            frame->records[frame->count++] = tx->latest[i].update;
+        }
+        frame->flags |= TELEMETRY_FRAME_FLAG_KEYFRAME;
+        tx->last_keyframe = now;
+        stats->keyframes_sent++;
+    } else {
+        // Keep only records that moved beyond their deadband, or that haven't been sent for too long
+        int count = 0;
+        for ( i=0; i<frame->count; i++ ) {
+            int type = frame->records[i].type;
+            if ( type >= TELEMETRY_TYPE_COUNT || !tx->sent[type].valid || now - tx->sent[type].time >= tx->max_age
+                    || fpv_telemetry_tx_record_changed(tx, &frame->records[i], &tx->sent[type].update) ) {
+                frame->records[count++] = frame->records[i];
+            } else {
+                stats->records_suppressed++;
+            }
+        }
+        frame->count = count;
+    }
+
+    for ( i=0; i<frame->count; i++ ) {
+        int type = frame->records[i].type;
+        if ( type >= TELEMETRY_TYPE_COUNT ) continue;
+        tx->sent[type].update = frame->records[i];
+        tx->sent[type].valid = 1;
+        tx->sent[type].time = now;
+    }
+    stats->records_sent += frame->count;
 }
 
-static void fpv_telemetry_tx_send_update(int socket, struct sockaddr_in * destaddr, FPVTelemetryUpdate *update) {
-    XDR xdrs;
-    char sendbuffer[1024];
-    xdrmem_create(&xdrs, sendbuffer, sizeof(sendbuffer), XDR_ENCODE);
-    if ( xdr_telemetry_update(&xdrs, update) ) {
-        int length = xdr_getpos(&xdrs);
-        sendto(socket, sendbuffer, length, 0, (struct sockaddr*)destaddr, sizeof(*destaddr));
+static void fpv_telemetry_tx_send_frame(FPVTelemetryTX * tx, int socket, FPVTelemetryFrame *frame) {
+    frame->vehicle_id = tx->vehicle_id;
+    frame->sequence = tx->sequence++;
+    frame->timestamp = (uint32_t)fpv_telemetry_now();
+
+    uint8_t sendbuffer[TELEMETRY_WIRE_MAX_LENGTH];
+    int length = fpv_telemetry_frame_encode(frame, sendbuffer, sizeof(sendbuffer));
+    if ( length > 0 ) {
+        sendto(socket, sendbuffer, length, 0, (struct sockaddr*)&tx->destaddr, sizeof(tx->destaddr));
+        tx->suppression_stats.frames_sent++;
     }
-    xdr_destroy(&xdrs);
+}
+
+static unsigned int fpv_telemetry_tx_wait_for_sensors(FPVTelemetryTX * tx, int timer_fd) {
+    // Find the earliest deadline among the enabled sensors
+    uint64_t next_deadline = 0;
+    int i;
+    for ( i=0; i<FPV_TELEMETRY_SENSOR_COUNT; i++ ) {
+        if ( !tx->schedule[i].interval ) continue;
+        if ( !next_deadline || tx->schedule[i].deadline < next_deadline ) {
+            next_deadline = tx->schedule[i].deadline;
+        }
+    }
+
+    // Arm the timer with an absolute deadline, so time spent sampling and sending doesn't accumulate as drift
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = next_deadline / 1000000;
+    timer.it_value.tv_nsec = (next_deadline % 1000000) * 1000;
+    if ( next_deadline ) {
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+    }
+
+    struct pollfd fds[] = {
+        { .fd = tx->stop_fd, .events = POLLIN },
+        { .fd = next_deadline ? timer_fd : -1, .events = POLLIN },
+        { .fd = tx->gps_fd, .events = POLLIN },
+        { .fd = tx->mavlink_fd, .events = POLLIN } };
+    if ( poll(fds, sizeof(fds)/sizeof(fds[0]), -1) <= 0 || (fds[0].revents & POLLIN) ) {
+        return 0;
+    }
+
+    // Parse whatever the GPS has sent; a completed fix is sent straight away rather than on the next tick
+    unsigned int due = 0;
+    if ( fds[2].revents & (POLLIN | POLLERR | POLLHUP) ) {
+        if ( fpv_gps_parser_read(tx->gps_parser, tx->gps_fd) < 0 ) {
+            fprintf(stderr, "Lost GPS connection: %s\n", errno ? strerror(errno) : "end of file");
+            close(tx->gps_fd);
+            tx->gps_fd = -1;
+        }
+        if ( tx->gps_fix_fresh ) {
+            due |= 1 << FPV_TELEMETRY_SENSOR_POSITION;
+        }
+    }
+
+    // Likewise, records decoded from the flight controller go out as soon as they arrive
+    if ( fds[3].revents & (POLLIN | POLLERR | POLLHUP) ) {
+        if ( fpv_mavlink_parser_read(tx->mavlink_parser, tx->mavlink_fd) < 0 ) {
+            fprintf(stderr, "Lost MAVLink connection: %s\n", errno ? strerror(errno) : "end of file");
+            close(tx->mavlink_fd);
+            tx->mavlink_fd = -1;
+        }
+        if ( tx->mavlink_fresh ) {
+            due |= MAVLINK_DUE;
+        }
+    }
+
+    if ( !(fds[1].revents & POLLIN) ) {
+        return due;
+    }
+
+    uint64_t expirations;
+    if ( read(timer_fd, &expirations, sizeof(expirations)) < 0 ) {
+        return due;
+    }
+
+    uint64_t now = fpv_telemetry_now();
+    uint64_t lateness = now > next_deadline ? now - next_deadline : 0;
+    FPVTelemetryTXSchedulerStats *stats = &tx->scheduler_stats;
+    stats->ticks++;
+    if ( lateness > LATE_TICK_THRESHOLD ) stats->late_ticks++;
+    if ( lateness > stats->max_jitter ) stats->max_jitter = lateness;
+    stats->mean_jitter += ((double)lateness - stats->mean_jitter) / (double)stats->ticks;
+
+    // Collect due sensors and advance their deadlines along a fixed grid
+    for ( i=0; i<FPV_TELEMETRY_SENSOR_COUNT; i++ ) {
+        if ( !tx->schedule[i].interval || tx->schedule[i].deadline > now ) continue;
+        due |= 1 << i;
+        tx->schedule[i].deadline += tx->schedule[i].interval;
+        if ( tx->schedule[i].deadline <= now ) {
+            uint64_t missed = (now - tx->schedule[i].deadline) / tx->schedule[i].interval + 1;
+            stats->missed_deadlines += missed;
+            tx->schedule[i].deadline += missed * tx->schedule[i].interval;
+        }
+    }
+
+    return due;
 }
 
 static void * fpv_telemetry_tx_thread_entry(void *userinfo) {
@@ -232,29 +733,55 @@ static void * fpv_telemetry_tx_thread_entry(void *userinfo) {
     u_char loop = 0;
     setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
 
-    FPVTelemetryUpdate update;
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if ( timer_fd == -1 ) {
+        fprintf(stderr, "Unable to create FPVTelemetryTX timer: %s\n", strerror(errno));
+        close(sock);
+        tx->running = 0;
+        return NULL;
+    }
+
+    memset(&tx->scheduler_stats, 0, sizeof(tx->scheduler_stats));
+    memset(&tx->suppression_stats, 0, sizeof(tx->suppression_stats));
+    tx->last_keyframe = 0;
+    uint64_t start = fpv_telemetry_now();
+    int i;
+    for ( i=0; i<FPV_TELEMETRY_SENSOR_COUNT; i++ ) {
+        tx->schedule[i].deadline = start;
+    }
 
-    int update_interval = UPDATE_INTERVAL * 1e6;
+    FPVTelemetryFrame frame;
 
     while ( tx->running ) {
-        memset(&update, 0, sizeof(update));
-        if ( fpv_telemetry_tx_check_power(tx, &update) ) {
-            fpv_telemetry_tx_send_update(sock, &tx->destaddr, &update);
+        unsigned int due = fpv_telemetry_tx_wait_for_sensors(tx, timer_fd);
+        if ( !due ) continue;
+
+        unsigned int updated = fpv_telemetry_tx_sample_adc(tx, due);
+
+        // Gather every record with a new value on this tick into one frame
+        memset(&frame, 0, sizeof(frame));
+        if ( (updated & ((1 << FPV_TELEMETRY_SENSOR_VOLTAGE) | (1 << FPV_TELEMETRY_SENSOR_CURRENT)))
+                && fpv_telemetry_tx_check_power(tx, &frame.records[frame.count]) ) {
+            frame.count++;
+        }
+        if ( (updated & (1 << FPV_TELEMETRY_SENSOR_RSSI)) && fpv_telemetry_tx_check_rssi(tx, &frame.records[frame.count]) ) {
+            frame.count++;
         }
-        memset(&update, 0, sizeof(update));
-        if ( fpv_telemetry_tx_check_rssi(tx, &update) ) {
-            fpv_telemetry_tx_send_update(sock, &tx->destaddr, &update);
+        if ( (due & (1 << FPV_TELEMETRY_SENSOR_POSITION)) && fpv_telemetry_tx_check_position(tx, &frame.records[frame.count]) ) {
+            frame.count++;
         }
-        memset(&update, 0, sizeof(update));
-        if ( fpv_telemetry_tx_check_position(tx, &update) ) {
-            fpv_telemetry_tx_send_update(sock, &tx->destaddr, &update);
+        if ( due & MAVLINK_DUE ) {
+            fpv_telemetry_tx_add_mavlink_records(tx, &frame);
+        }
+        fpv_telemetry_tx_suppress_unchanged(tx, &frame, fpv_telemetry_now());
+        if ( frame.count > 0 ) {
+            fpv_telemetry_tx_send_frame(tx, sock, &frame);
         }
-        usleep(update_interval);
     }
 
+    close(timer_fd);
     close(sock);
     sock = 0;
     tx->running = 0;
     return NULL;
 }
-
@@ -20,9 +20,33 @@
 #define __TELEMETRY_TX_H
 
 #include "telemetry_common.h"
+#include "sensor_filter.h"
 
 typedef struct _FPVTelemetryTX FPVTelemetryTX;
 
+typedef enum {
+    FPV_TELEMETRY_SENSOR_VOLTAGE,
+    FPV_TELEMETRY_SENSOR_CURRENT,
+    FPV_TELEMETRY_SENSOR_RSSI,
+    FPV_TELEMETRY_SENSOR_POSITION,
+    FPV_TELEMETRY_SENSOR_COUNT
+} FPVTelemetrySensor;
+
+typedef struct {
+    uint64_t ticks;             // Scheduler wakeups
+    uint64_t late_ticks;        // Wakeups more than 1 ms after their deadline
+    uint64_t missed_deadlines;  // Sensor deadlines skipped because a previous tick overran
+    double mean_jitter;         // Mean wakeup lateness, microseconds
+    uint64_t max_jitter;        // Worst wakeup lateness, microseconds
+} FPVTelemetryTXSchedulerStats;
+
+typedef struct {
+    uint64_t frames_sent;
+    uint64_t keyframes_sent;
+    uint64_t records_sent;
+    uint64_t records_suppressed; // Records withheld because they were within their deadband
+} FPVTelemetryTXSuppressionStats;
+
 FPVTelemetryTX * fpv_telemetry_tx_new(char * address, int port);
 void fpv_telemetry_tx_dispose(FPVTelemetryTX * tx);
 
@@ -30,10 +54,30 @@ int fpv_telemetry_tx_sender_start(FPVTelemetryTX * tx);
 void fpv_telemetry_tx_sender_stop(FPVTelemetryTX * tx);
 
 int fpv_telemetry_tx_set_spi(FPVTelemetryTX * tx, int bus, int device);
+int fpv_telemetry_tx_set_gps(FPVTelemetryTX * tx, const char * device, int baud);
+int fpv_telemetry_tx_set_mavlink(FPVTelemetryTX * tx, const char * device, int baud);
+int fpv_telemetry_tx_set_mavlink_udp(FPVTelemetryTX * tx, int port);
 void fpv_telemetry_tx_set_voltage_sensor(FPVTelemetryTX * tx, int adc_channel, double max_volts);
 void fpv_telemetry_tx_set_current_sensor(FPVTelemetryTX * tx, int adc_channel, double max_amps);
 void fpv_telemetry_tx_set_rssi_sensor(FPVTelemetryTX * tx, int adc_channel, double min_rssi, double max_rssi);
 
+void fpv_telemetry_tx_set_sensor_rate(FPVTelemetryTX * tx, FPVTelemetrySensor sensor, double rate);
+double fpv_telemetry_tx_get_sensor_rate(FPVTelemetryTX * tx, FPVTelemetrySensor sensor);
+void fpv_telemetry_tx_set_sensor_filter(FPVTelemetryTX * tx, FPVTelemetrySensor sensor, const FPVSensorFilterConfig *config);
+void fpv_telemetry_tx_get_sensor_filter(FPVTelemetryTX * tx, FPVTelemetrySensor sensor, FPVSensorFilterConfig *config);
+
+void fpv_telemetry_tx_set_change_driven(FPVTelemetryTX * tx, int change_driven, double max_age, double keyframe_interval);
+int fpv_telemetry_tx_get_change_driven(FPVTelemetryTX * tx, double *max_age, double *keyframe_interval);
+void fpv_telemetry_tx_set_deadband(FPVTelemetryTX * tx, FPVTelemetrySensor sensor, double deadband);
+double fpv_telemetry_tx_get_deadband(FPVTelemetryTX * tx, FPVTelemetrySensor sensor);
+
+// Identifies this aircraft to receivers shared with other vehicles (0 by default)
+void fpv_telemetry_tx_set_vehicle_id(FPVTelemetryTX * tx, uint8_t vehicle_id);
+uint8_t fpv_telemetry_tx_get_vehicle_id(FPVTelemetryTX * tx);
+
+void fpv_telemetry_tx_get_scheduler_stats(FPVTelemetryTX * tx, FPVTelemetryTXSchedulerStats *stats);
+void fpv_telemetry_tx_get_suppression_stats(FPVTelemetryTX * tx, FPVTelemetryTXSuppressionStats *stats);
+
 void fpv_telemetry_tx_get_spi(FPVTelemetryTX * tx, int *bus, int *device);
 void fpv_telemetry_tx_get_voltage_sensor(FPVTelemetryTX * tx, int *adc_channel, double *max_volts);
 void fpv_telemetry_tx_get_current_sensor(FPVTelemetryTX * tx, int *adc_channel, double *max_amps);
@@ -0,0 +1,361 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Drives the bitrate controller with a simulated link: the encoder's packets queue at a
+// bottleneck of a given capacity behind a radio buffer, some are lost at random on the air,
+// and every 100 ms the ground station reports what arrived, as the receiver does. Checks
+// the rate finds the capacity, drops quickly when it shrinks, rides out radio loss that
+// isn't congestion, backs off when reports stop, and follows the worst of several stations.
+
+#include "bitrate_controller.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TICK 1000               // Simulation step, microseconds
+#define REPORT_INTERVAL 100000  // As the receiver sends them
+#define PACKET_BYTES 1200
+#define QUEUE_SLOTS 8192
+
+typedef struct {
+    FPVBitrateController *controller;
+    uint64_t now;
+
+    // Link
+    double capacity;            // Bits per second
+    double radio_loss;          // Fraction of packets lost after the queue
+    double buffer_time;         // Seconds of capacity the radio can queue
+    double source_rate;         // Most the encoder will produce, bits per second, whatever the target
+    int reporting;
+    uint32_t seed;
+
+    double send_credit;         // Bytes
+    double link_credit;
+    uint64_t queue[QUEUE_SLOTS];
+    int queue_head, queue_length;
+
+    // Current report
+    uint64_t next_report;
+    uint32_t sent, received, bytes;
+    uint32_t ages[QUEUE_SLOTS];
+
+    // Totals, reset by the scenarios
+    uint64_t total_sent, total_lost;
+    double bitrate_sum;
+    uint64_t samples;
+} Link;
+
+static void link_init(Link *link, int bitrate, int min_bitrate, int max_bitrate, double capacity) {
+    memset(link, 0, sizeof(*link));
+    link->controller = fpv_bitrate_controller_new(bitrate, min_bitrate, max_bitrate);
+    link->now = 1000000;
+    link->capacity = capacity;
+    link->buffer_time = 0.2;
+    link->source_rate = 1e12;
+    link->reporting = 1;
+    link->seed = 2024;
+    link->next_report = link->now + REPORT_INTERVAL;
+}
+
+static void link_reset_totals(Link *link) {
+    link->total_sent = link->total_lost = 0;
+    link->bitrate_sum = 0;
+    link->samples = 0;
+}
+
+static int compare_ages(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void link_step(Link *link) {
+    int bitrate = fpv_bitrate_controller_get_bitrate(link->controller);
+    double rate = bitrate < link->source_rate ? bitrate : link->source_rate;
+
+    // Encoder output joins the radio's queue, or is dropped when the queue is full
+    link->send_credit += rate * TICK / 8e6;
+    while ( link->send_credit >= PACKET_BYTES ) {
+        link->send_credit -= PACKET_BYTES;
+        link->sent++;
+        link->total_sent++;
+        if ( link->queue_length * PACKET_BYTES * 8.0 < link->capacity * link->buffer_time && link->queue_length < QUEUE_SLOTS ) {
+            link->queue[(link->queue_head + link->queue_length++) % QUEUE_SLOTS] = link->now;
+        } else {
+            link->total_lost++;
+        }
+    }
+
+    // The bottleneck drains at its capacity; some packets don't survive the air
+    link->link_credit += link->capacity * TICK / 8e6;
+    if ( !link->queue_length && link->link_credit > PACKET_BYTES ) link->link_credit = PACKET_BYTES;
+    while ( link->queue_length && link->link_credit >= PACKET_BYTES ) {
+        link->link_credit -= PACKET_BYTES;
+        uint64_t queued = link->queue[link->queue_head];
+        link->queue_head = (link->queue_head + 1) % QUEUE_SLOTS;
+        link->queue_length--;
+        if ( (test_random(&link->seed) % 10000) < link->radio_loss * 10000 ) {
+            link->total_lost++;
+            continue;
+        }
+        if ( link->received < QUEUE_SLOTS ) link->ages[link->received] = link->now - queued;
+        link->received++;
+        link->bytes += PACKET_BYTES;
+    }
+
+    link->now += TICK;
+    if ( link->now >= link->next_report ) {
+        link->next_report += REPORT_INTERVAL;
+        if ( link->reporting ) {
+            FPVLinkFeedbackReport report;
+            memset(&report, 0, sizeof(report));
+            report.interval = REPORT_INTERVAL;
+            report.expected = link->sent;
+            report.received = link->received;
+            report.bytes = link->bytes;
+            int count = link->received < QUEUE_SLOTS ? link->received : QUEUE_SLOTS;
+            if ( count ) {
+                qsort(link->ages, count, sizeof(uint32_t), compare_ages);
+                report.age_p95 = link->ages[count * 95 / 100];
+            }
+            fpv_bitrate_controller_report(link->controller, 0, &report, link->now);
+        }
+        fpv_bitrate_controller_check_timeout(link->controller, link->now);
+        link->sent = link->received = link->bytes = 0;
+    }
+
+    link->bitrate_sum += fpv_bitrate_controller_get_bitrate(link->controller);
+    link->samples++;
+}
+
+static void link_run(Link *link, double seconds) {
+    uint64_t steps = seconds * 1e6 / TICK;
+    while ( steps-- ) link_step(link);
+}
+
+// Seconds until the target is at or under the given rate, or -1 if it doesn't get there
+static double link_run_until_below(Link *link, double bitrate, double seconds) {
+    uint64_t start = link->now, steps = seconds * 1e6 / TICK;
+    while ( steps-- ) {
+        if ( fpv_bitrate_controller_get_bitrate(link->controller) <= bitrate ) return (link->now - start) / 1e6;
+        link_step(link);
+    }
+    return -1.0;
+}
+
+static double mean_bitrate(Link *link) {
+    return link->samples ? link->bitrate_sum / link->samples : 0.0;
+}
+
+static double loss(Link *link) {
+    return link->total_sent ? (double)link->total_lost / link->total_sent : 0.0;
+}
+
+#pragma mark - Scenarios
+
+static void test_finds_capacity(void) {
+    Link link;
+    link_init(&link, 2000000, 500000, 12000000, 8e6);
+    link_run(&link, 30.0);
+    link_reset_totals(&link);
+    link_run(&link, 30.0);
+
+    printf("8 Mbit/s link from 2 Mbit/s: %.2f Mbit/s mean over the second 30 s, %.2f%% lost\n",
+        mean_bitrate(&link) / 1e6, loss(&link) * 100);
+    CHECK(mean_bitrate(&link) > 0.6 * link.capacity);
+    CHECK(mean_bitrate(&link) < 1.1 * link.capacity);
+    CHECK(loss(&link) < 0.02);
+    fpv_bitrate_controller_dispose(link.controller);
+}
+
+static void test_capacity_drop(void) {
+    Link link;
+    link_init(&link, 6000000, 500000, 12000000, 8e6);
+    link_run(&link, 20.0);
+
+    // The radio falls back to a slower rate: the queue fills and the target must follow
+    link.capacity = 2e6;
+    link_reset_totals(&link);
+    double settle = link_run_until_below(&link, 2.2e6, 5.0);
+    link_run(&link, 2.0);
+    double early_loss = loss(&link);
+    link_reset_totals(&link);
+    link_run(&link, 20.0);
+
+    printf("8 to 2 Mbit/s: under 2.2 Mbit/s after %.2f s, %.1f%% lost over the first 2 s after, "
+           "then %.2f Mbit/s mean and %.2f%% lost\n", settle, early_loss * 100, mean_bitrate(&link) / 1e6, loss(&link) * 100);
+    CHECK(settle >= 0 && settle < 1.0);
+    CHECK(mean_bitrate(&link) > 0.6 * link.capacity && mean_bitrate(&link) < 1.1 * link.capacity);
+    CHECK(loss(&link) < 0.03);
+
+    // And grows back once the link recovers
+    link.capacity = 8e6;
+    link_run(&link, 30.0);
+    CHECK(fpv_bitrate_controller_get_bitrate(link.controller) > 4e6);
+    fpv_bitrate_controller_dispose(link.controller);
+}
+
+static void test_radio_loss(void) {
+    // 5% lost on the air with plenty of capacity is not congestion: hold the rate
+    Link link;
+    link_init(&link, 6000000, 500000, 12000000, 20e6);
+    link.radio_loss = 0.05;
+    link_run(&link, 30.0);
+    FPVBitrateControllerStats stats;
+    fpv_bitrate_controller_get_stats(link.controller, &stats);
+    printf("5%% radio loss: %.2f Mbit/s after 30 s, %llu decreases\n",
+        fpv_bitrate_controller_get_bitrate(link.controller) / 1e6, (unsigned long long)stats.decreases);
+    CHECK(fpv_bitrate_controller_get_bitrate(link.controller) == 6000000);
+    CHECK(stats.decreases == 0);
+    fpv_bitrate_controller_dispose(link.controller);
+
+    // 25% is a link in trouble, whatever the cause
+    link_init(&link, 6000000, 500000, 12000000, 20e6);
+    link.radio_loss = 0.25;
+    double settle = link_run_until_below(&link, 1000000, 10.0);
+    printf("25%% radio loss: down to 1 Mbit/s after %.2f s\n", settle);
+    CHECK(settle >= 0 && settle < 5.0);
+    link_run(&link, 10.0);
+    CHECK(fpv_bitrate_controller_get_bitrate(link.controller) < 1000000);
+    fpv_bitrate_controller_dispose(link.controller);
+}
+
+static void test_quiet_scene(void) {
+    // An encoder that only needs 1 Mbit/s shouldn't talk the target up to the maximum
+    Link link;
+    link_init(&link, 2000000, 500000, 12000000, 20e6);
+    link.source_rate = 1e6;
+    link_run(&link, 60.0);
+    printf("Quiet scene at 1 Mbit/s: target %.2f Mbit/s after 60 s\n", fpv_bitrate_controller_get_bitrate(link.controller) / 1e6);
+    CHECK(fpv_bitrate_controller_get_bitrate(link.controller) <= 2000000);
+    fpv_bitrate_controller_dispose(link.controller);
+}
+
+static void test_report_timeout(void) {
+    Link link;
+    link_init(&link, 4000000, 500000, 12000000, 20e6);
+
+    // Never heard from the ground station: the configured rate stands
+    link.reporting = 0;
+    link_run(&link, 5.0);
+    CHECK(fpv_bitrate_controller_get_bitrate(link.controller) == 4000000);
+
+    // Reports flow, then stop: halve once a second, down to the minimum
+    link.reporting = 1;
+    link_run(&link, 1.0);
+    int before = fpv_bitrate_controller_get_bitrate(link.controller);
+    link.reporting = 0;
+    link_run(&link, 0.95);
+    CHECK(fpv_bitrate_controller_get_bitrate(link.controller) == before);
+    link_run(&link, 0.1);
+    CHECK(fpv_bitrate_controller_get_bitrate(link.controller) == before / 2);
+    link_run(&link, 1.0);
+    CHECK(fpv_bitrate_controller_get_bitrate(link.controller) == before / 4);
+    link_run(&link, 10.0);
+    CHECK(fpv_bitrate_controller_get_bitrate(link.controller) == 500000);
+
+    // Reports return: hold while the queue drains, then grow
+    link.reporting = 1;
+    link_run(&link, 0.5);
+    CHECK(fpv_bitrate_controller_get_bitrate(link.controller) == 500000);
+    link_run(&link, 10.0);
+    CHECK(fpv_bitrate_controller_get_bitrate(link.controller) > 500000);
+
+    FPVBitrateControllerStats stats;
+    fpv_bitrate_controller_get_stats(link.controller, &stats);
+    CHECK(stats.timeouts >= 3);
+    fpv_bitrate_controller_dispose(link.controller);
+}
+
+// A report from one station that lost the given fraction, with far more arriving than the rate
+static void station_report(FPVBitrateController * controller, int sender, double loss, uint64_t now) {
+    FPVLinkFeedbackReport report;
+    memset(&report, 0, sizeof(report));
+    report.interval = REPORT_INTERVAL;
+    report.expected = 1000;
+    report.received = 1000 * (1 - loss);
+    report.bytes = 20e6 / 8 * REPORT_INTERVAL / 1e6;
+    fpv_bitrate_controller_report(controller, sender, &report, now);
+}
+
+static void test_two_stations(void) {
+    // A second station reporting the same clean link doesn't double the growth
+    FPVBitrateController *one = fpv_bitrate_controller_new(2000000, 500000, 12000000);
+    FPVBitrateController *two = fpv_bitrate_controller_new(2000000, 500000, 12000000);
+    uint64_t now;
+    for ( now=REPORT_INTERVAL; now<=10000000; now+=REPORT_INTERVAL ) {
+        station_report(one, 0, 0, now);
+        station_report(two, 0, 0, now);
+        station_report(two, 1, 0, now + REPORT_INTERVAL / 2);
+    }
+    double ratio = (double)fpv_bitrate_controller_get_bitrate(two) / fpv_bitrate_controller_get_bitrate(one);
+    printf("Two stations: %.2f Mbit/s after 10 s, against %.2f Mbit/s for one\n",
+        fpv_bitrate_controller_get_bitrate(two) / 1e6, fpv_bitrate_controller_get_bitrate(one) / 1e6);
+    CHECK(fpv_bitrate_controller_get_bitrate(one) > 4000000);
+    CHECK(ratio > 0.97 && ratio < 1.03);
+    fpv_bitrate_controller_dispose(one);
+    fpv_bitrate_controller_dispose(two);
+
+    // The station faring worst sets the rate, though the other's link is clean
+    FPVBitrateController *controller = fpv_bitrate_controller_new(6000000, 500000, 12000000);
+    for ( now=REPORT_INTERVAL; now<=3000000; now+=REPORT_INTERVAL ) {
+        station_report(controller, 0, 0, now);
+        station_report(controller, 1, 0.25, now + REPORT_INTERVAL / 2);
+    }
+    CHECK(fpv_bitrate_controller_get_bitrate(controller) < 3000000);
+    fpv_bitrate_controller_dispose(controller);
+
+    // Loss that only holds the rate at one station holds it for both, until that one goes quiet
+    controller = fpv_bitrate_controller_new(4000000, 500000, 12000000);
+    for ( now=REPORT_INTERVAL; now<=5000000; now+=REPORT_INTERVAL ) {
+        station_report(controller, 1, 0.05, now);
+        station_report(controller, 0, 0, now + REPORT_INTERVAL / 2);
+    }
+    CHECK(fpv_bitrate_controller_get_bitrate(controller) == 4000000);
+    for ( ; now<=10000000; now+=REPORT_INTERVAL ) {
+        station_report(controller, 0, 0, now);
+    }
+    CHECK(fpv_bitrate_controller_get_bitrate(controller) > 4000000);
+    fpv_bitrate_controller_dispose(controller);
+}
+
+static void test_limits(void) {
+    FPVBitrateController *controller = fpv_bitrate_controller_new(20000000, 500000, 8000000);
+    CHECK(fpv_bitrate_controller_get_bitrate(controller) == 8000000);
+    CHECK(fpv_bitrate_controller_set_limits(controller, 500000, 4000000) == 4000000);
+    CHECK(fpv_bitrate_controller_set_limits(controller, 5000000, 1000000) == 5000000);
+
+    // Empty reports count, but don't move the rate
+    FPVLinkFeedbackReport report;
+    memset(&report, 0, sizeof(report));
+    CHECK(fpv_bitrate_controller_report(controller, 0, &report, 1000000) == 5000000);
+    FPVBitrateControllerStats stats;
+    fpv_bitrate_controller_get_stats(controller, &stats);
+    CHECK(stats.reports == 1);
+    fpv_bitrate_controller_dispose(controller);
+}
+
+int main(int argc, char **argv) {
+    test_finds_capacity();
+    test_capacity_drop();
+    test_radio_loss();
+    test_quiet_scene();
+    test_report_timeout();
+    test_two_stations();
+    test_limits();
+    return test_failures();
+}
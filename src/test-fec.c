@@ -0,0 +1,402 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks the erasure code end to end: every GF(256) region kernel this CPU can run against
+// a bit-by-bit reference multiply, every loss pattern of an 8 + 4 group, and streams of
+// RTP packets with random group sizes, frame lengths and loss, random or in bursts, where
+// each group that kept k of its k + m packets must come back byte-exact and nothing else
+// may be handed on.
+
+#include "gf256.h"
+#include "fec.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define STREAM_PACKETS 4096
+#define RTP_PAYLOAD_TYPE 96
+
+// Reference products, from shift-and-add
+static uint8_t reference_products[256][256];
+
+// The packets of one simulated stream, and what the receiver made of them
+typedef struct {
+    int count;
+    uint16_t first;
+    uint8_t packets[STREAM_PACKETS][FEC_MAX_PACKET_LENGTH];
+    int lengths[STREAM_PACKETS];
+    int lost[STREAM_PACKETS];
+    int recovered[STREAM_PACKETS];
+    int wrong;                  // Handed on but not lost, twice, or not as sent
+} stream_t;
+
+static stream_t stream;
+
+// Long-run loss rate, in bursts of a mean length (Gilbert-Elliott, losing everything in
+// the bad state), or independent losses for a burst length of 1
+typedef struct {
+    uint32_t seed;
+    double loss;
+    double burst;
+    int bad;
+} channel_t;
+
+typedef struct {
+    uint64_t packets;
+    uint64_t lost;
+    uint64_t unrecovered;
+    uint64_t repair;
+} stream_result_t;
+
+static double random_unit(uint32_t *seed) {
+    return test_random(seed) / 4294967296.0;
+}
+
+static int channel_drop(channel_t *channel) {
+    double u = random_unit(&channel->seed);
+    if ( channel->burst <= 1 ) return u < channel->loss;
+    double leave = 1 / channel->burst;
+    double enter = channel->loss * leave / (1 - channel->loss);
+    channel->bad = channel->bad ? u >= leave : u < enter;
+    return channel->bad;
+}
+
+static uint8_t reference_mul(uint8_t a, uint8_t b) {
+    unsigned int product = 0, x = a;
+    while ( b ) {
+        if ( b & 1 ) product ^= x;
+        x <<= 1;
+        if ( x & 0x100 ) x ^= 0x11D;
+        b >>= 1;
+    }
+    return product;
+}
+
+// Fills packet i of the stream with an RTP header and a random payload
+static void stream_make_packet(int i, uint16_t sequence, uint32_t timestamp, int marker, uint32_t *seed) {
+    uint8_t *p = stream.packets[i];
+    int length = 13 + test_random(seed) % (1400 - 13);
+    p[0] = 0x80;
+    p[1] = RTP_PAYLOAD_TYPE | (marker ? 0x80 : 0);
+    p[2] = sequence >> 8;
+    p[3] = sequence;
+    p[4] = timestamp >> 24;
+    p[5] = timestamp >> 16;
+    p[6] = timestamp >> 8;
+    p[7] = timestamp;
+    memcpy(p + 8, "\x12\x34\x56\x78", 4);
+    int j;
+    for ( j=12; j<length; j++ ) p[j] = test_random(seed);
+    stream.lengths[i] = length;
+    stream.lost[i] = stream.recovered[i] = 0;
+}
+
+static void stream_recovered(const uint8_t * packet, int length, void * userinfo) {
+    uint16_t index = ((packet[2] << 8) | packet[3]) - stream.first;
+    if ( index >= stream.count || !stream.lost[index] || stream.recovered[index]
+            || length != stream.lengths[index] || memcmp(packet, stream.packets[index], length) != 0 ) {
+        stream.wrong++;
+        return;
+    }
+    stream.recovered[index] = 1;
+}
+
+#pragma mark - GF(256)
+
+static void test_arithmetic(void) {
+    gf256_init();
+    int a, b, mismatches = 0;
+    for ( a=0; a<256; a++ ) {
+        for ( b=0; b<256; b++ ) {
+            reference_products[a][b] = reference_mul(a, b);
+            if ( gf256_mul(a, b) != reference_products[a][b] ) mismatches++;
+        }
+    }
+    CHECK(mismatches == 0);
+
+    for ( a=1; a<256; a++ ) {
+        if ( reference_products[a][gf256_inv(a)] != 1 ) mismatches++;
+    }
+    CHECK(mismatches == 0);
+}
+
+// Through the public entry point, whose shortcuts for 0 and 1 are checked along the way
+static int region_matches(uint32_t *seed) {
+    static const int lengths[] = { 0, 1, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65, 100, 1400, FEC_MAX_PACKET_LENGTH + 2 };
+    uint8_t src[FEC_MAX_PACKET_LENGTH + 8], dst[FEC_MAX_PACKET_LENGTH + 16], expected[FEC_MAX_PACKET_LENGTH + 16];
+    int c, l, offset, i, mismatches = 0;
+
+    for ( c=0; c<256; c++ ) {
+        for ( l=0; l<(int)(sizeof(lengths)/sizeof(lengths[0])); l++ ) {
+            // Unaligned source and destination, with guard bytes either side that must survive
+            for ( offset=0; offset<4; offset++ ) {
+                for ( i=0; i<(int)sizeof(src); i++ ) src[i] = test_random(seed);
+                for ( i=0; i<(int)sizeof(dst); i++ ) dst[i] = expected[i] = test_random(seed);
+                for ( i=0; i<lengths[l]; i++ ) expected[4 + i] ^= reference_products[c][src[offset + i]];
+                gf256_mul_add_region(dst + 4, src + offset, c, lengths[l]);
+                if ( memcmp(dst, expected, sizeof(dst)) != 0 ) mismatches++;
+            }
+        }
+    }
+    return mismatches == 0;
+}
+
+static void test_kernels(void) {
+    static const char *kernels[] = { "scalar", "ssse3", "avx2", "neon" };
+    uint32_t seed = 1;
+    int i, tested = 0;
+    const char *best = NULL;
+    for ( i=0; i<(int)(sizeof(kernels)/sizeof(kernels[0])); i++ ) {
+        if ( !gf256_use_kernel(kernels[i]) ) continue;
+        CHECK(strcmp(gf256_kernel_name(), kernels[i]) == 0);
+        CHECK(region_matches(&seed));
+        tested++;
+        if ( strcmp(kernels[i], "scalar") != 0 ) best = kernels[i];
+    }
+    CHECK(tested >= 1);
+    CHECK(!gf256_use_kernel("mmx"));
+
+    // Left to itself, it runs the best kernel there is
+    CHECK(gf256_use_kernel(NULL));
+    CHECK(strcmp(gf256_kernel_name(), best ? best : "scalar") == 0);
+    printf("GF(256) region kernel: %s, of %d tested\n", gf256_kernel_name(), tested);
+}
+
+#pragma mark - Every loss pattern of one group
+
+static void test_loss_patterns(void) {
+    const int k = 8, m = 4;
+    uint32_t seed = 2;
+    uint8_t repair[4][FEC_MAX_REPAIR_LENGTH];
+    int repair_lengths[4];
+    int i, j;
+
+    FPVFecEncoder *encoder = fpv_fec_encoder_new(k, m);
+    stream.count = k;
+    stream.first = 1000;
+    for ( i=0; i<k; i++ ) {
+        uint8_t **r;
+        int *rl;
+        stream_make_packet(i, stream.first + i, 0, 0, &seed);
+        int n = fpv_fec_encoder_add(encoder, stream.packets[i], stream.lengths[i], &r, &rl);
+        CHECK(n == (i == k-1 ? m : 0));
+        for ( j=0; j<n; j++ ) {
+            memcpy(repair[j], r[j], rl[j]);
+            repair_lengths[j] = rl[j];
+        }
+    }
+    fpv_fec_encoder_dispose(encoder);
+
+    // Lost media comes back exactly when at least k of the k + m packets arrived
+    int pattern, failures = 0;
+    for ( pattern=0; pattern<(1 << (k + m)); pattern++ ) {
+        FPVFecDecoder *decoder = fpv_fec_decoder_new(stream_recovered, NULL);
+        int lost = 0, arrived = 0;
+        stream.wrong = 0;
+        for ( i=0; i<k; i++ ) {
+            stream.lost[i] = (pattern >> i) & 1;
+            stream.recovered[i] = 0;
+            lost += stream.lost[i];
+            if ( !stream.lost[i] ) fpv_fec_decoder_add_media(decoder, stream.packets[i], stream.lengths[i]);
+        }
+        for ( j=0; j<m; j++ ) {
+            if ( (pattern >> (k + j)) & 1 ) continue;
+            arrived++;
+            fpv_fec_decoder_add_repair(decoder, repair[j], repair_lengths[j]);
+        }
+        int recoverable = lost <= arrived;
+        for ( i=0; i<k; i++ ) {
+            if ( stream.lost[i] && stream.recovered[i] != recoverable ) failures++;
+        }
+        if ( stream.wrong ) failures++;
+
+        FPVFecStats stats;
+        fpv_fec_decoder_get_stats(decoder, &stats);
+        if ( stats.recovered != (uint64_t)(recoverable ? lost : 0) ) failures++;
+        fpv_fec_decoder_dispose(decoder);
+    }
+    CHECK(failures == 0);
+}
+
+#pragma mark - Streams
+
+// Sends packets through the encoder and a lossy channel to the decoder, frames of up to
+// frame_max packets each, and checks what came back against what each group could rebuild
+static void run_stream(int k, int m, int frame_max, channel_t *channel, int packets, uint32_t *seed, stream_result_t *result) {
+    FPVFecEncoder *encoder = fpv_fec_encoder_new(k, m);
+    FPVFecDecoder *decoder = fpv_fec_decoder_new(stream_recovered, NULL);
+    int i, j, group_start = 0, group_lost = 0, frame_left = 0;
+    uint32_t timestamp = 0;
+    int wrong_groups = 0;
+
+    stream.count = packets;
+    stream.first = test_random(seed);   // Sometimes wraps mid-stream
+    stream.wrong = 0;
+
+    for ( i=0; i<packets; i++ ) {
+        if ( frame_left == 0 ) {
+            frame_left = 1 + test_random(seed) % frame_max;
+            timestamp += 3000;
+        }
+        frame_left--;
+        stream_make_packet(i, stream.first + i, timestamp, frame_left == 0 || i == packets - 1, seed);
+
+        uint8_t **repair;
+        int *repair_lengths;
+        int n = fpv_fec_encoder_add(encoder, stream.packets[i], stream.lengths[i], &repair, &repair_lengths);
+
+        // The sender puts each media packet on the air before its group's repair
+        stream.lost[i] = channel_drop(channel);
+        group_lost += stream.lost[i];
+        if ( !stream.lost[i] ) fpv_fec_decoder_add_media(decoder, stream.packets[i], stream.lengths[i]);
+        if ( n == 0 ) continue;
+
+        int arrived = 0;
+        for ( j=0; j<n; j++ ) {
+            if ( channel_drop(channel) ) continue;
+            arrived++;
+            fpv_fec_decoder_add_repair(decoder, repair[j], repair_lengths[j]);
+        }
+        result->repair += n;
+
+        // The whole group is back if it lost no more than the repair that arrived, and
+        // none of it otherwise
+        int recoverable = group_lost <= arrived;
+        for ( j=group_start; j<=i; j++ ) {
+            if ( stream.lost[j] && stream.recovered[j] != recoverable ) {
+                wrong_groups++;
+                break;
+            }
+        }
+        group_start = i + 1;
+        group_lost = 0;
+    }
+    CHECK(group_start == packets);
+    CHECK(wrong_groups == 0);
+    CHECK(stream.wrong == 0);
+
+    FPVFecStats stats;
+    fpv_fec_decoder_get_stats(decoder, &stats);
+    uint64_t recovered = 0;
+    for ( i=0; i<packets; i++ ) {
+        result->lost += stream.lost[i];
+        result->unrecovered += stream.lost[i] && !stream.recovered[i];
+        recovered += stream.recovered[i];
+    }
+    CHECK(stats.recovered == recovered);
+    result->packets += packets;
+
+    fpv_fec_encoder_dispose(encoder);
+    fpv_fec_decoder_dispose(decoder);
+}
+
+static void test_random_streams(void) {
+    uint32_t seed = 3;
+    int trial;
+    for ( trial=0; trial<200; trial++ ) {
+        int k = 1 + test_random(&seed) % FEC_MAX_MEDIA_PACKETS;
+        int m = 1 + test_random(&seed) % FEC_MAX_REPAIR_PACKETS;
+        int frame_max = 1 + test_random(&seed) % 100;
+        channel_t channel = { test_random(&seed), 0.3 * random_unit(&seed), trial % 2 ? 1 : 1 + 7 * random_unit(&seed), 0 };
+        stream_result_t result = { 0 };
+        run_stream(k, m, frame_max, &channel, 2000, &seed, &result);
+    }
+}
+
+// A late packet still completes a group whose repair has already arrived
+static void test_repair_first(void) {
+    const int k = 8, m = 4;
+    uint32_t seed = 4;
+    uint8_t repair[4][FEC_MAX_REPAIR_LENGTH];
+    int repair_lengths[4];
+    int i, j;
+
+    FPVFecEncoder *encoder = fpv_fec_encoder_new(k, m);
+    FPVFecDecoder *decoder = fpv_fec_decoder_new(stream_recovered, NULL);
+    stream.count = k;
+    stream.first = 65534;
+    stream.wrong = 0;
+    for ( i=0; i<k; i++ ) {
+        uint8_t **r;
+        int *rl;
+        stream_make_packet(i, stream.first + i, 0, i == k-1, &seed);
+        int n = fpv_fec_encoder_add(encoder, stream.packets[i], stream.lengths[i], &r, &rl);
+        for ( j=0; j<n; j++ ) {
+            memcpy(repair[j], r[j], rl[j]);
+            repair_lengths[j] = rl[j];
+        }
+    }
+    stream.lost[2] = stream.lost[5] = 1;
+
+    for ( j=0; j<m; j++ ) fpv_fec_decoder_add_repair(decoder, repair[j], repair_lengths[j]);
+    fpv_fec_decoder_add_repair(decoder, repair[0], repair_lengths[0]);
+    for ( i=0; i<k-4; i++ ) {
+        if ( !stream.lost[i] ) fpv_fec_decoder_add_media(decoder, stream.packets[i], stream.lengths[i]);
+    }
+    CHECK(!stream.recovered[2] && !stream.recovered[5]);
+
+    // Packets still on their way count as missing too, and come back with the lost ones
+    // once there's repair enough for all of them
+    stream.lost[6] = stream.lost[7] = 1;
+    fpv_fec_decoder_add_media(decoder, stream.packets[4], stream.lengths[4]);
+    CHECK(stream.recovered[2] && stream.recovered[5] && stream.recovered[6] && stream.recovered[7]);
+    CHECK(stream.wrong == 0);
+
+    FPVFecStats stats;
+    fpv_fec_decoder_get_stats(decoder, &stats);
+    CHECK(stats.groups == 1 && stats.repairs == 5 && stats.recovered == 4 && stats.unrecoverable == 0);
+
+    fpv_fec_encoder_dispose(encoder);
+    fpv_fec_decoder_dispose(decoder);
+}
+
+#pragma mark - Residual loss
+
+static double residual_loss(int k, int m, double loss, double burst, uint32_t seed) {
+    channel_t channel = { seed, loss, burst, 0 };
+    stream_result_t result = { 0 };
+    int run;
+    for ( run=0; run<16; run++ ) {
+        run_stream(k, m, 1000, &channel, STREAM_PACKETS, &seed, &result);
+    }
+    return (double)result.unrecovered / result.packets;
+}
+
+static void test_residual_loss(void) {
+    // 16/4 turns 5% random loss into well under 0.2%, and more repair does better still
+    double m1 = residual_loss(16, 1, 0.05, 1, 5);
+    double m4 = residual_loss(16, 4, 0.05, 1, 5);
+    double m8 = residual_loss(16, 8, 0.05, 1, 5);
+    CHECK(m4 < 0.002);
+    CHECK(m1 > m4 && m4 > m8);
+
+    // The same loss in bursts averaging 4 packets defeats far more groups
+    double burst = residual_loss(16, 4, 0.05, 4, 5);
+    CHECK(burst > 10 * m4);
+    CHECK(burst < 0.05);
+}
+
+int main(int argc, char **argv) {
+    test_arithmetic();
+    test_kernels();
+    test_loss_patterns();
+    test_random_streams();
+    test_repair_first();
+    test_residual_loss();
+    return test_failures();
+}
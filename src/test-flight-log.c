@@ -0,0 +1,250 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests for the flight log: telemetry sent over loopback is recorded and read back in order,
+// seeks through the index land on the right record, and a recorder killed mid-flight leaves
+// a log that reads back cleanly up to its last flush
+
+#include "flight_log.h"
+#include "telemetry_rx.h"
+#include "telemetry_common.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define FRAMES 3000
+#define CRASH_FRAMES 4000
+#define SYNC_INTERVAL 50    // Milliseconds
+
+static int port;
+static int sock = -1;
+
+// Frame i carries sequence number i in its sender timestamp and a voltage derived from it
+static void send_frame(uint32_t i) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    FPVTelemetryFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.vehicle_id = 7;
+    frame.sequence = i;
+    frame.timestamp = i;
+    frame.count = 2;
+    frame.records[0].type = TELEMETRY_TYPE_POWER;
+    frame.records[0].content.power.voltage = (i % 60000) * 0.001;
+    frame.records[1].type = TELEMETRY_TYPE_ATTITUDE;
+    frame.records[1].content.attitude.roll = (i % 1800) * 0.1 - 90.0;
+    uint8_t buffer[TELEMETRY_WIRE_MAX_LENGTH];
+    int length = fpv_telemetry_frame_encode(&frame, buffer, sizeof(buffer));
+    sendto(sock, buffer, length, 0, (struct sockaddr*)&address, sizeof(address));
+}
+
+static void log_path(char *path, size_t size, const char *name) {
+    const char *directory = getenv("TMPDIR");
+    snprintf(path, size, "%s/%s-%d.log", directory ? directory : "/tmp", name, getpid());
+}
+
+#pragma mark - Recording and reading back
+
+typedef struct {
+    uint32_t timestamp;
+    uint64_t received;
+} RecordInfo;
+
+static RecordInfo records[FRAMES * 2];
+
+static void test_record_and_read(void) {
+    FPVTelemetryRX *rx = fpv_telemetry_rx_new(NULL, port);
+    CHECK(rx != NULL);
+    if ( !rx || !fpv_telemetry_rx_listener_start(rx) ) {
+        CHECK(0);
+        return;
+    }
+    usleep(100000);
+
+    char path[256];
+    log_path(path, sizeof(path), "test-flight-log");
+    FPVFlightLog *log = fpv_flight_log_new(rx, path, 4 << 20);
+    CHECK(log != NULL);
+    if ( !log ) return;
+    fpv_flight_log_set_sync_interval(log, SYNC_INTERVAL);
+    fpv_flight_log_set_index_interval(log, 16);
+    CHECK(fpv_flight_log_start(log) == 1);
+
+    uint64_t wall_start = (uint64_t)time(NULL) * 1000000;
+    uint32_t i;
+    for ( i=1; i<=FRAMES; i++ ) {
+        send_frame(i);
+        if ( (i & 31) == 0 ) usleep(200);
+    }
+
+    FPVFlightLogStats stats;
+    int wait;
+    for ( wait=0; wait<200; wait++ ) {
+        fpv_flight_log_get_stats(log, &stats);
+        if ( stats.records >= FRAMES * 2 ) break;
+        usleep(5000);
+    }
+    usleep(2 * SYNC_INTERVAL * 1000);
+    fpv_flight_log_get_stats(log, &stats);
+    CHECK(stats.records == FRAMES * 2);
+    CHECK(stats.dropped == 0);
+    CHECK(stats.syncs > 0);
+    fpv_flight_log_stop(log);
+    fpv_flight_log_dispose(log);
+    fpv_telemetry_rx_listener_stop(rx);
+    fpv_telemetry_rx_dispose(rx);
+
+    // Unused preallocated space is given back
+    struct stat st;
+    CHECK(stat(path, &st) == 0 && st.st_size < (4 << 20));
+
+    FPVFlightLogReader *reader = fpv_flight_log_reader_new(path);
+    CHECK(reader != NULL);
+    if ( !reader ) return;
+
+    // Every record, in order, with its type, vehicle, values and times intact
+    FPVTelemetryUpdate update;
+    int count = 0, wrong = 0;
+    while ( fpv_flight_log_reader_next(reader, &update) && count < FRAMES * 2 ) {
+        uint32_t frame = count / 2 + 1;
+        if ( update.timestamp != frame || update.vehicle_id != 7 ) wrong++;
+        if ( count % 2 == 0 && (update.type != TELEMETRY_TYPE_POWER || lrint(update.content.power.voltage * 1000) != frame % 60000) ) wrong++;
+        if ( count % 2 == 1 && (update.type != TELEMETRY_TYPE_ATTITUDE || lrint((update.content.attitude.roll + 90.0) * 10) != frame % 1800) ) wrong++;
+        if ( count > 0 && update.received < records[count - 1].received ) wrong++;
+        records[count].timestamp = update.timestamp;
+        records[count].received = update.received;
+        count++;
+    }
+    CHECK(count == FRAMES * 2);
+    CHECK(wrong == 0);
+    CHECK(!fpv_flight_log_reader_next(reader, &update));
+
+    uint64_t started, first, last;
+    fpv_flight_log_reader_get_info(reader, &started, &first, &last);
+    CHECK(started >= wall_start - 60000000 && started <= wall_start + 60000000);
+    CHECK(first == records[0].received);
+    CHECK(last == records[count - 1].received);
+
+    // A seek lands on the first record received at or after the target, including targets
+    // between index entries and between records
+    uint32_t seed = 4242;
+    int round;
+    for ( round=0; round<500 && count == FRAMES * 2; round++ ) {
+        int k = test_random(&seed) % count;
+        uint64_t target = records[k].received - (round & 1);
+        int expected = 0;
+        while ( records[expected].received < target ) expected++;
+        fpv_flight_log_reader_seek(reader, target);
+        CHECK(fpv_flight_log_reader_next(reader, &update) && update.timestamp == records[expected].timestamp
+            && update.received == records[expected].received);
+    }
+    fpv_flight_log_reader_seek(reader, 0);
+    CHECK(fpv_flight_log_reader_next(reader, &update) && update.timestamp == 1);
+    fpv_flight_log_reader_seek(reader, last + 1);
+    CHECK(!fpv_flight_log_reader_next(reader, &update));
+
+    fpv_flight_log_reader_dispose(reader);
+    unlink(path);
+}
+
+#pragma mark - Killed mid-flight
+
+// The recorder runs in a child process that is killed without warning. The page cache
+// outlives the process, so this can't show what reaches the disk on a power cut, but it
+// does show the header only ever advertises complete records and keeps within a flush
+// interval or so of the data.
+static void test_killed_recorder(void) {
+    char path[256];
+    log_path(path, sizeof(path), "test-flight-log-killed");
+    int ready[2];
+    CHECK(pipe(ready) == 0);
+
+    pid_t child = fork();
+    if ( child == 0 ) {
+        close(ready[0]);
+        FPVTelemetryRX *rx = fpv_telemetry_rx_new(NULL, port);
+        if ( !rx || !fpv_telemetry_rx_listener_start(rx) ) _exit(1);
+        FPVFlightLog *log = fpv_flight_log_new(rx, path, 4 << 20);
+        if ( !log ) _exit(1);
+        fpv_flight_log_set_sync_interval(log, SYNC_INTERVAL);
+        if ( fpv_flight_log_start(log) != 1 ) _exit(1);
+        usleep(100000);
+        if ( write(ready[1], "", 1) != 1 ) _exit(1);
+        while ( 1 ) pause();
+    }
+    close(ready[1]);
+    char byte;
+    CHECK(child > 0 && read(ready[0], &byte, 1) == 1);
+    close(ready[0]);
+
+    static uint64_t sent_at[CRASH_FRAMES + 1];
+    uint32_t i;
+    for ( i=1; i<=CRASH_FRAMES; i++ ) {
+        sent_at[i] = test_now();
+        send_frame(i);
+        if ( (i & 7) == 0 ) usleep(1000);
+    }
+    uint64_t killed = test_now();
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+
+    FPVFlightLogReader *reader = fpv_flight_log_reader_new(path);
+    CHECK(reader != NULL);
+    if ( !reader ) return;
+    FPVTelemetryUpdate update;
+    int count = 0, wrong = 0;
+    uint32_t newest = 0;
+    while ( fpv_flight_log_reader_next(reader, &update) ) {
+        uint32_t frame = count / 2 + 1;
+        if ( update.timestamp != frame ) wrong++;
+        if ( update.type != (count % 2 ? TELEMETRY_TYPE_ATTITUDE : TELEMETRY_TYPE_POWER) ) wrong++;
+        newest = update.timestamp;
+        count++;
+    }
+    fpv_flight_log_reader_dispose(reader);
+    unlink(path);
+
+    uint64_t lost = newest < CRASH_FRAMES ? killed - sent_at[newest + 1] : 0;
+    printf("Recorder killed after %d frames: %d records read back, the last %.0f ms of sending lost\n",
+        CRASH_FRAMES, count, lost / 1000.0);
+    CHECK(count > 0);
+    CHECK(wrong == 0);
+    CHECK(lost < 4 * SYNC_INTERVAL * 1000);
+}
+
+int main(int argc, char **argv) {
+    port = 20000 + getpid() % 20000;
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    test_record_and_read();
+    test_killed_recorder();
+    close(sock);
+    return test_failures();
+}
@@ -0,0 +1,321 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Replays NMEA and UBX through a pseudo-terminal into fpv_gps_parser_read, as a GPS on a
+// serial port would deliver them: whole, corrupted, and split across reads
+
+#define _GNU_SOURCE
+#include "gps_parser.h"
+#include "serial.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define MAX_FIXES 16
+
+static struct {
+    FPVGPSFix fixes[MAX_FIXES];
+    int count;
+} received;
+
+static void fix_callback(FPVGPSParser * parser, const FPVGPSFix * fix, void * context) {
+    if ( received.count < MAX_FIXES ) received.fixes[received.count] = *fix;
+    received.count++;
+}
+
+#pragma mark - Messages
+
+static int nmea(char *buffer, const char *body) {
+    uint8_t checksum = 0;
+    const char *p;
+    for ( p = body; *p; p++ ) checksum ^= *p;
+    return sprintf(buffer, "$%s*%02X\r\n", body, checksum);
+}
+
+static void put_le32(uint8_t *p, int32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static int ubx_nav_pvt(uint8_t *buffer, int fix_type, int32_t latitude, int32_t longitude, int32_t altitude) {
+    static const int payload_length = 92;
+    memset(buffer, 0, 6 + payload_length + 2);
+    buffer[0] = 0xB5;
+    buffer[1] = 0x62;
+    buffer[2] = 0x01;
+    buffer[3] = 0x07;
+    buffer[4] = payload_length;
+    buffer[5] = 0;
+    uint8_t *pvt = buffer + 6;
+    pvt[20] = fix_type;
+    pvt[21] = 0x01;
+    pvt[23] = 14;
+    put_le32(pvt + 24, longitude);
+    put_le32(pvt + 28, latitude);
+    put_le32(pvt + 36, altitude);
+    put_le32(pvt + 60, 12500);      // mm/s
+    put_le32(pvt + 64, 9000000);    // 1e-5 degrees
+
+    uint8_t ck_a = 0, ck_b = 0;
+    int i;
+    for ( i=2; i<6 + payload_length; i++ ) {
+        ck_a += buffer[i];
+        ck_b += ck_a;
+    }
+    buffer[6 + payload_length] = ck_a;
+    buffer[6 + payload_length + 1] = ck_b;
+    return 6 + payload_length + 2;
+}
+
+#pragma mark - Pseudo-terminal
+
+typedef struct {
+    int master;
+    int slave;
+    FPVGPSParser *parser;
+} GPSLine;
+
+static int gps_line_open(GPSLine *line) {
+    line->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if ( line->master < 0 || grantpt(line->master) < 0 || unlockpt(line->master) < 0 ) {
+        perror("Couldn't create a pseudo-terminal");
+        return 0;
+    }
+    line->slave = serial_open(ptsname(line->master), 9600);
+    if ( line->slave < 0 ) return 0;
+    line->parser = fpv_gps_parser_new(fix_callback, NULL);
+    memset(&received, 0, sizeof(received));
+    return 1;
+}
+
+static void gps_line_close(GPSLine *line) {
+    fpv_gps_parser_dispose(line->parser);
+    close(line->slave);
+    if ( line->master >= 0 ) close(line->master);
+}
+
+// Writes to the GPS end, then reads everything that arrives at the parser's end
+static int gps_line_send(GPSLine *line, const void *data, int length) {
+    CHECK(write(line->master, data, length) == length);
+
+    int total = 0;
+    struct pollfd pollfd = { .fd = line->slave, .events = POLLIN };
+    while ( total < length && poll(&pollfd, 1, 1000) == 1 ) {
+        int result = fpv_gps_parser_read(line->parser, line->slave);
+        CHECK(result >= 0);
+        if ( result < 0 ) break;
+        total += result;
+    }
+    CHECK(total == length);
+    return total;
+}
+
+#pragma mark - Tests
+
+static void test_nmea(void) {
+    GPSLine line;
+    if ( !gps_line_open(&line) ) {
+        CHECK(0);
+        return;
+    }
+
+    char buffer[256];
+    int length = nmea(buffer, "GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,");
+    gps_line_send(&line, buffer, length);
+    CHECK(received.count == 1);
+    CHECK(received.fixes[0].source == GPS_SOURCE_NMEA_GGA);
+    CHECK(received.fixes[0].fix == 3);
+    CHECK(received.fixes[0].satellites == 8);
+    CHECK_NEAR(received.fixes[0].latitude, 48.1173, 1e-6);
+    CHECK_NEAR(received.fixes[0].longitude, 11.516666, 1e-6);
+    CHECK_NEAR(received.fixes[0].altitude, 545.4, 1e-9);
+
+    // Any talker ID; southern and western hemispheres are negative
+    length = nmea(buffer, "GNRMC,123520,A,3351.000,S,15112.000,W,022.4,084.4,230394,003.1,W");
+    gps_line_send(&line, buffer, length);
+    CHECK(received.count == 2);
+    CHECK(received.fixes[1].source == GPS_SOURCE_NMEA_RMC);
+    CHECK_NEAR(received.fixes[1].latitude, -33.85, 1e-9);
+    CHECK_NEAR(received.fixes[1].longitude, -151.2, 1e-9);
+    CHECK_NEAR(received.fixes[1].speed, 22.4 * 0.514444, 1e-6);
+    CHECK_NEAR(received.fixes[1].course, 84.4, 1e-9);
+    CHECK_NEAR(received.fixes[1].altitude, 545.4, 1e-9);
+
+    // No fix: GGA reports it, a void RMC is ignored, and other sentences are counted but unused
+    length = nmea(buffer, "GPGGA,123521,,,,,0,00,99.9,,M,,M,,");
+    length += nmea(buffer + length, "GPRMC,123521,V,,,,,,,230394,,");
+    length += nmea(buffer + length, "GPGSA,A,1,,,,,,,,,,,,,99.9,99.9,99.9");
+    gps_line_send(&line, buffer, length);
+    CHECK(received.count == 2);
+
+    FPVGPSParserStats stats;
+    fpv_gps_parser_get_stats(line.parser, &stats);
+    CHECK(stats.messages == 5);
+    CHECK(stats.checksum_errors == 0);
+    CHECK(stats.resyncs == 0);
+    gps_line_close(&line);
+}
+
+static void test_ubx(void) {
+    GPSLine line;
+    if ( !gps_line_open(&line) ) {
+        CHECK(0);
+        return;
+    }
+
+    uint8_t buffer[256];
+    int length = ubx_nav_pvt(buffer, 3, 473769000, 85417000, 408123);
+    gps_line_send(&line, buffer, length);
+    CHECK(received.count == 1);
+    CHECK(received.fixes[0].source == GPS_SOURCE_UBX_NAV_PVT);
+    CHECK(received.fixes[0].fix == 3);
+    CHECK(received.fixes[0].satellites == 14);
+    CHECK_NEAR(received.fixes[0].latitude, 47.3769, 1e-9);
+    CHECK_NEAR(received.fixes[0].longitude, 8.5417, 1e-9);
+    CHECK_NEAR(received.fixes[0].altitude, 408.123, 1e-9);
+    CHECK_NEAR(received.fixes[0].speed, 12.5, 1e-9);
+    CHECK_NEAR(received.fixes[0].course, 90.0, 1e-9);
+
+    // A 2D fix, then a dead-reckoning-only one (type 1), which isn't a fix
+    length = ubx_nav_pvt(buffer, 2, -1, -1, 0);
+    length += ubx_nav_pvt(buffer + length, 1, 0, 0, 0);
+    gps_line_send(&line, buffer, length);
+    CHECK(received.count == 2);
+    CHECK(received.fixes[1].fix == 2);
+    gps_line_close(&line);
+}
+
+static void test_corrupted(void) {
+    GPSLine line;
+    if ( !gps_line_open(&line) ) {
+        CHECK(0);
+        return;
+    }
+
+    uint8_t buffer[512];
+    int length = 0;
+    memcpy(buffer, "\x00\xff noise", 8);
+    length += 8;
+
+    // A bad NMEA checksum, then a UBX message with a flipped payload bit
+    length += nmea((char*)buffer + length, "GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,");
+    buffer[length - 5] ^= 1;
+    int ubx_start = length;
+    length += ubx_nav_pvt(buffer + length, 3, 1, 1, 1);
+    buffer[ubx_start + 40] ^= 0x10;
+
+    // A truncated sentence that runs into the next one
+    memcpy(buffer + length, "$GPGGA,1235", 11);
+    length += 11;
+
+    // Followed by good messages, which must still come through
+    length += nmea((char*)buffer + length, "GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,");
+    length += ubx_nav_pvt(buffer + length, 3, 473769000, 85417000, 408123);
+    gps_line_send(&line, buffer, length);
+
+    CHECK(received.count == 2);
+    CHECK(received.fixes[0].source == GPS_SOURCE_NMEA_GGA);
+    CHECK(received.fixes[1].source == GPS_SOURCE_UBX_NAV_PVT);
+
+    FPVGPSParserStats stats;
+    fpv_gps_parser_get_stats(line.parser, &stats);
+    CHECK(stats.messages == 2);
+    CHECK(stats.checksum_errors == 2);
+    CHECK(stats.resyncs > 0);
+    CHECK(stats.bytes == length);
+
+    // A run of garbage longer than the parser's buffer is dropped without losing what follows
+    uint8_t garbage[3000];
+    memset(garbage, 'x', sizeof(garbage));
+    gps_line_send(&line, garbage, sizeof(garbage));
+    length = nmea((char*)buffer, "GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,");
+    gps_line_send(&line, buffer, length);
+    CHECK(received.count == 3);
+    gps_line_close(&line);
+}
+
+static void test_split(void) {
+    GPSLine line;
+    if ( !gps_line_open(&line) ) {
+        CHECK(0);
+        return;
+    }
+
+    uint8_t buffer[512];
+    int length = nmea((char*)buffer, "GPRMC,123520,A,4807.038,N,01131.000,E,022.4,084.4,230394,003.1,W");
+    length += ubx_nav_pvt(buffer + length, 3, 473769000, 85417000, 408123);
+    length += nmea((char*)buffer + length, "GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,");
+
+    // One byte per read, as at low baud rates
+    int i;
+    for ( i=0; i<length; i++ ) gps_line_send(&line, buffer + i, 1);
+    CHECK(received.count == 3);
+
+    // And in every other chunk size up to a whole message
+    int chunk;
+    for ( chunk=2; chunk<=100; chunk++ ) {
+        for ( i=0; i<length; i+=chunk ) gps_line_send(&line, buffer + i, length - i < chunk ? length - i : chunk);
+    }
+    CHECK(received.count == 3 + 99 * 3);
+
+    FPVGPSParserStats stats;
+    fpv_gps_parser_get_stats(line.parser, &stats);
+    CHECK(stats.checksum_errors == 0);
+    CHECK(stats.resyncs == 0);
+    gps_line_close(&line);
+}
+
+static void test_end_of_file(void) {
+    // A device that goes away reports -1 so its fd gets closed: EIO from a pty whose other end
+    // has closed, end of file (errno 0) from a pipe or a file
+    GPSLine line;
+    if ( gps_line_open(&line) ) {
+        close(line.master);
+        line.master = -1;
+        CHECK(fpv_gps_parser_read(line.parser, line.slave) == -1);
+        gps_line_close(&line);
+    } else {
+        CHECK(0);
+    }
+
+    int pipe_fds[2];
+    CHECK(pipe2(pipe_fds, O_NONBLOCK) == 0);
+    FPVGPSParser *parser = fpv_gps_parser_new(fix_callback, NULL);
+    CHECK(fpv_gps_parser_read(parser, pipe_fds[0]) == 0);
+    CHECK(errno == EAGAIN);
+    close(pipe_fds[1]);
+    CHECK(fpv_gps_parser_read(parser, pipe_fds[0]) == -1);
+    CHECK(errno == 0);
+    close(pipe_fds[0]);
+    fpv_gps_parser_dispose(parser);
+}
+
+int main(int argc, char **argv) {
+    test_nmea();
+    test_ubx();
+    test_corrupted();
+    test_split();
+    test_end_of_file();
+    return test_failures();
+}
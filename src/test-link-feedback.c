@@ -0,0 +1,116 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests for the link feedback wire format and for keeping feedback in order per ground
+// station: each station numbers its feedback from 0, so one station's late messages are
+// dropped without discarding another's.
+
+#include "link_feedback.h"
+#include "test_common.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+#pragma mark - Wire format
+
+static void test_round_trip(void) {
+    uint8_t buffer[LINK_FEEDBACK_MAX_LENGTH];
+    FPVLinkFeedback feedback, decoded;
+
+    memset(&feedback, 0, sizeof(feedback));
+    feedback.type = LINK_FEEDBACK_TYPE_REPORT;
+    feedback.sequence = 65535;
+    feedback.content.report = (FPVLinkFeedbackReport){ 100000, 812, 790, 1000000, 2500, 180000 };
+    int length = fpv_link_feedback_encode(&feedback, buffer, sizeof(buffer));
+    CHECK(length > 0);
+    CHECK(fpv_link_feedback_decode(buffer, length, &decoded));
+    CHECK(decoded.type == feedback.type && decoded.sequence == feedback.sequence);
+    CHECK(memcmp(&decoded.content.report, &feedback.content.report, sizeof(feedback.content.report)) == 0);
+    CHECK(!fpv_link_feedback_decode(buffer, length - 1, &decoded));
+
+    memset(&feedback, 0, sizeof(feedback));
+    feedback.type = LINK_FEEDBACK_TYPE_CLOCK_REPLY;
+    feedback.sequence = 7;
+    feedback.content.clock = (FPVLinkFeedbackClock){ 1ULL << 40, (1ULL << 40) + 1234, (1ULL << 40) + 1300 };
+    length = fpv_link_feedback_encode(&feedback, buffer, sizeof(buffer));
+    CHECK(fpv_link_feedback_decode(buffer, length, &decoded));
+    CHECK(memcmp(&decoded.content.clock, &feedback.content.clock, sizeof(feedback.content.clock)) == 0);
+
+    memset(&feedback, 0, sizeof(feedback));
+    feedback.type = LINK_FEEDBACK_TYPE_KEYFRAME_REQUEST;
+    feedback.content.keyframe_request = (FPVLinkFeedbackKeyframeRequest){ 42, 3 };
+    length = fpv_link_feedback_encode(&feedback, buffer, sizeof(buffer));
+    CHECK(fpv_link_feedback_decode(buffer, length, &decoded));
+    CHECK(decoded.content.keyframe_request.lost == 42 && decoded.content.keyframe_request.attempt == 3);
+
+    buffer[0] ^= 0xFF;
+    CHECK(!fpv_link_feedback_decode(buffer, length, &decoded));
+}
+
+#pragma mark - Senders
+
+static void test_senders(void) {
+    FPVLinkFeedbackSenders senders;
+    memset(&senders, 0, sizeof(senders));
+    uint32_t first = inet_addr("192.168.1.10"), second = inet_addr("192.168.1.11");
+    uint16_t port = htons(40000);
+    uint64_t now = 1000000;
+
+    // Both stations count from 0; each keeps its own slot and its own order
+    int a = fpv_link_feedback_senders_accept(&senders, first, port, 0, now);
+    CHECK(a >= 0);
+    CHECK(fpv_link_feedback_senders_accept(&senders, first, port, 1, now + 100) == a);
+    CHECK(fpv_link_feedback_senders_accept(&senders, first, port, 2, now + 200) == a);
+    int b = fpv_link_feedback_senders_accept(&senders, second, port, 0, now + 300);
+    CHECK(b >= 0 && b != a);
+    CHECK(fpv_link_feedback_senders_accept(&senders, second, port, 1, now + 400) == b);
+    CHECK(fpv_link_feedback_senders_accept(&senders, first, port, 3, now + 500) == a);
+
+    // Late and repeated messages are stale only against their own sender
+    CHECK(fpv_link_feedback_senders_accept(&senders, first, port, 2, now + 600) == -1);
+    CHECK(fpv_link_feedback_senders_accept(&senders, second, port, 1, now + 700) == -1);
+    CHECK(fpv_link_feedback_senders_accept(&senders, second, port, 2, now + 800) == b);
+
+    // Two stations behind one address differ by port
+    int c = fpv_link_feedback_senders_accept(&senders, first, htons(40001), 0, now + 900);
+    CHECK(c >= 0 && c != a && c != b);
+
+    // Sequence numbers wrap
+    int i;
+    for ( i=3; i<=65535; i+=1000 ) fpv_link_feedback_senders_accept(&senders, second, port, i, now + 1000);
+    CHECK(fpv_link_feedback_senders_accept(&senders, second, port, 65535, now + 1100) == b);
+    CHECK(fpv_link_feedback_senders_accept(&senders, second, port, 0, now + 1200) == b);
+
+    // A restarted station counts from 0 again, accepted once it has been quiet a while
+    now += 1300;
+    CHECK(fpv_link_feedback_senders_accept(&senders, first, port, 0, now) == -1);
+    now += LINK_FEEDBACK_SEQUENCE_RESET;
+    CHECK(fpv_link_feedback_senders_accept(&senders, first, port, 0, now) == a);
+
+    // More stations than slots: the longest silent gives way, and the rest keep theirs
+    for ( i=0; i<LINK_FEEDBACK_MAX_SENDERS; i++ ) {
+        CHECK(fpv_link_feedback_senders_accept(&senders, htonl(0x0A000001 + i), port, 0, now + 10 + i) >= 0);
+    }
+    CHECK(fpv_link_feedback_senders_accept(&senders, htonl(0x0A000001 + LINK_FEEDBACK_MAX_SENDERS - 1), port, 0, now + 100) == -1);
+    CHECK(fpv_link_feedback_senders_accept(&senders, htonl(0x0A000001 + LINK_FEEDBACK_MAX_SENDERS - 1), port, 1, now + 110) >= 0);
+}
+
+int main(int argc, char **argv) {
+    test_round_trip();
+    test_senders();
+    return test_failures();
+}
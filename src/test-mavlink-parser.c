@@ -0,0 +1,434 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Feeds generated MAVLink v1 and v2 streams through the parser, including truncated, signed,
+// unknown, corrupted and split frames, and reads them from a serial port, a UDP-style socket
+// and a closed pipe
+
+#define _GNU_SOURCE
+#include "mavlink_parser.h"
+#include "serial.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#define MAX_UPDATES 64
+
+enum {
+    HEARTBEAT = 0,
+    SYS_STATUS = 1,
+    ATTITUDE = 30,
+    GLOBAL_POSITION_INT = 33,
+    RADIO_STATUS = 109,
+    BATTERY_STATUS = 147
+};
+
+static const struct {
+    uint32_t id;
+    uint8_t crc_extra;
+    uint8_t length;
+} MESSAGES[] = {
+    { HEARTBEAT, 50, 9 },
+    { SYS_STATUS, 124, 31 },
+    { ATTITUDE, 39, 28 },
+    { GLOBAL_POSITION_INT, 104, 28 },
+    { RADIO_STATUS, 185, 9 },
+    { BATTERY_STATUS, 154, 36 },
+};
+
+static struct {
+    FPVTelemetryUpdate updates[MAX_UPDATES];
+    int count;
+} received;
+
+static void update_callback(FPVMAVLinkParser * parser, const FPVTelemetryUpdate * update, void * context) {
+    if ( received.count < MAX_UPDATES ) received.updates[received.count] = *update;
+    received.count++;
+}
+
+static FPVMAVLinkParser * new_parser(void) {
+    memset(&received, 0, sizeof(received));
+    return fpv_mavlink_parser_new(update_callback, NULL);
+}
+
+#pragma mark - Frames
+
+static uint16_t crc_accumulate(uint8_t byte, uint16_t crc) {
+    uint8_t tmp = byte ^ (uint8_t)(crc & 0xff);
+    tmp ^= (tmp << 4);
+    return (crc >> 8) ^ ((uint16_t)tmp << 8) ^ ((uint16_t)tmp << 3) ^ (tmp >> 4);
+}
+
+static void put_le16(uint8_t *p, uint16_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static void put_float(uint8_t *p, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    put_le32(p, bits);
+}
+
+// Payload layouts are in MAVLink wire order (fields sorted by size)
+static int frame(uint8_t *buffer, int v2, int sign, uint32_t id, const uint8_t *payload, int length, uint8_t crc_extra) {
+    if ( v2 ) {
+        // v2 senders strip trailing zeros from the payload
+        while ( length > 1 && payload[length-1] == 0 ) length--;
+    }
+    int header_length = v2 ? 10 : 6;
+    uint8_t *p = buffer;
+    *p++ = v2 ? 0xFD : 0xFE;
+    *p++ = length;
+    if ( v2 ) {
+        *p++ = sign ? 0x01 : 0;
+        *p++ = 0;
+    }
+    *p++ = 42;      // Sequence
+    *p++ = 1;       // System
+    *p++ = 1;       // Component
+    *p++ = id;
+    if ( v2 ) {
+        *p++ = id >> 8;
+        *p++ = id >> 16;
+    }
+    memcpy(p, payload, length);
+    p += length;
+
+    uint16_t crc = 0xFFFF;
+    int i;
+    for ( i=1; i<header_length + length; i++ ) crc = crc_accumulate(buffer[i], crc);
+    crc = crc_accumulate(crc_extra, crc);
+    put_le16(p, crc);
+    p += 2;
+
+    if ( sign ) {
+        memset(p, 0xA5, 13);
+        p += 13;
+    }
+    return p - buffer;
+}
+
+static int message(uint8_t *buffer, int v2, uint32_t id, const uint8_t *payload) {
+    int i;
+    for ( i=0; i<sizeof(MESSAGES)/sizeof(MESSAGES[0]); i++ ) {
+        if ( MESSAGES[i].id == id ) return frame(buffer, v2, 0, id, payload, MESSAGES[i].length, MESSAGES[i].crc_extra);
+    }
+    return 0;
+}
+
+static int attitude(uint8_t *buffer, int v2, float roll, float pitch, float yaw) {
+    uint8_t payload[28];
+    memset(payload, 0, sizeof(payload));
+    put_float(payload + 4, roll);
+    put_float(payload + 8, pitch);
+    put_float(payload + 12, yaw);
+    return message(buffer, v2, ATTITUDE, payload);
+}
+
+static int sys_status(uint8_t *buffer, uint16_t millivolts, int16_t centiamps) {
+    uint8_t payload[31];
+    memset(payload, 0, sizeof(payload));
+    put_le16(payload + 14, millivolts);
+    put_le16(payload + 16, centiamps);
+    return message(buffer, 1, SYS_STATUS, payload);
+}
+
+static int global_position_int(uint8_t *buffer, int32_t latitude, int32_t longitude, int32_t altitude,
+                               int16_t north, int16_t east, uint16_t heading) {
+    uint8_t payload[28];
+    memset(payload, 0, sizeof(payload));
+    put_le32(payload + 4, latitude);
+    put_le32(payload + 8, longitude);
+    put_le32(payload + 12, altitude);
+    put_le16(payload + 20, north);
+    put_le16(payload + 22, east);
+    put_le16(payload + 26, heading);
+    return message(buffer, 1, GLOBAL_POSITION_INT, payload);
+}
+
+static int radio_status(uint8_t *buffer, uint8_t rssi) {
+    uint8_t payload[9];
+    memset(payload, 0, sizeof(payload));
+    payload[4] = rssi;
+    return message(buffer, 1, RADIO_STATUS, payload);
+}
+
+static int battery_status(uint8_t *buffer, uint8_t battery, int cells, uint16_t cell_millivolts, int16_t centiamps) {
+    uint8_t payload[36];
+    memset(payload, 0, sizeof(payload));
+    int i;
+    for ( i=0; i<10; i++ ) put_le16(payload + 10 + i*2, i < cells ? cell_millivolts : UINT16_MAX);
+    put_le16(payload + 30, centiamps);
+    payload[32] = battery;
+    return message(buffer, 1, BATTERY_STATUS, payload);
+}
+
+static int heartbeat(uint8_t *buffer) {
+    uint8_t payload[9] = { 0, 0, 0, 0, 2, 3, 0x51, 4, 3 };
+    return message(buffer, 1, HEARTBEAT, payload);
+}
+
+#pragma mark - Tests
+
+static void test_messages(void) {
+    FPVMAVLinkParser *parser = new_parser();
+    uint8_t buffer[512];
+    int length = 0;
+    length += attitude(buffer + length, 1, 0.1f, -0.2f, -1.5707964f);
+    length += sys_status(buffer + length, 16800, 1234);
+    length += global_position_int(buffer + length, 473769000, 85417000, 408123, 0, 0, 27050);
+    length += radio_status(buffer + length, 190);
+    length += battery_status(buffer + length, 0, 4, 4100, -1);
+    length += heartbeat(buffer + length);
+    fpv_mavlink_parser_feed(parser, buffer, length);
+
+    CHECK(received.count == 5);
+    FPVTelemetryUpdate *update = received.updates;
+    CHECK(update[0].type == TELEMETRY_TYPE_ATTITUDE);
+    CHECK_NEAR(update[0].content.attitude.roll, 5.7296, 1e-3);
+    CHECK_NEAR(update[0].content.attitude.pitch, -11.4592, 1e-3);
+    CHECK_NEAR(update[0].content.attitude.yaw, 270.0, 1e-3);
+    CHECK(update[1].type == TELEMETRY_TYPE_POWER);
+    CHECK_NEAR(update[1].content.power.voltage, 16.8, 1e-9);
+    CHECK_NEAR(update[1].content.power.current, 12.34, 1e-9);
+    CHECK(update[2].type == TELEMETRY_TYPE_POSITION);
+    CHECK_NEAR(update[2].content.position.latitude, 47.3769, 1e-9);
+    CHECK_NEAR(update[2].content.position.longitude, 8.5417, 1e-9);
+    CHECK_NEAR(update[2].content.position.altitude, 408.123, 1e-9);
+    CHECK_NEAR(update[2].content.position.bearing, 270.5, 1e-9);
+    CHECK(update[3].type == TELEMETRY_TYPE_SIGNAL);
+    CHECK_NEAR(update[3].content.signal.rssi, 190 / 1.9 - 127.0, 1e-9);
+    CHECK(update[4].type == TELEMETRY_TYPE_POWER);
+    CHECK_NEAR(update[4].content.power.voltage, 16.4, 1e-9);
+    CHECK_NEAR(update[4].content.power.current, 0.0, 1e-9);
+
+    FPVMAVLinkParserStats stats;
+    fpv_mavlink_parser_get_stats(parser, &stats);
+    CHECK(stats.messages == 6);
+    CHECK(stats.bytes == length);
+    CHECK(stats.crc_errors == 0 && stats.resyncs == 0 && stats.unhandled == 0);
+    fpv_mavlink_parser_dispose(parser);
+}
+
+static void test_unavailable_values(void) {
+    // Values the flight controller marks unknown produce no update, rather than a zero one
+    FPVMAVLinkParser *parser = new_parser();
+    uint8_t buffer[512];
+    int length = 0;
+    length += sys_status(buffer + length, UINT16_MAX, -1);
+    length += global_position_int(buffer + length, 0, 0, 0, 0, 0, 0);
+    length += radio_status(buffer + length, UINT8_MAX);
+    length += battery_status(buffer + length, 1, 4, 4100, 100);
+    length += battery_status(buffer + length, 0, 0, 0, 100);
+
+    // No heading: bearing comes from the velocity instead
+    length += global_position_int(buffer + length, 1, 1, 0, -100, 0, UINT16_MAX);
+    fpv_mavlink_parser_feed(parser, buffer, length);
+
+    CHECK(received.count == 1);
+    CHECK(received.updates[0].type == TELEMETRY_TYPE_POSITION);
+    CHECK_NEAR(received.updates[0].content.position.bearing, 180.0, 1e-9);
+    fpv_mavlink_parser_dispose(parser);
+}
+
+static void test_versions(void) {
+    FPVMAVLinkParser *parser = new_parser();
+    uint8_t buffer[512];
+    int length = 0;
+
+    // v1, v2 with trailing zeros truncated, and v2 signed
+    length += attitude(buffer + length, 0, 0.5f, 0, 0);
+    length += attitude(buffer + length, 1, 0.5f, 0, 0);
+    uint8_t payload[28];
+    memset(payload, 0, sizeof(payload));
+    put_float(payload + 4, 0.5f);
+    int signed_length = frame(buffer + length, 1, 1, ATTITUDE, payload, sizeof(payload), 39);
+    CHECK(signed_length < 10 + 28 + 2 + 13);
+    length += signed_length;
+    fpv_mavlink_parser_feed(parser, buffer, length);
+
+    CHECK(received.count == 3);
+    int i;
+    for ( i=0; i<received.count; i++ ) {
+        CHECK(received.updates[i].type == TELEMETRY_TYPE_ATTITUDE);
+        CHECK_NEAR(received.updates[i].content.attitude.roll, 28.6479, 1e-3);
+        CHECK_NEAR(received.updates[i].content.attitude.pitch, 0.0, 1e-9);
+    }
+    fpv_mavlink_parser_dispose(parser);
+}
+
+static void test_corrupted(void) {
+    FPVMAVLinkParser *parser = new_parser();
+    uint8_t buffer[1024];
+    int length = 0;
+
+    // Noise, a flipped payload bit, a v1 frame with the wrong length for its ID, and a frame
+    // whose payload was encoded for a different definition (wrong CRC extra)
+    memcpy(buffer, "\x00\x11noise", 7);
+    length += 7;
+    int start = length;
+    length += attitude(buffer + length, 1, 1.0f, 1.0f, 1.0f);
+    buffer[start + 12] ^= 0x04;
+    uint8_t payload[28];
+    memset(payload, 0x11, sizeof(payload));
+    length += frame(buffer + length, 0, 0, ATTITUDE, payload, 20, 39);
+    length += frame(buffer + length, 1, 0, ATTITUDE, payload, 28, 40);
+
+    length += attitude(buffer + length, 1, 0.25f, 0, 0);
+    fpv_mavlink_parser_feed(parser, buffer, length);
+
+    CHECK(received.count == 1);
+    CHECK_NEAR(received.updates[0].content.attitude.roll, 14.3239, 1e-3);
+    FPVMAVLinkParserStats stats;
+    fpv_mavlink_parser_get_stats(parser, &stats);
+    CHECK(stats.crc_errors == 2);
+    CHECK(stats.messages == 1);
+    CHECK(stats.resyncs > 7);
+    fpv_mavlink_parser_dispose(parser);
+}
+
+static void test_unknown_messages(void) {
+    FPVMAVLinkParser *parser = new_parser();
+    uint8_t buffer[2048];
+    int length = 0;
+
+    // Real unknown messages (v1 and a 24-bit v2 ID) are skipped whole
+    uint8_t payload[40];
+    memset(payload, 0x33, sizeof(payload));
+    length += frame(buffer + length, 0, 0, 253, payload, 40, 0);
+    length += frame(buffer + length, 1, 0, 0x012345, payload, 40, 0);
+    length += attitude(buffer + length, 1, 0.1f, 0, 0);
+
+    // A stray marker that reads as an unknown message claiming 200 bytes mustn't swallow the
+    // real frames behind it, once enough has arrived to see that it isn't one
+    static const uint8_t stray[] = { 0xFD, 200, 0, 0, 1, 1, 1, 0xff, 0xff, 0 };
+    memcpy(buffer + length, stray, sizeof(stray));
+    length += sizeof(stray);
+    int i;
+    for ( i=0; i<20; i++ ) length += attitude(buffer + length, 1, 0.1f, 0, 0);
+    fpv_mavlink_parser_feed(parser, buffer, length);
+
+    CHECK(received.count == 21);
+    FPVMAVLinkParserStats stats;
+    fpv_mavlink_parser_get_stats(parser, &stats);
+    CHECK(stats.unhandled == 2);
+    CHECK(stats.messages == 21);
+    CHECK(stats.resyncs == sizeof(stray));
+
+    // An unknown message at the very end is held until the next marker confirms its length
+    length = frame(buffer, 1, 0, 0x012345, payload, 40, 0);
+    fpv_mavlink_parser_feed(parser, buffer, length);
+    fpv_mavlink_parser_get_stats(parser, &stats);
+    CHECK(stats.unhandled == 2);
+    length = attitude(buffer, 1, 0.1f, 0, 0);
+    fpv_mavlink_parser_feed(parser, buffer, length);
+    fpv_mavlink_parser_get_stats(parser, &stats);
+    CHECK(stats.unhandled == 3);
+    CHECK(received.count == 22);
+    fpv_mavlink_parser_dispose(parser);
+}
+
+static void test_split(void) {
+    FPVMAVLinkParser *parser = new_parser();
+    uint8_t buffer[512];
+    int length = 0;
+    length += attitude(buffer + length, 0, 0.1f, 0.2f, 0.3f);
+    length += sys_status(buffer + length, 12000, 500);
+    uint8_t payload[28];
+    memset(payload, 0, sizeof(payload));
+    put_float(payload + 4, 0.1f);
+    length += frame(buffer + length, 1, 1, ATTITUDE, payload, sizeof(payload), 39);
+
+    int chunk, i;
+    for ( chunk=1; chunk<=64; chunk++ ) {
+        for ( i=0; i<length; i+=chunk ) fpv_mavlink_parser_feed(parser, buffer + i, length - i < chunk ? length - i : chunk);
+    }
+    CHECK(received.count == 64 * 3);
+    FPVMAVLinkParserStats stats;
+    fpv_mavlink_parser_get_stats(parser, &stats);
+    CHECK(stats.crc_errors == 0 && stats.resyncs == 0);
+    fpv_mavlink_parser_dispose(parser);
+}
+
+static void test_read(void) {
+    uint8_t buffer[256];
+    int length = attitude(buffer, 1, 0.1f, 0, 0);
+
+    // Serial port: a pseudo-terminal, as when replaying a log
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    CHECK(master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0);
+    int serial = serial_open(ptsname(master), 57600);
+    CHECK(serial >= 0);
+    FPVMAVLinkParser *parser = new_parser();
+    CHECK(fpv_mavlink_parser_read(parser, serial) == 0);
+    CHECK(write(master, buffer, length) == length);
+    struct pollfd pollfd = { .fd = serial, .events = POLLIN };
+    CHECK(poll(&pollfd, 1, 1000) == 1);
+    CHECK(fpv_mavlink_parser_read(parser, serial) == length);
+    CHECK(received.count == 1);
+    close(master);
+    CHECK(fpv_mavlink_parser_read(parser, serial) == -1);
+    close(serial);
+    fpv_mavlink_parser_dispose(parser);
+
+    // Datagram socket: an empty datagram is just that, not the end of the stream
+    int sockets[2];
+    CHECK(socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, sockets) == 0);
+    parser = new_parser();
+    CHECK(send(sockets[1], buffer, 0, 0) == 0);
+    CHECK(send(sockets[1], buffer, length, 0) == length);
+    CHECK(fpv_mavlink_parser_read(parser, sockets[0]) == length);
+    CHECK(received.count == 1);
+    close(sockets[0]);
+    close(sockets[1]);
+    fpv_mavlink_parser_dispose(parser);
+
+    // End of file on a stream is -1 with errno 0
+    int pipe_fds[2];
+    CHECK(pipe2(pipe_fds, O_NONBLOCK) == 0);
+    parser = new_parser();
+    close(pipe_fds[1]);
+    CHECK(fpv_mavlink_parser_read(parser, pipe_fds[0]) == -1);
+    CHECK(errno == 0);
+    close(pipe_fds[0]);
+    fpv_mavlink_parser_dispose(parser);
+}
+
+int main(int argc, char **argv) {
+    test_messages();
+    test_unavailable_values();
+    test_versions();
+    test_corrupted();
+    test_unknown_messages();
+    test_split();
+    test_read();
+    return test_failures();
+}
@@ -0,0 +1,309 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Sends video-shaped RTP frames over loopback through the sender's batches and checks
+// every packet arrives whole and in order, with and without UDP GSO; that nothing is read
+// from the caller's memory after the release callback; that repair packets rebuild lost
+// media; and that pacing spreads a frame over the asked part of the frame interval, with
+// parameter sets sharing their keyframe's part.
+
+#include "rtp_batch.h"
+#include "fec.h"
+#include "telemetry_common.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_FRAME_PACKETS 60
+#define PACKET_LENGTH 1400
+#define RTP_HEADER_LENGTH 12
+#define POISON 0xA5
+
+static int port;
+static uint16_t sequence;
+static uint32_t timestamp;
+
+// A frame as sent, and the copy it's checked against, since the sent one is poisoned on release
+typedef struct {
+    int count;
+    int lengths[MAX_FRAME_PACKETS];
+    uint8_t expected[MAX_FRAME_PACKETS][PACKET_LENGTH];
+    uint8_t headers[MAX_FRAME_PACKETS][RTP_HEADER_LENGTH];
+    uint8_t payloads[MAX_FRAME_PACKETS][PACKET_LENGTH];
+    int queued;                 // Packets handed to the batch so far
+    int released;               // Packets the batch has let go of
+    int releases;
+} frame_t;
+
+static frame_t frame;
+
+static void release_callback(void * userinfo) {
+    for ( ; frame.released<frame.queued; frame.released++ ) {
+        memset(frame.headers[frame.released], POISON, RTP_HEADER_LENGTH);
+        memset(frame.payloads[frame.released], POISON, frame.lengths[frame.released] - RTP_HEADER_LENGTH);
+    }
+    frame.releases++;
+}
+
+static int receive_socket(int port) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int size = 8 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if ( bind(sock, (struct sockaddr*)&address, sizeof(address)) != 0 ) {
+        perror("bind");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Up to max datagrams, waiting a little for stragglers
+static int receive(int sock, uint8_t packets[][FEC_MAX_REPAIR_LENGTH], int * lengths, int max) {
+    int count = 0;
+    struct pollfd pollfd = { sock, POLLIN, 0 };
+    while ( count < max && poll(&pollfd, 1, 100) > 0 ) {
+        lengths[count] = recv(sock, packets[count], FEC_MAX_REPAIR_LENGTH, 0);
+        if ( lengths[count] > 0 ) count++;
+    }
+    return count;
+}
+
+// RTP packets as rtph264pay makes them, header and payload apart: full-sized but for a
+// shorter last one, or all of random sizes
+static void make_frame(int count, int full, uint32_t *seed) {
+    int i, j;
+    frame.count = count;
+    for ( i=0; i<count; i++ ) {
+        int length = full && i < count - 1 ? PACKET_LENGTH : RTP_HEADER_LENGTH + 1 + test_random(seed) % (PACKET_LENGTH - RTP_HEADER_LENGTH);
+        uint8_t *p = frame.expected[i];
+        p[0] = 0x80;
+        p[1] = 96 | (i == count - 1 ? 0x80 : 0);
+        p[2] = sequence >> 8;
+        p[3] = sequence;
+        p[4] = timestamp >> 24;
+        p[5] = timestamp >> 16;
+        p[6] = timestamp >> 8;
+        p[7] = timestamp;
+        memset(p + 8, 0, 4);
+        for ( j=RTP_HEADER_LENGTH; j<length; j++ ) p[j] = test_random(seed);
+        sequence++;
+        frame.lengths[i] = length;
+        memcpy(frame.headers[i], p, RTP_HEADER_LENGTH);
+        memcpy(frame.payloads[i], p + RTP_HEADER_LENGTH, length - RTP_HEADER_LENGTH);
+    }
+}
+
+// Queues the frame in pieces; the batch may send, and release, any time it's handed one
+static void send_frame(FPVRTPBatch * batch, int pieces) {
+    int i, j;
+    frame.queued = frame.released = 0;
+    fpv_rtp_batch_begin_frame(batch, frame.count, timestamp);
+    for ( i=0; i<frame.count; i++ ) {
+        struct iovec iov[16];
+        int payload = frame.lengths[i] - RTP_HEADER_LENGTH;
+        iov[0].iov_base = frame.headers[i];
+        iov[0].iov_len = RTP_HEADER_LENGTH;
+        for ( j=1; j<pieces; j++ ) {
+            int start = payload * (j - 1) / (pieces - 1), end = payload * j / (pieces - 1);
+            iov[j].iov_base = frame.payloads[i] + start;
+            iov[j].iov_len = end - start;
+        }
+        frame.queued++;
+        fpv_rtp_batch_queue(batch, iov, pieces);
+
+        // Packets in too many pieces to send in place are copied, so are the caller's again at once
+        if ( pieces > RTP_BATCH_MAX_PIECES ) {
+            memset(frame.headers[i], POISON, RTP_HEADER_LENGTH);
+            memset(frame.payloads[i], POISON, payload);
+        }
+    }
+    fpv_rtp_batch_end_frame(batch);
+    CHECK(frame.released == frame.count);
+}
+
+// Each packet of the frame arrived whole, in order; returns how many did
+static int check_frame(int sock) {
+    static uint8_t packets[MAX_FRAME_PACKETS][FEC_MAX_REPAIR_LENGTH];
+    int lengths[MAX_FRAME_PACKETS];
+    int count = receive(sock, packets, lengths, frame.count), i, wrong = 0;
+    for ( i=0; i<count; i++ ) {
+        if ( lengths[i] != frame.lengths[i] || memcmp(packets[i], frame.expected[i], lengths[i]) != 0 ) wrong++;
+    }
+    CHECK(count == frame.count);
+    CHECK(wrong == 0);
+    return count;
+}
+
+#pragma mark - Sending
+
+// A second of 30 fps video: a 60-packet keyframe, then P-frames of random sizes
+static void test_frames(int gso, int pieces) {
+    int sock = receive_socket(port);
+    FPVRTPBatch *batch = fpv_rtp_batch_new("127.0.0.1", port, release_callback, NULL);
+    int using_gso = fpv_rtp_batch_set_gso(batch, gso);
+    CHECK(!gso || using_gso);
+    uint32_t seed = 1;
+    int i, packets = 0, flushes = 0, received = 0;
+
+    for ( i=0; i<30; i++ ) {
+        frame.releases = 0;
+        make_frame(i == 0 ? MAX_FRAME_PACKETS : 1 + test_random(&seed) % 12, i == 0, &seed);
+        send_frame(batch, pieces);
+        packets += frame.count;
+        flushes += frame.releases;
+        received += check_frame(sock);
+    }
+
+    // With GSO, the keyframe's full-sized packets go as a few large sends
+    FPVRTPBatchStats stats;
+    fpv_rtp_batch_get_stats(batch, &stats);
+    CHECK(stats.packets == (uint64_t)packets);
+    CHECK(received == packets);
+    CHECK(stats.errors == 0);
+    CHECK(stats.syscalls == (uint64_t)flushes);
+    CHECK(gso ? stats.segments > 0 : stats.segments == 0);
+    CHECK(stats.last_sent > 0);
+
+    fpv_rtp_batch_dispose(batch);
+    close(sock);
+}
+
+// Media lost on the way comes back from the repair sent behind it
+static void test_fec(void) {
+    int sock = receive_socket(port), fec_sock = receive_socket(port + 1);
+    FPVRTPBatch *batch = fpv_rtp_batch_new("127.0.0.1", port, release_callback, NULL);
+    CHECK(fpv_rtp_batch_enable_fec(batch, port + 1, 8, 2));
+    FPVFecDecoder *decoder = fpv_fec_decoder_new(NULL, NULL);
+    static uint8_t packets[MAX_FRAME_PACKETS][FEC_MAX_REPAIR_LENGTH];
+    int lengths[MAX_FRAME_PACKETS];
+    uint32_t seed = 2;
+    int i, j, dropped = 0, repairs = 0;
+
+    for ( i=0; i<10; i++ ) {
+        make_frame(i == 0 ? MAX_FRAME_PACKETS : 8, 1, &seed);
+        send_frame(batch, 2);
+
+        // One media packet in eight goes missing, which 2 repair packets per 8 can cover
+        int count = receive(sock, packets, lengths, frame.count);
+        CHECK(count == frame.count);
+        for ( j=0; j<count; j++ ) {
+            if ( j % 8 == 3 ) {
+                dropped++;
+                continue;
+            }
+            fpv_fec_decoder_add_media(decoder, packets[j], lengths[j]);
+        }
+        count = receive(fec_sock, packets, lengths, MAX_FRAME_PACKETS);
+        for ( j=0; j<count; j++ ) fpv_fec_decoder_add_repair(decoder, packets[j], lengths[j]);
+        repairs += count;
+    }
+
+    FPVFecStats stats;
+    fpv_fec_decoder_get_stats(decoder, &stats);
+    // The keyframe's last group holds only 4 packets, and gets 1 repair packet
+    CHECK(repairs == (60 / 8) * 2 + 1 + 9 * 2);
+    CHECK(stats.recovered == (uint64_t)dropped);
+    CHECK(stats.unrecoverable == 0);
+
+    fpv_fec_decoder_dispose(decoder);
+    fpv_rtp_batch_dispose(batch);
+    close(sock);
+    close(fec_sock);
+}
+
+// Pacing at half the frame interval spreads a keyframe over about that long. Sends can only
+// run late, so the upper bounds leave an order of magnitude for a busy host.
+static void test_pacing(void) {
+    int sock = receive_socket(port);
+    FPVRTPBatch *batch = fpv_rtp_batch_new("127.0.0.1", port, release_callback, NULL);
+    uint32_t seed = 3;
+    int i;
+
+    make_frame(MAX_FRAME_PACKETS, 1, &seed);
+    uint64_t start = fpv_telemetry_now();
+    send_frame(batch, 2);
+    uint64_t unpaced = fpv_telemetry_now() - start;
+    check_frame(sock);
+    CHECK(unpaced < 50000);
+
+    // The last burst of 4 is due 56/60 of the way through the half interval
+    fpv_rtp_batch_set_pacing(batch, 0.5, 30);
+    for ( i=0; i<3; i++ ) {
+        timestamp += 3000;
+        make_frame(MAX_FRAME_PACKETS, 1, &seed);
+        start = fpv_telemetry_now();
+        send_frame(batch, 2);
+        uint64_t paced = fpv_telemetry_now() - start;
+        check_frame(sock);
+        CHECK(paced >= 15000 && paced < 250000);
+    }
+
+    fpv_rtp_batch_dispose(batch);
+    close(sock);
+}
+
+// The SPS and PPS come as frames of their own ahead of a keyframe, with its timestamp; the
+// three go out in one slot rather than three
+static void test_pacing_parameter_sets(void) {
+    int sock = receive_socket(port);
+    FPVRTPBatch *batch = fpv_rtp_batch_new("127.0.0.1", port, release_callback, NULL);
+    uint32_t seed = 4;
+    int i;
+
+    // A one-second slot, so one slot is told from three by a second's margin
+    fpv_rtp_batch_set_pacing(batch, 1.0, 1);
+    uint64_t start = fpv_telemetry_now();
+    timestamp += 90000;
+    for ( i=0; i<2; i++ ) {
+        make_frame(1, 0, &seed);
+        send_frame(batch, 2);
+        check_frame(sock);
+    }
+    make_frame(MAX_FRAME_PACKETS, 1, &seed);
+    send_frame(batch, 2);
+    check_frame(sock);
+
+    // The keyframe's last burst is due 56/60 of the way through the slot
+    uint64_t elapsed = fpv_telemetry_now() - start;
+    CHECK(elapsed >= 900000 && elapsed < 1900000);
+
+    fpv_rtp_batch_dispose(batch);
+    close(sock);
+}
+
+int main(int argc, char **argv) {
+    port = 20000 + getpid() % 20000;
+
+    test_frames(1, 2);
+    test_frames(0, 2);
+    test_frames(1, 12);
+    test_fec();
+    test_pacing();
+    test_pacing_parameter_sets();
+    return test_failures();
+}
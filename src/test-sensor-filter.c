@@ -0,0 +1,173 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Feeds spikes, steps and noise through the sensor filter chain and checks what each stage
+// lets through
+
+#include "sensor_filter.h"
+#include "test_common.h"
+#include <math.h>
+
+#define ONE (1 << SENSOR_FILTER_Q)
+
+static void init(FPVSensorFilter *filter, int median, int oversample, int lowpass_shift) {
+    FPVSensorFilterConfig config = { .median = median, .oversample = oversample, .lowpass_shift = lowpass_shift };
+    fpv_sensor_filter_init(filter, &config);
+}
+
+static void test_config(void) {
+    FPVSensorFilter filter;
+    fpv_sensor_filter_init(&filter, NULL);
+    CHECK(filter.config.median == 1 && filter.config.oversample == 1 && filter.config.lowpass_shift == 0);
+
+    // Even windows round up to odd; everything is clamped to what the filter can hold
+    init(&filter, 4, 1000, 40);
+    CHECK(filter.config.median == 5);
+    CHECK(filter.config.oversample == SENSOR_FILTER_MAX_OVERSAMPLE);
+    CHECK(filter.config.lowpass_shift == 15);
+    init(&filter, 100, -3, -1);
+    CHECK(filter.config.median == SENSOR_FILTER_MAX_MEDIAN);
+    CHECK(filter.config.oversample == 1 && filter.config.lowpass_shift == 0);
+}
+
+static void test_passthrough(void) {
+    FPVSensorFilter filter;
+    int32_t output;
+    fpv_sensor_filter_init(&filter, NULL);
+    uint16_t sample;
+    for ( sample=0; sample<1024; sample+=31 ) {
+        CHECK(fpv_sensor_filter_push(&filter, sample, &output) == 1);
+        CHECK(output == (int32_t)sample * ONE);
+    }
+}
+
+static void test_median_spikes(void) {
+    FPVSensorFilter filter;
+    int32_t output;
+    init(&filter, 5, 1, 0);
+    int i;
+    for ( i=0; i<10; i++ ) fpv_sensor_filter_push(&filter, 500, &output);
+
+    // Up to two spikes in a window of five never reach the output, whichever way they go
+    static const uint16_t spikes[] = { 1023, 500, 0, 500, 500, 1023, 1023, 500, 500, 500, 0, 0, 500, 500, 500 };
+    for ( i=0; i<sizeof(spikes)/sizeof(spikes[0]); i++ ) {
+        CHECK(fpv_sensor_filter_push(&filter, spikes[i], &output) == 1);
+        CHECK(output == 500 * ONE);
+    }
+
+    // A step is a change that persists: it comes through once it fills half the window
+    for ( i=0; i<3; i++ ) {
+        fpv_sensor_filter_push(&filter, 700, &output);
+        CHECK(output == (i < 2 ? 500 : 700) * ONE);
+    }
+}
+
+static void test_oversample(void) {
+    FPVSensorFilter filter;
+    int32_t output;
+    init(&filter, 1, 4, 0);
+
+    // One output per four samples, their average
+    static const uint16_t samples[] = { 1, 2, 3, 4, 10, 10, 10, 11 };
+    int i, outputs = 0;
+    for ( i=0; i<8; i++ ) {
+        if ( fpv_sensor_filter_push(&filter, samples[i], &output) ) {
+            outputs++;
+            CHECK(i == 3 || i == 7);
+            CHECK(output == (i == 3 ? 5 * ONE / 2 : 41 * ONE / 4));
+        }
+    }
+    CHECK(outputs == 2);
+
+    // Averaging keeps the resolution dithering gives: alternate codes land between them
+    init(&filter, 1, 16, 0);
+    for ( i=0; i<16; i++ ) {
+        if ( fpv_sensor_filter_push(&filter, 511 + (i & 1), &output) ) CHECK(output == 1023 * ONE / 2);
+    }
+
+    // Full scale over the largest window doesn't overflow
+    init(&filter, 1, SENSOR_FILTER_MAX_OVERSAMPLE, 0);
+    for ( i=0; i<SENSOR_FILTER_MAX_OVERSAMPLE; i++ ) {
+        if ( fpv_sensor_filter_push(&filter, 1023, &output) ) CHECK(output == 1023 * ONE);
+    }
+}
+
+static void test_lowpass_step(void) {
+    FPVSensorFilter filter;
+    int32_t output;
+    init(&filter, 1, 1, 3);
+
+    // The first output primes the filter rather than ramping up from zero
+    fpv_sensor_filter_push(&filter, 200, &output);
+    CHECK(output == 200 * ONE);
+
+    // Step response is 1 - (1 - 2^-shift)^n
+    int n;
+    for ( n=1; n<=60; n++ ) {
+        fpv_sensor_filter_push(&filter, 800, &output);
+        double expected = 200 + 600 * (1 - pow(1 - 1.0/8, n));
+        CHECK_NEAR((double)output / ONE, expected, 0.01);
+    }
+    for ( n=1; n<=100; n++ ) fpv_sensor_filter_push(&filter, 800, &output);
+    CHECK_NEAR((double)output / ONE, 800, 0.001);
+
+    // And back down, without getting stuck short of the target
+    for ( n=1; n<=200; n++ ) fpv_sensor_filter_push(&filter, 100, &output);
+    CHECK_NEAR((double)output / ONE, 100, 0.001);
+
+    // Reset forgets the state, not the configuration
+    fpv_sensor_filter_reset(&filter);
+    CHECK(filter.config.lowpass_shift == 3);
+    fpv_sensor_filter_push(&filter, 42, &output);
+    CHECK(output == 42 * ONE);
+}
+
+static void test_noise(void) {
+    // Uniform noise of +-16 counts plus the odd spike, through the full chain
+    FPVSensorFilter filter;
+    int32_t output;
+    init(&filter, 5, 8, 2);
+    uint32_t seed = 12345;
+    double input_error = 0, output_error = 0;
+    int i, inputs = 0, outputs = 0;
+    for ( i=0; i<8000; i++ ) {
+        int sample = 600 + (int)(test_random(&seed) % 33) - 16;
+        if ( test_random(&seed) % 50 == 0 ) sample = test_random(&seed) & 1 ? 1023 : 0;
+        input_error += (sample - 600.0) * (sample - 600.0);
+        inputs++;
+        if ( fpv_sensor_filter_push(&filter, sample, &output) && i > 100 ) {
+            double error = (double)output / ONE - 600.0;
+            CHECK(fabs(error) < 8);
+            output_error += error * error;
+            outputs++;
+        }
+    }
+    double input_rms = sqrt(input_error / inputs), output_rms = sqrt(output_error / outputs);
+    CHECK(outputs > 900);
+    CHECK(output_rms < input_rms / 10);
+}
+
+int main(int argc, char **argv) {
+    test_config();
+    test_passthrough();
+    test_median_spikes();
+    test_oversample();
+    test_lowpass_step();
+    test_noise();
+    return test_failures();
+}
@@ -0,0 +1,185 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks spi_transaction_batch against a fake spidev standing in for an MCP3008: open() and
+// ioctl() on /dev/spidev* are intercepted here, so no hardware is needed
+
+#include "spi.h"
+#include "test_common.h"
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/spi/spidev.h>
+
+#define ADC_CHANNELS 8
+
+static struct {
+    int fd;
+    uint16_t values[ADC_CHANNELS];
+    int messages;               // SPI_IOC_MESSAGE ioctls
+    int transfers;              // Transfers within them
+    int cs_errors;              // Transfers whose chip select handling was wrong
+} fake = { .fd = -1 };
+
+#pragma mark - Fake spidev
+
+int open(const char *path, int flags, ...) {
+    mode_t mode = 0;
+    if ( flags & O_CREAT ) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    if ( strncmp(path, "/dev/spidev", strlen("/dev/spidev")) == 0 ) {
+        // A real fd, so close() needs no special handling
+        fake.fd = eventfd(0, 0);
+        return fake.fd;
+    }
+    return syscall(SYS_openat, AT_FDCWD, path, flags, mode);
+}
+
+static void fake_mcp3008_transfer(const struct spi_ioc_transfer *transfer) {
+    const uint8_t *tx = (const uint8_t*)(unsigned long)transfer->tx_buf;
+    uint8_t *rx = (uint8_t*)(unsigned long)transfer->rx_buf;
+    memset(rx, 0, transfer->len);
+    if ( transfer->len != 3 || tx[0] != 1 || !(tx[1] & 0x80) ) return;
+
+    // Single-ended conversion: the 10-bit result comes back in the last two bytes
+    uint16_t value = fake.values[(tx[1] >> 4) & 7];
+    rx[1] = (value >> 8) & 3;
+    rx[2] = value & 0xff;
+}
+
+int ioctl(int fd, unsigned long request, ...) {
+    va_list args;
+    va_start(args, request);
+    void *argument = va_arg(args, void*);
+    va_end(args);
+
+    if ( fd != fake.fd || fd < 0 ) return syscall(SYS_ioctl, fd, request, argument);
+
+    if ( request == SPI_IOC_RD_BITS_PER_WORD ) {
+        *(uint8_t*)argument = 8;
+        return 0;
+    }
+    if ( request == SPI_IOC_RD_MAX_SPEED_HZ ) {
+        *(uint32_t*)argument = 1000000;
+        return 0;
+    }
+    if ( _IOC_TYPE(request) == SPI_IOC_MAGIC && _IOC_NR(request) == 0 ) {
+        int count = _IOC_SIZE(request) / sizeof(struct spi_ioc_transfer);
+        const struct spi_ioc_transfer *transfers = argument;
+        int i;
+        for ( i=0; i<count; i++ ) {
+            fake_mcp3008_transfer(&transfers[i]);
+            // The ADC needs chip select released between conversions, but not after the last
+            if ( transfers[i].cs_change != (i < count-1) ) fake.cs_errors++;
+        }
+        fake.messages++;
+        fake.transfers += count;
+        return count ? 3 * count : 0;
+    }
+    return -1;
+}
+
+#pragma mark - Tests
+
+static void mcp3008_command(uint8_t command[3], int channel) {
+    command[0] = 1;
+    command[1] = (8+channel) << 4;
+    command[2] = 0;
+}
+
+static uint16_t mcp3008_value(const uint8_t response[3]) {
+    return ((response[1] & 3) << 8) + response[2];
+}
+
+static void test_batch_matches_single(SPIInterface *spi) {
+    int channel;
+    for ( channel=0; channel<ADC_CHANNELS; channel++ ) {
+        fake.values[channel] = (channel * 131 + 7) & 0x3ff;
+    }
+
+    // One ioctl per channel, as before batching
+    uint16_t single[ADC_CHANNELS];
+    fake.messages = 0;
+    for ( channel=0; channel<ADC_CHANNELS; channel++ ) {
+        uint8_t command[3], response[3];
+        mcp3008_command(command, channel);
+        CHECK(spi_transaction(spi, command, response, sizeof(response)) == 0);
+        single[channel] = mcp3008_value(response);
+    }
+    CHECK(fake.messages == ADC_CHANNELS);
+
+    // All of them in one
+    uint8_t commands[ADC_CHANNELS][3], responses[ADC_CHANNELS][3];
+    SPITransfer transfers[ADC_CHANNELS];
+    for ( channel=0; channel<ADC_CHANNELS; channel++ ) {
+        mcp3008_command(commands[channel], channel);
+        transfers[channel].txbuffer = commands[channel];
+        transfers[channel].rxbuffer = responses[channel];
+        transfers[channel].length = sizeof(responses[channel]);
+    }
+    fake.messages = fake.transfers = fake.cs_errors = 0;
+    CHECK(spi_transaction_batch(spi, transfers, ADC_CHANNELS) == 0);
+    CHECK(fake.messages == 1);
+    CHECK(fake.transfers == ADC_CHANNELS);
+    CHECK(fake.cs_errors == 0);
+
+    for ( channel=0; channel<ADC_CHANNELS; channel++ ) {
+        CHECK(mcp3008_value(responses[channel]) == single[channel]);
+        CHECK(mcp3008_value(responses[channel]) == fake.values[channel]);
+    }
+}
+
+static void test_batch_limits(SPIInterface *spi) {
+    uint8_t command[3], response[3];
+    mcp3008_command(command, 0);
+    SPITransfer transfers[SPI_MAX_BATCH_TRANSFERS+1];
+    int i;
+    for ( i=0; i<SPI_MAX_BATCH_TRANSFERS+1; i++ ) {
+        transfers[i].txbuffer = command;
+        transfers[i].rxbuffer = response;
+        transfers[i].length = sizeof(response);
+    }
+
+    fake.messages = fake.transfers = 0;
+    CHECK(spi_transaction_batch(spi, transfers, 0) == 0);
+    CHECK(fake.messages == 0);
+    CHECK(spi_transaction_batch(spi, transfers, SPI_MAX_BATCH_TRANSFERS+1) == -1);
+    CHECK(fake.messages == 0);
+    CHECK(spi_transaction_batch(spi, transfers, SPI_MAX_BATCH_TRANSFERS) == 0);
+    CHECK(fake.messages == 1);
+    CHECK(fake.transfers == SPI_MAX_BATCH_TRANSFERS);
+}
+
+int main(int argc, char **argv) {
+    SPIInterface *spi = spi_new(0, 0);
+    CHECK(spi != NULL);
+    if ( !spi ) return test_failures();
+
+    test_batch_matches_single(spi);
+    test_batch_limits(spi);
+
+    spi_dispose(spi);
+    return test_failures();
+}
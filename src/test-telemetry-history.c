@@ -0,0 +1,323 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests for the telemetry history ring: lookups and range queries against a brute-force scan
+// of the same samples, clearing, the mAh integral, wraparound, and readers racing a fast writer
+
+#include "telemetry_history.h"
+#include "test_common.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define SAMPLES 2000
+#define INTERVAL 10000      // Microseconds between samples, 100 Hz
+
+static uint64_t timestamps[SAMPLES];
+static double voltages[SAMPLES];
+
+static void add_power(FPVTelemetryHistory *history, double voltage, double current, uint64_t timestamp) {
+    FPVTelemetryUpdate update;
+    memset(&update, 0, sizeof(update));
+    update.type = TELEMETRY_TYPE_POWER;
+    update.content.power.voltage = voltage;
+    update.content.power.current = current;
+    fpv_telemetry_history_add(history, &update, timestamp);
+}
+
+// What get_stats should report for samples first..end-1 of the reference arrays
+static int brute_stats(int first, int end, uint64_t since, uint64_t until, FPVTelemetryHistoryStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    int i, lower = -1, upper = -1;
+    for ( i=first; i<end; i++ ) {
+        if ( timestamps[i] < since || timestamps[i] > until ) continue;
+        if ( lower < 0 ) {
+            lower = i;
+            stats->min = stats->max = voltages[i];
+        }
+        upper = i;
+        if ( voltages[i] < stats->min ) stats->min = voltages[i];
+        if ( voltages[i] > stats->max ) stats->max = voltages[i];
+        stats->count++;
+    }
+    if ( !stats->count ) return 0;
+    double integral = 0.0;
+    for ( i=lower; i<upper; i++ ) integral += (voltages[i] + voltages[i+1]) * 0.5 * (timestamps[i+1] - timestamps[i]) * 1e-6;
+    stats->mean = upper > lower ? integral / ((timestamps[upper] - timestamps[lower]) * 1e-6) : voltages[upper];
+    return stats->count;
+}
+
+static void check_ranges(FPVTelemetryHistory *history, int first, int end, uint32_t *seed, int rounds) {
+    int round;
+    for ( round=0; round<rounds; round++ ) {
+        uint64_t a = timestamps[first] - INTERVAL + test_random(seed) % ((end - first + 2) * INTERVAL);
+        uint64_t b = timestamps[first] - INTERVAL + test_random(seed) % ((end - first + 2) * INTERVAL);
+        uint64_t since = a < b ? a : b, until = a < b ? b : a;
+
+        FPVTelemetryHistoryStats expected, stats;
+        int count = fpv_telemetry_history_get_stats(history, FPV_TELEMETRY_FIELD_VOLTAGE, since, until, &stats);
+        CHECK(count == brute_stats(first, end, since, until, &expected));
+        CHECK(stats.count == expected.count);
+        if ( count != expected.count || !count ) continue;
+        CHECK(stats.min == expected.min);
+        CHECK(stats.max == expected.max);
+        CHECK_NEAR(stats.mean, expected.mean, 1e-6);
+    }
+}
+
+#pragma mark - Lookups and ranges
+
+static void test_empty(void) {
+    FPVTelemetryHistory *history = fpv_telemetry_history_new(256);
+    CHECK(history != NULL);
+    double value = -1.0;
+    FPVTelemetryHistoryStats stats;
+    CHECK(!fpv_telemetry_history_value_at(history, FPV_TELEMETRY_FIELD_VOLTAGE, 1000, &value));
+    CHECK(value == -1.0);
+    CHECK(fpv_telemetry_history_get_stats(history, FPV_TELEMETRY_FIELD_VOLTAGE, 0, UINT64_MAX, &stats) == 0);
+    CHECK(fpv_telemetry_history_integrate(history, FPV_TELEMETRY_FIELD_CURRENT, 0, 1000000) == 0.0);
+    CHECK(!fpv_telemetry_history_value_at(history, FPV_TELEMETRY_FIELD_COUNT, 1000, &value));
+
+    // A power sample says nothing about the other record types
+    add_power(history, 12.0, 1.0, 1000);
+    CHECK(fpv_telemetry_history_value_at(history, FPV_TELEMETRY_FIELD_VOLTAGE, 1000, &value));
+    CHECK(!fpv_telemetry_history_value_at(history, FPV_TELEMETRY_FIELD_ALTITUDE, 1000, &value));
+    fpv_telemetry_history_dispose(history);
+}
+
+static void test_lookups(void) {
+    FPVTelemetryHistory *history = fpv_telemetry_history_new(SAMPLES + 64);
+    uint32_t seed = 12345;
+    int i;
+    for ( i=0; i<SAMPLES; i++ ) {
+        timestamps[i] = 1000000 + (uint64_t)i * INTERVAL;
+        voltages[i] = 10.0 + (test_random(&seed) % 5000) * 0.001;
+        add_power(history, voltages[i], 0.0, timestamps[i]);
+    }
+
+    double value;
+    CHECK(!fpv_telemetry_history_value_at(history, FPV_TELEMETRY_FIELD_VOLTAGE, timestamps[0] - 1, &value));
+    for ( i=0; i<SAMPLES; i+=37 ) {
+        CHECK(fpv_telemetry_history_value_at(history, FPV_TELEMETRY_FIELD_VOLTAGE, timestamps[i], &value) && value == voltages[i]);
+        CHECK(fpv_telemetry_history_value_at(history, FPV_TELEMETRY_FIELD_VOLTAGE, timestamps[i] + INTERVAL - 1, &value) && value == voltages[i]);
+    }
+    CHECK(fpv_telemetry_history_value_at(history, FPV_TELEMETRY_FIELD_VOLTAGE, UINT64_MAX, &value) && value == voltages[SAMPLES-1]);
+
+    // Whole history, single samples, empty gaps between samples, and random ranges
+    FPVTelemetryHistoryStats stats;
+    CHECK(fpv_telemetry_history_get_stats(history, FPV_TELEMETRY_FIELD_VOLTAGE, 0, UINT64_MAX, &stats) == SAMPLES);
+    CHECK(fpv_telemetry_history_get_stats(history, FPV_TELEMETRY_FIELD_VOLTAGE, timestamps[5], timestamps[5], &stats) == 1);
+    CHECK(stats.mean == voltages[5]);
+    CHECK(fpv_telemetry_history_get_stats(history, FPV_TELEMETRY_FIELD_VOLTAGE, timestamps[5] + 1, timestamps[6] - 1, &stats) == 0);
+    check_ranges(history, 0, SAMPLES, &seed, 2000);
+    fpv_telemetry_history_dispose(history);
+}
+
+static void test_clock_step_back(void) {
+    FPVTelemetryHistory *history = fpv_telemetry_history_new(256);
+    add_power(history, 1.0, 0.0, 2000);
+    add_power(history, 2.0, 0.0, 1000);   // Held at 2000 so the searches stay ordered
+    add_power(history, 3.0, 0.0, 3000);
+    double value;
+    CHECK(fpv_telemetry_history_value_at(history, FPV_TELEMETRY_FIELD_VOLTAGE, 2500, &value) && value == 2.0);
+    CHECK(!fpv_telemetry_history_value_at(history, FPV_TELEMETRY_FIELD_VOLTAGE, 1500, &value));
+    fpv_telemetry_history_dispose(history);
+}
+
+static void test_clear(void) {
+    FPVTelemetryHistory *history = fpv_telemetry_history_new(256);
+    int i;
+    for ( i=1; i<=100; i++ ) add_power(history, 20.0, 5.0, (uint64_t)i * 1000);
+    fpv_telemetry_history_clear(history);
+    double value;
+    FPVTelemetryHistoryStats stats;
+    CHECK(!fpv_telemetry_history_value_at(history, FPV_TELEMETRY_FIELD_VOLTAGE, 100000, &value));
+    CHECK(fpv_telemetry_history_get_stats(history, FPV_TELEMETRY_FIELD_VOLTAGE, 0, UINT64_MAX, &stats) == 0);
+
+    // What's added afterwards stands alone, even across a block boundary
+    for ( i=101; i<=200; i++ ) add_power(history, 10.0, 1.0, (uint64_t)i * 1000);
+    CHECK(!fpv_telemetry_history_value_at(history, FPV_TELEMETRY_FIELD_VOLTAGE, 100000, &value));
+    CHECK(fpv_telemetry_history_get_stats(history, FPV_TELEMETRY_FIELD_VOLTAGE, 0, UINT64_MAX, &stats) == 100);
+    CHECK(stats.min == 10.0 && stats.max == 10.0);
+    CHECK_NEAR(stats.mean, 10.0, 1e-9);
+    CHECK_NEAR(fpv_telemetry_history_integrate(history, FPV_TELEMETRY_FIELD_CURRENT, 0, UINT64_MAX), 1.0 * 0.099, 1e-9);
+    fpv_telemetry_history_dispose(history);
+}
+
+#pragma mark - Integration
+
+static void test_integration(void) {
+    FPVTelemetryHistory *history = fpv_telemetry_history_new(2048);
+
+    // 12 A for 100 s at 10 Hz is 1200 As, or 333.3 mAh
+    int i;
+    for ( i=0; i<=1000; i++ ) add_power(history, 16.0, 12.0, 5000000 + (uint64_t)i * 100000);
+    double consumed = fpv_telemetry_history_integrate(history, FPV_TELEMETRY_FIELD_CURRENT, 0, UINT64_MAX) / 3.6;
+    CHECK_NEAR(consumed, 1200.0 / 3.6, 1e-6);
+
+    // Partial ranges interpolate within a sample interval, and don't extrapolate past the ends
+    CHECK_NEAR(fpv_telemetry_history_integrate(history, FPV_TELEMETRY_FIELD_CURRENT, 5050000, 5250000), 12.0 * 0.2, 1e-9);
+    CHECK_NEAR(fpv_telemetry_history_integrate(history, FPV_TELEMETRY_FIELD_CURRENT, 0, 5000000), 0.0, 1e-9);
+    CHECK(fpv_telemetry_history_integrate(history, FPV_TELEMETRY_FIELD_CURRENT, 6000000, 6000000) == 0.0);
+    fpv_telemetry_history_dispose(history);
+
+    // A ramp from 0 to 10 A over 10 s is 50 As, exactly under the trapezoid rule
+    history = fpv_telemetry_history_new(256);
+    for ( i=0; i<=100; i++ ) add_power(history, 16.0, i * 0.1, (uint64_t)i * 100000);
+    CHECK_NEAR(fpv_telemetry_history_integrate(history, FPV_TELEMETRY_FIELD_CURRENT, 0, 10000000), 50.0, 1e-9);
+    CHECK_NEAR(fpv_telemetry_history_integrate(history, FPV_TELEMETRY_FIELD_CURRENT, 0, 5000000), 12.5, 1e-9);
+    CHECK_NEAR(fpv_telemetry_history_integrate(history, FPV_TELEMETRY_FIELD_CURRENT, 0, 50000), 0.5 * 0.05 * 0.05, 1e-9);
+    fpv_telemetry_history_dispose(history);
+}
+
+#pragma mark - Iteration
+
+typedef struct {
+    int calls;
+    int wrong;
+} IterateState;
+
+static void iterate_callback(uint64_t timestamp, double value, void *context) {
+    IterateState *state = (IterateState*)context;
+    // Voltage is the sample's timestamp in milliseconds, so the held value is easy to predict
+    if ( value != (double)(timestamp / 1000) ) state->wrong++;
+    state->calls++;
+}
+
+static void test_iterate(void) {
+    FPVTelemetryHistory *history = fpv_telemetry_history_new(256);
+    int i;
+    for ( i=1; i<=100; i++ ) add_power(history, i, 0.0, (uint64_t)i * 1000);
+
+    IterateState state = { 0, 0 };
+    int calls = fpv_telemetry_history_iterate(history, FPV_TELEMETRY_FIELD_VOLTAGE, 0, 200000, 250, iterate_callback, &state);
+    // Nothing before the first sample, then one call per step through the end of the range
+    CHECK(calls == (200000 - 1000) / 250 + 1);
+    CHECK(state.calls == calls);
+    CHECK(state.wrong == (200000 - 101000) / 250 + 1);     // Past the last sample the value holds at 100
+    CHECK(fpv_telemetry_history_iterate(history, FPV_TELEMETRY_FIELD_VOLTAGE, 0, 1000, 0, iterate_callback, &state) == 0);
+    fpv_telemetry_history_dispose(history);
+}
+
+#pragma mark - Wraparound
+
+static void test_wraparound(void) {
+    // Rounded up to 256, of which the newest 192 are queryable while the oldest block is recycled
+    FPVTelemetryHistory *history = fpv_telemetry_history_new(200);
+    uint32_t seed = 777;
+    int i;
+    for ( i=0; i<SAMPLES; i++ ) {
+        timestamps[i] = 1000000 + (uint64_t)i * INTERVAL;
+        voltages[i] = (test_random(&seed) % 10000) * 0.01;
+        add_power(history, voltages[i], 0.0, timestamps[i]);
+    }
+
+    FPVTelemetryHistoryStats stats;
+    CHECK(fpv_telemetry_history_get_stats(history, FPV_TELEMETRY_FIELD_VOLTAGE, 0, UINT64_MAX, &stats) == 192);
+    double value;
+    CHECK(!fpv_telemetry_history_value_at(history, FPV_TELEMETRY_FIELD_VOLTAGE, timestamps[SAMPLES - 193], &value));
+    CHECK(fpv_telemetry_history_value_at(history, FPV_TELEMETRY_FIELD_VOLTAGE, timestamps[SAMPLES - 192], &value)
+        && value == voltages[SAMPLES - 192]);
+    check_ranges(history, SAMPLES - 192, SAMPLES, &seed, 2000);
+    fpv_telemetry_history_dispose(history);
+}
+
+#pragma mark - Concurrent readers
+
+#define CONCURRENT_SAMPLES 400000
+
+static FPVTelemetryHistory *shared;
+static volatile int writing = 1;
+
+typedef struct {
+    uint64_t queries;
+    uint64_t wrong;
+} ReaderStats;
+
+// The writer stores sample i at i ms with voltage i, so any mixed-up read shows as a mismatch
+static void * reader_entry(void *userinfo) {
+    ReaderStats *stats = (ReaderStats*)userinfo;
+    uint32_t seed = 99;
+    double value;
+    FPVTelemetryHistoryStats range;
+    while ( __atomic_load_n(&writing, __ATOMIC_ACQUIRE) ) {
+        uint64_t newest;
+        if ( !fpv_telemetry_history_value_at(shared, FPV_TELEMETRY_FIELD_VOLTAGE, UINT64_MAX, &value) ) continue;
+        newest = (uint64_t)value * 1000;
+        if ( newest < 300000 ) continue;
+        uint64_t timestamp = newest - test_random(&seed) % 300000;
+
+        if ( fpv_telemetry_history_value_at(shared, FPV_TELEMETRY_FIELD_VOLTAGE, timestamp, &value) ) {
+            stats->queries++;
+            if ( (uint64_t)value * 1000 != timestamp / 1000 * 1000 ) stats->wrong++;
+        }
+
+        // Consecutive samples hold consecutive values, so a range's extremes follow from its count.
+        // The mean comes from a difference of running integrals, so allow for their rounding.
+        uint64_t since = timestamp - timestamp % 1000;
+        if ( fpv_telemetry_history_get_stats(shared, FPV_TELEMETRY_FIELD_VOLTAGE, since, since + 99999, &range) ) {
+            stats->queries++;
+            if ( range.min * 1000 < since || range.max * 1000 > since + 99999 || range.max != range.min + range.count - 1
+                    || fabs(range.mean - (range.min + range.max) * 0.5) > range.max * 1e-9 ) {
+                stats->wrong++;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void test_concurrent_readers(void) {
+    shared = fpv_telemetry_history_new(256);
+    pthread_t readers[2];
+    ReaderStats stats[2];
+    memset(stats, 0, sizeof(stats));
+    add_power(shared, 1.0, 0.0, 1000);
+    int i;
+    for ( i=0; i<2; i++ ) pthread_create(&readers[i], NULL, reader_entry, &stats[i]);
+
+    for ( i=2; i<=CONCURRENT_SAMPLES; i++ ) {
+        add_power(shared, i, 0.0, (uint64_t)i * 1000);
+        if ( (i & 4095) == 0 ) sched_yield();
+    }
+    __atomic_store_n(&writing, 0, __ATOMIC_RELEASE);
+
+    uint64_t queries = 0, wrong = 0;
+    for ( i=0; i<2; i++ ) {
+        pthread_join(readers[i], NULL);
+        queries += stats[i].queries;
+        wrong += stats[i].wrong;
+    }
+    printf("%d samples through a 256-sample ring: %llu queries answered while writing, %llu inconsistent\n",
+        CONCURRENT_SAMPLES, (unsigned long long)queries, (unsigned long long)wrong);
+    CHECK(wrong == 0);
+    CHECK(queries > 0);
+    fpv_telemetry_history_dispose(shared);
+}
+
+int main(int argc, char **argv) {
+    test_empty();
+    test_lookups();
+    test_clock_step_back();
+    test_clear();
+    test_integration();
+    test_iterate();
+    test_wraparound();
+    test_concurrent_readers();
+    return test_failures();
+}
@@ -0,0 +1,108 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks the receiver's motion estimate from a vehicle flying north at a steady speed, and
+// that a fix delivered behind a newer one is ignored rather than moving the vehicle back
+
+#include "telemetry_rx.h"
+#include "telemetry_common.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define FIX_INTERVAL 100000     // Sender microseconds between fixes
+#define SPEED 20.0              // m/s north
+#define METRES_PER_DEGREE 111320.0
+
+static int port;
+static int sock;
+static int updates;
+
+static void update_callback(FPVTelemetryRX * rx, FPVTelemetryUpdate * update, void * context) {
+    __atomic_add_fetch(&updates, 1, __ATOMIC_RELEASE);
+}
+
+static double fix_latitude(int fix) {
+    return 50.0 + SPEED * fix * (FIX_INTERVAL / 1e6) / METRES_PER_DEGREE;
+}
+
+// Sends the fix and waits for the listener to take it
+static int send_fix(int fix) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    FPVTelemetryFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.sequence = fix;
+    frame.timestamp = 1000000 + fix * FIX_INTERVAL;
+    frame.count = 1;
+    frame.records[0].type = TELEMETRY_TYPE_POSITION;
+    frame.records[0].content.position.latitude = fix_latitude(fix);
+    frame.records[0].content.position.longitude = -1.0;
+    frame.records[0].content.position.altitude = 100.0;
+    uint8_t buffer[TELEMETRY_WIRE_MAX_LENGTH];
+    int length = fpv_telemetry_frame_encode(&frame, buffer, sizeof(buffer));
+
+    int expected = __atomic_load_n(&updates, __ATOMIC_ACQUIRE) + 1, i;
+    sendto(sock, buffer, length, 0, (struct sockaddr*)&address, sizeof(address));
+    for ( i=0; i<200 && __atomic_load_n(&updates, __ATOMIC_ACQUIRE) < expected; i++ ) usleep(5000);
+    return __atomic_load_n(&updates, __ATOMIC_ACQUIRE) >= expected;
+}
+
+int main(int argc, char **argv) {
+    port = 20000 + getpid() % 20000;
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    FPVTelemetryRX *rx = fpv_telemetry_rx_new(NULL, port);
+    fpv_telemetry_rx_set_callback(rx, update_callback, NULL);
+    CHECK(fpv_telemetry_rx_listener_start(rx) == 1);
+    // The listener binds its socket once its thread is running
+    usleep(100000);
+
+    // Fixes go out back to back; the sender's timestamps say how far apart they were taken
+    int fix;
+    for ( fix=1; fix<=8; fix++ ) CHECK(send_fix(fix));
+    telemetry_rx_t telemetry = fpv_telemetry_rx_get(rx);
+    CHECK_NEAR(telemetry.velocity_north, SPEED, 0.5);
+    CHECK_NEAR(telemetry.location.latitude, fix_latitude(8), 1e-6);
+
+    // An older fix arriving late leaves position and motion as they were
+    CHECK(send_fix(5));
+    telemetry = fpv_telemetry_rx_get(rx);
+    CHECK_NEAR(telemetry.velocity_north, SPEED, 0.5);
+    CHECK_NEAR(telemetry.location.latitude, fix_latitude(8), 1e-6);
+    CHECK(telemetry.position_timestamp.sent == 1000000 + 8 * FIX_INTERVAL);
+
+    // And the next one carries on from the newest, as does a repeat of it
+    CHECK(send_fix(9));
+    CHECK(send_fix(9));
+    telemetry = fpv_telemetry_rx_get(rx);
+    CHECK_NEAR(telemetry.velocity_north, SPEED, 0.5);
+    CHECK_NEAR(telemetry.location.latitude, fix_latitude(9), 1e-6);
+
+    fpv_telemetry_rx_listener_stop(rx);
+    fpv_telemetry_rx_dispose(rx);
+    close(sock);
+    return test_failures();
+}
@@ -0,0 +1,156 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks the telemetry listener delivers what arrives, sleeps while nothing does, and stops
+// straight away when asked, rather than on its next timeout
+
+#define _GNU_SOURCE
+#include "telemetry_rx.h"
+#include "telemetry_common.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static int port;
+static int updates;
+static double last_voltage;
+
+static void update_callback(FPVTelemetryRX * rx, FPVTelemetryUpdate * update, void * context) {
+    if ( update->type == TELEMETRY_TYPE_POWER ) last_voltage = update->content.power.voltage;
+    __atomic_add_fetch(&updates, 1, __ATOMIC_RELEASE);
+}
+
+static void send_power(double voltage, uint16_t sequence) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    FPVTelemetryFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.sequence = sequence;
+    frame.count = 1;
+    frame.records[0].type = TELEMETRY_TYPE_POWER;
+    frame.records[0].content.power.voltage = voltage;
+    uint8_t buffer[TELEMETRY_WIRE_MAX_LENGTH];
+    int length = fpv_telemetry_frame_encode(&frame, buffer, sizeof(buffer));
+    sendto(sock, buffer, length, 0, (struct sockaddr*)&address, sizeof(address));
+    close(sock);
+}
+
+// Sends until the listener has bound its socket and taken the update, or a second passes
+static int deliver(double voltage, uint16_t sequence) {
+    int before = __atomic_load_n(&updates, __ATOMIC_ACQUIRE);
+    int i;
+    for ( i=0; i<100; i++ ) {
+        send_power(voltage, sequence);
+        usleep(10000);
+        if ( __atomic_load_n(&updates, __ATOMIC_ACQUIRE) != before ) return 1;
+    }
+    return 0;
+}
+
+// The listener is the process's only thread besides this one
+static pid_t listener_tid(void) {
+    DIR *tasks = opendir("/proc/self/task");
+    pid_t tid = 0;
+    struct dirent *entry;
+    while ( tasks && (entry = readdir(tasks)) ) {
+        pid_t task = atoi(entry->d_name);
+        if ( task > 0 && task != syscall(SYS_gettid) ) tid = task;
+    }
+    if ( tasks ) closedir(tasks);
+    return tid;
+}
+
+static void thread_usage(pid_t tid, long *switches, double *cpu) {
+    char path[64], line[256];
+    *switches = -1;
+    *cpu = -1;
+    snprintf(path, sizeof(path), "/proc/self/task/%d/status", tid);
+    FILE *file = fopen(path, "r");
+    while ( file && fgets(line, sizeof(line), file) ) {
+        sscanf(line, "voluntary_ctxt_switches: %ld", switches);
+    }
+    if ( file ) fclose(file);
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+    file = fopen(path, "r");
+    if ( file && fgets(line, sizeof(line), file) ) {
+        // utime and stime are fields 14 and 15, after the parenthesised command name
+        unsigned long utime, stime;
+        char *fields = strrchr(line, ')');
+        if ( fields && sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2 ) {
+            *cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+        }
+    }
+    if ( file ) fclose(file);
+}
+
+int main(int argc, char **argv) {
+    port = 20000 + getpid() % 20000;
+    FPVTelemetryRX *rx = fpv_telemetry_rx_new(NULL, port);
+    fpv_telemetry_rx_set_callback(rx, update_callback, NULL);
+
+    int run;
+    for ( run=0; run<2; run++ ) {
+        // A stopped listener can be started again
+        CHECK(fpv_telemetry_rx_listener_start(rx) == 1);
+        CHECK(deliver(11.1 + run, run));
+        CHECK_NEAR(last_voltage, 11.1 + run, 1e-9);
+        CHECK_NEAR(fpv_telemetry_rx_get(rx).voltage, 11.1 + run, 1e-9);
+
+        // Idle: the old loop woke every 8 ms or so on its receive timeout
+        pid_t tid = listener_tid();
+        CHECK(tid > 0);
+        long switches_before, switches_after;
+        double cpu_before, cpu_after;
+        thread_usage(tid, &switches_before, &cpu_before);
+        usleep(1000000);
+        thread_usage(tid, &switches_after, &cpu_after);
+        long wakeups = switches_after - switches_before;
+        CHECK(switches_before >= 0 && wakeups <= 2);
+
+        // Stopping wakes the listener, which otherwise waits for a packet with no timeout;
+        // it usually takes well under a millisecond, so the bound leaves a busy host plenty
+        uint64_t start = test_now();
+        fpv_telemetry_rx_listener_stop(rx);
+        uint64_t stop_time = test_now() - start;
+        CHECK(stop_time < 500000);
+
+        printf("Idle for 1 s: %ld wakeups, %.2f s CPU; stopped in %.2f ms\n", wakeups, cpu_after - cpu_before,
+            stop_time / 1000.0);
+    }
+
+    // Nothing is delivered once stopped
+    int before = updates;
+    send_power(20.0, 99);
+    usleep(20000);
+    CHECK(updates == before);
+
+    fpv_telemetry_rx_dispose(rx);
+    return test_failures();
+}
@@ -0,0 +1,147 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks the listener's batched receive: packets that queue while it's busy are all delivered
+// in order, stamped with when they reached the socket rather than when they were handled, and
+// datagrams too big for its buffers are dropped rather than decoded from a truncated copy
+
+#include "telemetry_rx.h"
+#include "telemetry_common.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_UPDATES 128
+#define BUSY_TIME 50000
+
+static int port;
+static int sock;
+
+static struct {
+    FPVTelemetryUpdate updates[MAX_UPDATES];
+    uint64_t handled[MAX_UPDATES];
+    int count;
+    int busy;   // Hold up the listener in the next callback
+} received;
+
+static void update_callback(FPVTelemetryRX * rx, FPVTelemetryUpdate * update, void * context) {
+    int index = __atomic_load_n(&received.count, __ATOMIC_ACQUIRE);
+    if ( index < MAX_UPDATES ) {
+        received.updates[index] = *update;
+        received.handled[index] = fpv_telemetry_now();
+    }
+    __atomic_store_n(&received.count, index + 1, __ATOMIC_RELEASE);
+    if ( __atomic_exchange_n(&received.busy, 0, __ATOMIC_ACQ_REL) ) usleep(BUSY_TIME);
+}
+
+static void send_power(uint16_t sequence, int padding) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    FPVTelemetryFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.sequence = sequence;
+    frame.count = 1;
+    frame.records[0].type = TELEMETRY_TYPE_POWER;
+    frame.records[0].content.power.voltage = sequence * 0.01;
+    uint8_t buffer[4096];
+    memset(buffer, 0, sizeof(buffer));
+    int length = fpv_telemetry_frame_encode(&frame, buffer, sizeof(buffer));
+    sendto(sock, buffer, length + padding, 0, (struct sockaddr*)&address, sizeof(address));
+}
+
+static int wait_for(int count) {
+    int i;
+    for ( i=0; i<200 && __atomic_load_n(&received.count, __ATOMIC_ACQUIRE) < count; i++ ) usleep(5000);
+    return __atomic_load_n(&received.count, __ATOMIC_ACQUIRE) >= count;
+}
+
+int main(int argc, char **argv) {
+    port = 20000 + getpid() % 20000;
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    FPVTelemetryRX *rx = fpv_telemetry_rx_new(NULL, port);
+    fpv_telemetry_rx_set_callback(rx, update_callback, NULL);
+    CHECK(fpv_telemetry_rx_listener_start(rx) == 1);
+
+    // Wait for the listener to bind
+    int i;
+    for ( i=0; i<100 && !received.count; i++ ) {
+        send_power(0, 0);
+        usleep(10000);
+    }
+    CHECK(received.count > 0);
+    usleep(20000);
+    memset(&received, 0, sizeof(received));
+
+    // Hold the listener up on the first packet, and queue a burst behind it
+    __atomic_store_n(&received.busy, 1, __ATOMIC_RELEASE);
+    send_power(1, 0);
+    CHECK(wait_for(1));
+    uint64_t sent[MAX_UPDATES];
+    static const int burst = 40;
+    for ( i=0; i<burst; i++ ) {
+        sent[i] = fpv_telemetry_now();
+        send_power(2 + i, 0);
+        usleep(200);
+    }
+    CHECK(wait_for(1 + burst));
+    CHECK(received.count == 1 + burst);
+
+    int late = 0;
+    for ( i=0; i<burst; i++ ) {
+        FPVTelemetryUpdate *update = &received.updates[1 + i];
+        CHECK(update->type == TELEMETRY_TYPE_POWER);
+        CHECK_NEAR(update->content.power.voltage, (2 + i) * 0.01, 1e-9);
+
+        // Stamped on arrival however long it then waited: for those held up, nearer when it
+        // was sent than when it was handled, which a loaded host only makes more so
+        CHECK(update->received + 1000 >= sent[i]);
+        CHECK(update->received <= received.handled[1 + i]);
+        if ( received.handled[1 + i] - sent[i] > BUSY_TIME / 2 ) {
+            late++;
+            CHECK((int64_t)(update->received - sent[i]) < (int64_t)(received.handled[1 + i] - update->received));
+        }
+        if ( i > 0 ) CHECK(update->received >= received.updates[i].received);
+    }
+    // Most of the burst arrived while the listener was held up
+    CHECK(late > burst / 2);
+
+    // A datagram bigger than the receive buffer, with a valid frame at its start, is dropped
+    int before = received.count;
+    send_power(500, 2000);
+    send_power(501, 0);
+    CHECK(wait_for(before + 1));
+    usleep(20000);
+    CHECK(received.count == before + 1);
+    CHECK_NEAR(received.updates[before].content.power.voltage, 5.01, 1e-9);
+
+    printf("%d packets queued behind a %d ms stall, %d handled more than %d ms after arrival, all stamped on arrival\n",
+        burst, BUSY_TIME / 1000, late, BUSY_TIME / 2000);
+
+    fpv_telemetry_rx_listener_stop(rx);
+    fpv_telemetry_rx_dispose(rx);
+    close(sock);
+    return test_failures();
+}
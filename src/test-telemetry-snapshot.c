@@ -0,0 +1,174 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Stress test for the telemetry snapshot seqlock: a sender streams frames over loopback whose
+// every field is derived from the frame's sequence number, while reader threads hammer
+// fpv_telemetry_rx_get and check that no snapshot mixes fields from different frames
+
+#include "telemetry_rx.h"
+#include "telemetry_common.h"
+#include "test_common.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define READERS 3
+#define FRAMES 50000
+
+static FPVTelemetryRX *rx;
+static int port;
+static volatile int sending = 1;
+
+typedef struct {
+    uint64_t snapshots;
+    uint64_t torn;
+    uint64_t distinct;  // Snapshots that differed from the previous one
+} ReaderStats;
+
+// Each field encodes the sequence differently, so a snapshot with fields from two frames disagrees
+static void make_frame(FPVTelemetryFrame *frame, uint16_t sequence) {
+    memset(frame, 0, sizeof(*frame));
+    frame->sequence = sequence;
+    frame->timestamp = sequence * 1000u;
+    frame->count = 4;
+    frame->records[0].type = TELEMETRY_TYPE_POSITION;
+    frame->records[0].content.position.latitude = 10.0 + sequence * 1e-7;
+    frame->records[0].content.position.longitude = -20.0 - sequence * 1e-7;
+    frame->records[0].content.position.altitude = sequence * 0.01;
+    frame->records[0].content.position.bearing = (sequence % 36000) * 0.01;
+    frame->records[1].type = TELEMETRY_TYPE_POWER;
+    frame->records[1].content.power.voltage = sequence * 0.001;
+    frame->records[1].content.power.current = (65535 - sequence) * 0.01;
+    frame->records[2].type = TELEMETRY_TYPE_SIGNAL;
+    frame->records[2].content.signal.rssi = -(sequence % 30000) * 0.01;
+    frame->records[3].type = TELEMETRY_TYPE_ATTITUDE;
+    frame->records[3].content.attitude.roll = (sequence % 18000) * 0.01;
+    frame->records[3].content.attitude.pitch = -(sequence % 18000) * 0.01;
+    frame->records[3].content.attitude.yaw = (sequence % 36000) * 0.01;
+}
+
+static int consistent(const telemetry_rx_t *telemetry) {
+    int sequence = telemetry->sequence;
+    return lrint((telemetry->location.latitude - 10.0) * 1e7) == sequence
+        && lrint((-20.0 - telemetry->location.longitude) * 1e7) == sequence
+        && lrint(telemetry->location.altitude * 100) == sequence
+        && lrint(telemetry->bearing * 100) == sequence % 36000
+        && lrint(telemetry->voltage * 1000) == sequence
+        && lrint(telemetry->current * 100) == 65535 - sequence
+        && lrint(-telemetry->rssi * 100) == sequence % 30000
+        && lrint(telemetry->roll * 100) == sequence % 18000
+        && lrint(-telemetry->pitch * 100) == sequence % 18000
+        && lrint(telemetry->yaw * 100) == sequence % 36000
+        && telemetry->position_timestamp.sent == sequence * 1000u
+        && telemetry->position_timestamp.received == telemetry->power_timestamp.received
+        && telemetry->power_timestamp.received == telemetry->signal_timestamp.received
+        && telemetry->signal_timestamp.received == telemetry->attitude_timestamp.received;
+}
+
+static void * reader_entry(void *userinfo) {
+    ReaderStats *stats = (ReaderStats*)userinfo;
+    uint16_t last = 0;
+    while ( __atomic_load_n(&sending, __ATOMIC_ACQUIRE) ) {
+        telemetry_rx_t telemetry = fpv_telemetry_rx_get(rx);
+        if ( !telemetry.power_timestamp.received ) continue;
+        stats->snapshots++;
+        if ( !consistent(&telemetry) ) {
+            if ( stats->torn++ == 0 ) {
+                fprintf(stderr, "Torn snapshot: sequence %d, voltage %.3f, roll %.2f\n", telemetry.sequence,
+                    telemetry.voltage, telemetry.roll);
+            }
+        }
+        if ( telemetry.sequence != last ) stats->distinct++;
+        last = telemetry.sequence;
+    }
+    return NULL;
+}
+
+static int send_frames(int count) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    FPVTelemetryFrame frame;
+    uint8_t buffer[TELEMETRY_WIRE_MAX_LENGTH];
+    int i, sent = 0;
+    for ( i=1; i<=count; i++ ) {
+        make_frame(&frame, i & 0xffff);
+        int length = fpv_telemetry_frame_encode(&frame, buffer, sizeof(buffer));
+        if ( sendto(sock, buffer, length, 0, (struct sockaddr*)&address, sizeof(address)) == length ) sent++;
+        // Let the listener keep up now and then, so readers see plenty of distinct frames
+        if ( (i & 63) == 0 ) usleep(50);
+    }
+
+    // Repeat the last frame once the listener has drained its queue, in case the first copy was dropped
+    usleep(50000);
+    sendto(sock, buffer, fpv_telemetry_frame_encode(&frame, buffer, sizeof(buffer)), 0, (struct sockaddr*)&address, sizeof(address));
+    close(sock);
+    return sent;
+}
+
+int main(int argc, char **argv) {
+    int frames = argc > 1 ? atoi(argv[1]) : FRAMES;
+    port = 20000 + getpid() % 20000;
+    rx = fpv_telemetry_rx_new(NULL, port);
+    CHECK(rx != NULL);
+    if ( !rx || !fpv_telemetry_rx_listener_start(rx) ) {
+        CHECK(0);
+        return test_failures();
+    }
+
+    pthread_t readers[READERS];
+    ReaderStats stats[READERS];
+    memset(stats, 0, sizeof(stats));
+    int i;
+    for ( i=0; i<READERS; i++ ) pthread_create(&readers[i], NULL, reader_entry, &stats[i]);
+
+    int sent = send_frames(frames);
+    usleep(100000);
+    __atomic_store_n(&sending, 0, __ATOMIC_RELEASE);
+
+    uint64_t snapshots = 0, torn = 0, distinct = 0;
+    for ( i=0; i<READERS; i++ ) {
+        pthread_join(readers[i], NULL);
+        snapshots += stats[i].snapshots;
+        torn += stats[i].torn;
+        distinct += stats[i].distinct;
+    }
+
+    // The last frame sent is what's left once the listener has caught up
+    telemetry_rx_t final = fpv_telemetry_rx_get(rx);
+    CHECK(consistent(&final));
+    CHECK(final.sequence == (frames & 0xffff));
+
+    printf("%d frames sent, %d readers took %llu snapshots (%llu changes seen): %llu torn\n", sent, READERS,
+        (unsigned long long)snapshots, (unsigned long long)distinct, (unsigned long long)torn);
+    CHECK(torn == 0);
+    CHECK(distinct > 100);
+
+    fpv_telemetry_rx_listener_stop(rx);
+    fpv_telemetry_rx_dispose(rx);
+    return test_failures();
+}
@@ -0,0 +1,306 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests for telemetry subscriptions: what each overflow policy keeps when its queue fills,
+// eventfd wakeups, a consumer thread racing the producer through a large queue, and
+// subscribers coming and going while the listener dispatches live traffic
+
+#include "telemetry_rx.h"
+#include "telemetry_subscription.h"
+#include "telemetry_common.h"
+#include "test_common.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Every update carries its sequence number in the sender timestamp
+static void make_update(FPVTelemetryUpdate *update, int type, uint32_t sequence) {
+    memset(update, 0, sizeof(*update));
+    update->type = type;
+    update->timestamp = sequence;
+}
+
+static int readable(int fd) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+#pragma mark - Overflow policies
+
+static void test_drop_oldest(void) {
+    FPVTelemetrySubscription *subscription = fpv_telemetry_subscription_new(4, FPV_TELEMETRY_OVERFLOW_DROP_OLDEST);
+    CHECK(subscription != NULL);
+    int fd = fpv_telemetry_subscription_get_fd(subscription);
+    FPVTelemetryUpdate update;
+    CHECK(!readable(fd));
+    CHECK(!fpv_telemetry_subscription_pop(subscription, &update));
+
+    // Ten updates into four slots keeps the newest four, in order
+    int i;
+    for ( i=1; i<=10; i++ ) {
+        make_update(&update, TELEMETRY_TYPE_POWER, i);
+        fpv_telemetry_subscription_publish(subscription, &update, 1);
+    }
+    CHECK(readable(fd));
+    for ( i=7; i<=10; i++ ) {
+        CHECK(fpv_telemetry_subscription_pop(subscription, &update) && update.timestamp == (uint32_t)i);
+    }
+    CHECK(!fpv_telemetry_subscription_pop(subscription, &update));
+    CHECK(!readable(fd));
+
+    FPVTelemetrySubscriptionStats stats;
+    fpv_telemetry_subscription_get_stats(subscription, &stats);
+    CHECK(stats.published == 10);
+    CHECK(stats.dropped == 6);
+
+    // A frame's records are queued together, and the queue signals again once it has emptied
+    FPVTelemetryUpdate frame[3];
+    for ( i=0; i<3; i++ ) make_update(&frame[i], i, 100 + i);
+    fpv_telemetry_subscription_publish(subscription, frame, 3);
+    CHECK(readable(fd));
+    for ( i=0; i<3; i++ ) {
+        CHECK(fpv_telemetry_subscription_pop(subscription, &update) && update.type == i && update.timestamp == 100u + i);
+    }
+    fpv_telemetry_subscription_dispose(subscription);
+
+    // Capacities round up to a power of two
+    subscription = fpv_telemetry_subscription_new(5, FPV_TELEMETRY_OVERFLOW_DROP_OLDEST);
+    for ( i=1; i<=20; i++ ) {
+        make_update(&update, TELEMETRY_TYPE_POWER, i);
+        fpv_telemetry_subscription_publish(subscription, &update, 1);
+    }
+    CHECK(fpv_telemetry_subscription_pop(subscription, &update) && update.timestamp == 13);
+    fpv_telemetry_subscription_dispose(subscription);
+}
+
+static void test_coalesce(void) {
+    FPVTelemetrySubscription *subscription = fpv_telemetry_subscription_new(0, FPV_TELEMETRY_OVERFLOW_COALESCE);
+    CHECK(subscription != NULL);
+    int fd = fpv_telemetry_subscription_get_fd(subscription);
+    FPVTelemetryUpdate update;
+
+    // A hundred updates cycling through the types leaves the latest of each
+    int i;
+    for ( i=0; i<100; i++ ) {
+        make_update(&update, i % TELEMETRY_TYPE_COUNT, i);
+        fpv_telemetry_subscription_publish(subscription, &update, 1);
+    }
+    make_update(&update, TELEMETRY_TYPE_COUNT, 1000);   // Unknown types aren't queued
+    fpv_telemetry_subscription_publish(subscription, &update, 1);
+    CHECK(readable(fd));
+
+    unsigned int seen = 0;
+    while ( fpv_telemetry_subscription_pop(subscription, &update) ) {
+        CHECK(update.type < TELEMETRY_TYPE_COUNT);
+        CHECK(!(seen & (1u << update.type)));
+        CHECK(update.timestamp == 100u - TELEMETRY_TYPE_COUNT + update.type);
+        seen |= 1u << update.type;
+    }
+    CHECK(seen == (1u << TELEMETRY_TYPE_COUNT) - 1);
+    CHECK(!readable(fd));
+
+    FPVTelemetrySubscriptionStats stats;
+    fpv_telemetry_subscription_get_stats(subscription, &stats);
+    CHECK(stats.published == 100);
+    CHECK(stats.dropped == 100 - TELEMETRY_TYPE_COUNT);
+    fpv_telemetry_subscription_dispose(subscription);
+}
+
+#pragma mark - Producer and consumer threads
+
+#define STREAM_UPDATES 1000000
+
+typedef struct {
+    FPVTelemetrySubscription *subscription;
+    volatile int done;
+    uint64_t received;
+    uint64_t out_of_order;
+    uint64_t duplicates;
+    uint32_t last[TELEMETRY_TYPE_COUNT];
+} ConsumerState;
+
+// Waits on the eventfd like a real subscriber would, draining the queue on each wakeup
+static void * consumer_entry(void *userinfo) {
+    ConsumerState *state = (ConsumerState*)userinfo;
+    struct pollfd pfd = { fpv_telemetry_subscription_get_fd(state->subscription), POLLIN, 0 };
+    FPVTelemetryUpdate update;
+    while ( 1 ) {
+        int finishing = __atomic_load_n(&state->done, __ATOMIC_ACQUIRE);
+        while ( fpv_telemetry_subscription_pop(state->subscription, &update) ) {
+            state->received++;
+            if ( update.timestamp < state->last[update.type] ) state->out_of_order++;
+            if ( update.timestamp == state->last[update.type] ) state->duplicates++;
+            state->last[update.type] = update.timestamp;
+        }
+        if ( finishing ) break;
+        poll(&pfd, 1, 10);
+    }
+    return NULL;
+}
+
+static void run_stream(FPVTelemetryOverflowPolicy policy, int capacity, ConsumerState *state, FPVTelemetrySubscriptionStats *stats) {
+    memset(state, 0, sizeof(*state));
+    state->subscription = fpv_telemetry_subscription_new(capacity, policy);
+    pthread_t consumer;
+    pthread_create(&consumer, NULL, consumer_entry, state);
+
+    FPVTelemetryUpdate update;
+    uint32_t i;
+    for ( i=1; i<=STREAM_UPDATES; i++ ) {
+        make_update(&update, i % TELEMETRY_TYPE_COUNT, i);
+        fpv_telemetry_subscription_publish(state->subscription, &update, 1);
+        if ( (i & 1023) == 0 ) sched_yield();
+    }
+    __atomic_store_n(&state->done, 1, __ATOMIC_RELEASE);
+    pthread_join(consumer, NULL);
+    fpv_telemetry_subscription_get_stats(state->subscription, stats);
+    fpv_telemetry_subscription_dispose(state->subscription);
+}
+
+static void test_streams(void) {
+    ConsumerState state;
+    FPVTelemetrySubscriptionStats stats;
+
+    // Everything is either delivered once, in order, or counted as dropped
+    run_stream(FPV_TELEMETRY_OVERFLOW_DROP_OLDEST, 1024, &state, &stats);
+    printf("Drop-oldest, 1024 slots: %llu of %d delivered, %llu dropped, %llu out of order\n",
+        (unsigned long long)state.received, STREAM_UPDATES, (unsigned long long)stats.dropped, (unsigned long long)state.out_of_order);
+    CHECK(stats.published == STREAM_UPDATES);
+    CHECK(state.received + stats.dropped == STREAM_UPDATES);
+    CHECK(state.out_of_order == 0);
+    CHECK(state.duplicates == 0);
+    CHECK(state.last[STREAM_UPDATES % TELEMETRY_TYPE_COUNT] == STREAM_UPDATES);
+
+    // Coalescing never hands over the same update twice or goes backwards, and the consumer
+    // ends on the latest of each type. An update replaced just as it is popped may be both
+    // delivered and counted as dropped, but none goes missing uncounted.
+    run_stream(FPV_TELEMETRY_OVERFLOW_COALESCE, 0, &state, &stats);
+    printf("Coalescing: %llu of %d delivered, %llu coalesced away, %llu out of order, %llu twice\n",
+        (unsigned long long)state.received, STREAM_UPDATES, (unsigned long long)stats.dropped,
+        (unsigned long long)state.out_of_order, (unsigned long long)state.duplicates);
+    CHECK(stats.published == STREAM_UPDATES);
+    CHECK(state.out_of_order == 0);
+    CHECK(state.duplicates == 0);
+    CHECK(state.received + stats.dropped >= STREAM_UPDATES);
+    int type;
+    for ( type=0; type<TELEMETRY_TYPE_COUNT; type++ ) {
+        CHECK(state.last[type] == STREAM_UPDATES - (STREAM_UPDATES - type) % TELEMETRY_TYPE_COUNT);
+    }
+}
+
+#pragma mark - Subscribing under traffic
+
+#define CHURN_ROUNDS 500
+
+static int port;
+static volatile int sending = 1;
+
+static void * sender_entry(void *userinfo) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    FPVTelemetryFrame frame;
+    uint8_t buffer[TELEMETRY_WIRE_MAX_LENGTH];
+    uint32_t sequence = 0;
+    while ( __atomic_load_n(&sending, __ATOMIC_ACQUIRE) ) {
+        memset(&frame, 0, sizeof(frame));
+        frame.sequence = ++sequence & 0xffff;
+        frame.timestamp = sequence;
+        frame.count = 2;
+        frame.records[0].type = TELEMETRY_TYPE_POWER;
+        frame.records[1].type = TELEMETRY_TYPE_SIGNAL;
+        int length = fpv_telemetry_frame_encode(&frame, buffer, sizeof(buffer));
+        sendto(sock, buffer, length, 0, (struct sockaddr*)&address, sizeof(address));
+        if ( (sequence & 15) == 0 ) usleep(100);
+    }
+    close(sock);
+    return NULL;
+}
+
+static void test_churn(void) {
+    port = 20000 + getpid() % 20000;
+    FPVTelemetryRX *rx = fpv_telemetry_rx_new(NULL, port);
+    CHECK(rx != NULL);
+    if ( !rx || !fpv_telemetry_rx_listener_start(rx) ) {
+        CHECK(0);
+        return;
+    }
+
+    // One subscriber stays for the whole run while others come and go around it
+    FPVTelemetrySubscription *steady = fpv_telemetry_rx_subscribe(rx, 1024, FPV_TELEMETRY_OVERFLOW_DROP_OLDEST);
+    pthread_t sender;
+    pthread_create(&sender, NULL, sender_entry, NULL);
+
+    FPVTelemetrySubscription *churning[4] = { NULL, NULL, NULL, NULL };
+    FPVTelemetryUpdate update;
+    uint64_t steady_received = 0, steady_out_of_order = 0, churn_received = 0;
+    uint32_t last = 0;
+    int round, i;
+    for ( round=0; round<CHURN_ROUNDS; round++ ) {
+        int index = round % 4;
+        if ( churning[index] ) {
+            while ( fpv_telemetry_subscription_pop(churning[index], &update) ) churn_received++;
+            fpv_telemetry_rx_unsubscribe(rx, churning[index]);
+        }
+        churning[index] = fpv_telemetry_rx_subscribe(rx, 16 << index,
+            index & 1 ? FPV_TELEMETRY_OVERFLOW_COALESCE : FPV_TELEMETRY_OVERFLOW_DROP_OLDEST);
+        CHECK(churning[index] != NULL);
+
+        while ( fpv_telemetry_subscription_pop(steady, &update) ) {
+            steady_received++;
+            if ( update.timestamp < last ) steady_out_of_order++;
+            last = update.timestamp;
+        }
+        usleep(200);
+    }
+
+    __atomic_store_n(&sending, 0, __ATOMIC_RELEASE);
+    pthread_join(sender, NULL);
+    for ( i=0; i<4; i++ ) {
+        if ( churning[i] ) fpv_telemetry_rx_unsubscribe(rx, churning[i]);
+    }
+
+    FPVTelemetrySubscriptionStats stats;
+    fpv_telemetry_subscription_get_stats(steady, &stats);
+    printf("%d subscribe/unsubscribe rounds: steady subscriber got %llu of %llu updates, churning ones %llu\n",
+        CHURN_ROUNDS, (unsigned long long)steady_received, (unsigned long long)stats.published, (unsigned long long)churn_received);
+    CHECK(steady_received > 0);
+    CHECK(churn_received > 0);
+    CHECK(steady_out_of_order == 0);
+
+    fpv_telemetry_rx_unsubscribe(rx, steady);
+    fpv_telemetry_rx_listener_stop(rx);
+    fpv_telemetry_rx_dispose(rx);
+}
+
+int main(int argc, char **argv) {
+    test_drop_oldest();
+    test_coalesce();
+    test_streams();
+    test_churn();
+    return test_failures();
+}
@@ -0,0 +1,238 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests for multi-vehicle telemetry: senders on different loopback addresses and vehicle IDs
+// each get their own state, the followed vehicle (and with it the history) can be switched,
+// and vehicles beyond the limit are ignored rather than merged into another's state
+
+#include "telemetry_rx.h"
+#include "telemetry_common.h"
+#include "test_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define SOURCES 3
+#define IDS_PER_SOURCE 8
+
+static int port;
+static int updates;
+static int sockets[SOURCES];
+
+static void update_callback(FPVTelemetryRX * rx, FPVTelemetryUpdate * update, void * context) {
+    __atomic_add_fetch(&updates, 1, __ATOMIC_RELEASE);
+}
+
+// Loopback answers for all of 127/8, so each socket can stand in for a different aircraft
+static int source_socket(int source) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + source);
+    if ( bind(sock, (struct sockaddr*)&address, sizeof(address)) != 0 ) {
+        perror("bind");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static uint32_t source_address(int source) {
+    return htonl(INADDR_LOOPBACK + 1 + source);
+}
+
+// Voltage identifies the vehicle, so a state fed by the wrong sender shows up. It travels in
+// millivolts, up to 65.535 V.
+static double vehicle_voltage(int source, int vehicle_id) {
+    return 1.0 + source * 8.0 + vehicle_id * 0.125;
+}
+
+static void send_from(int source, int vehicle_id, uint16_t sequence) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    FPVTelemetryFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.vehicle_id = vehicle_id;
+    frame.sequence = sequence;
+    frame.count = 1;
+    frame.records[0].type = TELEMETRY_TYPE_POWER;
+    frame.records[0].content.power.voltage = vehicle_voltage(source, vehicle_id);
+    uint8_t buffer[TELEMETRY_WIRE_MAX_LENGTH];
+    int length = fpv_telemetry_frame_encode(&frame, buffer, sizeof(buffer));
+    sendto(sockets[source], buffer, length, 0, (struct sockaddr*)&address, sizeof(address));
+}
+
+static int wait_for_updates(int expected) {
+    int i;
+    for ( i=0; i<200 && __atomic_load_n(&updates, __ATOMIC_ACQUIRE) < expected; i++ ) usleep(5000);
+    return __atomic_load_n(&updates, __ATOMIC_ACQUIRE) >= expected;
+}
+
+#pragma mark -
+
+static void test_separate_states(FPVTelemetryRX *rx) {
+    // The same vehicle IDs from every source, several rounds, interleaved
+    int round, source, id, sent = 0;
+    for ( round=1; round<=5; round++ ) {
+        for ( id=0; id<IDS_PER_SOURCE; id++ ) {
+            for ( source=0; source<SOURCES; source++ ) {
+                send_from(source, id, round * 10 + id);
+                sent++;
+            }
+        }
+    }
+    CHECK(wait_for_updates(sent));
+
+    FPVTelemetryVehicle vehicles[FPV_TELEMETRY_MAX_VEHICLES];
+    int count = fpv_telemetry_rx_get_vehicles(rx, vehicles, FPV_TELEMETRY_MAX_VEHICLES);
+    CHECK(count == SOURCES * IDS_PER_SOURCE);
+    CHECK(fpv_telemetry_rx_get_vehicles(rx, vehicles, 5) == 5);
+
+    count = fpv_telemetry_rx_get_vehicles(rx, vehicles, FPV_TELEMETRY_MAX_VEHICLES);
+    int i, seen[SOURCES][IDS_PER_SOURCE];
+    memset(seen, 0, sizeof(seen));
+    for ( i=0; i<count; i++ ) {
+        for ( source=0; source<SOURCES && vehicles[i].address != source_address(source); source++ );
+        CHECK(source < SOURCES && vehicles[i].vehicle_id < IDS_PER_SOURCE);
+        if ( source == SOURCES || vehicles[i].vehicle_id >= IDS_PER_SOURCE ) continue;
+        seen[source][vehicles[i].vehicle_id]++;
+
+        telemetry_rx_t telemetry;
+        CHECK(fpv_telemetry_rx_get_vehicle(rx, &vehicles[i], &telemetry));
+        CHECK(telemetry.vehicle_id == vehicles[i].vehicle_id);
+        CHECK_NEAR(telemetry.voltage, vehicle_voltage(source, vehicles[i].vehicle_id), 1e-6);
+        CHECK(telemetry.sequence == 50 + vehicles[i].vehicle_id);
+
+        // Each vehicle's link stats only count its own five frames
+        FPVLinkStatsSnapshot stats;
+        CHECK(fpv_telemetry_rx_get_link_stats(rx, &vehicles[i], &stats));
+        CHECK(stats.received == 5);
+    }
+    for ( source=0; source<SOURCES; source++ ) {
+        for ( id=0; id<IDS_PER_SOURCE; id++ ) CHECK(seen[source][id] == 1);
+    }
+
+    FPVTelemetryVehicle unknown = { source_address(SOURCES + 5), 1 };
+    telemetry_rx_t telemetry;
+    CHECK(!fpv_telemetry_rx_get_vehicle(rx, &unknown, &telemetry));
+}
+
+static void test_follow(FPVTelemetryRX *rx) {
+    // The first vehicle heard is followed until told otherwise
+    telemetry_rx_t telemetry = fpv_telemetry_rx_get(rx);
+    CHECK_NEAR(telemetry.voltage, vehicle_voltage(0, 0), 1e-6);
+
+    fpv_telemetry_rx_follow(rx, 3);
+    telemetry = fpv_telemetry_rx_get(rx);
+    CHECK(telemetry.vehicle_id == 3);
+
+    // A vehicle that hasn't been heard yet is picked up as soon as it is
+    fpv_telemetry_rx_follow(rx, 42);
+    telemetry = fpv_telemetry_rx_get(rx);
+    CHECK(telemetry.power_timestamp.received == 0);
+    int expected = updates + 1;
+    send_from(1, 42, 1);
+    CHECK(wait_for_updates(expected));
+    telemetry = fpv_telemetry_rx_get(rx);
+    CHECK(telemetry.vehicle_id == 42);
+    CHECK_NEAR(telemetry.voltage, vehicle_voltage(1, 42), 1e-6);
+
+    // The history started over with the switch, rather than mixing in the first vehicle
+    FPVTelemetryHistoryStats stats;
+    CHECK(fpv_telemetry_history_get_stats(fpv_telemetry_rx_get_history(rx), FPV_TELEMETRY_FIELD_VOLTAGE, 0, UINT64_MAX, &stats) == 1);
+    CHECK_NEAR(stats.min, vehicle_voltage(1, 42), 1e-6);
+
+    // Switching while the vehicle's first packet is in flight may lose the race with the
+    // listener, but its next packet settles it
+    int id;
+    for ( id=60; id<68; id++ ) {
+        send_from(2, id, 1);
+        fpv_telemetry_rx_follow(rx, id);
+        send_from(2, id, 2);
+        expected += 2;
+        CHECK(wait_for_updates(expected));
+        CHECK(fpv_telemetry_rx_get(rx).vehicle_id == id);
+    }
+
+    fpv_telemetry_rx_follow(rx, -1);
+    CHECK(fpv_telemetry_rx_get(rx).power_timestamp.received != 0);
+}
+
+static void test_vehicle_limit(FPVTelemetryRX *rx) {
+    FPVTelemetryVehicle vehicles[FPV_TELEMETRY_MAX_VEHICLES + 16];
+    int known = fpv_telemetry_rx_get_vehicles(rx, vehicles, FPV_TELEMETRY_MAX_VEHICLES + 16);
+
+    // Fill up to the limit and past it from a fresh source; the extra vehicles' packets are dropped
+    int id, expected = updates;
+    for ( id=100; id<100 + FPV_TELEMETRY_MAX_VEHICLES - known + 10; id++ ) {
+        send_from(2, id, 1);
+        if ( id < 100 + FPV_TELEMETRY_MAX_VEHICLES - known ) expected++;
+    }
+    CHECK(wait_for_updates(expected));
+    usleep(50000);
+    CHECK(__atomic_load_n(&updates, __ATOMIC_ACQUIRE) == expected);
+    CHECK(fpv_telemetry_rx_get_vehicles(rx, vehicles, FPV_TELEMETRY_MAX_VEHICLES + 16) == FPV_TELEMETRY_MAX_VEHICLES);
+
+    // Vehicles already known keep updating
+    send_from(0, 0, 99);
+    CHECK(wait_for_updates(expected + 1));
+    FPVTelemetryVehicle first = { source_address(0), 0 };
+    telemetry_rx_t telemetry;
+    CHECK(fpv_telemetry_rx_get_vehicle(rx, &first, &telemetry) && telemetry.sequence == 99);
+    FPVTelemetryVehicle ignored = { source_address(2), 100 + FPV_TELEMETRY_MAX_VEHICLES - known };
+    CHECK(!fpv_telemetry_rx_get_vehicle(rx, &ignored, &telemetry));
+}
+
+int main(int argc, char **argv) {
+    int source;
+    for ( source=0; source<SOURCES; source++ ) {
+        if ( (sockets[source] = source_socket(source)) < 0 ) {
+            CHECK(0);
+            return test_failures();
+        }
+    }
+
+    port = 20000 + getpid() % 20000;
+    FPVTelemetryRX *rx = fpv_telemetry_rx_new(NULL, port);
+    CHECK(rx != NULL);
+    fpv_telemetry_rx_set_callback(rx, update_callback, NULL);
+    CHECK(fpv_telemetry_rx_enable_history(rx, 256));
+    if ( !rx || !fpv_telemetry_rx_listener_start(rx) ) {
+        CHECK(0);
+        return test_failures();
+    }
+    // The listener binds its socket once its thread is running
+    usleep(100000);
+
+    test_separate_states(rx);
+    test_follow(rx);
+    test_vehicle_limit(rx);
+
+    fpv_telemetry_rx_listener_stop(rx);
+    fpv_telemetry_rx_dispose(rx);
+    for ( source=0; source<SOURCES; source++ ) close(sockets[source]);
+    return test_failures();
+}
@@ -0,0 +1,259 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Round-trips telemetry records and frames through the compact wire format, and checks that
+// legacy, truncated and corrupted packets decode to nothing worse than fewer records
+
+#include "telemetry_common.h"
+#include "test_common.h"
+#include <rpc/types.h>
+#include <rpc/xdr.h>
+#include <string.h>
+
+static FPVTelemetryUpdate position(double latitude, double longitude, double altitude, double bearing) {
+    FPVTelemetryUpdate update;
+    memset(&update, 0, sizeof(update));
+    update.type = TELEMETRY_TYPE_POSITION;
+    update.content.position.latitude = latitude;
+    update.content.position.longitude = longitude;
+    update.content.position.altitude = altitude;
+    update.content.position.bearing = bearing;
+    return update;
+}
+
+static FPVTelemetryUpdate power(double voltage, double current) {
+    FPVTelemetryUpdate update;
+    memset(&update, 0, sizeof(update));
+    update.type = TELEMETRY_TYPE_POWER;
+    update.content.power.voltage = voltage;
+    update.content.power.current = current;
+    return update;
+}
+
+static FPVTelemetryUpdate signal_record(double rssi) {
+    FPVTelemetryUpdate update;
+    memset(&update, 0, sizeof(update));
+    update.type = TELEMETRY_TYPE_SIGNAL;
+    update.content.signal.rssi = rssi;
+    return update;
+}
+
+static FPVTelemetryUpdate attitude(double roll, double pitch, double yaw) {
+    FPVTelemetryUpdate update;
+    memset(&update, 0, sizeof(update));
+    update.type = TELEMETRY_TYPE_ATTITUDE;
+    update.content.attitude.roll = roll;
+    update.content.attitude.pitch = pitch;
+    update.content.attitude.yaw = yaw;
+    return update;
+}
+
+static FPVTelemetryUpdate round_trip(FPVTelemetryUpdate update, int expected_length) {
+    uint8_t buffer[TELEMETRY_WIRE_MAX_RECORD_LENGTH];
+    FPVTelemetryUpdate decoded;
+    memset(&decoded, 0, sizeof(decoded));
+    int length = fpv_telemetry_record_encode(&update, buffer);
+    CHECK(length == expected_length);
+    CHECK(fpv_telemetry_record_decode(update.type, buffer, length, &decoded) == 1);
+    CHECK(fpv_telemetry_record_decode(update.type, buffer, length-1, &decoded) == 0);
+    CHECK(decoded.type == update.type);
+    return decoded;
+}
+
+static void test_records(void) {
+    FPVTelemetryUpdate decoded = round_trip(position(51.5074123, -0.1277583, 123.456, 359.994), 14);
+    CHECK_NEAR(decoded.content.position.latitude, 51.5074123, 1e-7);
+    CHECK_NEAR(decoded.content.position.longitude, -0.1277583, 1e-7);
+    CHECK_NEAR(decoded.content.position.altitude, 123.46, 1e-9);
+    CHECK_NEAR(decoded.content.position.bearing, 359.99, 1e-9);
+
+    decoded = round_trip(position(-33.8688, 151.2093, -4.2, -10.0), 14);
+    CHECK_NEAR(decoded.content.position.altitude, -4.2, 1e-9);
+    CHECK_NEAR(decoded.content.position.bearing, 350.0, 1e-9);
+
+    decoded = round_trip(power(16.8, 12.347), 4);
+    CHECK_NEAR(decoded.content.power.voltage, 16.8, 1e-9);
+    CHECK_NEAR(decoded.content.power.current, 12.35, 1e-9);
+
+    // Out of range values clamp rather than wrap
+    decoded = round_trip(power(100.0, -1.0), 4);
+    CHECK_NEAR(decoded.content.power.voltage, 65.535, 1e-9);
+    CHECK_NEAR(decoded.content.power.current, 0.0, 1e-9);
+
+    decoded = round_trip(signal_record(-47.25), 2);
+    CHECK_NEAR(decoded.content.signal.rssi, -47.25, 1e-9);
+
+    decoded = round_trip(attitude(-12.34, 5.67, 270.5), 6);
+    CHECK_NEAR(decoded.content.attitude.roll, -12.34, 1e-9);
+    CHECK_NEAR(decoded.content.attitude.pitch, 5.67, 1e-9);
+    CHECK_NEAR(decoded.content.attitude.yaw, 270.5, 1e-9);
+
+    decoded = round_trip(attitude(200.0, -200.0, -90.0), 6);
+    CHECK_NEAR(decoded.content.attitude.roll, 180.0, 1e-9);
+    CHECK_NEAR(decoded.content.attitude.pitch, -180.0, 1e-9);
+    CHECK_NEAR(decoded.content.attitude.yaw, 270.0, 1e-9);
+
+    uint8_t buffer[TELEMETRY_WIRE_MAX_RECORD_LENGTH];
+    FPVTelemetryUpdate unknown;
+    memset(&unknown, 0, sizeof(unknown));
+    unknown.type = TELEMETRY_TYPE_COUNT;
+    CHECK(fpv_telemetry_record_encode(&unknown, buffer) == 0);
+    CHECK(fpv_telemetry_record_decode(TELEMETRY_TYPE_COUNT, buffer, sizeof(buffer), &unknown) == 0);
+}
+
+static void make_frame(FPVTelemetryFrame *frame, uint8_t vehicle_id) {
+    memset(frame, 0, sizeof(*frame));
+    frame->flags = TELEMETRY_FRAME_FLAG_KEYFRAME | TELEMETRY_FRAME_FLAG_UNSEQUENCED;
+    frame->vehicle_id = vehicle_id;
+    frame->sequence = 0xBEEF;
+    frame->timestamp = 0xDEADBEEF;
+    frame->records[frame->count++] = position(47.3769, 8.5417, 408.0, 90.0);
+    frame->records[frame->count++] = power(11.1, 3.2);
+    frame->records[frame->count++] = signal_record(-60.0);
+    frame->records[frame->count++] = attitude(1.0, -2.0, 3.0);
+}
+
+static void test_frames(void) {
+    static const int record_bytes = (2+14) + (2+4) + (2+2) + (2+6);
+    uint8_t buffer[TELEMETRY_WIRE_MAX_LENGTH];
+    FPVTelemetryFrame frame, decoded;
+
+    // Vehicle 0 sends version 2, others version 3 with the vehicle ID
+    uint8_t vehicle_id;
+    for ( vehicle_id=0; vehicle_id<2; vehicle_id++ ) {
+        make_frame(&frame, vehicle_id * 7);
+        int length = fpv_telemetry_frame_encode(&frame, buffer, sizeof(buffer));
+        CHECK(length == (vehicle_id ? 10 : 9) + record_bytes);
+        CHECK(buffer[0] == TELEMETRY_WIRE_MAGIC);
+        CHECK(buffer[1] == (vehicle_id ? TELEMETRY_WIRE_VERSION_VEHICLE_FRAME : TELEMETRY_WIRE_VERSION_FRAME));
+
+        CHECK(fpv_telemetry_frame_decode(buffer, length, &decoded) == 4);
+        CHECK(decoded.flags == TELEMETRY_FRAME_FLAG_KEYFRAME);
+        CHECK(decoded.vehicle_id == vehicle_id * 7);
+        CHECK(decoded.sequence == 0xBEEF);
+        CHECK(decoded.timestamp == 0xDEADBEEF);
+        int i;
+        for ( i=0; i<decoded.count; i++ ) {
+            CHECK(decoded.records[i].type == frame.records[i].type);
+            CHECK(decoded.records[i].timestamp == 0xDEADBEEF);
+            CHECK(decoded.records[i].vehicle_id == vehicle_id * 7);
+        }
+        CHECK_NEAR(decoded.records[0].content.position.latitude, 47.3769, 1e-7);
+        CHECK_NEAR(decoded.records[1].content.power.voltage, 11.1, 1e-9);
+        CHECK_NEAR(decoded.records[2].content.signal.rssi, -60.0, 1e-9);
+        CHECK_NEAR(decoded.records[3].content.attitude.yaw, 3.0, 1e-9);
+    }
+
+    // Encoding needs room for the largest frame
+    CHECK(fpv_telemetry_frame_encode(&frame, buffer, TELEMETRY_WIRE_MAX_LENGTH-1) == 0);
+}
+
+static void test_legacy_record(void) {
+    uint8_t buffer[3 + TELEMETRY_WIRE_MAX_RECORD_LENGTH];
+    FPVTelemetryUpdate update = power(12.6, 1.5);
+    buffer[0] = TELEMETRY_WIRE_MAGIC;
+    buffer[1] = TELEMETRY_WIRE_VERSION_RECORD;
+    buffer[2] = update.type;
+    int length = 3 + fpv_telemetry_record_encode(&update, buffer + 3);
+
+    FPVTelemetryFrame frame;
+    CHECK(fpv_telemetry_frame_decode(buffer, length, &frame) == 1);
+    CHECK(frame.flags == TELEMETRY_FRAME_FLAG_UNSEQUENCED);
+    CHECK(frame.vehicle_id == 0);
+    CHECK_NEAR(frame.records[0].content.power.voltage, 12.6, 1e-9);
+    CHECK(fpv_telemetry_frame_decode(buffer, length-1, &frame) == 0);
+}
+
+static void test_xdr_record(void) {
+    // Senders that predate the compact format; the magic byte can never start one of these
+    char buffer[64];
+    XDR xdrs;
+    FPVTelemetryUpdate update = position(1.5, -2.5, 30.0, 45.0), decoded;
+    xdrmem_create(&xdrs, buffer, sizeof(buffer), XDR_ENCODE);
+    CHECK(xdr_telemetry_update(&xdrs, &update));
+    int length = xdr_getpos(&xdrs);
+    xdr_destroy(&xdrs);
+    CHECK(length == 36);
+    CHECK((uint8_t)buffer[0] != TELEMETRY_WIRE_MAGIC);
+
+    FPVTelemetryFrame frame;
+    CHECK(fpv_telemetry_frame_decode((uint8_t*)buffer, length, &frame) == 0);
+
+    memset(&decoded, 0, sizeof(decoded));
+    xdrmem_create(&xdrs, buffer, length, XDR_DECODE);
+    CHECK(xdr_telemetry_update(&xdrs, &decoded));
+    xdr_destroy(&xdrs);
+    CHECK(decoded.type == TELEMETRY_TYPE_POSITION);
+    CHECK(decoded.content.position.longitude == -2.5);
+}
+
+static void test_truncated_and_corrupted(void) {
+    uint8_t buffer[TELEMETRY_WIRE_MAX_LENGTH];
+    FPVTelemetryFrame frame, decoded;
+    make_frame(&frame, 3);
+    int length = fpv_telemetry_frame_encode(&frame, buffer, sizeof(buffer));
+
+    // Every truncation decodes only the records that fit entirely
+    static const int record_ends[] = { 10 + 16, 10 + 16 + 6, 10 + 16 + 6 + 4, 10 + 16 + 6 + 4 + 8 };
+    int truncated;
+    for ( truncated=0; truncated<length; truncated++ ) {
+        int expected = 0;
+        while ( expected < 4 && record_ends[expected] <= truncated ) expected++;
+        CHECK(fpv_telemetry_frame_decode(buffer, truncated, &decoded) == expected);
+    }
+
+    uint8_t corrupted[TELEMETRY_WIRE_MAX_LENGTH];
+    memcpy(corrupted, buffer, length);
+    corrupted[0] = 0;
+    CHECK(fpv_telemetry_frame_decode(corrupted, length, &decoded) == 0);
+
+    memcpy(corrupted, buffer, length);
+    corrupted[1] = 9;
+    CHECK(fpv_telemetry_frame_decode(corrupted, length, &decoded) == 0);
+
+    // An unknown record type is skipped; the rest still decode
+    memcpy(corrupted, buffer, length);
+    corrupted[10] = 0x7f;
+    CHECK(fpv_telemetry_frame_decode(corrupted, length, &decoded) == 3);
+    CHECK(decoded.records[0].type == TELEMETRY_TYPE_POWER);
+
+    // A record length running past the end stops decoding there
+    memcpy(corrupted, buffer, length);
+    corrupted[11] = 0xff;
+    CHECK(fpv_telemetry_frame_decode(corrupted, length, &decoded) == 0);
+
+    // Random bytes after a valid header never decode more records than fit, or crash
+    uint32_t seed = 0x2545F491;
+    int round;
+    for ( round=0; round<10000; round++ ) {
+        int random_length = 10 + test_random(&seed) % (sizeof(corrupted) - 10);
+        int i;
+        for ( i=10; i<random_length; i++ ) corrupted[i] = test_random(&seed);
+        int count = fpv_telemetry_frame_decode(corrupted, random_length, &decoded);
+        CHECK(count >= 0 && count <= TELEMETRY_FRAME_MAX_RECORDS);
+    }
+}
+
+int main(int argc, char **argv) {
+    test_records();
+    test_frames();
+    test_legacy_record();
+    test_xdr_record();
+    test_truncated_and_corrupted();
+    return test_failures();
+}
@@ -0,0 +1,66 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TEST_COMMON_H
+#define __TEST_COMMON_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+// Shared by the check programs: each CHECK that fails is reported and counted, and the
+// program exits with test_failures() so the test harness sees the result
+
+static int test_failure_count = 0;
+
+#define CHECK(condition) do { \
+        if ( !(condition) ) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            test_failure_count++; \
+        } \
+    } while (0)
+
+#define CHECK_NEAR(value, expected, tolerance) do { \
+        double _value = (value), _expected = (expected); \
+        if ( _value < _expected - (tolerance) || _value > _expected + (tolerance) ) { \
+            fprintf(stderr, "%s:%d: check failed: %s is %g, expected %g\n", __FILE__, __LINE__, #value, _value, _expected); \
+            test_failure_count++; \
+        } \
+    } while (0)
+
+static inline int test_failures(void) {
+    if ( test_failure_count ) fprintf(stderr, "%d checks failed\n", test_failure_count);
+    return test_failure_count ? 1 : 0;
+}
+
+// Monotonic microseconds, for the benchmarks
+static inline uint64_t test_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Deterministic pseudo-random numbers, so a failing run can be repeated
+static inline uint32_t test_random(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+#endif
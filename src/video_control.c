@@ -0,0 +1,496 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "video_control.h"
+#include "video_encoder.h"
+#include "telemetry_common.h"
+#include <glib-unix.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define VIDEO_CONTROL_MAX_COMMAND 128
+
+static const uint64_t KEYFRAME_REQUEST_HOLDOFF = 100000;   // Microseconds a forced keyframe answers any further requests for
+
+struct _FPVVideoControl {
+    GstElement *encoder;
+    GstElement *capsfilter;     // NULL if the source's size and rate are fixed
+    GstPad *pad;                // The encoder's source pad
+    gulong probe;
+    FPVRTPSender *sender;
+    FPVAdaptiveBitrate *adaptive;
+    const char *bitrate_property;
+    int bitrate_scale;
+    const char *keyframe_property;
+    FPVVideoSettings settings;
+    int sock;
+    guint watch;
+    char *socket_path;
+
+    // Keyframe requests, when taken; main loop only
+    FPVFeedbackServer *server;
+    uint64_t last_requested_keyframe;
+    uint64_t keyframe_requests;
+    uint64_t keyframes_requested;
+
+    // Shared with the streaming thread
+    GMutex lock;
+    uint64_t awaiting_since;    // When the change now waiting on a keyframe was asked for, 0 if none
+    int awaiting_caps;          // It renegotiates, so only a keyframe after the new caps counts
+    int awaiting_startup;
+    uint64_t startup_blackout;
+    uint64_t blackouts;
+    uint64_t blackout_total;
+    uint64_t blackout_max;
+    gint keyframe_interval;     // Atomic: the one wanted, and the encoder's own (0 if unknown)
+    gint encoder_interval;
+
+    // Streaming thread only
+    int frames_since_keyframe;
+    int forced_at;              // frames_since_keyframe when a keyframe was forced, -1 if none since the last
+};
+
+#pragma mark - Forward declarations
+
+static GstElement * fpv_video_control_find_capsfilter(GstPipeline * pipeline);
+static int fpv_video_control_renegotiate(FPVVideoControl * control, const FPVVideoSettings * settings, char * error, size_t error_length);
+static void fpv_video_control_set_bitrate(FPVVideoControl * control, int bitrate);
+static void fpv_video_control_set_keyframe_interval(FPVVideoControl * control, int interval);
+static void fpv_video_control_await_keyframe(FPVVideoControl * control, int caps, int startup);
+static void fpv_video_control_command(FPVVideoControl * control, const char * command, char * reply, size_t reply_length);
+static GstPadProbeReturn on_encoder_data(GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static void on_keyframe(FPVVideoControl * control);
+static gboolean on_command(gint fd, GIOCondition condition, gpointer user_data);
+static void on_keyframe_request(const FPVLinkFeedback * feedback, int sender, uint64_t received, void * userinfo);
+
+#pragma mark -
+
+FPVVideoControl * fpv_video_control_new(GstPipeline * pipeline, FPVRTPSender * sender, FPVAdaptiveBitrate * adaptive,
+                                        const FPVVideoSettings * settings) {
+    GstElement *encoder = fpv_video_encoder_find(pipeline);
+    GstPad *pad = encoder ? gst_element_get_static_pad(encoder, "src") : NULL;
+    if ( !pad ) {
+        fprintf(stderr, "No encoder in the video pipeline\n");
+        if ( encoder ) gst_object_unref(encoder);
+        return NULL;
+    }
+
+    FPVVideoControl *control = (FPVVideoControl*)calloc(1, sizeof(FPVVideoControl));
+    control->encoder = encoder;
+    control->pad = pad;
+    control->capsfilter = fpv_video_control_find_capsfilter(pipeline);
+    control->sender = sender;
+    control->adaptive = adaptive;
+    control->bitrate_property = fpv_video_encoder_bitrate_property(encoder, &control->bitrate_scale);
+    control->keyframe_property = fpv_video_encoder_keyframe_property(encoder);
+    control->settings = *settings;
+    control->sock = -1;
+    control->forced_at = -1;
+    g_mutex_init(&control->lock);
+
+    if ( !control->capsfilter ) {
+        fprintf(stderr, "No raw video capsfilter in the video pipeline; resolution and framerate are fixed\n");
+    }
+
+    // The pipeline description gives the encoder bits per second whatever its units; set it
+    // properly, unless adaptive bitrate already has
+    if ( !adaptive && control->bitrate_property ) {
+        fpv_video_encoder_set_integer(encoder, control->bitrate_property, settings->bitrate / control->bitrate_scale);
+    }
+
+    // Still stopped, so the encoder takes any keyframe interval
+    g_atomic_int_set(&control->keyframe_interval, settings->keyframe_interval);
+    if ( settings->keyframe_interval > 0 && control->keyframe_property
+            && fpv_video_encoder_set_integer(encoder, control->keyframe_property, settings->keyframe_interval) ) {
+        g_atomic_int_set(&control->encoder_interval, settings->keyframe_interval);
+    }
+
+    fpv_video_control_await_keyframe(control, 1, 1);
+    control->probe = gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                                       on_encoder_data, control, NULL);
+    return control;
+}
+
+void fpv_video_control_dispose(FPVVideoControl * control) {
+    if ( control->sock != -1 ) fpv_video_control_stop(control);
+    if ( control->server ) fpv_video_control_stop_keyframe_requests(control);
+    gst_pad_remove_probe(control->pad, control->probe);
+    gst_object_unref(control->pad);
+    gst_object_unref(control->encoder);
+    if ( control->capsfilter ) gst_object_unref(control->capsfilter);
+
+    printf("Video control: first keyframe %.1f ms after startup", control->startup_blackout / 1000.0);
+    if ( control->blackouts ) {
+        printf("; %llu changes waited on a keyframe, %.1f ms mean, %.1f ms worst",
+            (unsigned long long)control->blackouts, control->blackout_total / 1000.0 / control->blackouts,
+            control->blackout_max / 1000.0);
+    }
+    printf("\n");
+
+    g_mutex_clear(&control->lock);
+    free(control);
+}
+
+int fpv_video_control_set_intra_refresh(FPVVideoControl * control, int enabled) {
+    return fpv_video_encoder_set_intra_refresh(control->encoder, enabled);
+}
+
+int fpv_video_control_apply(FPVVideoControl * control, const FPVVideoSettings * settings, char * error, size_t error_length) {
+    if ( settings->width <= 0 || settings->height <= 0 || settings->framerate <= 0 || settings->bitrate <= 0
+            || settings->keyframe_interval < 0 ) {
+        snprintf(error, error_length, "settings out of range");
+        return 0;
+    }
+
+    if ( settings->width != control->settings.width || settings->height != control->settings.height
+            || settings->framerate != control->settings.framerate ) {
+        if ( !fpv_video_control_renegotiate(control, settings, error, error_length) ) return 0;
+    }
+    if ( settings->bitrate != control->settings.bitrate ) {
+        fpv_video_control_set_bitrate(control, settings->bitrate);
+    }
+    if ( settings->keyframe_interval != control->settings.keyframe_interval ) {
+        fpv_video_control_set_keyframe_interval(control, settings->keyframe_interval);
+    }
+
+    if ( memcmp(settings, &control->settings, sizeof(*settings)) != 0 ) {
+        printf("Video now %dx%d at %d fps, %d bps, keyframe interval %d\n", settings->width, settings->height,
+            settings->framerate, settings->bitrate, settings->keyframe_interval);
+    }
+    control->settings = *settings;
+    return 1;
+}
+
+void fpv_video_control_get_settings(FPVVideoControl * control, FPVVideoSettings * settings) {
+    *settings = control->settings;
+}
+
+void fpv_video_control_force_keyframe(FPVVideoControl * control) {
+    fpv_video_control_await_keyframe(control, 0, 0);
+    fpv_video_encoder_force_keyframe(control->encoder);
+}
+
+int fpv_video_control_start(FPVVideoControl * control, const char * socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if ( strlen(socket_path) >= sizeof(addr.sun_path) ) {
+        fprintf(stderr, "Control socket path %s is too long\n", socket_path);
+        return 0;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( sock == -1 ) {
+        perror("socket");
+        return 0;
+    }
+
+    // A previous run's socket would be left behind if it didn't exit cleanly
+    unlink(socket_path);
+    if ( bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 ) {
+        fprintf(stderr, "Couldn't bind control socket %s: %s\n", socket_path, strerror(errno));
+        close(sock);
+        return 0;
+    }
+
+    control->sock = sock;
+    control->socket_path = strdup(socket_path);
+    control->watch = g_unix_fd_add(sock, G_IO_IN, on_command, control);
+
+    printf("Listening for video control commands on %s\n", socket_path);
+    return 1;
+}
+
+void fpv_video_control_stop(FPVVideoControl * control) {
+    if ( control->sock == -1 ) return;
+
+    g_source_remove(control->watch);
+    close(control->sock);
+    control->sock = -1;
+    unlink(control->socket_path);
+    free(control->socket_path);
+    control->socket_path = NULL;
+}
+
+void fpv_video_control_start_keyframe_requests(FPVVideoControl * control, FPVFeedbackServer * server) {
+    control->server = server;
+    fpv_feedback_server_set_handler(server, LINK_FEEDBACK_TYPE_KEYFRAME_REQUEST, on_keyframe_request, control);
+
+    printf("Forcing keyframes when the ground station asks\n");
+}
+
+void fpv_video_control_stop_keyframe_requests(FPVVideoControl * control) {
+    if ( !control->server ) return;
+
+    fpv_feedback_server_set_handler(control->server, LINK_FEEDBACK_TYPE_KEYFRAME_REQUEST, NULL, NULL);
+    control->server = NULL;
+
+    printf("Keyframe requests: %llu received, %llu keyframes forced\n",
+        (unsigned long long)control->keyframe_requests, (unsigned long long)control->keyframes_requested);
+}
+
+static GstElement * fpv_video_control_find_capsfilter(GstPipeline * pipeline) {
+    GstIterator *iterator = gst_bin_iterate_recurse(GST_BIN(pipeline));
+    GValue item = G_VALUE_INIT;
+    GstElement *capsfilter = NULL;
+    gboolean done = FALSE;
+
+    while ( !done ) {
+        switch ( gst_iterator_next(iterator, &item) ) {
+            case GST_ITERATOR_OK: {
+                GstElement *element = GST_ELEMENT(g_value_get_object(&item));
+                GstElementFactory *factory = gst_element_get_factory(element);
+                if ( factory && strcmp(gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory)), "capsfilter") == 0 ) {
+                    // The one that sets the source's size, as "video/x-raw, width=%d, ..." does
+                    GstCaps *caps = NULL;
+                    g_object_get(element, "caps", &caps, NULL);
+                    GstStructure *structure = caps && gst_caps_get_size(caps) > 0 ? gst_caps_get_structure(caps, 0) : NULL;
+                    if ( structure && gst_structure_has_name(structure, "video/x-raw") && gst_structure_has_field(structure, "width") ) {
+                        capsfilter = gst_object_ref(element);
+                        done = TRUE;
+                    }
+                    if ( caps ) gst_caps_unref(caps);
+                }
+                g_value_reset(&item);
+                break;
+            }
+            case GST_ITERATOR_RESYNC:
+                gst_iterator_resync(iterator);
+                break;
+            default:
+                done = TRUE;
+                break;
+        }
+    }
+
+    g_value_unset(&item);
+    gst_iterator_free(iterator);
+    return capsfilter;
+}
+
+static int fpv_video_control_renegotiate(FPVVideoControl * control, const FPVVideoSettings * settings, char * error, size_t error_length) {
+    if ( !control->capsfilter ) {
+        snprintf(error, error_length, "no raw video capsfilter to change");
+        return 0;
+    }
+
+    GstCaps *caps = NULL;
+    g_object_get(control->capsfilter, "caps", &caps, NULL);
+    caps = gst_caps_make_writable(caps);
+    guint i;
+    for ( i=0; i<gst_caps_get_size(caps); i++ ) {
+        gst_structure_set(gst_caps_get_structure(caps, i), "width", G_TYPE_INT, settings->width, "height", G_TYPE_INT, settings->height,
+                          "framerate", GST_TYPE_FRACTION, settings->framerate, 1, NULL);
+    }
+
+    // Ask first: caps the source can't produce would stop the pipeline, not-negotiated
+    GstPad *sink = gst_element_get_static_pad(control->capsfilter, "sink");
+    GstCaps *possible = gst_pad_peer_query_caps(sink, caps);
+    int supported = !gst_caps_is_empty(possible);
+    gst_caps_unref(possible);
+    gst_object_unref(sink);
+    if ( !supported ) {
+        snprintf(error, error_length, "source can't produce %dx%d at %d fps", settings->width, settings->height, settings->framerate);
+        gst_caps_unref(caps);
+        return 0;
+    }
+
+    // The capsfilter asks upstream to reconfigure; the encoder restarts its stream with a
+    // keyframe once the new caps reach it
+    fpv_video_control_await_keyframe(control, 1, 0);
+    g_object_set(control->capsfilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    return 1;
+}
+
+static void fpv_video_control_set_bitrate(FPVVideoControl * control, int bitrate) {
+    if ( control->adaptive ) {
+        fpv_adaptive_bitrate_set_max_bitrate(control->adaptive, bitrate);
+    } else if ( control->bitrate_property ) {
+        fpv_video_encoder_set_integer(control->encoder, control->bitrate_property, bitrate / control->bitrate_scale);
+    }
+}
+
+static void fpv_video_control_set_keyframe_interval(FPVVideoControl * control, int interval) {
+    g_atomic_int_set(&control->keyframe_interval, interval);
+    if ( interval > 0 && control->keyframe_property && fpv_video_encoder_is_mutable(control->encoder, control->keyframe_property)
+            && fpv_video_encoder_set_integer(control->encoder, control->keyframe_property, interval) ) {
+        g_atomic_int_set(&control->encoder_interval, interval);
+    }
+}
+
+static void fpv_video_control_await_keyframe(FPVVideoControl * control, int caps, int startup) {
+    g_mutex_lock(&control->lock);
+    control->awaiting_since = fpv_telemetry_now();
+    control->awaiting_caps = caps;
+    control->awaiting_startup = startup;
+    g_mutex_unlock(&control->lock);
+}
+
+static void fpv_video_control_command(FPVVideoControl * control, const char * command, char * reply, size_t reply_length) {
+    FPVVideoSettings settings = control->settings;
+    char error[128];
+    int a, b;
+
+    if ( sscanf(command, "bitrate %d", &a) == 1 ) {
+        settings.bitrate = a;
+    } else if ( sscanf(command, "keyframe-interval %d", &a) == 1 ) {
+        settings.keyframe_interval = a;
+    } else if ( sscanf(command, "resolution %dx%d", &a, &b) == 2 ) {
+        settings.width = a;
+        settings.height = b;
+    } else if ( sscanf(command, "framerate %d", &a) == 1 ) {
+        settings.framerate = a;
+    } else if ( strcmp(command, "keyframe") == 0 ) {
+        fpv_video_control_force_keyframe(control);
+        snprintf(reply, reply_length, "ok");
+        return;
+    } else if ( strcmp(command, "status") == 0 ) {
+        snprintf(reply, reply_length, "%dx%d at %d fps, %d bps, keyframe interval %d", settings.width, settings.height,
+            settings.framerate, settings.bitrate, settings.keyframe_interval);
+        return;
+    } else {
+        snprintf(reply, reply_length, "error: unknown command");
+        return;
+    }
+
+    if ( fpv_video_control_apply(control, &settings, error, sizeof(error)) ) {
+        snprintf(reply, reply_length, "ok");
+    } else {
+        snprintf(reply, reply_length, "error: %s", error);
+    }
+}
+
+static GstPadProbeReturn on_encoder_data(GstPad * pad, GstPadProbeInfo * info, gpointer user_data) {
+    FPVVideoControl *control = (FPVVideoControl*)user_data;
+
+    if ( info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM ) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if ( GST_EVENT_TYPE(event) == GST_EVENT_CAPS ) {
+            GstCaps *caps;
+            gst_event_parse_caps(event, &caps);
+
+            // No queue after the encoder, so this is the sender's thread too
+            int numerator, denominator;
+            if ( gst_structure_get_fraction(gst_caps_get_structure(caps, 0), "framerate", &numerator, &denominator) && denominator > 0 ) {
+                fpv_rtp_sender_set_framerate(control->sender, numerator / denominator);
+            }
+
+            g_mutex_lock(&control->lock);
+            control->awaiting_caps = 0;
+            g_mutex_unlock(&control->lock);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    // Parameter sets on their own aren't a frame
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if ( GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER) ) return GST_PAD_PROBE_OK;
+
+    if ( !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT) ) {
+        control->frames_since_keyframe = 0;
+        control->forced_at = -1;
+        on_keyframe(control);
+        return GST_PAD_PROBE_OK;
+    }
+
+    // Keep a keyframe interval shorter than the encoder's own by forcing them, once per
+    // interval, as the encoder may take a few frames to act on it
+    control->frames_since_keyframe++;
+    int interval = g_atomic_int_get(&control->keyframe_interval);
+    int encoder_interval = g_atomic_int_get(&control->encoder_interval);
+    if ( interval > 0 && (encoder_interval <= 0 || interval < encoder_interval)
+            && control->frames_since_keyframe + 1 >= interval
+            && (control->forced_at < 0 || control->frames_since_keyframe - control->forced_at >= interval) ) {
+        fpv_video_encoder_force_keyframe(control->encoder);
+        control->forced_at = control->frames_since_keyframe;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static void on_keyframe(FPVVideoControl * control) {
+    uint64_t now = fpv_telemetry_now();
+    uint64_t blackout = 0;
+    int startup = 0;
+
+    g_mutex_lock(&control->lock);
+    if ( control->awaiting_since && !control->awaiting_caps ) {
+        blackout = now - control->awaiting_since;
+        startup = control->awaiting_startup;
+        if ( startup ) {
+            control->startup_blackout = blackout;
+        } else {
+            control->blackouts++;
+            control->blackout_total += blackout;
+            if ( blackout > control->blackout_max ) control->blackout_max = blackout;
+        }
+        control->awaiting_since = 0;
+    }
+    g_mutex_unlock(&control->lock);
+
+    if ( blackout ) printf("First keyframe %.1f ms after %s\n", blackout / 1000.0, startup ? "startup" : "the change");
+}
+
+static gboolean on_command(gint fd, GIOCondition condition, gpointer user_data) {
+    FPVVideoControl *control = (FPVVideoControl*)user_data;
+
+    char command[VIDEO_CONTROL_MAX_COMMAND];
+    struct sockaddr_un addr;
+    socklen_t addr_length = sizeof(addr);
+    ssize_t length;
+    while ( (length = recvfrom(fd, command, sizeof(command)-1, 0, (struct sockaddr*)&addr, &addr_length)) >= 0 ) {
+        command[length] = '\0';
+        while ( length > 0 && (command[length-1] == '\n' || command[length-1] == '\r' || command[length-1] == ' ') ) {
+            command[--length] = '\0';
+        }
+
+        char reply[VIDEO_CONTROL_MAX_COMMAND];
+        fpv_video_control_command(control, command, reply, sizeof(reply));
+
+        // Unbound senders have no address to answer
+        if ( addr_length > offsetof(struct sockaddr_un, sun_path) ) {
+            sendto(fd, reply, strlen(reply), 0, (struct sockaddr*)&addr, addr_length);
+        }
+        addr_length = sizeof(addr);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void on_keyframe_request(const FPVLinkFeedback * feedback, int sender, uint64_t received, void * userinfo) {
+    FPVVideoControl *control = (FPVVideoControl*)userinfo;
+    control->keyframe_requests++;
+
+    // The ground station repeats its request until a keyframe arrives, and loses more
+    // frames meanwhile; only a request that has had time to see the last one is new
+    if ( control->last_requested_keyframe && received - control->last_requested_keyframe < KEYFRAME_REQUEST_HOLDOFF ) return;
+    control->last_requested_keyframe = received;
+    control->keyframes_requested++;
+
+    if ( feedback->content.keyframe_request.attempt == 0 ) {
+        printf("Ground station lost %u packets; forcing a keyframe\n", feedback->content.keyframe_request.lost);
+    }
+    fpv_video_encoder_force_keyframe(control->encoder);
+}
@@ -0,0 +1,94 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VIDEO_CONTROL_H
+#define __VIDEO_CONTROL_H
+
+#include <gst/gst.h>
+#include <stddef.h>
+#include "rtp_sender.h"
+#include "adaptive_bitrate.h"
+#include "feedback_server.h"
+
+/*
+ * Changes the running video pipeline's settings in place. Bitrate and keyframe interval
+ * go straight to the encoder (see video_encoder.h). Resolution and framerate go into the
+ * source's raw video capsfilter, and the source, encoder and payloader renegotiate while
+ * the payloader and RTP sender carry on, so the ground station sees the same RTP session
+ * and only waits for the encoder's first keyframe at the new size. That wait, from the
+ * request to the keyframe leaving the encoder, is logged as the blackout; so is the wait
+ * for the first keyframe at startup, for comparison with a restart. The startup figure
+ * leaves out process start, gst_init and pipeline parsing, so it understates what a
+ * restart costs; these are measurements to take on a target, not a result.
+ *
+ * Encoders that only take a new keyframe interval at negotiation (omxh264enc) keep their
+ * old one until then; a shorter one is kept meanwhile by forcing keyframes.
+ *
+ * Keyframes are also forced when a ground station asks for one over the feedback
+ * channel, having lost video its decoder needed, so it recovers in a round trip rather
+ * than at the next periodic keyframe. Requests that arrive while one forced for an
+ * earlier request is still on its way are taken as repeats and ignored.
+ *
+ * Commands arrive one per datagram on a local socket, and are answered to the sender's
+ * address if it has one:
+ *
+ *   bitrate <bits per second>      ceiling, when adapting bitrate
+ *   keyframe-interval <frames>
+ *   resolution <width>x<height>
+ *   framerate <frames per second>
+ *   keyframe                       force one now
+ *   status
+ *
+ * Runs on the default main context.
+ */
+
+typedef struct {
+    int width;
+    int height;
+    int framerate;
+    int bitrate;            // Bits per second
+    int keyframe_interval;  // Frames; 0 leaves the encoder's own
+} FPVVideoSettings;
+
+typedef struct _FPVVideoControl FPVVideoControl;
+
+// Before the pipeline starts, with the settings it was built with; returns NULL if it
+// has no encoder or no raw video capsfilter. adaptive may be NULL
+FPVVideoControl * fpv_video_control_new(GstPipeline * pipeline, FPVRTPSender * sender, FPVAdaptiveBitrate * adaptive,
+                                        const FPVVideoSettings * settings);
+
+// Before the pipeline starts; see video_encoder.h. Returns 0 if the encoder can't
+int fpv_video_control_set_intra_refresh(FPVVideoControl * control, int enabled);
+
+// Only once the pipeline has stopped; logs the blackouts
+void fpv_video_control_dispose(FPVVideoControl * control);
+
+// Applies whatever differs from the current settings. Returns 0, with why in error, if
+// the source can't produce the new size or rate; nothing is changed then
+int fpv_video_control_apply(FPVVideoControl * control, const FPVVideoSettings * settings, char * error, size_t error_length);
+void fpv_video_control_get_settings(FPVVideoControl * control, FPVVideoSettings * settings);
+void fpv_video_control_force_keyframe(FPVVideoControl * control);
+
+int fpv_video_control_start(FPVVideoControl * control, const char * socket_path);
+void fpv_video_control_stop(FPVVideoControl * control);
+
+// Takes keyframe requests from the feedback server until stopped; they're logged on stopping
+void fpv_video_control_start_keyframe_requests(FPVVideoControl * control, FPVFeedbackServer * server);
+void fpv_video_control_stop_keyframe_requests(FPVVideoControl * control);
+
+#endif
@@ -0,0 +1,119 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "video_encoder.h"
+#include <gst/video/video.h>
+#include <string.h>
+#include <stdio.h>
+
+GstElement * fpv_video_encoder_find(GstPipeline * pipeline) {
+    GstIterator *iterator = gst_bin_iterate_recurse(GST_BIN(pipeline));
+    GValue item = G_VALUE_INIT;
+    GstElement *encoder = NULL;
+    gboolean done = FALSE;
+
+    while ( !done ) {
+        switch ( gst_iterator_next(iterator, &item) ) {
+            case GST_ITERATOR_OK: {
+                GstElement *element = GST_ELEMENT(g_value_get_object(&item));
+                const char *klass = gst_element_class_get_metadata(GST_ELEMENT_GET_CLASS(element), GST_ELEMENT_METADATA_KLASS);
+                if ( klass && strstr(klass, "Encoder") ) {
+                    encoder = gst_object_ref(element);
+                    done = TRUE;
+                }
+                g_value_reset(&item);
+                break;
+            }
+            case GST_ITERATOR_RESYNC:
+                gst_iterator_resync(iterator);
+                break;
+            default:
+                done = TRUE;
+                break;
+        }
+    }
+
+    g_value_unset(&item);
+    gst_iterator_free(iterator);
+    return encoder;
+}
+
+const char * fpv_video_encoder_bitrate_property(GstElement * encoder, int * scale) {
+    GObjectClass *object_class = G_OBJECT_GET_CLASS(encoder);
+    if ( g_object_class_find_property(object_class, "target-bitrate") ) {
+        *scale = 1;
+        return "target-bitrate";
+    }
+    if ( g_object_class_find_property(object_class, "bitrate") ) {
+        *scale = 1000;
+        return "bitrate";
+    }
+    return NULL;
+}
+
+const char * fpv_video_encoder_keyframe_property(GstElement * encoder) {
+    GObjectClass *object_class = G_OBJECT_GET_CLASS(encoder);
+    if ( g_object_class_find_property(object_class, "interval-intraframes") ) return "interval-intraframes";
+    if ( g_object_class_find_property(object_class, "key-int-max") ) return "key-int-max";
+    return NULL;
+}
+
+int fpv_video_encoder_set_intra_refresh(GstElement * encoder, int enabled) {
+    GParamSpec *spec = g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), "intra-refresh");
+    if ( !spec || spec->value_type != G_TYPE_BOOLEAN ) return 0;
+    g_object_set(encoder, "intra-refresh", enabled ? TRUE : FALSE, NULL);
+    return 1;
+}
+
+int fpv_video_encoder_is_mutable(GstElement * encoder, const char * property) {
+    GParamSpec *spec = g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), property);
+    return spec && (spec->flags & GST_PARAM_MUTABLE_PLAYING);
+}
+
+int fpv_video_encoder_set_integer(GstElement * encoder, const char * property, int64_t value) {
+    GParamSpec *spec = g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), property);
+    if ( !spec ) return 0;
+
+    GValue gvalue = G_VALUE_INIT;
+    g_value_init(&gvalue, spec->value_type);
+    switch ( G_TYPE_FUNDAMENTAL(spec->value_type) ) {
+        case G_TYPE_INT:    g_value_set_int(&gvalue, value); break;
+        case G_TYPE_UINT:   g_value_set_uint(&gvalue, value); break;
+        case G_TYPE_INT64:  g_value_set_int64(&gvalue, value); break;
+        case G_TYPE_UINT64: g_value_set_uint64(&gvalue, value); break;
+        case G_TYPE_LONG:   g_value_set_long(&gvalue, value); break;
+        case G_TYPE_ULONG:  g_value_set_ulong(&gvalue, value); break;
+        default:
+            fprintf(stderr, "Encoder %s property has unsupported type %s\n", property, g_type_name(spec->value_type));
+            g_value_unset(&gvalue);
+            return 0;
+    }
+    g_object_set_property(G_OBJECT(encoder), property, &gvalue);
+    g_value_unset(&gvalue);
+    return 1;
+}
+
+void fpv_video_encoder_force_keyframe(GstElement * encoder) {
+    // Upstream into the encoder's source pad, so it also sends it on downstream and the
+    // payloader resends SPS/PPS. Not through the element, whose state lock a streaming
+    // thread mustn't take
+    GstPad *pad = gst_element_get_static_pad(encoder, "src");
+    if ( !pad ) return;
+    gst_pad_send_event(pad, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+    gst_object_unref(pad);
+}
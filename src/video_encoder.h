@@ -0,0 +1,54 @@
+/* RasPiFPV
+ *
+ * Copyright (C) 2014 Pod <monsieur.pod@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VIDEO_ENCODER_H
+#define __VIDEO_ENCODER_H
+
+#include <gst/gst.h>
+#include <stdint.h>
+
+/*
+ * What the sender needs to drive whichever H.264 encoder the video pipeline uses, found
+ * by its class rather than by name, so custom sender_source_pipelines work too. Bitrate
+ * is "target-bitrate" in bits per second on omxh264enc, "bitrate" in kilobits per second
+ * on x264enc; the keyframe interval is "interval-intraframes" or "key-int-max", in frames.
+ */
+
+// The first element of class Encoder, with a reference; NULL if there's none
+GstElement * fpv_video_encoder_find(GstPipeline * pipeline);
+
+// Property names, or NULL if the encoder has none; scale is bits per second per unit
+const char * fpv_video_encoder_bitrate_property(GstElement * encoder, int * scale);
+const char * fpv_video_encoder_keyframe_property(GstElement * encoder);
+
+// Intra refresh (x264enc's "intra-refresh") sends each keyframe interval's worth of
+// intra coding as a column sweeping across successive frames, instead of a single IDR
+// frame, which evens out the bitrate; before the pipeline starts. Returns 0 if the
+// encoder can't
+int fpv_video_encoder_set_intra_refresh(GstElement * encoder, int enabled);
+
+// Whether the property takes effect while the pipeline plays, rather than at the next negotiation
+int fpv_video_encoder_is_mutable(GstElement * encoder, const char * property);
+
+// Sets an integer property of any width; returns 0 if it isn't one
+int fpv_video_encoder_set_integer(GstElement * encoder, const char * property, int64_t value);
+
+// Asks the encoder for an IDR frame, with its parameter sets, as soon as it can; from any thread
+void fpv_video_encoder_force_keyframe(GstElement * encoder);
+
+#endif